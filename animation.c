@@ -0,0 +1,352 @@
+#include "animation.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double elapsed_seconds(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+static Vec3 lerp(Vec3 a, Vec3 b, double s)
+{
+    return vec3_add(a, vec3_scale(vec3_sub(b, a), s));
+}
+
+// -----------------------------------------------------------------------------
+// Keys
+// -----------------------------------------------------------------------------
+
+void animation_init(Animation *animation)
+{
+    *animation = (Animation){.frame_count = 1};
+}
+
+void animation_free(Animation *animation)
+{
+    for (uint32_t t = 0; t < animation->track_count; t++)
+        free(animation->tracks[t].keys);
+    free(animation->tracks);
+    free(animation->camera_keys);
+    *animation = (Animation){0};
+}
+
+// Makes room for one more element in a growing array
+static bool reserve_one(void **items, uint32_t count, uint32_t *capacity, size_t size)
+{
+    if (count < *capacity)
+        return true;
+    uint32_t grown_capacity = *capacity ? 2 * *capacity : 8;
+    void *grown = realloc(*items, size * grown_capacity);
+    if (!grown)
+        return false;
+    *items = grown;
+    *capacity = grown_capacity;
+    return true;
+}
+
+bool animation_add_camera_key(Animation *animation, CameraKey key)
+{
+    uint32_t count = animation->camera_key_count;
+    if (count > 0 && key.frame <= animation->camera_keys[count - 1].frame)
+        return false;
+    if (!reserve_one((void **)&animation->camera_keys, count, &animation->camera_key_capacity, sizeof(CameraKey)))
+        return false;
+    animation->camera_keys[animation->camera_key_count++] = key;
+    return true;
+}
+
+bool animation_add_instance_key(Animation *animation, size_t hittable, InstanceKey key)
+{
+    InstanceTrack *track = NULL;
+    for (uint32_t t = 0; t < animation->track_count && !track; t++)
+    {
+        if (animation->tracks[t].hittable == hittable)
+            track = &animation->tracks[t];
+    }
+    if (!track)
+    {
+        if (!reserve_one((void **)&animation->tracks, animation->track_count, &animation->track_capacity,
+                         sizeof(InstanceTrack)))
+            return false;
+        track = &animation->tracks[animation->track_count++];
+        *track = (InstanceTrack){.hittable = hittable};
+    }
+
+    if (track->key_count > 0 && key.frame <= track->keys[track->key_count - 1].frame)
+        return false;
+    if (!reserve_one((void **)&track->keys, track->key_count, &track->key_capacity, sizeof(InstanceKey)))
+        return false;
+    track->keys[track->key_count++] = key;
+    return true;
+}
+
+bool animation_is_animated(const Animation *animation)
+{
+    return animation->camera_key_count > 0 || animation->track_count > 0;
+}
+
+// Finds the keys around frame in an array of CameraKey or InstanceKey, which
+// both start with their frame: returns i with frame *s of the way from key i
+// to key i + 1, or key i alone with *s = 0 outside the keyed range
+static uint32_t find_segment(const void *keys, size_t key_size, uint32_t count, uint32_t frame, double *s)
+{
+    const unsigned char *base = keys;
+#define KEY_FRAME(i) (*(const uint32_t *)(base + (size_t)(i) * key_size))
+    uint32_t i = 0;
+    while (i + 1 < count && KEY_FRAME(i + 1) <= frame)
+        i++;
+    *s = 0.0;
+    if (i + 1 < count && frame > KEY_FRAME(i))
+        *s = (double)(frame - KEY_FRAME(i)) / (double)(KEY_FRAME(i + 1) - KEY_FRAME(i));
+#undef KEY_FRAME
+    return i;
+}
+
+Camera animation_camera(const Animation *animation, uint32_t frame, const Camera *base)
+{
+    if (animation->camera_key_count == 0)
+        return *base;
+    double s;
+    uint32_t i = find_segment(animation->camera_keys, sizeof(CameraKey), animation->camera_key_count, frame, &s);
+    const CameraKey *a = &animation->camera_keys[i];
+    const CameraKey *b = s > 0.0 ? a + 1 : a;
+    return camera_create(lerp(a->center, b->center, s), lerp(a->lower_left, b->lower_left, s),
+                         lerp(a->horizontal, b->horizontal, s), lerp(a->vertical, b->vertical, s),
+                         base->image_width, base->image_height, base->samples_per_pixel);
+}
+
+bool animation_apply(const Animation *animation, Scene *scene, uint32_t frame, bool *rebuilt)
+{
+    *rebuilt = false;
+    if (animation->track_count == 0)
+        return true;
+    for (uint32_t t = 0; t < animation->track_count; t++)
+    {
+        const InstanceTrack *track = &animation->tracks[t];
+        double s;
+        uint32_t i = find_segment(track->keys, sizeof(InstanceKey), track->key_count, frame, &s);
+        const InstanceKey *a = &track->keys[i];
+        const InstanceKey *b = s > 0.0 ? a + 1 : a;
+        Transform to_world = transform_place(lerp(a->position, b->position, s), lerp(a->rotation, b->rotation, s),
+                                             lerp(a->scale, b->scale, s));
+        if (!scene_set_instance_transform(scene, track->hittable, to_world))
+        {
+            fprintf(stderr, "animation_apply: instance %zu has a singular transform at frame %u\n", track->hittable,
+                    frame);
+            return false;
+        }
+    }
+    return scene_refit(scene, rebuilt);
+}
+
+// -----------------------------------------------------------------------------
+// Encoder thread
+// -----------------------------------------------------------------------------
+
+// One rendered frame on its way to disk, with the timings to report
+typedef struct
+{
+    Framebuffer *fb;
+    uint32_t frame;
+    char path[4096];
+    double update_seconds;
+    const char *update; // What the update did to the BVH
+    double render_seconds;
+    RenderCounts counts;
+} EncodeJob;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    EncodeJob job;
+    bool pending; // job is waiting or being written
+    bool closing;
+    bool failed;
+    ImageFormat format;
+    double seconds; // Total spent writing
+} Encoder;
+
+static void *encoder_thread(void *arg)
+{
+    Encoder *encoder = arg;
+    pthread_mutex_lock(&encoder->lock);
+    for (;;)
+    {
+        while (!encoder->pending && !encoder->closing)
+            pthread_cond_wait(&encoder->changed, &encoder->lock);
+        if (!encoder->pending)
+            break;
+        EncodeJob *job = &encoder->job;
+        pthread_mutex_unlock(&encoder->lock);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool ok = framebuffer_write_file(job->path, job->fb, encoder->format);
+        double seconds = elapsed_seconds(&start);
+        double render = job->render_seconds > 0 ? job->render_seconds : 1e-9;
+        fprintf(stderr, "Frame %u: update %.2f ms (%s), render %.3f s (%.3f M rays/s), encode %.1f ms -> %s%s\n",
+                job->frame, job->update_seconds * 1e3, job->update, job->render_seconds,
+                job->counts.rays / render * 1e-6, seconds * 1e3, job->path, ok ? "" : " FAILED");
+
+        pthread_mutex_lock(&encoder->lock);
+        encoder->seconds += seconds;
+        encoder->failed = encoder->failed || !ok;
+        encoder->pending = false;
+        pthread_cond_broadcast(&encoder->changed);
+    }
+    pthread_mutex_unlock(&encoder->lock);
+    return NULL;
+}
+
+// Waits until the previous frame is written, then queues job. Returns false
+// once a write has failed.
+static bool encoder_post(Encoder *encoder, const EncodeJob *job)
+{
+    pthread_mutex_lock(&encoder->lock);
+    while (encoder->pending)
+        pthread_cond_wait(&encoder->changed, &encoder->lock);
+    bool ok = !encoder->failed;
+    if (ok)
+    {
+        encoder->job = *job;
+        encoder->pending = true;
+        pthread_cond_broadcast(&encoder->changed);
+    }
+    pthread_mutex_unlock(&encoder->lock);
+    return ok;
+}
+
+// -----------------------------------------------------------------------------
+// Sequence
+// -----------------------------------------------------------------------------
+
+bool sequence_frame_path(char *out, size_t size, const char *pattern, uint32_t frame)
+{
+    const char *hashes = strchr(pattern, '#');
+    int written;
+    if (hashes)
+    {
+        int digits = (int)strspn(hashes, "#");
+        written = snprintf(out, size, "%.*s%0*u%s", (int)(hashes - pattern), pattern, digits, frame,
+                           hashes + digits);
+    }
+    else
+    {
+        // Before the extension of the file name, not a dot in a directory
+        const char *name = strrchr(pattern, '/');
+        const char *dot = strrchr(name ? name : pattern, '.');
+        int stem = dot ? (int)(dot - pattern) : (int)strlen(pattern);
+        written = snprintf(out, size, "%.*s_%0*u%s", stem, pattern, ANIMATION_DEFAULT_FRAME_DIGITS, frame,
+                           dot ? dot : "");
+    }
+    return written >= 0 && (size_t)written < size;
+}
+
+bool render_sequence(Scene *scene, const Camera *camera, const Animation *animation, const RenderSettings *settings,
+                     const SequenceSettings *sequence)
+{
+    RenderPool pool;
+    if (!render_pool_init(&pool, settings->thread_count))
+    {
+        fprintf(stderr, "render_sequence: could not start the worker pool\n");
+        return false;
+    }
+    Framebuffer buffers[2] = {0};
+    if (!framebuffer_init(&buffers[0], camera->image_width, camera->image_height) ||
+        !framebuffer_init(&buffers[1], camera->image_width, camera->image_height))
+    {
+        fprintf(stderr, "render_sequence: could not allocate the framebuffers\n");
+        framebuffer_free(&buffers[0]);
+        render_pool_free(&pool);
+        return false;
+    }
+
+    Encoder encoder = {.format = sequence->format};
+    pthread_mutex_init(&encoder.lock, NULL);
+    pthread_cond_init(&encoder.changed, NULL);
+    pthread_t encoder_id;
+    bool ok = pthread_create(&encoder_id, NULL, encoder_thread, &encoder) == 0;
+    bool encoder_started = ok;
+    if (!ok)
+        fprintf(stderr, "render_sequence: could not start the encoder thread\n");
+
+    uint32_t frame_count = sequence->last_frame - sequence->first_frame + 1;
+    fprintf(stderr, "Rendering frames %u to %u, %d x %d with %zu samples per pixel on %d threads\n",
+            sequence->first_frame, sequence->last_frame, camera->image_width, camera->image_height,
+            camera->samples_per_pixel, pool.started + 1);
+
+    RenderSettings frame_settings = *settings;
+    frame_settings.pool = &pool;
+    uint32_t rebuilds = 0;
+    double render_total = 0.0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t frame = sequence->first_frame; ok && frame - sequence->first_frame < frame_count; frame++)
+    {
+        EncodeJob job = {.fb = &buffers[frame & 1], .frame = frame};
+        if (!sequence_frame_path(job.path, sizeof(job.path), sequence->output_pattern, frame))
+        {
+            fprintf(stderr, "render_sequence: output path too long\n");
+            ok = false;
+            break;
+        }
+
+        struct timespec step;
+        clock_gettime(CLOCK_MONOTONIC, &step);
+        bool rebuilt;
+        if (!animation_apply(animation, scene, frame, &rebuilt))
+        {
+            ok = false;
+            break;
+        }
+        Camera frame_camera = animation_camera(animation, frame, camera);
+        job.update_seconds = elapsed_seconds(&step);
+        job.update = rebuilt ? "rebuild" : (animation->track_count > 0 ? "refit" : "static");
+        rebuilds += rebuilt;
+
+        // The other buffer may still be encoding, this one was written
+        // before the previous frame was queued
+        clock_gettime(CLOCK_MONOTONIC, &step);
+        frame_settings.frame = frame;
+        job.counts = render_tiles(job.fb, scene, &frame_camera, &frame_settings);
+        job.render_seconds = elapsed_seconds(&step);
+        if (!job.counts.ok)
+        {
+            ok = false;
+            break;
+        }
+        render_total += job.render_seconds;
+
+        ok = encoder_post(&encoder, &job);
+    }
+
+    // Let the encoder finish the last frame
+    if (encoder_started)
+    {
+        pthread_mutex_lock(&encoder.lock);
+        encoder.closing = true;
+        pthread_cond_broadcast(&encoder.changed);
+        pthread_mutex_unlock(&encoder.lock);
+        pthread_join(encoder_id, NULL);
+        ok = ok && !encoder.failed;
+    }
+
+    double seconds = elapsed_seconds(&start);
+    fprintf(stderr, "Sequence: %u frames in %.2f s, %.3f s per frame (render %.3f s, encode %.1f ms), %u BVH rebuilds\n",
+            frame_count, seconds, seconds / frame_count, render_total / frame_count, encoder.seconds * 1e3 / frame_count,
+            rebuilds);
+
+    pthread_cond_destroy(&encoder.changed);
+    pthread_mutex_destroy(&encoder.lock);
+    framebuffer_free(&buffers[1]);
+    framebuffer_free(&buffers[0]);
+    render_pool_free(&pool);
+    return ok;
+}
@@ -0,0 +1,109 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "render.h"
+#include "math/transform.h"
+
+#define ANIMATION_DEFAULT_FRAME_DIGITS 4 // Frame number width when the output path has no "#"
+
+// -----------------------------------------------------------------------------
+// Keyframe animation
+// -----------------------------------------------------------------------------
+// The camera and any instance can be keyed. Every key gives the full state at
+// one frame; in between the state is interpolated linearly component by
+// component, before the first key and after the last it holds. Rotations are
+// interpolated as angles, so keys at 0 and 360 degrees make one full turn.
+// The camera vectors are interpolated as they are, which suits moves and
+// zooms; turning the camera far between two keys narrows the view halfway,
+// add keys in between or turn the scene instead.
+typedef struct
+{
+    uint32_t frame;
+    Vec3 position;
+    Vec3 rotation; // Degrees, see transform_place
+    Vec3 scale;
+} InstanceKey;
+
+typedef struct
+{
+    uint32_t frame;
+    Point3 center;
+    Point3 lower_left;
+    Vec3 horizontal;
+    Vec3 vertical;
+} CameraKey;
+
+// The keys of one instance, scene->world[hittable]
+typedef struct
+{
+    size_t hittable;
+    InstanceKey *keys;
+    uint32_t key_count;
+    uint32_t key_capacity;
+} InstanceTrack;
+
+typedef struct
+{
+    uint32_t frame_count; // Frames 0 .. frame_count - 1
+    CameraKey *camera_keys;
+    uint32_t camera_key_count;
+    uint32_t camera_key_capacity;
+    InstanceTrack *tracks;
+    uint32_t track_count;
+    uint32_t track_capacity;
+} Animation;
+
+// Starts without keys and with one frame
+void animation_init(Animation *animation);
+
+void animation_free(Animation *animation);
+
+// Keys must be added in ascending frame order, per track. Both return false
+// for a frame at or before the previous key's, or on allocation failure.
+bool animation_add_camera_key(Animation *animation, CameraKey key);
+bool animation_add_instance_key(Animation *animation, size_t hittable, InstanceKey key);
+
+// True when anything is keyed
+bool animation_is_animated(const Animation *animation);
+
+// The camera at frame, or base when the camera is not keyed. Resolution and
+// samples per pixel always come from base.
+Camera animation_camera(const Animation *animation, uint32_t frame, const Camera *base);
+
+// Moves the keyed instances to frame and brings the BVH up to date with
+// scene_refit. *rebuilt is set when the BVH had to be rebuilt. Returns false
+// for a singular transform or when a rebuild runs out of memory.
+bool animation_apply(const Animation *animation, Scene *scene, uint32_t frame, bool *rebuilt);
+
+// -----------------------------------------------------------------------------
+// Sequence rendering
+// -----------------------------------------------------------------------------
+// Renders frames first_frame .. last_frame with one persistent worker pool.
+// Every frame moves the instances and refits the BVH, renders with the frame
+// number mixed into the random seeds (RenderSettings.frame), and hands the
+// image to an encoder thread that writes it while the next frame updates and
+// renders. Two framebuffers alternate, so the render waits for an encode
+// only when writing a frame takes longer than rendering the next one.
+//
+// Output paths come from output_pattern: its first run of "#" is replaced by
+// the zero-padded frame number, without one the number is inserted before
+// the extension as "_0042".
+typedef struct
+{
+    uint32_t first_frame;
+    uint32_t last_frame; // Inclusive
+    const char *output_pattern;
+    ImageFormat format;
+} SequenceSettings;
+
+// Writes the output path of frame into out. Returns false if it does not fit.
+bool sequence_frame_path(char *out, size_t size, const char *pattern, uint32_t frame);
+
+// Prints one line per frame with the update, render and encode times. The
+// scene's instances are left at last_frame. settings->pool and
+// settings->frame are ignored. Returns false when a frame could not be
+// updated or written.
+bool render_sequence(Scene *scene, const Camera *camera, const Animation *animation, const RenderSettings *settings,
+                     const SequenceSettings *sequence);
+
+#endif // ANIMATION_H
@@ -0,0 +1,131 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static size_t align_up(size_t x, size_t align)
+{
+    return (x + align - 1) & ~(align - 1);
+}
+
+void arena_init(Arena *arena, size_t block_size)
+{
+    arena->head = NULL;
+    arena->block_size = block_size > 0 ? block_size : ARENA_DEFAULT_BLOCK_SIZE;
+    arena->reserved = 0;
+}
+
+void arena_free(Arena *arena)
+{
+    ArenaBlock *block = arena->head;
+    while (block)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+    arena->reserved = 0;
+}
+
+static ArenaBlock *new_block(Arena *arena, size_t size)
+{
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+    if (!block)
+        return NULL;
+    block->size = size;
+    block->used = 0;
+    block->next = arena->head;
+    arena->head = block;
+    arena->reserved += sizeof(ArenaBlock) + size;
+    return block;
+}
+
+void *arena_alloc(Arena *arena, size_t size, size_t align)
+{
+    ArenaBlock *block = arena->head;
+    if (block)
+    {
+        size_t offset = align_up(block->used, align);
+        if (offset + size <= block->size)
+        {
+            block->used = offset + size;
+            return block->data + offset;
+        }
+    }
+
+    // Large requests get a block of their own so the current block keeps
+    // serving small allocations
+    if (size > arena->block_size / 2)
+    {
+        block = malloc(sizeof(ArenaBlock) + size);
+        if (!block)
+            return NULL;
+        block->size = size;
+        block->used = size;
+        arena->reserved += sizeof(ArenaBlock) + size;
+        if (arena->head)
+        {
+            block->next = arena->head->next;
+            arena->head->next = block;
+        }
+        else
+        {
+            block->next = NULL;
+            arena->head = block;
+        }
+        return block->data;
+    }
+
+    block = new_block(arena, arena->block_size);
+    if (!block)
+        return NULL;
+    block->used = size;
+    return block->data;
+}
+
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size, size_t align)
+{
+    if (!ptr)
+        return arena_alloc(arena, new_size, align);
+    if (new_size <= old_size)
+        return ptr;
+
+    unsigned char *p = ptr;
+    ArenaBlock **link = &arena->head;
+    for (ArenaBlock *block = arena->head; block; link = &block->next, block = block->next)
+    {
+        if (p < block->data || p >= block->data + block->size)
+            continue;
+
+        // Only the last allocation of a block can be extended
+        if (p + old_size != block->data + block->used)
+            break;
+
+        size_t offset = (size_t)(p - block->data);
+        if (offset + new_size <= block->size)
+        {
+            block->used = offset + new_size;
+            return ptr;
+        }
+
+        // The block holds nothing else, so it can be resized as a whole
+        if (offset == 0)
+        {
+            ArenaBlock *grown = realloc(block, sizeof(ArenaBlock) + new_size);
+            if (!grown)
+                return NULL;
+            arena->reserved += new_size - grown->size;
+            grown->size = new_size;
+            grown->used = new_size;
+            *link = grown;
+            return grown->data;
+        }
+        break;
+    }
+
+    void *copy = arena_alloc(arena, new_size, align);
+    if (copy)
+        memcpy(copy, ptr, old_size);
+    return copy;
+}
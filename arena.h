@@ -0,0 +1,44 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_DEFAULT_BLOCK_SIZE (1024 * 1024)
+
+// -----------------------------------------------------------------------------
+// Arena allocator
+// -----------------------------------------------------------------------------
+// Bump allocator over a list of large blocks. Individual allocations are never
+// freed, everything is released at once by arena_free. Requests bigger than
+// half a block get a dedicated block, which lets arena_grow resize them in
+// place with realloc instead of copying.
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t size; // Usable bytes in data
+    size_t used;
+    _Alignas(16) unsigned char data[];
+} ArenaBlock;
+
+typedef struct
+{
+    ArenaBlock *head; // Most recently created block first
+    size_t block_size;
+    size_t reserved; // Bytes obtained from malloc, including block headers
+} Arena;
+
+// block_size = 0 selects ARENA_DEFAULT_BLOCK_SIZE
+void arena_init(Arena *arena, size_t block_size);
+
+// Releases every block, the arena can be reused afterwards
+void arena_free(Arena *arena);
+
+// Returns size bytes aligned to align (a power of two, at most 16), NULL on failure
+void *arena_alloc(Arena *arena, size_t size, size_t align);
+
+// Resizes an allocation to new_size, keeping its contents. Grows in place when
+// ptr is the last allocation of its block, otherwise copies. Returns NULL on
+// failure, in which case ptr is left untouched.
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size, size_t align);
+
+#endif // ARENA_H
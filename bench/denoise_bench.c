@@ -0,0 +1,108 @@
+// Compares low sample counts plus the denoiser with a plain 100 spp render of
+// the demo scene: render and denoise time, and the display-space RMSE of each
+// image against a high sample count reference.
+// Build and run with: make bench-denoise
+
+#include "../demo_scene.h"
+#include "../denoise.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_WIDTH 320
+#define BENCH_HEIGHT 180
+#define BENCH_REFERENCE_SPP 1024
+#define BENCH_BASELINE_SPP 100
+#define BENCH_DEPTH 10
+
+static const size_t bench_spp[] = {4, 8, 16, 32};
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// RMSE after clamping and gamma 2, the error a viewer of the output sees
+static double display_rmse(const Framebuffer *a, const Framebuffer *reference)
+{
+    double sum = 0.0;
+    size_t count = (size_t)a->width * (size_t)a->height;
+    for (size_t i = 0; i < count; i++)
+    {
+        const real *p = &a->pixels[i].x, *q = &reference->pixels[i].x;
+        for (int c = 0; c < 3; c++)
+        {
+            double d = sqrt(fmin(fmax(p[c], 0.0), 1.0)) - sqrt(fmin(fmax(q[c], 0.0), 1.0));
+            sum += d * d;
+        }
+    }
+    return sqrt(sum / (3.0 * (double)count));
+}
+
+// Renders at spp and returns the render time, denoising afterwards when
+// aovs is set
+static double render(Framebuffer *fb, Scene *scene, size_t spp, RenderAovs *aovs, double *denoise_seconds)
+{
+    Camera camera = demo_camera(BENCH_WIDTH, BENCH_HEIGHT, spp);
+    RenderSettings settings = {
+        .max_depth = BENCH_DEPTH,
+        .roulette_depth = RENDER_DEFAULT_ROULETTE_DEPTH,
+        .packets = true,
+        .aovs = aovs,
+    };
+    double start = now_seconds();
+    render_tiles(fb, scene, &camera, &settings);
+    double seconds = now_seconds() - start;
+    if (aovs)
+    {
+        DenoiseSettings denoise_settings = {0};
+        start = now_seconds();
+        denoise(fb, aovs, &denoise_settings);
+        *denoise_seconds = now_seconds() - start;
+    }
+    return seconds;
+}
+
+int main(void)
+{
+    Scene scene;
+    scene_init(&scene);
+    if (!demo_scene_spheres(&scene) || !scene_build(&scene))
+        return 1;
+
+    Framebuffer reference, image;
+    RenderAovs aovs;
+    if (!framebuffer_init(&reference, BENCH_WIDTH, BENCH_HEIGHT) ||
+        !framebuffer_init(&image, BENCH_WIDTH, BENCH_HEIGHT) ||
+        !render_aovs_init(&aovs, BENCH_WIDTH, BENCH_HEIGHT))
+        return 1;
+
+    fprintf(stderr, "Rendering the %d spp reference...\n", BENCH_REFERENCE_SPP);
+    render(&reference, &scene, BENCH_REFERENCE_SPP, NULL, NULL);
+
+    printf("%d x %d, depth %d, %d threads, RMSE against %d spp\n", BENCH_WIDTH, BENCH_HEIGHT, BENCH_DEPTH,
+           render_default_thread_count(), BENCH_REFERENCE_SPP);
+    double seconds = render(&image, &scene, BENCH_BASELINE_SPP, NULL, NULL);
+    double baseline = display_rmse(&image, &reference);
+    printf("%4d spp            %8.3f s                      RMSE %.5f\n", BENCH_BASELINE_SPP, seconds, baseline);
+
+    for (size_t i = 0; i < sizeof(bench_spp) / sizeof(bench_spp[0]); i++)
+    {
+        double denoise_seconds = 0.0;
+        seconds = render(&image, &scene, bench_spp[i], &aovs, &denoise_seconds);
+        double rmse = display_rmse(&image, &reference);
+        printf("%4zu spp + denoise  %8.3f s (%.3f s denoise)  RMSE %.5f  %s\n", bench_spp[i],
+               seconds + denoise_seconds, denoise_seconds, rmse,
+               rmse <= baseline ? "<= baseline" : "> baseline");
+    }
+
+    render_aovs_free(&aovs);
+    framebuffer_free(&image);
+    framebuffer_free(&reference);
+    scene_free(&scene);
+    return 0;
+}
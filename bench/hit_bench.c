@@ -0,0 +1,95 @@
+// Measures closest-hit throughput of scene_hit, without any shading, on the
+// demo scene and on a random scene of spheres and triangles.
+// Build and run with: make bench-hit
+
+#include "../demo_scene.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#define RANDOM_SPHERES 20000
+#define RANDOM_TRIANGLES 20000
+#define RAYS 2000000
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static Point3 random_point(Rng *rng, double extent)
+{
+    return vec3_create((random_double(rng) - 0.5) * extent, (random_double(rng) - 0.5) * extent,
+                       (random_double(rng) - 0.5) * extent);
+}
+
+static bool build_random_scene(Scene *scene)
+{
+    Rng rng;
+    rng_seed(&rng, 1, 0, 0);
+    MaterialId material;
+    bool ok = scene_add_material(scene, (Material){.color = {0.5, 0.5, 0.5}, .type = MATERIAL_LAMBERTIAN}, &material);
+    for (int i = 0; ok && i < RANDOM_SPHERES; i++)
+    {
+        Hittable h = {HITTABLE_SPHERE, .object.sphere = {random_point(&rng, 20.0), 0.05 + 0.1 * random_double(&rng)},
+                      .material = material};
+        ok = scene_add(scene, h);
+    }
+    for (int i = 0; ok && i < RANDOM_TRIANGLES; i++)
+    {
+        Point3 p = random_point(&rng, 20.0);
+        Hittable h = {HITTABLE_TRIANGLE, .material = material};
+        h.object.triangle.v0 = p;
+        h.object.triangle.v1 = vec3_add(p, random_point(&rng, 0.6));
+        h.object.triangle.v2 = vec3_add(p, random_point(&rng, 0.6));
+        ok = scene_add(scene, h);
+    }
+    Hittable ground = {HITTABLE_PLANE, .object.plane = {{0, -10, 0}, {0, 1, 0}}, .material = material};
+    return ok && scene_add(scene, ground) && scene_build(scene);
+}
+
+// Rays start inside the scene and point in random directions. The hit
+// distances are summed so the compiler cannot drop the loop.
+static void bench_scene(const char *name, Scene *scene, double extent)
+{
+    Rng rng;
+    rng_seed(&rng, 2, 0, 0);
+    size_t hits = 0;
+    double sum = 0.0;
+    HitRecord rec;
+
+    double start = now_seconds();
+    for (int i = 0; i < RAYS; i++)
+    {
+        Ray r = ray_create(random_point(&rng, extent), random_point(&rng, 2.0));
+        if (scene_hit(scene, r, RAY_T_MIN, RAY_T_MAX, &rec))
+        {
+            hits++;
+            sum += rec.t;
+        }
+    }
+    double seconds = now_seconds() - start;
+    printf("%-8s %8.3f s  %7.2f Mrays/s  %5.1f%% hit  (checksum %.6g)\n", name, seconds, RAYS / seconds * 1e-6,
+           100.0 * hits / RAYS, sum);
+}
+
+int main(void)
+{
+    printf("sizeof(Hittable) = %zu, sizeof(HitRecord) = %zu, %d rays per scene, 1 thread\n", sizeof(Hittable),
+           sizeof(HitRecord), RAYS);
+
+    Scene scene;
+    scene_init(&scene);
+    if (!demo_scene_spheres(&scene) || !scene_build(&scene))
+        return 1;
+    bench_scene("demo", &scene, 2.0);
+    scene_free(&scene);
+
+    scene_init(&scene);
+    if (!build_random_scene(&scene))
+        return 1;
+    bench_scene("random", &scene, 20.0);
+    scene_free(&scene);
+    return 0;
+}
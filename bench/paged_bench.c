@@ -0,0 +1,292 @@
+// Out-of-core geometry: writes a generated terrain of several GB as a paged
+// mesh, one cluster per patch, then traces the same rays through it one at a
+// time and in binned batches (paged_mesh_intersect_batch), each run starting
+// with the file dropped from the page cache. Prints rays per second, cluster
+// visits and loads, the page faults and storage reads of the run and the
+// process's resident memory.
+// Build and run with: make bench-paged PAGED_BENCH_ARGS="<GB> <budget MB>"
+
+#include "../paged.h"
+#include "../stats.h"
+#include "../math/rng.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PAGED_PATH "bench/paged_bench.rtpage"
+#define BENCH_DEFAULT_GB 2.0
+#define BENCH_DEFAULT_BUDGET_MB 256
+#define BENCH_PATCH_QUADS 45 // 4050 triangles per patch
+#define BENCH_IMAGE_WIDTH 512
+#define BENCH_IMAGE_HEIGHT 256
+#define BENCH_BATCH_SIDE 64 // Camera rays are batched by 64 x 64 tile
+#define BENCH_BATCH (BENCH_BATCH_SIDE * BENCH_BATCH_SIDE)
+#define BENCH_RAYS (BENCH_IMAGE_WIDTH * BENCH_IMAGE_HEIGHT)
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double terrain_height(double x, double z)
+{
+    return 40.0 * (sin(x * 0.013) * cos(z * 0.011) + 0.5 * sin(x * 0.041 + z * 0.037)) +
+           3.0 * sin(x * 0.31) * sin(z * 0.27);
+}
+
+// Fills mesh with the patch at (px, pz) of the grid, one unit per quad
+static void make_patch(Mesh *mesh, uint32_t px, uint32_t pz)
+{
+    const uint32_t side = BENCH_PATCH_QUADS + 1;
+    for (uint32_t j = 0; j < side; j++)
+    {
+        for (uint32_t i = 0; i < side; i++)
+        {
+            double x = (double)(px * BENCH_PATCH_QUADS + i);
+            double z = (double)(pz * BENCH_PATCH_QUADS + j);
+            mesh->vertices[j * side + i] = vec3_create(x, terrain_height(x, z), z);
+        }
+    }
+    uint32_t *index = mesh->indices;
+    for (uint32_t j = 0; j < BENCH_PATCH_QUADS; j++)
+    {
+        for (uint32_t i = 0; i < BENCH_PATCH_QUADS; i++)
+        {
+            uint32_t v = j * side + i;
+            *index++ = v;
+            *index++ = v + side;
+            *index++ = v + 1;
+            *index++ = v + 1;
+            *index++ = v + side;
+            *index++ = v + side + 1;
+        }
+    }
+}
+
+// Writes patches until the file reaches about target bytes, the grid side in
+// patches follows from the size of the first one. Returns the side, 0 on
+// failure.
+static uint32_t write_terrain(double target_bytes)
+{
+    FILE *file = fopen(BENCH_PAGED_PATH, "wb");
+    if (!file)
+    {
+        perror(BENCH_PAGED_PATH);
+        return 0;
+    }
+    const uint32_t side = BENCH_PATCH_QUADS + 1;
+    Point3 vertices[(BENCH_PATCH_QUADS + 1) * (BENCH_PATCH_QUADS + 1)];
+    static uint32_t indices[BENCH_PATCH_QUADS * BENCH_PATCH_QUADS * 6];
+    Mesh mesh = {vertices, indices, side * side, BENCH_PATCH_QUADS * BENCH_PATCH_QUADS * 2};
+
+    PagedWriter w;
+    paged_writer_begin(&w, file);
+    make_patch(&mesh, 0, 0);
+    bool ok = paged_writer_add(&w, &mesh);
+    uint32_t patches = 0;
+    if (ok)
+    {
+        double patch_bytes = (double)(w.position - PAGED_ALIGN);
+        patches = (uint32_t)ceil(sqrt(target_bytes / patch_bytes));
+        if (patches < 1)
+            patches = 1;
+    }
+    for (uint32_t k = 1; ok && k < patches * patches; k++)
+    {
+        make_patch(&mesh, k % patches, k / patches);
+        ok = paged_writer_add(&w, &mesh);
+    }
+    ok = paged_writer_finish(&w, ok);
+    // Written pages must reach the disk before they can be dropped from the
+    // page cache
+    ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+    ok = fclose(file) == 0 && ok;
+    return ok ? patches : 0;
+}
+
+// Camera rays over the terrain from above one corner, tile by tile
+static void camera_rays(Ray *rays, double extent)
+{
+    Point3 origin = vec3_create(-0.05 * extent, 0.15 * extent, -0.05 * extent);
+    Point3 target = vec3_create(0.6 * extent, 0.0, 0.6 * extent);
+    Vec3 w = vec3_unit(vec3_sub(origin, target));
+    Vec3 u = vec3_unit(vec3_cross(vec3_create(0, 1, 0), w));
+    Vec3 v = vec3_cross(w, u);
+    double half_height = tan(0.5 * 50.0 * M_PI / 180.0);
+    double half_width = half_height * BENCH_IMAGE_WIDTH / BENCH_IMAGE_HEIGHT;
+    int n = 0;
+    for (int ty = 0; ty < BENCH_IMAGE_HEIGHT; ty += BENCH_BATCH_SIDE)
+    {
+        for (int tx = 0; tx < BENCH_IMAGE_WIDTH; tx += BENCH_BATCH_SIDE)
+        {
+            for (int y = ty; y < ty + BENCH_BATCH_SIDE; y++)
+            {
+                for (int x = tx; x < tx + BENCH_BATCH_SIDE; x++)
+                {
+                    double s = (2.0 * (x + 0.5) / BENCH_IMAGE_WIDTH - 1.0) * half_width;
+                    double t = (1.0 - 2.0 * (y + 0.5) / BENCH_IMAGE_HEIGHT) * half_height;
+                    Vec3 d = vec3_sub(vec3_add(vec3_scale(u, s), vec3_scale(v, t)), w);
+                    rays[n++] = ray_create(origin, vec3_unit(d));
+                }
+            }
+        }
+    }
+}
+
+// Nearly horizontal rays from random places just above the terrain, like
+// the bounces of a path tracer: incoherent, and each crosses many clusters
+static void bounce_rays(Ray *rays, double extent)
+{
+    Rng rng;
+    rng_seed(&rng, 3, 0, 0);
+    for (int i = 0; i < BENCH_RAYS; i++)
+    {
+        double x = random_double(&rng) * extent;
+        double z = random_double(&rng) * extent;
+        double phi = 2.0 * M_PI * random_double(&rng);
+        Vec3 d = vec3_create(cos(phi), 0.2 * random_double(&rng) - 0.15, sin(phi));
+        rays[i] = ray_create(vec3_create(x, terrain_height(x, z) + 5.0, z), vec3_unit(d));
+    }
+}
+
+typedef struct
+{
+    double seconds;
+    uint32_t hits;
+    double checksum; // Sum of the hit distances and slots, equal for both paths
+} BenchResult;
+
+static void run(const PagedMesh *pm, const Ray *rays, bool batched, PagedBatch *batch, BenchResult *result)
+{
+    *result = (BenchResult){0};
+    double start = now_seconds();
+    for (int first = 0; first < BENCH_RAYS; first += BENCH_BATCH)
+    {
+        if (batched)
+        {
+            for (int k = 0; k < BENCH_BATCH; k++)
+            {
+                batch->rays[k] = rays[first + k];
+                batch->t_max[k] = INFINITY;
+            }
+            paged_mesh_intersect_batch(pm, batch, BENCH_BATCH, 1e-3);
+            for (int k = 0; k < BENCH_BATCH; k++)
+            {
+                if (batch->found[k])
+                {
+                    result->hits++;
+                    result->checksum += batch->t_max[k] + batch->hits[k].cluster + batch->hits[k].prim;
+                }
+            }
+        }
+        else
+        {
+            for (int k = 0; k < BENCH_BATCH; k++)
+            {
+                double t_max = INFINITY;
+                PagedHit hit;
+                if (paged_mesh_intersect(pm, rays[first + k], 1e-3, &t_max, &hit))
+                {
+                    result->hits++;
+                    result->checksum += t_max + hit.cluster + hit.prim;
+                }
+            }
+        }
+    }
+    result->seconds = now_seconds() - start;
+}
+
+int main(int argc, char **argv)
+{
+    double gb = argc > 1 ? atof(argv[1]) : BENCH_DEFAULT_GB;
+    int budget_mb = argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_BUDGET_MB;
+    if (gb <= 0 || budget_mb <= 0)
+    {
+        fprintf(stderr, "Usage: %s [GB] [budget MB]\n", argv[0]);
+        return 1;
+    }
+
+    double start = now_seconds();
+    uint32_t patches = write_terrain(gb * 1024.0 * 1024.0 * 1024.0);
+    if (patches == 0)
+        return 1;
+    double written = now_seconds() - start;
+
+    PagedGeometry pg;
+    paged_geometry_init(&pg);
+    const PagedMesh *pm;
+    if (!paged_geometry_add(&pg, BENCH_PAGED_PATH, 1, &pm))
+        return 1;
+    // The mapping keeps the data and fd drops it from the page cache, the name
+    // is not needed any more
+    int fd = open(BENCH_PAGED_PATH, O_RDONLY);
+    unlink(BENCH_PAGED_PATH);
+    if (fd < 0)
+        return 1;
+    printf("%.2f GB terrain, %u x %u patches, %llu triangles, written in %.1f s, %d rays per run\n",
+           (double)pm->mapping_size / (1024.0 * 1024.0 * 1024.0), patches, patches,
+           (unsigned long long)pm->triangle_count, written, BENCH_RAYS);
+
+    Ray *rays = malloc(sizeof(Ray) * BENCH_RAYS);
+    PagedBatch batch = {0};
+    if (!rays || !paged_batch_reserve(&batch, BENCH_BATCH))
+        return 1;
+    double extent = (double)patches * BENCH_PATCH_QUADS;
+    double mb = 1.0 / (1024.0 * 1024.0);
+
+    printf("%8s %8s %9s %10s %11s %8s %10s %8s %10s %10s  %s\n", "rays", "path", "Mrays/s", "visits", "rays/visit",
+           "loads", "loaded", "faults", "read", "resident", "hits");
+    for (int set = 0; set < 2; set++)
+    {
+        if (set == 0)
+            camera_rays(rays, extent);
+        else
+            bounce_rays(rays, extent);
+        BenchResult results[2];
+        for (int batched = 0; batched < 2; batched++)
+        {
+            // Cold start: evict everything the cache allows, then drop the
+            // file from the page cache
+            paged_geometry_prepare(&pg, 0);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            paged_geometry_prepare(&pg, (size_t)budget_mb << 20);
+
+            PagedStats before, after;
+            ProcessStats process_before, process_after;
+            paged_geometry_stats(&pg, &before);
+            stats_process(&process_before);
+            run(pm, rays, batched, &batch, &results[batched]);
+            paged_geometry_stats(&pg, &after);
+            stats_process(&process_after);
+
+            uint64_t visits = after.requests - before.requests;
+            uint64_t binned = after.binned_requests - before.binned_requests;
+            uint64_t binned_rays = after.binned_rays - before.binned_rays;
+            printf("%8s %8s %9.3f %10llu %11.1f %8llu %7.0f MB %8llu %7.0f MB %7.1f MB  %u\n",
+                   set == 0 ? "camera" : "bounce", batched ? "batched" : "per-ray",
+                   BENCH_RAYS / results[batched].seconds * 1e-6, (unsigned long long)visits,
+                   binned ? (double)binned_rays / (double)binned : 1.0, (unsigned long long)(after.loads - before.loads),
+                   (double)(after.load_bytes - before.load_bytes) * mb,
+                   (unsigned long long)(process_after.major_faults - process_before.major_faults),
+                   (double)(process_after.read_bytes - process_before.read_bytes) * mb,
+                   (double)process_after.resident_bytes * mb, results[batched].hits);
+        }
+        if (results[0].hits != results[1].hits || results[0].checksum != results[1].checksum)
+        {
+            fprintf(stderr, "paged_bench: per-ray and batched hits differ\n");
+            return 1;
+        }
+    }
+    paged_stats_print(stdout, &pg);
+    paged_batch_free(&batch);
+    free(rays);
+    paged_geometry_free(&pg);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,122 @@
+// Compares the recursive, iterative and wavefront path tracers on the demo
+// scene: wall time and the largest per-channel difference between images.
+// Build and run with: make bench-path
+
+#include "../demo_scene.h"
+#include "../render.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_WIDTH 320
+#define BENCH_HEIGHT 180
+#define BENCH_SPP 32
+#define BENCH_DEPTH 10
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The recursive ray_color the renderer used before the iterative loop,
+// kept here as the reference implementation
+static Color ray_color_recursive(Scene *scene, Ray r, int depth, Sampler *sampler)
+{
+    HitRecord rec;
+    if (depth <= 0)
+        return vec3_create(0, 0, 0);
+
+    if (scene_hit(scene, r, RAY_T_MIN, RAY_T_MAX, &rec))
+    {
+        Ray scattered;
+        Color attenuation;
+        sampler_vertex(sampler, BENCH_DEPTH - depth + 1);
+        if (!scatter_ray(&scene->materials[rec.material], r, &rec, &attenuation, &scattered, sampler))
+            return vec3_create(0, 0, 0);
+        return vec3_mul(attenuation, ray_color_recursive(scene, scattered, depth - 1, sampler));
+    }
+    return sky_color(r);
+}
+
+static void render_recursive(Framebuffer *fb, Scene *scene, Camera *camera)
+{
+    double scale = 1.0 / (double)camera->samples_per_pixel;
+    SamplerSetup sampling = {.type = SAMPLER_SOBOL, .sample_count = (uint32_t)camera->samples_per_pixel};
+    sampler_prepare(sampling.type);
+    for (int y = 0; y < fb->height; y++)
+    {
+        int j = camera->image_height - 1 - y;
+        for (int i = 0; i < fb->width; i++)
+        {
+            Color sum = vec3_create(0, 0, 0);
+            for (size_t s = 0; s < camera->samples_per_pixel; s++)
+            {
+                Sampler sampler;
+                sampler_start(&sampler, &sampling, i, j, (uint32_t)(j * camera->image_width + i), (uint32_t)s);
+                Ray r = camera_get_ray(camera, i, j, &sampler);
+                sum = vec3_add(sum, ray_color_recursive(scene, r, BENCH_DEPTH, &sampler));
+            }
+            *framebuffer_at(fb, i, y) = vec3_scale(sum, scale);
+        }
+    }
+}
+
+static double max_difference(const Framebuffer *a, const Framebuffer *b)
+{
+    double worst = 0.0;
+    size_t count = (size_t)a->width * (size_t)a->height;
+    for (size_t i = 0; i < count; i++)
+    {
+        Vec3 d = vec3_sub(a->pixels[i], b->pixels[i]);
+        worst = fmax(worst, fmax(fabs(d.x), fmax(fabs(d.y), fabs(d.z))));
+    }
+    return worst;
+}
+
+int main(void)
+{
+    Scene scene;
+    scene_init(&scene);
+    if (!demo_scene_spheres(&scene) || !scene_build(&scene))
+        return 1;
+    Camera camera = demo_camera(BENCH_WIDTH, BENCH_HEIGHT, BENCH_SPP);
+
+    Framebuffer reference, iterative, wavefront;
+    if (!framebuffer_init(&reference, BENCH_WIDTH, BENCH_HEIGHT) ||
+        !framebuffer_init(&iterative, BENCH_WIDTH, BENCH_HEIGHT) ||
+        !framebuffer_init(&wavefront, BENCH_WIDTH, BENCH_HEIGHT))
+        return 1;
+
+    RenderSettings settings = {.max_depth = BENCH_DEPTH, .thread_count = 1};
+    double paths = (double)BENCH_WIDTH * BENCH_HEIGHT * BENCH_SPP;
+
+    double start = now_seconds();
+    render_recursive(&reference, &scene, &camera);
+    double t_recursive = now_seconds() - start;
+
+    start = now_seconds();
+    render_tiles(&iterative, &scene, &camera, &settings);
+    double t_iterative = now_seconds() - start;
+
+    settings.wavefront = true;
+    start = now_seconds();
+    render_tiles(&wavefront, &scene, &camera, &settings);
+    double t_wavefront = now_seconds() - start;
+
+    printf("%d x %d, %d spp, depth %d, 1 thread\n", BENCH_WIDTH, BENCH_HEIGHT, BENCH_SPP, BENCH_DEPTH);
+    printf("%-10s %8.3f s  %8.3f Mpaths/s\n", "recursive", t_recursive, paths / t_recursive * 1e-6);
+    printf("%-10s %8.3f s  %8.3f Mpaths/s  max diff vs recursive %.3g\n", "iterative", t_iterative,
+           paths / t_iterative * 1e-6, max_difference(&iterative, &reference));
+    printf("%-10s %8.3f s  %8.3f Mpaths/s  max diff vs iterative %.3g\n", "wavefront", t_wavefront,
+           paths / t_wavefront * 1e-6, max_difference(&wavefront, &iterative));
+
+    framebuffer_free(&reference);
+    framebuffer_free(&iterative);
+    framebuffer_free(&wavefront);
+    scene_free(&scene);
+    return 0;
+}
@@ -0,0 +1,317 @@
+// Renders a fixed set of scenes and reports, as JSON on stdout, the time spent
+// building, rendering and encoding each one, primary and total rays per
+// second, and how rendering scales with the thread count.
+// Build and run with: make bench
+//
+// Options: -s spp (default 16), -W width, -H height (default 320 x 180),
+//          -t max threads (default: one per core), -d max depth (default 10)
+
+#include "../demo_scene.h"
+#include "../render.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MESH_RINGS 500 // Torus tessellation, 2 * MESH_RINGS * MESH_SIDES triangles
+#define MESH_SIDES 200
+
+typedef struct
+{
+    const char *name;
+    bool (*build)(Scene *scene);
+    Point3 look_from;
+    Point3 look_at;
+    double vfov; // Vertical field of view in degrees, 0 for the demo camera
+} BenchScene;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static Camera look_at_camera(Point3 from, Point3 at, double vfov, int width, int height, size_t spp)
+{
+    double h = tan(vfov * M_PI / 360.0);
+    double viewport_height = 2.0 * h;
+    double viewport_width = viewport_height * width / height;
+    Vec3 w = vec3_unit(vec3_sub(from, at));
+    Vec3 u = vec3_unit(vec3_cross(vec3_create(0, 1, 0), w));
+    Vec3 v = vec3_cross(w, u);
+
+    Vec3 horizontal = vec3_scale(u, viewport_width);
+    Vec3 vertical = vec3_scale(v, viewport_height);
+    Point3 lower_left = vec3_sub(vec3_sub(vec3_sub(from, vec3_scale(horizontal, 0.5)), vec3_scale(vertical, 0.5)), w);
+    return camera_create(from, lower_left, horizontal, vertical, width, height, spp);
+}
+
+// -----------------------------------------------------------------------------
+// Scenes
+// -----------------------------------------------------------------------------
+
+static bool add_ground(Scene *scene)
+{
+    MaterialId id;
+    Hittable plane = {HITTABLE_PLANE, .object.plane = {{0, 0, 0}, {0, 1, 0}}};
+    if (!scene_add_material(scene, (Material){.color = {0.5, 0.5, 0.5}, .type = MATERIAL_LAMBERTIAN}, &id))
+        return false;
+    plane.material = id;
+    return scene_add(scene, plane);
+}
+
+static bool add_sphere(Scene *scene, Point3 center, double radius, Material material)
+{
+    MaterialId id;
+    Hittable h = {HITTABLE_SPHERE, .object.sphere = {center, radius}};
+    if (!scene_add_material(scene, material, &id))
+        return false;
+    h.material = id;
+    return scene_add(scene, h);
+}
+
+static bool build_spheres(Scene *scene)
+{
+    return demo_scene_spheres(scene);
+}
+
+// A 22 x 22 grid of small spheres with random materials around three large ones
+static bool build_sphere_field(Scene *scene)
+{
+    Rng rng;
+    rng_seed(&rng, 7, 0, 0);
+    bool ok = add_ground(scene);
+    for (int a = -11; ok && a < 11; a++)
+    {
+        for (int b = -11; ok && b < 11; b++)
+        {
+            Point3 center = vec3_create(a + 0.9 * random_double(&rng), 0.2, b + 0.9 * random_double(&rng));
+            double choose = random_double(&rng);
+            Material m = {.color = {random_double(&rng), random_double(&rng), random_double(&rng)}};
+            if (choose < 0.8)
+            {
+                m.type = MATERIAL_LAMBERTIAN;
+            }
+            else if (choose < 0.95)
+            {
+                m.type = MATERIAL_METAL;
+                m.properties.fuzz = 0.5 * random_double(&rng);
+            }
+            else
+            {
+                m.type = MATERIAL_DIELECTRIC;
+                m.color = vec3_create(1, 1, 1);
+                m.properties.ref_idx = 1.5;
+            }
+            ok = add_sphere(scene, center, 0.2, m);
+        }
+    }
+    return ok &&
+           add_sphere(scene, vec3_create(0, 1, 0), 1.0,
+                      (Material){.color = {1, 1, 1}, .type = MATERIAL_DIELECTRIC, .properties.ref_idx = 1.5}) &&
+           add_sphere(scene, vec3_create(-4, 1, 0), 1.0, (Material){.color = {0.4, 0.2, 0.1}, .type = MATERIAL_LAMBERTIAN}) &&
+           add_sphere(scene, vec3_create(4, 1, 0), 1.0,
+                      (Material){.color = {0.7, 0.6, 0.5}, .type = MATERIAL_METAL, .properties.fuzz = 0.0});
+}
+
+// A finely tessellated torus standing on the ground
+static bool build_mesh(Scene *scene)
+{
+    Mesh *mesh = arena_alloc(&scene->arena, sizeof(Mesh), _Alignof(Mesh));
+    if (!mesh)
+        return false;
+    mesh->vertex_count = MESH_RINGS * MESH_SIDES;
+    mesh->triangle_count = 2 * MESH_RINGS * MESH_SIDES;
+    mesh->vertices = arena_alloc(&scene->arena, sizeof(Point3) * mesh->vertex_count, _Alignof(Point3));
+    mesh->indices = arena_alloc(&scene->arena, sizeof(uint32_t) * 3 * (size_t)mesh->triangle_count, _Alignof(uint32_t));
+    if (!mesh->vertices || !mesh->indices)
+        return false;
+
+    for (uint32_t i = 0; i < MESH_RINGS; i++)
+    {
+        double theta = 2.0 * M_PI * i / MESH_RINGS;
+        for (uint32_t j = 0; j < MESH_SIDES; j++)
+        {
+            double phi = 2.0 * M_PI * j / MESH_SIDES;
+            double r = 1.0 + 0.4 * cos(phi);
+            mesh->vertices[i * MESH_SIDES + j] = vec3_create(r * cos(theta), 1.4 + r * sin(theta), 0.4 * sin(phi));
+
+            uint32_t a = i * MESH_SIDES + j;
+            uint32_t b = ((i + 1) % MESH_RINGS) * MESH_SIDES + j;
+            uint32_t c = ((i + 1) % MESH_RINGS) * MESH_SIDES + (j + 1) % MESH_SIDES;
+            uint32_t d = i * MESH_SIDES + (j + 1) % MESH_SIDES;
+            uint32_t *tri = &mesh->indices[6 * (size_t)a];
+            tri[0] = a, tri[1] = b, tri[2] = c;
+            tri[3] = a, tri[4] = c, tri[5] = d;
+        }
+    }
+
+    MaterialId id;
+    Hittable h = {HITTABLE_MESH, .object.mesh = mesh};
+    if (!add_ground(scene) ||
+        !scene_add_material(scene, (Material){.color = {0.8, 0.3, 0.3}, .type = MATERIAL_LAMBERTIAN}, &id))
+        return false;
+    h.material = id;
+    return scene_add(scene, h);
+}
+
+// Rows of glass spheres in front of a few diffuse ones, most paths refract
+// several times before they leave
+static bool build_glass(Scene *scene)
+{
+    bool ok = add_ground(scene);
+    for (int row = 0; ok && row < 4; row++)
+    {
+        for (int col = -3; ok && col <= 3; col++)
+        {
+            Material glass = {.color = {0.95, 0.95, 1.0}, .type = MATERIAL_DIELECTRIC, .properties.ref_idx = 1.3 + 0.1 * row};
+            ok = add_sphere(scene, vec3_create(col * 0.9, 0.4, -row * 0.9), 0.4, glass);
+        }
+    }
+    for (int col = -1; ok && col <= 1; col++)
+        ok = add_sphere(scene, vec3_create(col * 2.0, 1.0, -5.0), 1.0,
+                        (Material){.color = {0.2 + 0.3 * (col + 1), 0.5, 0.8 - 0.3 * (col + 1)}, .type = MATERIAL_LAMBERTIAN});
+    return ok;
+}
+
+static const BenchScene scenes[] = {
+    {"spheres", build_spheres, {.x = 0, .y = 0, .z = 0}, {.x = 0, .y = 0, .z = 0}, 0.0},
+    {"sphere_field", build_sphere_field, {.x = 13, .y = 2, .z = 3}, {.x = 0, .y = 0, .z = 0}, 20.0},
+    {"mesh", build_mesh, {.x = 0, .y = 2.5, .z = 5}, {.x = 0, .y = 1.2, .z = 0}, 40.0},
+    {"glass", build_glass, {.x = 0, .y = 2, .z = 4}, {.x = 0, .y = 0.5, .z = -1.5}, 45.0},
+};
+
+#define SCENE_COUNT (sizeof(scenes) / sizeof(scenes[0]))
+
+// -----------------------------------------------------------------------------
+// Driver
+// -----------------------------------------------------------------------------
+
+static uint64_t fnv1a(const unsigned char *data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+static bool bench_scene(const BenchScene *bench, int width, int height, size_t spp, int max_depth,
+                        const int *thread_counts, int thread_count_count, bool first)
+{
+    fprintf(stderr, "%s...\n", bench->name);
+    Scene scene;
+    scene_init(&scene);
+
+    double start = now_seconds();
+    bool ok = bench->build(&scene) && scene_build(&scene);
+    double build_seconds = now_seconds() - start;
+    if (!ok)
+    {
+        fprintf(stderr, "render_bench: could not build %s\n", bench->name);
+        scene_free(&scene);
+        return false;
+    }
+
+    Camera camera = bench->vfov > 0 ? look_at_camera(bench->look_from, bench->look_at, bench->vfov, width, height, spp)
+                                    : demo_camera(width, height, spp);
+    Framebuffer fb;
+    if (!framebuffer_init(&fb, width, height))
+    {
+        scene_free(&scene);
+        return false;
+    }
+
+    printf("%s    {\n", first ? "" : ",\n");
+    printf("      \"name\": \"%s\",\n", bench->name);
+    printf("      \"primitives\": %u,\n", scene.bvh.prim_count + (uint32_t)scene.unbounded_count);
+    printf("      \"build_seconds\": %.6f,\n", build_seconds);
+    printf("      \"runs\": [\n");
+
+    double single_thread_seconds = 0.0;
+    for (int i = 0; i < thread_count_count; i++)
+    {
+        RenderSettings settings = {
+            .max_depth = max_depth,
+            .roulette_depth = RENDER_DEFAULT_ROULETTE_DEPTH,
+            .thread_count = thread_counts[i],
+            .tile_size = RENDER_DEFAULT_TILE_SIZE,
+            .packets = true,
+        };
+        start = now_seconds();
+        RenderCounts counts = render_tiles(&fb, &scene, &camera, &settings);
+        double seconds = now_seconds() - start;
+        if (i == 0)
+            single_thread_seconds = seconds * thread_counts[0];
+
+        printf("        {\"threads\": %d, \"render_seconds\": %.6f, \"primary_rays_per_second\": %.0f, "
+               "\"rays_per_second\": %.0f, \"rays_per_sample\": %.3f, \"speedup\": %.3f}%s\n",
+               thread_counts[i], seconds, counts.samples / seconds, counts.rays / seconds,
+               counts.samples ? (double)counts.rays / counts.samples : 0.0, single_thread_seconds / seconds,
+               i + 1 < thread_count_count ? "," : "");
+    }
+    printf("      ],\n");
+
+    // Output phase: encode the last render as binary PPM into memory
+    char *image = NULL;
+    size_t image_size = 0;
+    FILE *memory = open_memstream(&image, &image_size);
+    start = now_seconds();
+    ok = memory && framebuffer_write(memory, &fb, IMAGE_FORMAT_PPM);
+    if (memory)
+        fclose(memory);
+    double output_seconds = now_seconds() - start;
+    printf("      \"output_seconds\": %.6f,\n", output_seconds);
+    printf("      \"image_hash\": \"%016llx\"\n", ok ? (unsigned long long)fnv1a((unsigned char *)image, image_size) : 0ull);
+    printf("    }");
+
+    free(image);
+    framebuffer_free(&fb);
+    scene_free(&scene);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int width = 320, height = 180, max_depth = 10;
+    size_t spp = 16;
+    int max_threads = render_default_thread_count();
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "Usage: %s [-s spp] [-W width] [-H height] [-t max threads] [-d depth]\n", argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "-s") == 0)
+            spp = (size_t)atol(argv[++i]);
+        else if (strcmp(argv[i], "-W") == 0)
+            width = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-H") == 0)
+            height = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0)
+            max_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0)
+            max_depth = atoi(argv[++i]);
+    }
+
+    // Powers of two up to max_threads, then max_threads itself
+    int thread_counts[32];
+    int thread_count_count = 0;
+    for (int t = 1; t < max_threads && thread_count_count < 31; t *= 2)
+        thread_counts[thread_count_count++] = t;
+    thread_counts[thread_count_count++] = max_threads > 0 ? max_threads : 1;
+
+    printf("{\n");
+    printf("  \"config\": {\"precision\": \"%s\", \"simd\": \"%s\", \"cores\": %d, \"width\": %d, \"height\": %d, "
+           "\"spp\": %zu, \"max_depth\": %d},\n",
+           sizeof(real) == sizeof(float) ? "float" : "double", soa_kernel_name(), render_default_thread_count(), width,
+           height, spp, max_depth);
+    printf("  \"scenes\": [\n");
+    bool ok = true;
+    for (size_t s = 0; s < SCENE_COUNT; s++)
+        ok = bench_scene(&scenes[s], width, height, spp, max_depth, thread_counts, thread_count_count, s == 0) && ok;
+    printf("\n  ]\n}\n");
+    return ok ? 0 : 1;
+}
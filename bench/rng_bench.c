@@ -0,0 +1,116 @@
+// Compares the per-sample PCG32 generator against libc rand()/rand_r().
+// Build and run with: make bench-rng
+
+#include "../math/rng.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DRAWS 50000000u
+#define THREADS 4
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The sums are printed so the compiler cannot drop the loops
+static double bench_rand(void)
+{
+    double sum = 0.0;
+    for (unsigned i = 0; i < DRAWS; i++)
+        sum += rand() / (RAND_MAX + 1.0);
+    return sum;
+}
+
+static double bench_rand_r(void)
+{
+    unsigned int state = 1;
+    double sum = 0.0;
+    for (unsigned i = 0; i < DRAWS; i++)
+        sum += rand_r(&state) / (RAND_MAX + 1.0);
+    return sum;
+}
+
+static double bench_pcg(void)
+{
+    Rng rng;
+    rng_seed(&rng, 0, 0, 0);
+    double sum = 0.0;
+    for (unsigned i = 0; i < DRAWS; i++)
+        sum += random_double(&rng);
+    return sum;
+}
+
+// Seeding cost is paid once per camera sample
+static double bench_pcg_seed(void)
+{
+    Rng rng;
+    double sum = 0.0;
+    for (unsigned i = 0; i < DRAWS / 10; i++)
+    {
+        rng_seed(&rng, i, i & 1023, 0);
+        sum += random_double(&rng);
+    }
+    return sum;
+}
+
+static void *thread_rand(void *arg)
+{
+    *(double *)arg = bench_rand();
+    return NULL;
+}
+
+static void *thread_pcg(void *arg)
+{
+    *(double *)arg = bench_pcg();
+    return NULL;
+}
+
+// Runs fn on THREADS threads at once and returns the aggregate wall time
+static double run_threaded(void *(*fn)(void *))
+{
+    pthread_t threads[THREADS];
+    double sums[THREADS];
+    double start = now_seconds();
+    for (int t = 0; t < THREADS; t++)
+        pthread_create(&threads[t], NULL, fn, &sums[t]);
+    for (int t = 0; t < THREADS; t++)
+        pthread_join(threads[t], NULL);
+    return now_seconds() - start;
+}
+
+static void report(const char *name, double seconds, unsigned draws, double sum)
+{
+    printf("%-24s %8.2f ns/draw  (%.3f s, checksum %.1f)\n", name, seconds * 1e9 / draws, seconds, sum);
+}
+
+int main(void)
+{
+    double start, sum;
+
+    start = now_seconds();
+    sum = bench_rand();
+    report("rand()", now_seconds() - start, DRAWS, sum);
+
+    start = now_seconds();
+    sum = bench_rand_r();
+    report("rand_r()", now_seconds() - start, DRAWS, sum);
+
+    start = now_seconds();
+    sum = bench_pcg();
+    report("pcg32", now_seconds() - start, DRAWS, sum);
+
+    start = now_seconds();
+    sum = bench_pcg_seed();
+    report("pcg32 seed+draw", now_seconds() - start, DRAWS / 10, sum);
+
+    printf("\n%d threads, %u draws each (wall time per draw per thread):\n", THREADS, DRAWS);
+    report("rand() shared", run_threaded(thread_rand), DRAWS, 0.0);
+    report("pcg32 per thread", run_threaded(thread_pcg), DRAWS, 0.0);
+    return 0;
+}
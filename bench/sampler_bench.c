@@ -0,0 +1,174 @@
+// Convergence of the samplers: display-space RMSE against a high sample count
+// reference at doubling sample counts, on the sky-lit demo scene and on
+// scenes/lights.scene, which adds next-event estimation. Prints the error
+// curves, the slope of log error over log spp fitted from 4 spp up (-0.5 is
+// plain Monte Carlo), and the samples each sampler needs to match the
+// random sampler's error at the highest count.
+// Build and run with: make bench-sampler
+
+#include "../demo_scene.h"
+#include "../scene_file.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_WIDTH 160
+#define BENCH_HEIGHT 90
+#define BENCH_REFERENCE_SPP 4096
+#define BENCH_MAX_SPP 256
+#define BENCH_FIT_MIN_SPP 4
+#define BENCH_DEPTH 10
+#define BENCH_LIGHTS_SCENE "scenes/lights.scene"
+
+static const SamplerType bench_samplers[] = {SAMPLER_RANDOM, SAMPLER_STRATIFIED, SAMPLER_SOBOL, SAMPLER_BLUE_NOISE};
+#define BENCH_SAMPLER_COUNT (int)(sizeof(bench_samplers) / sizeof(bench_samplers[0]))
+#define BENCH_STEPS 9 // 1, 2, 4 .. BENCH_MAX_SPP
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// RMSE after clamping and gamma 2, the error a viewer of the output sees
+static double display_rmse(const Framebuffer *a, const Framebuffer *reference)
+{
+    double sum = 0.0;
+    size_t count = (size_t)a->width * (size_t)a->height;
+    for (size_t i = 0; i < count; i++)
+    {
+        const real *p = &a->pixels[i].x, *q = &reference->pixels[i].x;
+        for (int c = 0; c < 3; c++)
+        {
+            double d = sqrt(fmin(fmax(p[c], 0.0), 1.0)) - sqrt(fmin(fmax(q[c], 0.0), 1.0));
+            sum += d * d;
+        }
+    }
+    return sqrt(sum / (3.0 * (double)count));
+}
+
+static double render(Framebuffer *fb, Scene *scene, Camera camera, SamplerType sampler, size_t spp)
+{
+    camera.samples_per_pixel = spp;
+    RenderSettings settings = {
+        .max_depth = BENCH_DEPTH,
+        .roulette_depth = RENDER_DEFAULT_ROULETTE_DEPTH,
+        .packets = true,
+        .sampler = sampler,
+    };
+    double start = now_seconds();
+    render_tiles(fb, scene, &camera, &settings);
+    return now_seconds() - start;
+}
+
+// Least-squares slope of log(rmse) over log(spp) for the counts >= BENCH_FIT_MIN_SPP
+static double fit_slope(const double *rmse)
+{
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    int n = 0;
+    for (int step = 0; step < BENCH_STEPS; step++)
+    {
+        if ((1 << step) < BENCH_FIT_MIN_SPP)
+            continue;
+        double x = log((double)(1 << step)), y = log(rmse[step]);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+        n++;
+    }
+    return (n * sxy - sx * sy) / (n * sxx - sx * sx);
+}
+
+static bool bench_scene(const char *name, Scene *scene, Camera camera)
+{
+    Framebuffer reference, image;
+    if (!framebuffer_init(&reference, BENCH_WIDTH, BENCH_HEIGHT) || !framebuffer_init(&image, BENCH_WIDTH, BENCH_HEIGHT))
+        return false;
+
+    fprintf(stderr, "%s: rendering the %d spp reference...\n", name, BENCH_REFERENCE_SPP);
+    render(&reference, scene, camera, SAMPLER_SOBOL, BENCH_REFERENCE_SPP);
+
+    double rmse[BENCH_SAMPLER_COUNT][BENCH_STEPS];
+    double seconds[BENCH_SAMPLER_COUNT] = {0};
+    for (int k = 0; k < BENCH_SAMPLER_COUNT; k++)
+    {
+        for (int step = 0; step < BENCH_STEPS; step++)
+        {
+            seconds[k] += render(&image, scene, camera, bench_samplers[k], (size_t)1 << step);
+            rmse[k][step] = display_rmse(&image, &reference);
+        }
+    }
+
+    printf("\n%s, %d x %d, depth %d, RMSE against %d spp\n", name, BENCH_WIDTH, BENCH_HEIGHT, BENCH_DEPTH,
+           BENCH_REFERENCE_SPP);
+    printf("%6s", "spp");
+    for (int k = 0; k < BENCH_SAMPLER_COUNT; k++)
+        printf(" %11s", sampler_name(bench_samplers[k]));
+    printf("\n");
+    for (int step = 0; step < BENCH_STEPS; step++)
+    {
+        printf("%6d", 1 << step);
+        for (int k = 0; k < BENCH_SAMPLER_COUNT; k++)
+            printf(" %11.5f", rmse[k][step]);
+        printf("\n");
+    }
+    printf("%6s", "slope");
+    for (int k = 0; k < BENCH_SAMPLER_COUNT; k++)
+        printf(" %11.3f", fit_slope(rmse[k]));
+    printf("\n%6s", "time");
+    for (int k = 0; k < BENCH_SAMPLER_COUNT; k++)
+        printf(" %10.2fs", seconds[k]);
+
+    // Smallest count at or below the random sampler's error at the top
+    // count, interpolated log-linearly between the two counts around it
+    double target = rmse[0][BENCH_STEPS - 1];
+    printf("\n%6s", "match");
+    for (int k = 0; k < BENCH_SAMPLER_COUNT; k++)
+    {
+        int step = 0;
+        while (step < BENCH_STEPS && rmse[k][step] > target)
+            step++;
+        double spp = 1 << (step < BENCH_STEPS ? step : BENCH_STEPS - 1);
+        if (step > 0 && step < BENCH_STEPS)
+        {
+            double t = log(rmse[k][step - 1] / target) / log(rmse[k][step - 1] / rmse[k][step]);
+            spp = pow(2.0, step - 1 + t);
+        }
+        printf(" %11.0f", spp);
+    }
+    printf("   (spp to reach random at %d spp)\n", BENCH_MAX_SPP);
+
+    framebuffer_free(&image);
+    framebuffer_free(&reference);
+    return true;
+}
+
+int main(void)
+{
+    Scene scene;
+    scene_init(&scene);
+    if (!demo_scene_spheres(&scene) || !scene_build(&scene) ||
+        !bench_scene("Demo scene", &scene, demo_camera(BENCH_WIDTH, BENCH_HEIGHT, 1)))
+        return 1;
+    scene_free(&scene);
+
+    // The file's camera at the bench resolution
+    SceneFileSettings file;
+    Animation animation;
+    scene_init(&scene);
+    if (!scene_file_load(&scene, &file, &animation, BENCH_LIGHTS_SCENE, false, 0))
+        return 1;
+    Camera camera = file.camera;
+    camera.pixel_delta_u = vec3_scale(camera.pixel_delta_u, (double)camera.image_width / BENCH_WIDTH);
+    camera.pixel_delta_v = vec3_scale(camera.pixel_delta_v, (double)camera.image_height / BENCH_HEIGHT);
+    camera.image_width = BENCH_WIDTH;
+    camera.image_height = BENCH_HEIGHT;
+    bool ok = bench_scene(BENCH_LIGHTS_SCENE, &scene, camera);
+    animation_free(&animation);
+    scene_free(&scene);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,110 @@
+// Texture cache throughput and memory: converts a generated 4096 x 4096
+// image, then runs filtered lookups at a range of cache budgets, once along
+// a coherent path (neighbouring lookups share tiles, like the pixels of a
+// tile) and once at random places and sizes. Prints lookups per second, the
+// tile hit rate and the cache's resident bytes against its budget.
+// Build and run with: make bench-texture
+
+#include "../texture.h"
+#include "../framebuffer.h"
+#include "../math/rng.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_TEXTURE_PATH "bench/texture_bench.pfm"
+#define BENCH_TEXTURE_SIZE 4096
+#define BENCH_LOOKUPS 2000000
+
+static const int bench_budgets_mb[] = {1, 4, 16, 64, 256};
+#define BENCH_BUDGET_COUNT (int)(sizeof(bench_budgets_mb) / sizeof(bench_budgets_mb[0]))
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool write_texture(void)
+{
+    Framebuffer image;
+    if (!framebuffer_init(&image, BENCH_TEXTURE_SIZE, BENCH_TEXTURE_SIZE))
+        return false;
+    for (int y = 0; y < BENCH_TEXTURE_SIZE; y++)
+    {
+        for (int x = 0; x < BENCH_TEXTURE_SIZE; x++)
+        {
+            double s = 0.5 + 0.5 * sin(x * 0.05) * cos(y * 0.03);
+            *framebuffer_at(&image, x, y) = vec3_create(s, (double)x / BENCH_TEXTURE_SIZE, (double)y / BENCH_TEXTURE_SIZE);
+        }
+    }
+    bool ok = framebuffer_write_file(BENCH_TEXTURE_PATH, &image, IMAGE_FORMAT_PFM);
+    framebuffer_free(&image);
+    return ok;
+}
+
+// Returns the sum of the lookups, so the compiler cannot drop them
+static double run(const TextureSystem *ts, bool coherent, double *seconds)
+{
+    Rng rng;
+    rng_seed(&rng, 7, 0, 0);
+    double sum = 0;
+    double start = now_seconds();
+    for (int i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        double u, v, width;
+        if (coherent)
+        {
+            // A raster walk over the image at about one texel per lookup
+            u = (double)(i % 4096) / 4096.0;
+            v = (double)(i / 4096) / 4096.0;
+            width = 1.0 / 4096.0;
+        }
+        else
+        {
+            u = random_double(&rng);
+            v = random_double(&rng);
+            width = pow(2.0, -12.0 * random_double(&rng));
+        }
+        Color c = texture_lookup(ts, 0, u, v, width);
+        sum += c.x + c.y + c.z;
+    }
+    *seconds = now_seconds() - start;
+    return sum;
+}
+
+int main(void)
+{
+    TextureSystem ts;
+    texture_system_init(&ts);
+    uint32_t id;
+    double start = now_seconds();
+    if (!write_texture() || !texture_system_add(&ts, BENCH_TEXTURE_PATH, 1.0, &id))
+        return 1;
+    printf("%d x %d texture written and converted in %.2f s, %d lookups per run\n", BENCH_TEXTURE_SIZE,
+           BENCH_TEXTURE_SIZE, now_seconds() - start, BENCH_LOOKUPS);
+    printf("%9s %9s %12s %9s %10s %12s\n", "budget", "access", "Mlookups/s", "hits", "evictions", "resident");
+
+    for (int b = 0; b < BENCH_BUDGET_COUNT; b++)
+    {
+        for (int coherent = 1; coherent >= 0; coherent--)
+        {
+            // A changed budget starts the cache empty, so every run is cold
+            if (!texture_system_prepare(&ts, 1) || !texture_system_prepare(&ts, (size_t)bench_budgets_mb[b] << 20))
+                return 1;
+            double seconds;
+            double sum = run(&ts, coherent, &seconds);
+            TextureStats stats;
+            texture_system_stats(&ts, &stats);
+            printf("%6d MB %9s %12.2f %8.2f%% %10llu %9.1f MB  (checksum %g)\n", bench_budgets_mb[b],
+                   coherent ? "coherent" : "random", BENCH_LOOKUPS / seconds * 1e-6,
+                   100.0 * (double)stats.hits / (double)(stats.requests ? stats.requests : 1),
+                   (unsigned long long)stats.evictions, (double)stats.resident_bytes / (1024.0 * 1024.0), sum);
+        }
+    }
+    texture_stats_print(stdout, &ts);
+    texture_system_free(&ts);
+    return 0;
+}
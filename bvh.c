@@ -0,0 +1,618 @@
+#include "bvh.h"
+#include "instance.h"
+#include "stats.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Below this depth splits follow the SAH, deeper nodes fall back to object
+// median splits so the tree depth (and the traversal stack) stays bounded.
+#define BVH_MAX_SAH_DEPTH (BVH_STACK_SIZE - 32)
+
+// Relative cost of one node traversal step compared to one primitive test
+#define BVH_TRAVERSAL_COST 0.125
+
+bool hittable_bounds(const Hittable *h, Aabb *out)
+{
+    switch (h->type)
+    {
+    case HITTABLE_SPHERE:
+    {
+        const Sphere *s = &h->object.sphere;
+        double r = fabs(s->radius);
+        Vec3 extent = vec3_create(r, r, r);
+        out->min = vec3_sub(s->center, extent);
+        out->max = vec3_add(s->center, extent);
+        return true;
+    }
+    case HITTABLE_TRIANGLE:
+    {
+        const Triangle *tr = &h->object.triangle;
+        *out = aabb_grow(aabb_grow(aabb_grow(aabb_empty(), tr->v0), tr->v1), tr->v2);
+        return true;
+    }
+    case HITTABLE_MESH:
+    {
+        const Mesh *mesh = h->object.mesh;
+        *out = aabb_empty();
+        for (uint32_t i = 0; i < mesh->vertex_count; i++)
+            *out = aabb_grow(*out, mesh->vertices[i]);
+        return mesh->triangle_count > 0;
+    }
+    case HITTABLE_INSTANCE:
+        *out = instance_bounds(h->object.instance);
+        return true;
+    case HITTABLE_PLANE:
+    case HITTABLE_PAGED_MESH: // Has its own top-level tree, traced apart from the BVH
+    default:
+        return false;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Build
+// -----------------------------------------------------------------------------
+typedef struct
+{
+    Aabb bounds;
+    Point3 centroid;
+    uint32_t index;
+    uint32_t prim; // Triangle index for meshes
+    HittableType type;
+} BuildRef;
+
+typedef struct
+{
+    Aabb bounds;
+    uint32_t count;
+} Bin;
+
+typedef struct
+{
+    BvhNode *nodes;
+    uint32_t node_count;
+    BuildRef *refs;
+} Builder;
+
+// Rounds towards -inf / +inf so the float box always contains the double one
+static float float_down(double x)
+{
+    float f = (float)x;
+    return (double)f > x ? nextafterf(f, -INFINITY) : f;
+}
+
+static float float_up(double x)
+{
+    float f = (float)x;
+    return (double)f < x ? nextafterf(f, INFINITY) : f;
+}
+
+static void node_set_bounds(BvhNode *node, Aabb b)
+{
+    node->bounds_min[0] = float_down(b.min.x);
+    node->bounds_min[1] = float_down(b.min.y);
+    node->bounds_min[2] = float_down(b.min.z);
+    node->bounds_max[0] = float_up(b.max.x);
+    node->bounds_max[1] = float_up(b.max.y);
+    node->bounds_max[2] = float_up(b.max.z);
+}
+
+static int bin_of(double c, double lo, double scale)
+{
+    int bin = (int)((c - lo) * scale);
+    if (bin < 0)
+        bin = 0;
+    if (bin >= BVH_SAH_BINS)
+        bin = BVH_SAH_BINS - 1;
+    return bin;
+}
+
+// Evaluates every bin boundary on every axis. Returns false when no split
+// beats making a leaf, otherwise the winning axis and boundary.
+static bool find_sah_split(const BuildRef *refs, uint32_t count, Aabb bounds, Aabb centroid_bounds,
+                           int *best_axis, int *best_split)
+{
+    double parent_area = aabb_surface_area(bounds);
+    double best_cost = (double)count; // Cost of a leaf
+    bool found = false;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double lo = vec3_axis(centroid_bounds.min, axis);
+        double hi = vec3_axis(centroid_bounds.max, axis);
+        if (hi <= lo)
+            continue;
+        double scale = BVH_SAH_BINS / (hi - lo);
+
+        Bin bins[BVH_SAH_BINS];
+        for (int i = 0; i < BVH_SAH_BINS; i++)
+        {
+            bins[i].bounds = aabb_empty();
+            bins[i].count = 0;
+        }
+        for (uint32_t i = 0; i < count; i++)
+        {
+            int b = bin_of(vec3_axis(refs[i].centroid, axis), lo, scale);
+            bins[b].bounds = aabb_union(bins[b].bounds, refs[i].bounds);
+            bins[b].count++;
+        }
+
+        // Sweep from the right to get the cost of every right half, then
+        // from the left and combine.
+        double right_area[BVH_SAH_BINS];
+        uint32_t right_count[BVH_SAH_BINS];
+        Aabb acc = aabb_empty();
+        uint32_t n = 0;
+        for (int i = BVH_SAH_BINS - 1; i > 0; i--)
+        {
+            acc = aabb_union(acc, bins[i].bounds);
+            n += bins[i].count;
+            right_area[i] = aabb_surface_area(acc);
+            right_count[i] = n;
+        }
+
+        acc = aabb_empty();
+        n = 0;
+        for (int i = 0; i < BVH_SAH_BINS - 1; i++)
+        {
+            acc = aabb_union(acc, bins[i].bounds);
+            n += bins[i].count;
+            if (n == 0 || right_count[i + 1] == 0)
+                continue;
+
+            double cost = BVH_TRAVERSAL_COST +
+                          (n * aabb_surface_area(acc) + right_count[i + 1] * right_area[i + 1]) / parent_area;
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                *best_axis = axis;
+                *best_split = i;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+static int compare_x(const void *a, const void *b)
+{
+    double d = ((const BuildRef *)a)->centroid.x - ((const BuildRef *)b)->centroid.x;
+    return (d > 0) - (d < 0);
+}
+
+static int compare_y(const void *a, const void *b)
+{
+    double d = ((const BuildRef *)a)->centroid.y - ((const BuildRef *)b)->centroid.y;
+    return (d > 0) - (d < 0);
+}
+
+static int compare_z(const void *a, const void *b)
+{
+    double d = ((const BuildRef *)a)->centroid.z - ((const BuildRef *)b)->centroid.z;
+    return (d > 0) - (d < 0);
+}
+
+// BVH_LEAF_* kind a primitive is stored as
+static uint16_t leaf_kind(HittableType type)
+{
+    if (type == HITTABLE_SPHERE)
+        return BVH_LEAF_SPHERES;
+    return type == HITTABLE_INSTANCE ? BVH_LEAF_INSTANCES : BVH_LEAF_TRIANGLES;
+}
+
+// Moves the refs of the first ref's leaf kind to the front. Returns the size
+// of that group, or count when all refs already share one kind.
+static uint32_t group_by_type(BuildRef *refs, uint32_t count)
+{
+    uint16_t kind = leaf_kind(refs[0].type);
+    uint32_t i = 0, j = count;
+    while (i < j)
+    {
+        if (leaf_kind(refs[i].type) == kind)
+        {
+            i++;
+        }
+        else
+        {
+            BuildRef tmp = refs[i];
+            refs[i] = refs[--j];
+            refs[j] = tmp;
+        }
+    }
+    return (i == 0 || i == count) ? count : i;
+}
+
+static uint32_t build_recursive(Builder *b, uint32_t begin, uint32_t end, int depth)
+{
+    uint32_t node_index = b->node_count++;
+    BvhNode *node = &b->nodes[node_index];
+    BuildRef *refs = &b->refs[begin];
+    uint32_t count = end - begin;
+
+    Aabb bounds = aabb_empty();
+    Aabb centroid_bounds = aabb_empty();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        bounds = aabb_union(bounds, refs[i].bounds);
+        centroid_bounds = aabb_grow(centroid_bounds, refs[i].centroid);
+    }
+    node_set_bounds(node, bounds);
+
+    Vec3 extent = vec3_sub(centroid_bounds.max, centroid_bounds.min);
+    int axis = 0;
+    if (extent.y > extent.x)
+        axis = 1;
+    if (extent.z > vec3_axis(extent, axis))
+        axis = 2;
+
+    uint32_t mid = count / 2;
+    int split = 0;
+    bool leaf = count <= BVH_MAX_LEAF_SIZE;
+    if (!leaf && depth < BVH_MAX_SAH_DEPTH && find_sah_split(refs, count, bounds, centroid_bounds, &axis, &split))
+    {
+        double lo = vec3_axis(centroid_bounds.min, axis);
+        double scale = BVH_SAH_BINS / (vec3_axis(centroid_bounds.max, axis) - lo);
+
+        // In-place partition around the chosen bin boundary
+        uint32_t i = 0, j = count;
+        while (i < j)
+        {
+            if (bin_of(vec3_axis(refs[i].centroid, axis), lo, scale) <= split)
+            {
+                i++;
+            }
+            else
+            {
+                BuildRef tmp = refs[i];
+                refs[i] = refs[--j];
+                refs[j] = tmp;
+            }
+        }
+        mid = i;
+    }
+    else if (!leaf && count <= 4 * BVH_MAX_LEAF_SIZE && depth < BVH_MAX_SAH_DEPTH)
+    {
+        // Splitting does not pay off and the leaf is still small
+        leaf = true;
+    }
+    else if (!leaf)
+    {
+        // Too many primitives for one leaf (or too deep): object median split
+        int (*compare)(const void *, const void *) = axis == 0 ? compare_x : (axis == 1 ? compare_y : compare_z);
+        qsort(refs, count, sizeof(BuildRef), compare);
+    }
+
+    if (leaf)
+    {
+        // Leaves hold a single primitive type so they map onto one SoA range,
+        // mixed leaves get one more split by type instead
+        mid = group_by_type(refs, count);
+        if (mid == count)
+        {
+            node->offset = begin;
+            node->count = (uint16_t)count;
+            node->axis = 0;
+            return node_index;
+        }
+    }
+
+    build_recursive(b, begin, begin + mid, depth + 1);
+    uint32_t right = build_recursive(b, begin + mid, end, depth + 1);
+
+    // nodes was allocated for the worst case up front, so node is still valid
+    node->offset = right;
+    node->count = 0;
+    node->axis = (uint16_t)axis;
+    return node_index;
+}
+
+// Copies the primitives of every leaf into the SoA array of its type, in
+// depth-first order, and points the leaf at its range there
+static bool fill_leaves(Bvh *bvh, const Hittable *world, const BuildRef *refs, uint32_t count)
+{
+    uint32_t kind_count[3] = {0, 0, 0};
+    for (uint32_t i = 0; i < count; i++)
+        kind_count[leaf_kind(refs[i].type)]++;
+    if (!sphere_soa_init(&bvh->spheres, kind_count[BVH_LEAF_SPHERES]) ||
+        !triangle_soa_init(&bvh->triangles, kind_count[BVH_LEAF_TRIANGLES]))
+        return false;
+    if (kind_count[BVH_LEAF_INSTANCES] > 0)
+    {
+        bvh->instances = malloc(sizeof(Instance *) * kind_count[BVH_LEAF_INSTANCES]);
+        bvh->instance_hittable = malloc(sizeof(uint32_t) * kind_count[BVH_LEAF_INSTANCES]);
+        if (!bvh->instances || !bvh->instance_hittable)
+            return false;
+    }
+
+    for (uint32_t n = 0; n < bvh->node_count; n++)
+    {
+        BvhNode *node = &bvh->nodes[n];
+        if (node->count == 0)
+            continue;
+
+        const BuildRef *leaf = &refs[node->offset];
+        if (leaf[0].type == HITTABLE_INSTANCE)
+        {
+            node->offset = bvh->instance_count;
+            node->axis = BVH_LEAF_INSTANCES;
+            for (uint32_t i = 0; i < node->count; i++)
+            {
+                bvh->instances[bvh->instance_count] = world[leaf[i].index].object.instance;
+                bvh->instance_hittable[bvh->instance_count++] = leaf[i].index;
+            }
+        }
+        else if (leaf[0].type == HITTABLE_SPHERE)
+        {
+            node->offset = bvh->spheres.count;
+            node->axis = BVH_LEAF_SPHERES;
+            for (uint32_t i = 0; i < node->count; i++)
+            {
+                const Sphere *s = &world[leaf[i].index].object.sphere;
+                sphere_soa_push(&bvh->spheres, s->center, s->radius, leaf[i].index);
+            }
+        }
+        else
+        {
+            node->offset = bvh->triangles.count;
+            node->axis = BVH_LEAF_TRIANGLES;
+            for (uint32_t i = 0; i < node->count; i++)
+            {
+                const Hittable *h = &world[leaf[i].index];
+                Triangle tr = h->type == HITTABLE_MESH ? mesh_triangle(h->object.mesh, leaf[i].prim) : h->object.triangle;
+                triangle_soa_push(&bvh->triangles, tr.v0, tr.v1, tr.v2, leaf[i].index, leaf[i].prim);
+            }
+        }
+    }
+    return true;
+}
+
+static void ref_init(BuildRef *ref, uint32_t index, uint32_t prim, HittableType type, Aabb bounds)
+{
+    ref->bounds = bounds;
+    ref->centroid = aabb_centroid(bounds);
+    ref->index = index;
+    ref->prim = prim;
+    ref->type = type;
+}
+
+bool bvh_build(Bvh *bvh, const Hittable *world, const uint32_t *indices, uint32_t count)
+{
+    memset(bvh, 0, sizeof(*bvh));
+
+    // Meshes are expanded into one reference per triangle
+    size_t ref_count = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const Hittable *h = &world[indices[i]];
+        ref_count += h->type == HITTABLE_MESH ? h->object.mesh->triangle_count : 1;
+    }
+    if (ref_count == 0)
+        return true;
+    if (ref_count > UINT32_MAX / 2)
+        return false;
+
+    Builder b = {
+        // A binary tree with single-primitive leaves has 2N - 1 nodes
+        .nodes = malloc(sizeof(BvhNode) * (2 * ref_count - 1)),
+        .node_count = 0,
+        .refs = malloc(sizeof(BuildRef) * ref_count),
+    };
+    if (!b.nodes || !b.refs)
+    {
+        free(b.nodes);
+        free(b.refs);
+        return false;
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const Hittable *h = &world[indices[i]];
+        Aabb bounds;
+        if (h->type != HITTABLE_MESH)
+        {
+            hittable_bounds(h, &bounds);
+            ref_init(&b.refs[n++], indices[i], 0, h->type, bounds);
+            continue;
+        }
+        for (uint32_t t = 0; t < h->object.mesh->triangle_count; t++)
+        {
+            Triangle tr = mesh_triangle(h->object.mesh, t);
+            bounds = aabb_grow(aabb_grow(aabb_grow(aabb_empty(), tr.v0), tr.v1), tr.v2);
+            ref_init(&b.refs[n++], indices[i], t, HITTABLE_MESH, bounds);
+        }
+    }
+    count = n;
+
+    build_recursive(&b, 0, count, 0);
+
+    // Give back the unused tail of the worst-case node allocation
+    BvhNode *shrunk = realloc(b.nodes, sizeof(BvhNode) * b.node_count);
+    bvh->nodes = shrunk ? shrunk : b.nodes;
+    bvh->node_count = b.node_count;
+    bvh->prim_count = count;
+
+    bool ok = fill_leaves(bvh, world, b.refs, count);
+    free(b.refs);
+    if (!ok)
+        bvh_free(bvh);
+    return ok;
+}
+
+void bvh_free(Bvh *bvh)
+{
+    free(bvh->nodes);
+    sphere_soa_free(&bvh->spheres);
+    triangle_soa_free(&bvh->triangles);
+    free(bvh->instances);
+    free(bvh->instance_hittable);
+    memset(bvh, 0, sizeof(*bvh));
+}
+
+// -----------------------------------------------------------------------------
+// Refit
+// -----------------------------------------------------------------------------
+
+static Aabb node_bounds(const BvhNode *node)
+{
+    Aabb b = {vec3_create(node->bounds_min[0], node->bounds_min[1], node->bounds_min[2]),
+              vec3_create(node->bounds_max[0], node->bounds_max[1], node->bounds_max[2])};
+    return b;
+}
+
+void bvh_refit(Bvh *bvh)
+{
+    // Children always come after their parent, so one backwards sweep sees
+    // both children of a node before the node itself
+    for (uint32_t n = bvh->node_count; n-- > 0;)
+    {
+        BvhNode *node = &bvh->nodes[n];
+        if (node->count == 0)
+        {
+            Aabb left = node_bounds(&bvh->nodes[n + 1]);
+            Aabb right = node_bounds(&bvh->nodes[node->offset]);
+            node_set_bounds(node, aabb_union(left, right));
+        }
+        else if (node->axis == BVH_LEAF_INSTANCES)
+        {
+            Aabb bounds = aabb_empty();
+            for (uint32_t i = 0; i < node->count; i++)
+                bounds = aabb_union(bounds, instance_bounds(bvh->instances[node->offset + i]));
+            node_set_bounds(node, bounds);
+        }
+    }
+}
+
+double bvh_surface_area(const Bvh *bvh)
+{
+    double area = 0.0;
+    for (uint32_t n = 0; n < bvh->node_count; n++)
+        area += aabb_surface_area(node_bounds(&bvh->nodes[n]));
+    return area;
+}
+
+// -----------------------------------------------------------------------------
+// Traversal
+// -----------------------------------------------------------------------------
+
+size_t bvh_memory(const Bvh *bvh)
+{
+    size_t spheres = bvh->spheres.center_x ? sphere_soa_bytes(bvh->spheres.count) : 0;
+    size_t triangles = bvh->triangles.v0_x ? triangle_soa_bytes(bvh->triangles.count) : 0;
+    size_t instances = (sizeof(Instance *) + sizeof(uint32_t)) * (size_t)bvh->instance_count;
+    return sizeof(BvhNode) * bvh->node_count + spheres + triangles + instances;
+}
+
+bool bvh_intersect_leaf(const Bvh *bvh, const BvhNode *node, Ray r, double t_min, double *t_max, BvhHit *hit)
+{
+    int k;
+    if (node->axis == BVH_LEAF_SPHERES)
+    {
+        STATS_PRIM_TESTS(HITTABLE_SPHERE, node->count);
+        k = sphere_soa_hit(&bvh->spheres, node->offset, node->count, r, t_min, t_max);
+        if (k >= 0)
+        {
+            hit->hittable = bvh->spheres.hittable[k];
+            hit->prim = 0;
+            hit->instance = BVH_NO_INSTANCE;
+        }
+    }
+    else if (node->axis == BVH_LEAF_INSTANCES)
+    {
+        // The primitive tests inside each group are counted by their own kind
+        STATS_PRIM_TESTS(HITTABLE_INSTANCE, node->count);
+        k = -1;
+        for (uint32_t i = node->offset; i < node->offset + node->count; i++)
+        {
+            if (instance_intersect(bvh->instances[i], r, t_min, t_max, hit))
+            {
+                hit->instance = bvh->instance_hittable[i];
+                k = (int)i;
+            }
+        }
+    }
+    else
+    {
+        // Mesh triangles count as triangles
+        STATS_PRIM_TESTS(HITTABLE_TRIANGLE, node->count);
+        k = triangle_soa_hit(&bvh->triangles, node->offset, node->count, r, t_min, t_max);
+        if (k >= 0)
+        {
+            hit->hittable = bvh->triangles.hittable[k];
+            hit->prim = bvh->triangles.prim[k];
+            hit->instance = BVH_NO_INSTANCE;
+        }
+    }
+    return k >= 0;
+}
+
+bool bvh_intersect(const Bvh *bvh, uint32_t root, Ray r, double t_min, double *t_max, BvhHit *hit)
+{
+    if (bvh->node_count == 0)
+        return false;
+
+    double origin[3] = {r.origin.x, r.origin.y, r.origin.z};
+    double inv_dir[3] = {1.0 / r.direction.x, 1.0 / r.direction.y, 1.0 / r.direction.z};
+
+    uint32_t stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    uint32_t node_index = root;
+    bool hit_anything = false;
+
+    for (;;)
+    {
+        const BvhNode *node = &bvh->nodes[node_index];
+        STATS_ADD(node_visits, 1);
+        if (bvh_node_hit(node, origin, inv_dir, t_min, *t_max))
+        {
+            if (node->count > 0)
+            {
+                if (bvh_intersect_leaf(bvh, node, r, t_min, t_max, hit))
+                    hit_anything = true;
+            }
+            else
+            {
+                // Visit the child on the near side of the split plane first
+                if (inv_dir[node->axis] < 0)
+                {
+                    stack[stack_size++] = node_index + 1;
+                    node_index = node->offset;
+                }
+                else
+                {
+                    stack[stack_size++] = node->offset;
+                    node_index = node_index + 1;
+                }
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            break;
+        node_index = stack[--stack_size];
+    }
+    return hit_anything;
+}
+
+void bvh_hit_record(const Hittable *world, BvhHit hit, Ray r, double t, HitRecord *rec)
+{
+    if (hit.instance == BVH_NO_INSTANCE)
+    {
+        hittable_hit_record(&world[hit.hittable], hit.prim, r, t, rec);
+        return;
+    }
+    const Hittable *h = &world[hit.instance];
+    instance_hit_record(h->object.instance, h->material, hit, r, t, rec);
+}
+
+bool bvh_hit(const Bvh *bvh, const Hittable *world, Ray r, double t_min, double t_max, HitRecord *rec)
+{
+    // Only distances are compared during traversal, the hit record is filled
+    // once for the closest primitive
+    BvhHit hit;
+    if (!bvh_intersect(bvh, 0, r, t_min, &t_max, &hit))
+        return false;
+
+    bvh_hit_record(world, hit, r, t_max, rec);
+    return true;
+}
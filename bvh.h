@@ -0,0 +1,117 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "hittable.h"
+#include "math/aabb.h"
+#include "soa.h"
+#include <stdint.h>
+
+#define BVH_MAX_LEAF_SIZE 4
+#define BVH_SAH_BINS 16
+#define BVH_STACK_SIZE 64
+
+// Primitive type of a leaf, stored in the axis field of leaf nodes
+#define BVH_LEAF_SPHERES 0
+#define BVH_LEAF_TRIANGLES 1
+#define BVH_LEAF_INSTANCES 2
+
+// BvhHit.instance of hits that did not go through an instance
+#define BVH_NO_INSTANCE UINT32_MAX
+
+// -----------------------------------------------------------------------------
+// Flattened BVH node, 32 bytes so two nodes share a cache line
+// -----------------------------------------------------------------------------
+// Nodes are stored depth-first: the left child of an interior node always
+// directly follows it, only the right child index is stored. Bounds are kept
+// in single precision and rounded outwards so they stay conservative. Every
+// leaf holds primitives of one type, stored contiguously in that type's SoA.
+typedef struct
+{
+    float bounds_min[3];
+    float bounds_max[3];
+    uint32_t offset; // Leaf: first entry in its SoA, interior: right child
+    uint16_t count;  // Number of primitives in a leaf, 0 for interior nodes
+    uint16_t axis;   // Interior: split axis, picks the traversal order. Leaf: BVH_LEAF_*
+} BvhNode;
+
+typedef struct
+{
+    BvhNode *nodes;
+    uint32_t node_count;
+    SphereSoA spheres;     // Leaf primitives in depth-first leaf order
+    TriangleSoA triangles;
+    const Instance **instances;  // Instance leaves, with the world index of each
+    uint32_t *instance_hittable; // in instance_hittable
+    uint32_t instance_count;
+    uint32_t prim_count;
+} Bvh;
+
+// Closest hit reported by a traversal
+typedef struct
+{
+    uint32_t hittable; // Index into the world array, or into the group of instance
+    uint32_t prim;     // Triangle of a mesh hittable, 0 otherwise
+    uint32_t instance; // World index of the instance hit, BVH_NO_INSTANCE for none
+} BvhHit;
+
+// Slab test against the node box, clipped to the current [t_min, t_max]
+static inline bool bvh_node_hit(const BvhNode *node, const double origin[3], const double inv_dir[3], double t_min, double t_max)
+{
+    for (int a = 0; a < 3; a++)
+    {
+        double t0 = (node->bounds_min[a] - origin[a]) * inv_dir[a];
+        double t1 = (node->bounds_max[a] - origin[a]) * inv_dir[a];
+        if (inv_dir[a] < 0)
+        {
+            double tmp = t0;
+            t0 = t1;
+            t1 = tmp;
+        }
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if (t_max < t_min)
+            return false;
+    }
+    return true;
+}
+
+// Returns the bounds of a hittable, false if it is unbounded (planes) or
+// stays out of the BVH (paged meshes)
+bool hittable_bounds(const Hittable *h, Aabb *out);
+
+// Builds a BVH with binned SAH splits over the given subset of world.
+// All referenced hittables must be bounded, and the groups of instances
+// built. Meshes contribute one primitive per triangle, instances one each.
+// Returns false on allocation failure.
+bool bvh_build(Bvh *bvh, const Hittable *world, const uint32_t *indices, uint32_t count);
+
+void bvh_free(Bvh *bvh);
+
+// Recomputes the node boxes after instances moved, keeping the tree as it
+// is. Sphere and triangle leaves are static and keep their boxes. Much
+// cheaper than a rebuild, but the tree was split for the old positions, so
+// traversal gets slower as the instances drift apart.
+void bvh_refit(Bvh *bvh);
+
+// Sum of the surface areas of all node boxes, a measure of traversal cost
+// that grows as refits loosen the tree
+double bvh_surface_area(const Bvh *bvh);
+
+// Tests r against the primitives of one leaf. On a closer hit lowers *t_max,
+// stores the primitive in *hit and returns true.
+bool bvh_intersect_leaf(const Bvh *bvh, const BvhNode *node, Ray r, double t_min, double *t_max, BvhHit *hit);
+
+// Stack-based closest-hit traversal of the subtree below root. Like
+// bvh_intersect_leaf it only reports the distance and the primitive.
+bool bvh_intersect(const Bvh *bvh, uint32_t root, Ray r, double t_min, double *t_max, BvhHit *hit);
+
+// Bytes held by the nodes and the leaf SoAs
+size_t bvh_memory(const Bvh *bvh);
+
+// Fills rec for a hit reported by a traversal, at distance t along r
+void bvh_hit_record(const Hittable *world, BvhHit hit, Ray r, double t, HitRecord *rec);
+
+// Finds the closest hit in (t_min, t_max) and fills rec for it
+bool bvh_hit(const Bvh *bvh, const Hittable *world, Ray r, double t_min, double t_max, HitRecord *rec);
+
+#endif // BVH_H
@@ -0,0 +1,95 @@
+#include "demo_scene.h"
+
+#include <stdio.h>
+
+enum
+{
+    DEMO_BLUE,
+    DEMO_GLASS,
+    DEMO_MIRROR,
+    DEMO_GROUND,
+    DEMO_GREY,
+    DEMO_MATERIAL_COUNT
+};
+
+static const Material demo_materials[DEMO_MATERIAL_COUNT] = {
+    [DEMO_BLUE] = {.color = {0.1, 0.2, 0.5}, .type = MATERIAL_LAMBERTIAN},
+    [DEMO_GLASS] = {.color = {0.3, 0.3, 0.7}, .type = MATERIAL_DIELECTRIC, .properties.ref_idx = 0.9},
+    [DEMO_MIRROR] = {.color = {0.3, 0.7, 0.3}, .type = MATERIAL_METAL, .properties.fuzz = 0.0},
+    [DEMO_GROUND] = {.color = {0.8, 0.6, 0.2}, .type = MATERIAL_LAMBERTIAN},
+    [DEMO_GREY] = {.color = {0.7, 0.7, 0.7}, .type = MATERIAL_LAMBERTIAN},
+};
+
+// Material IDs are relative to the first demo material in the scene
+static const Hittable spheres_world[] = {
+    {HITTABLE_SPHERE, DEMO_BLUE, .object.sphere = {{0, 0, -1}, 0.5}},     // Center sphere
+    {HITTABLE_SPHERE, DEMO_GLASS, .object.sphere = {{1, 0, -1.5}, 0.5}},  // Right sphere
+    {HITTABLE_SPHERE, DEMO_MIRROR, .object.sphere = {{-1, 0, -1.5}, 0.5}}, // Left sphere
+    {HITTABLE_PLANE, DEMO_GROUND, .object.plane = {{0, -0.5, 0}, {0, 1, 0}}}, // Ground Plane,
+};
+
+#define NUM_SPHERES_WORLD (sizeof(spheres_world) / sizeof(spheres_world[0]))
+
+// Adds the demo materials, *first receives the ID of the first one
+static bool add_demo_materials(Scene *scene, MaterialId *first)
+{
+    MaterialId id;
+    for (int m = 0; m < DEMO_MATERIAL_COUNT; m++)
+    {
+        if (!scene_add_material(scene, demo_materials[m], &id))
+            return false;
+        if (m == 0)
+            *first = id;
+    }
+    return true;
+}
+
+static bool add_demo_hittable(Scene *scene, Hittable h, MaterialId first)
+{
+    h.material += first;
+    return scene_add(scene, h);
+}
+
+bool demo_scene_spheres(Scene *scene)
+{
+    MaterialId first;
+    if (!add_demo_materials(scene, &first))
+        return false;
+    for (size_t i = 0; i < NUM_SPHERES_WORLD; i++)
+    {
+        if (!add_demo_hittable(scene, spheres_world[i], first))
+            return false;
+    }
+    return true;
+}
+
+bool demo_scene_mesh(Scene *scene, const char *path, int thread_count)
+{
+    // The mesh lives in the scene arena, so it is released by scene_free
+    Mesh *mesh = arena_alloc(&scene->arena, sizeof(Mesh), _Alignof(Mesh));
+    MeshLoadStats stats;
+    if (!mesh || !mesh_load(mesh, path, &scene->arena, thread_count, &stats))
+        return false;
+    mesh_fit(mesh, vec3_create(0, 0, -1.2), 1.0);
+
+    fprintf(stderr, "Loaded %s: %u vertices, %u triangles in %.1f ms (%.0f MB/s), %.1f bytes per triangle\n",
+            path, mesh->vertex_count, mesh->triangle_count, stats.seconds * 1e3,
+            (double)stats.file_bytes / 1e6 / (stats.seconds > 0 ? stats.seconds : 1e-9),
+            mesh->triangle_count ? (double)mesh_memory(mesh) / mesh->triangle_count : 0.0);
+
+    MaterialId first;
+    Hittable object = {HITTABLE_MESH, DEMO_GREY, .object.mesh = mesh};
+    return add_demo_materials(scene, &first) && add_demo_hittable(scene, object, first) &&
+           add_demo_hittable(scene, spheres_world[NUM_SPHERES_WORLD - 1], first); // Ground plane
+}
+
+Camera demo_camera(int image_width, int image_height, size_t samples_per_pixel)
+{
+    return camera_create(
+        vec3_create(0, 0.0, 0.5),
+        vec3_create(-2.0, -1.725, -0.5),
+        vec3_create(4.0, 0, 0),
+        vec3_create(0, 2.25, 0),
+        image_width,
+        image_height, samples_per_pixel);
+}
@@ -0,0 +1,21 @@
+#ifndef DEMO_SCENE_H
+#define DEMO_SCENE_H
+
+#include "scene.h"
+#include "mesh.h"
+
+// -----------------------------------------------------------------------------
+// Built-in scenes, shared by the renderer and the benchmarks
+// -----------------------------------------------------------------------------
+
+// Adds the default scene: three spheres (diffuse, glass, metal) on a ground plane
+bool demo_scene_spheres(Scene *scene);
+
+// Adds the mesh file at path (see mesh.h), scaled to the size of the demo
+// spheres, above the ground plane. Prints load time and memory per triangle.
+bool demo_scene_mesh(Scene *scene, const char *path, int thread_count);
+
+// Camera looking at the demo scenes from slightly above the ground
+Camera demo_camera(int image_width, int image_height, size_t samples_per_pixel);
+
+#endif // DEMO_SCENE_H
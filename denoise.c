@@ -0,0 +1,318 @@
+#include "denoise.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Albedo channels below this are clamped before dividing, so black surfaces
+// do not blow the demodulated color up
+#define DENOISE_MIN_ALBEDO 0.01f
+// Depth tolerance relative to the center's depth, for surfaces seen head-on
+// where the depth slope is 0
+#define DENOISE_DEPTH_EPSILON 1e-3f
+
+static const float b3_kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+// -----------------------------------------------------------------------------
+// Work buffers
+// -----------------------------------------------------------------------------
+// Everything is stored as one float plane per channel. The guides stay fixed,
+// the illumination and its variance ping-pong between src and dst.
+typedef struct
+{
+    int width, height;
+
+    float *albedo[3]; // Divided out of the color and multiplied back at the end
+    float *normal[3]; // Unit length, 0 for misses
+    float *depth;     // 0 for misses
+    float *slope;     // Depth change per pixel, the smaller of the two sides in x and y
+
+    float *src[3], *dst[3]; // Demodulated color
+    float *src_var, *dst_var;
+
+    int step; // Tap spacing of the current iteration
+    float inv_sigma_luminance;
+    float sigma_normal;
+    float inv_sigma_depth;
+    float inv_sigma_albedo2;
+} DenoiseImage;
+
+typedef struct
+{
+    DenoiseImage *image;
+    int y0, y1;
+} DenoiseBand;
+
+static float luminance(float r, float g, float b)
+{
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+// Smallest non-zero depth difference to the two neighbours along one axis.
+// Taking the smaller side keeps silhouettes from widening the tolerance.
+static float side_slope(const float *depth, size_t center, size_t before, size_t after, bool has_before,
+                        bool has_after)
+{
+    float slope = INFINITY;
+    if (has_before && depth[before] > 0)
+        slope = fabsf(depth[center] - depth[before]);
+    if (has_after && depth[after] > 0)
+        slope = fminf(slope, fabsf(depth[center] - depth[after]));
+    return isinf(slope) ? 0.0f : slope;
+}
+
+// -----------------------------------------------------------------------------
+// Filter pass
+// -----------------------------------------------------------------------------
+
+// 3x3 Gaussian of the variance around (x, y), a steadier noise estimate for
+// the luminance weight than a single pixel's
+static float blurred_variance(const DenoiseImage *image, int x, int y)
+{
+    static const float gauss[2] = {0.5f, 0.25f};
+    float sum = 0.0f, weights = 0.0f;
+    for (int dy = -1; dy <= 1; dy++)
+    {
+        int qy = y + dy;
+        if (qy < 0 || qy >= image->height)
+            continue;
+        for (int dx = -1; dx <= 1; dx++)
+        {
+            int qx = x + dx;
+            if (qx < 0 || qx >= image->width)
+                continue;
+            float w = gauss[dx != 0] * gauss[dy != 0];
+            sum += w * image->src_var[(size_t)qy * image->width + qx];
+            weights += w;
+        }
+    }
+    return sum / weights;
+}
+
+static void filter_rows(DenoiseImage *image, int y0, int y1)
+{
+    int width = image->width, height = image->height, step = image->step;
+
+    for (int y = y0; y < y1; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            size_t p = (size_t)y * width + x;
+            float zp = image->depth[p];
+            if (zp <= 0)
+            {
+                for (int c = 0; c < 3; c++)
+                    image->dst[c][p] = image->src[c][p];
+                image->dst_var[p] = image->src_var[p];
+                continue;
+            }
+
+            float np[3] = {image->normal[0][p], image->normal[1][p], image->normal[2][p]};
+            float ap[3] = {image->albedo[0][p], image->albedo[1][p], image->albedo[2][p]};
+            float lp = luminance(image->src[0][p], image->src[1][p], image->src[2][p]);
+            float sigma_l = sqrtf(blurred_variance(image, x, y));
+            float inv_l = sigma_l > 0 ? image->inv_sigma_luminance / sigma_l : 0.0f;
+            float depth_scale = image->slope[p] * (float)step;
+            float depth_epsilon = DENOISE_DEPTH_EPSILON * zp;
+
+            float sum[3] = {0, 0, 0};
+            float sum_var = 0.0f, weights = 0.0f;
+            for (int ky = 0; ky < 5; ky++)
+            {
+                int qy = y + (ky - 2) * step;
+                if (qy < 0 || qy >= height)
+                    continue;
+                for (int kx = 0; kx < 5; kx++)
+                {
+                    int qx = x + (kx - 2) * step;
+                    if (qx < 0 || qx >= width)
+                        continue;
+                    size_t q = (size_t)qy * width + qx;
+                    float zq = image->depth[q];
+                    if (zq <= 0)
+                        continue;
+
+                    float cosine = np[0] * image->normal[0][q] + np[1] * image->normal[1][q] +
+                                   np[2] * image->normal[2][q];
+                    if (cosine <= 0)
+                        continue;
+                    float da0 = ap[0] - image->albedo[0][q];
+                    float da1 = ap[1] - image->albedo[1][q];
+                    float da2 = ap[2] - image->albedo[2][q];
+                    float lq = luminance(image->src[0][q], image->src[1][q], image->src[2][q]);
+                    float distance = sqrtf((float)((kx - 2) * (kx - 2) + (ky - 2) * (ky - 2)));
+
+                    // All four edge-stopping functions share one exp
+                    float exponent = image->sigma_normal * logf(fminf(cosine, 1.0f)) -
+                                     fabsf(zp - zq) * image->inv_sigma_depth /
+                                         (depth_scale * distance + depth_epsilon) -
+                                     (da0 * da0 + da1 * da1 + da2 * da2) * image->inv_sigma_albedo2 -
+                                     fabsf(lp - lq) * inv_l;
+                    float w = b3_kernel[kx] * b3_kernel[ky] * expf(exponent);
+
+                    sum[0] += w * image->src[0][q];
+                    sum[1] += w * image->src[1][q];
+                    sum[2] += w * image->src[2][q];
+                    sum_var += w * w * image->src_var[q];
+                    weights += w;
+                }
+            }
+            if (weights <= 0)
+            {
+                // Only when the center has no normal, keep it as it is
+                for (int c = 0; c < 3; c++)
+                    image->dst[c][p] = image->src[c][p];
+                image->dst_var[p] = image->src_var[p];
+                continue;
+            }
+            for (int c = 0; c < 3; c++)
+                image->dst[c][p] = sum[c] / weights;
+            image->dst_var[p] = sum_var / (weights * weights);
+        }
+    }
+}
+
+static void *filter_band(void *arg)
+{
+    DenoiseBand *band = arg;
+    filter_rows(band->image, band->y0, band->y1);
+    return NULL;
+}
+
+// Runs one iteration over bands of rows, the calling thread takes the first
+static void filter_pass(DenoiseImage *image, DenoiseBand *bands, pthread_t *threads, int thread_count)
+{
+    int started = 0;
+    for (int t = 0; t < thread_count; t++)
+    {
+        bands[t].image = image;
+        bands[t].y0 = (int)((long)image->height * t / thread_count);
+        bands[t].y1 = (int)((long)image->height * (t + 1) / thread_count);
+    }
+    for (int t = 1; t < thread_count; t++)
+    {
+        if (pthread_create(&threads[t], NULL, filter_band, &bands[t]) != 0)
+            break;
+        started = t;
+    }
+    filter_band(&bands[0]);
+    for (int t = 1; t <= started; t++)
+        pthread_join(threads[t], NULL);
+    // Bands whose thread failed to start are filtered here
+    for (int t = started + 1; t < thread_count; t++)
+        filter_band(&bands[t]);
+}
+
+// -----------------------------------------------------------------------------
+// Entry point
+// -----------------------------------------------------------------------------
+
+bool denoise(Framebuffer *fb, const RenderAovs *aovs, const DenoiseSettings *settings)
+{
+    int width = fb->width, height = fb->height;
+    size_t count = (size_t)width * (size_t)height;
+    int iterations = settings->iterations > 0 ? settings->iterations : DENOISE_DEFAULT_ITERATIONS;
+    int thread_count = settings->thread_count > 0 ? settings->thread_count : render_default_thread_count();
+    if (thread_count > height)
+        thread_count = height > 0 ? height : 1;
+
+    // 3 albedo + 3 normal + depth + slope + 2 x (3 color + variance) planes
+    enum { PLANES = 16 };
+    float *storage = malloc(sizeof(float) * count * PLANES);
+    DenoiseBand *bands = malloc(sizeof(DenoiseBand) * thread_count);
+    pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+    if (!storage || !bands || !threads)
+    {
+        fprintf(stderr, "denoise: out of memory\n");
+        free(storage);
+        free(bands);
+        free(threads);
+        return false;
+    }
+
+    double sigma_luminance = settings->sigma_luminance > 0 ? settings->sigma_luminance : DENOISE_DEFAULT_SIGMA_LUMINANCE;
+    double sigma_normal = settings->sigma_normal > 0 ? settings->sigma_normal : DENOISE_DEFAULT_SIGMA_NORMAL;
+    double sigma_depth = settings->sigma_depth > 0 ? settings->sigma_depth : DENOISE_DEFAULT_SIGMA_DEPTH;
+    double sigma_albedo = settings->sigma_albedo > 0 ? settings->sigma_albedo : DENOISE_DEFAULT_SIGMA_ALBEDO;
+    DenoiseImage image = {
+        .width = width,
+        .height = height,
+        .inv_sigma_luminance = (float)(1.0 / sigma_luminance),
+        .sigma_normal = (float)sigma_normal,
+        .inv_sigma_depth = (float)(1.0 / sigma_depth),
+        .inv_sigma_albedo2 = (float)(1.0 / (sigma_albedo * sigma_albedo)),
+    };
+    for (int c = 0; c < 3; c++)
+    {
+        image.albedo[c] = storage + count * c;
+        image.normal[c] = storage + count * (3 + c);
+        image.src[c] = storage + count * (8 + c);
+        image.dst[c] = storage + count * (12 + c);
+    }
+    image.depth = storage + count * 6;
+    image.slope = storage + count * 7;
+    image.src_var = storage + count * 11;
+    image.dst_var = storage + count * 15;
+
+    // Demodulate and convert to planes
+    for (size_t p = 0; p < count; p++)
+    {
+        Color a = aovs->albedo.pixels[p];
+        Color n = aovs->normal.pixels[p];
+        Color c = fb->pixels[p];
+        float albedo[3] = {fmaxf((float)a.x, DENOISE_MIN_ALBEDO), fmaxf((float)a.y, DENOISE_MIN_ALBEDO),
+                           fmaxf((float)a.z, DENOISE_MIN_ALBEDO)};
+        float color[3] = {(float)c.x, (float)c.y, (float)c.z};
+        float length = (float)vec3_length(n);
+        for (int k = 0; k < 3; k++)
+        {
+            image.albedo[k][p] = albedo[k];
+            image.src[k][p] = color[k] / albedo[k];
+        }
+        image.normal[0][p] = length > 0 ? (float)n.x / length : 0.0f;
+        image.normal[1][p] = length > 0 ? (float)n.y / length : 0.0f;
+        image.normal[2][p] = length > 0 ? (float)n.z / length : 0.0f;
+        image.depth[p] = (float)aovs->depth[p];
+        // Luminance variance of the color, scaled to the demodulated color
+        float lum = luminance(albedo[0], albedo[1], albedo[2]);
+        image.src_var[p] = (float)aovs->variance[p] / (lum * lum);
+    }
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            size_t p = (size_t)y * width + x;
+            float sx = side_slope(image.depth, p, p - 1, p + 1, x > 0, x + 1 < width);
+            float sy = side_slope(image.depth, p, p - width, p + width, y > 0, y + 1 < height);
+            image.slope[p] = fmaxf(sx, sy);
+        }
+    }
+
+    for (int i = 0; i < iterations; i++)
+    {
+        image.step = 1 << i;
+        filter_pass(&image, bands, threads, thread_count);
+        for (int c = 0; c < 3; c++)
+        {
+            float *swap = image.src[c];
+            image.src[c] = image.dst[c];
+            image.dst[c] = swap;
+        }
+        float *swap = image.src_var;
+        image.src_var = image.dst_var;
+        image.dst_var = swap;
+    }
+
+    // Remodulate
+    for (size_t p = 0; p < count; p++)
+    {
+        fb->pixels[p] = vec3_create(image.src[0][p] * image.albedo[0][p], image.src[1][p] * image.albedo[1][p],
+                                    image.src[2][p] * image.albedo[2][p]);
+    }
+
+    free(threads);
+    free(bands);
+    free(storage);
+    return true;
+}
@@ -0,0 +1,42 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "render.h"
+
+#define DENOISE_DEFAULT_ITERATIONS 5         // Filter footprint 4 * 2^iterations + 1 pixels
+#define DENOISE_DEFAULT_SIGMA_LUMINANCE 4.0  // Standard deviations of noise treated as the same value
+#define DENOISE_DEFAULT_SIGMA_NORMAL 128.0   // Exponent on the cosine between normals
+#define DENOISE_DEFAULT_SIGMA_DEPTH 1.0      // Multiples of the local depth slope
+#define DENOISE_DEFAULT_SIGMA_ALBEDO 0.1     // Albedo difference per channel
+
+// -----------------------------------------------------------------------------
+// Edge-avoiding a-trous denoiser
+// -----------------------------------------------------------------------------
+// Filters a render with the help of its first-hit AOVs (render.h). The color
+// is divided by the albedo first, so textures and material edges are kept
+// out of the blur, then smoothed by iterations of a 5x5 B3-spline kernel
+// whose taps are 2^i pixels apart in iteration i. Every tap is weighted by
+// how closely its normal, depth and albedo match the center pixel, and by
+// how far its luminance lies from the center's in units of the center's
+// estimated noise. The per-pixel variance is filtered along with the color,
+// so the luminance test tightens as the image gets cleaner. Renders with one
+// sample per pixel have no variance and get the geometric weights only.
+// Pixels whose camera samples all missed the scene are left as they are.
+//
+// The buffers are planar floats and each iteration runs over bands of rows
+// on thread_count threads.
+typedef struct
+{
+    int iterations;         // <= 0 means default
+    double sigma_luminance; // The sigmas use their defaults when <= 0
+    double sigma_normal;
+    double sigma_depth;
+    double sigma_albedo;
+    int thread_count;       // <= 0 means one per online core
+} DenoiseSettings;
+
+// Denoises fb in place. aovs must have the size of fb and come from the
+// same render. Returns false if the work buffers could not be allocated.
+bool denoise(Framebuffer *fb, const RenderAovs *aovs, const DenoiseSettings *settings);
+
+#endif // DENOISE_H
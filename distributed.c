@@ -0,0 +1,710 @@
+#include "distributed.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char hello_magic[8] = {'R', 'T', 'D', 'I', 'S', 'T', '\0', '\0'};
+
+// -----------------------------------------------------------------------------
+// Messages
+// -----------------------------------------------------------------------------
+// worker -> coordinator: HelloMessage, then one ResultMessage plus pixels per tile
+// coordinator -> worker: JobMessage, then one TileMessage per tile, an empty
+// TileMessage ends the job
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t color_size; // sizeof(Color), differs between float and double builds
+    uint64_t scene_key;  // See scene_key
+} HelloMessage;
+
+enum
+{
+    JOB_PACKETS = 1,
+    JOB_WAVEFRONT = 2,
+    JOB_ADAPTIVE = 4
+};
+
+typedef struct
+{
+    Camera camera;
+    int32_t max_depth;
+    int32_t roulette_depth;
+    uint32_t frame;
+    uint32_t sampler; // SamplerType
+    uint32_t flags;   // JOB_*
+    double adaptive_threshold;
+    uint64_t adaptive_min_spp;
+    uint64_t adaptive_max_spp;
+} JobMessage;
+
+typedef struct
+{
+    int32_t x0, y0, x1, y1;
+} TileMessage;
+
+// Followed by the tile's Colors, row by row
+typedef struct
+{
+    TileMessage tile;
+    uint64_t samples;
+    uint64_t rays;
+} ResultMessage;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Identifies the scene both sides loaded. Catches a different scene file or
+// material table, not every edit to the geometry.
+static uint64_t scene_key(const Scene *scene)
+{
+    uint64_t counts[3] = {scene->hittable_count, scene->bvh.prim_count, scene->light_count};
+    uint64_t hash = fnv1a(0xcbf29ce484222325ull, counts, sizeof(counts));
+    return fnv1a(hash, scene->materials, sizeof(Material) * scene->material_count);
+}
+
+static size_t tile_pixels(const TileMessage *t)
+{
+    return (size_t)(t->x1 - t->x0) * (size_t)(t->y1 - t->y0);
+}
+
+// -----------------------------------------------------------------------------
+// Sockets
+// -----------------------------------------------------------------------------
+
+static bool send_all(int fd, const void *data, size_t size)
+{
+    const char *p = data;
+    while (size > 0)
+    {
+        // MSG_NOSIGNAL: a vanished peer is an error, not a SIGPIPE
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void *data, size_t size)
+{
+    char *p = data;
+    while (size > 0)
+    {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false; // Closed, failed, or SO_RCVTIMEO expired
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+static void set_timeouts(int fd, double seconds)
+{
+    struct timeval tv = {(time_t)seconds, (suseconds_t)((seconds - (double)(time_t)seconds) * 1e6)};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Opens a listening (listening = true) or connected socket for address.
+// Returns -1 and prints the reason on failure.
+static int open_socket(const char *address, bool listening)
+{
+    if (strncmp(address, "unix:", 5) == 0)
+    {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        const char *path = address + 5;
+        if (strlen(path) >= sizeof(addr.sun_path))
+        {
+            fprintf(stderr, "distributed: socket path too long: %s\n", path);
+            return -1;
+        }
+        strcpy(addr.sun_path, path);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        if (listening)
+            unlink(path); // A stale socket from an earlier run
+        bool ok = listening ? bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(fd, 64) == 0
+                            : connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (!ok)
+        {
+            if (listening)
+                fprintf(stderr, "distributed: %s: %s\n", address, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // [tcp:]host:port, the port follows the last colon
+    if (strncmp(address, "tcp:", 4) == 0)
+        address += 4;
+    const char *colon = strrchr(address, ':');
+    char host[256];
+    if (!colon || (size_t)(colon - address) >= sizeof(host))
+    {
+        fprintf(stderr, "distributed: bad address %s, use unix:<path> or <host>:<port>\n", address);
+        return -1;
+    }
+    memcpy(host, address, (size_t)(colon - address));
+    host[colon - address] = '\0';
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = listening ? AI_PASSIVE : 0};
+    struct addrinfo *list;
+    int rc = getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &list);
+    if (rc != 0)
+    {
+        fprintf(stderr, "distributed: %s: %s\n", address, gai_strerror(rc));
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = list; ai && fd < 0; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        bool ok;
+        if (listening)
+        {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            ok = bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0;
+        }
+        else
+        {
+            ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+        }
+        if (!ok)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(list);
+    if (fd < 0 && listening)
+        fprintf(stderr, "distributed: could not listen on %s\n", address);
+    return fd;
+}
+
+// -----------------------------------------------------------------------------
+// Worker
+// -----------------------------------------------------------------------------
+
+bool distributed_worker(const char *address, Scene *scene, const RenderSettings *host)
+{
+    // The coordinator may still be starting, keep trying for a while
+    int fd = -1;
+    for (int attempt = 0; attempt < 50 && fd < 0; attempt++)
+    {
+        fd = open_socket(address, false);
+        if (fd < 0)
+            usleep(100 * 1000);
+    }
+    if (fd < 0)
+    {
+        fprintf(stderr, "distributed_worker: could not connect to %s\n", address);
+        return false;
+    }
+
+    HelloMessage hello = {.version = DISTRIBUTED_VERSION, .color_size = sizeof(Color), .scene_key = scene_key(scene)};
+    memcpy(hello.magic, hello_magic, sizeof(hello_magic));
+    JobMessage job;
+    if (!send_all(fd, &hello, sizeof(hello)) || !recv_all(fd, &job, sizeof(job)))
+    {
+        fprintf(stderr, "distributed_worker: %s rejected the handshake\n", address);
+        close(fd);
+        return false;
+    }
+
+    Camera camera = job.camera;
+    RenderSettings settings = {
+        .max_depth = job.max_depth,
+        .roulette_depth = job.roulette_depth,
+        .thread_count = host->thread_count,
+        .tile_size = RENDER_DEFAULT_TILE_SIZE,
+        .texture_cache_bytes = host->texture_cache_bytes,
+        .geometry_cache_bytes = host->geometry_cache_bytes,
+        .frame = job.frame,
+        .sampler = (SamplerType)job.sampler,
+        .packets = job.flags & JOB_PACKETS,
+        .wavefront = job.flags & JOB_WAVEFRONT,
+        .adaptive = {
+            .enabled = job.flags & JOB_ADAPTIVE,
+            .threshold = job.adaptive_threshold,
+            .min_spp = job.adaptive_min_spp,
+            .max_spp = job.adaptive_max_spp,
+        },
+    };
+
+    // Tiles are rendered in place into a full-size framebuffer, then copied
+    // out row by row
+    Framebuffer fb;
+    Color *pixels = NULL;
+    size_t pixel_capacity = 0;
+    if (!framebuffer_init(&fb, camera.image_width, camera.image_height))
+    {
+        fprintf(stderr, "distributed_worker: could not allocate framebuffer\n");
+        close(fd);
+        return false;
+    }
+
+    bool ok = true;
+    int tiles = 0;
+    for (;;)
+    {
+        TileMessage tile;
+        if (!recv_all(fd, &tile, sizeof(tile)))
+        {
+            fprintf(stderr, "distributed_worker: lost the coordinator\n");
+            ok = false;
+            break;
+        }
+        if (tile.x1 <= tile.x0 || tile.y1 <= tile.y0)
+            break; // No more tiles
+        if (tile.x0 < 0 || tile.y0 < 0 || tile.x1 > fb.width || tile.y1 > fb.height)
+        {
+            fprintf(stderr, "distributed_worker: tile outside the image\n");
+            ok = false;
+            break;
+        }
+
+        size_t count = tile_pixels(&tile);
+        if (count > pixel_capacity)
+        {
+            free(pixels);
+            pixels = malloc(sizeof(Color) * count);
+            pixel_capacity = pixels ? count : 0;
+            if (!pixels)
+            {
+                ok = false;
+                break;
+            }
+        }
+
+        settings.region = (RenderRegion){tile.x0, tile.y0, tile.x1, tile.y1};
+        RenderCounts counts = render_tiles(&fb, scene, &camera, &settings);
+        if (!counts.ok)
+        {
+            // Hang up instead of sending a black tile, the coordinator hands
+            // it to another worker
+            ok = false;
+            break;
+        }
+        int width = tile.x1 - tile.x0;
+        for (int y = tile.y0; y < tile.y1; y++)
+            memcpy(&pixels[(size_t)(y - tile.y0) * (size_t)width], framebuffer_at(&fb, tile.x0, y), sizeof(Color) * (size_t)width);
+
+        ResultMessage result = {tile, counts.samples, counts.rays};
+        if (!send_all(fd, &result, sizeof(result)) || !send_all(fd, pixels, sizeof(Color) * count))
+        {
+            fprintf(stderr, "distributed_worker: lost the coordinator\n");
+            ok = false;
+            break;
+        }
+        tiles++;
+    }
+
+    fprintf(stderr, "Worker %ld: rendered %d tiles\n", (long)getpid(), tiles);
+    free(pixels);
+    framebuffer_free(&fb);
+    close(fd);
+    return ok;
+}
+
+// -----------------------------------------------------------------------------
+// Coordinator
+// -----------------------------------------------------------------------------
+
+#define TILE_PENDING (-1)
+#define TILE_DONE (-2)
+
+typedef struct
+{
+    int fd;
+    bool ready;         // Handshake done
+    int tile;           // Tile being rendered, -1 when idle
+    double assigned_at; // When tile was handed out
+} Connection;
+
+typedef struct
+{
+    Framebuffer *fb;
+    uint64_t key;
+    JobMessage job;
+    TileMessage *tiles;
+    int *tile_state; // TILE_PENDING, TILE_DONE or the connection rendering it
+    int tile_count;
+    int done_count;
+    int reissued;
+    Connection *connections;
+    int connection_count;
+    int connection_capacity;
+    Color *pixels; // Receive buffer for one tile
+    uint64_t samples;
+    uint64_t rays;
+} Coordinator;
+
+// Closes connection c, its unfinished tile goes back to the queue
+static void drop_connection(Coordinator *co, int c, const char *reason)
+{
+    Connection *conn = &co->connections[c];
+    if (conn->tile >= 0 && co->tile_state[conn->tile] == c)
+    {
+        co->tile_state[conn->tile] = TILE_PENDING;
+        co->reissued++;
+        fprintf(stderr, "render_distributed: worker failed (%s), tile %d goes back to the queue\n", reason, conn->tile);
+    }
+    else if (!conn->ready)
+    {
+        fprintf(stderr, "render_distributed: rejected a worker (%s)\n", reason);
+    }
+    close(conn->fd);
+
+    // Keep the array dense; the moved connection's tile must follow it
+    int last = co->connection_count - 1;
+    if (c != last)
+    {
+        co->connections[c] = co->connections[last];
+        if (co->connections[c].tile >= 0 && co->tile_state[co->connections[c].tile] == last)
+            co->tile_state[co->connections[c].tile] = c;
+    }
+    co->connection_count--;
+}
+
+// Hands the next pending tile to idle connection c. Returns false if c failed.
+static bool assign_tile(Coordinator *co, int c)
+{
+    Connection *conn = &co->connections[c];
+    for (int t = 0; t < co->tile_count; t++)
+    {
+        if (co->tile_state[t] != TILE_PENDING)
+            continue;
+        if (!send_all(conn->fd, &co->tiles[t], sizeof(TileMessage)))
+            return false;
+        co->tile_state[t] = c;
+        conn->tile = t;
+        conn->assigned_at = now_seconds();
+        return true;
+    }
+    return true; // Nothing left, stay idle in case another worker fails
+}
+
+// Handles one readable connection. Returns false if it has to be dropped.
+static bool serve_connection(Coordinator *co, int c, const char **reason)
+{
+    Connection *conn = &co->connections[c];
+    if (!conn->ready)
+    {
+        HelloMessage hello;
+        *reason = "bad handshake";
+        if (!recv_all(conn->fd, &hello, sizeof(hello)) || memcmp(hello.magic, hello_magic, sizeof(hello_magic)) != 0)
+            return false;
+        *reason = "different version or build";
+        if (hello.version != DISTRIBUTED_VERSION || hello.color_size != sizeof(Color))
+            return false;
+        *reason = "different scene";
+        if (hello.scene_key != co->key)
+            return false;
+        *reason = "send failed";
+        if (!send_all(conn->fd, &co->job, sizeof(co->job)))
+            return false;
+        conn->ready = true;
+        return assign_tile(co, c);
+    }
+
+    ResultMessage result;
+    *reason = "disconnected";
+    if (!recv_all(conn->fd, &result, sizeof(result)))
+        return false;
+    *reason = "result for a tile it was not given";
+    if (conn->tile < 0 || memcmp(&result.tile, &co->tiles[conn->tile], sizeof(TileMessage)) != 0)
+        return false;
+    *reason = "truncated tile";
+    size_t count = tile_pixels(&result.tile);
+    if (!recv_all(conn->fd, co->pixels, sizeof(Color) * count))
+        return false;
+
+    // Tiles never overlap, and one that was re-issued is only accepted from
+    // the connection that holds it now
+    const TileMessage *t = &result.tile;
+    int width = t->x1 - t->x0;
+    for (int y = t->y0; y < t->y1; y++)
+        memcpy(framebuffer_at(co->fb, t->x0, y), &co->pixels[(size_t)(y - t->y0) * (size_t)width], sizeof(Color) * (size_t)width);
+    co->tile_state[conn->tile] = TILE_DONE;
+    co->done_count++;
+    co->samples += result.samples;
+    co->rays += result.rays;
+    conn->tile = -1;
+    *reason = "send failed";
+    return assign_tile(co, c);
+}
+
+static bool accept_connection(Coordinator *co, int listen_fd, double io_timeout)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return false;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (co->connection_count == co->connection_capacity)
+    {
+        int capacity = co->connection_capacity ? 2 * co->connection_capacity : 16;
+        Connection *grown = realloc(co->connections, sizeof(Connection) * (size_t)capacity);
+        if (!grown)
+        {
+            close(fd);
+            return false;
+        }
+        co->connections = grown;
+        co->connection_capacity = capacity;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Fails harmlessly on Unix sockets
+    set_timeouts(fd, io_timeout);
+    co->connections[co->connection_count++] = (Connection){.fd = fd, .ready = false, .tile = -1};
+    return true;
+}
+
+// Forks count workers that render with the scene already in memory, each
+// with the thread count and cache budgets of host
+static int spawn_local_workers(const char *address, Scene *scene, int count, const RenderSettings *host, int listen_fd,
+                               pid_t *pids)
+{
+    fflush(NULL); // Nothing buffered may be written twice
+    int spawned = 0;
+    for (int i = 0; i < count; i++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            fprintf(stderr, "render_distributed: could not fork worker %d\n", i);
+            break;
+        }
+        if (pid == 0)
+        {
+            close(listen_fd);
+            _exit(distributed_worker(address, scene, host) ? 0 : 1);
+        }
+        pids[spawned++] = pid;
+    }
+    return spawned;
+}
+
+bool render_distributed(Framebuffer *fb, Scene *scene, Camera *camera, const RenderSettings *settings,
+                        const DistributedSettings *distributed)
+{
+    if (settings->spp_map || settings->accumulation)
+    {
+        fprintf(stderr, "render_distributed: sample maps and accumulation are not supported\n");
+        return false;
+    }
+    int tile_size = distributed->tile_size > 0 ? distributed->tile_size : DISTRIBUTED_DEFAULT_TILE_SIZE;
+    double io_timeout = distributed->io_timeout > 0 ? distributed->io_timeout : DISTRIBUTED_DEFAULT_IO_TIMEOUT;
+    double idle_timeout = distributed->idle_timeout > 0 ? distributed->idle_timeout : DISTRIBUTED_DEFAULT_IDLE_TIMEOUT;
+
+    AdaptiveSettings adaptive = settings->adaptive;
+    if (adaptive.enabled)
+    {
+        // The same limits render_scene applies
+        if (adaptive.min_spp < 2)
+            adaptive.min_spp = 2;
+        if (adaptive.max_spp < adaptive.min_spp)
+            adaptive.max_spp = adaptive.min_spp;
+    }
+
+    if (!framebuffer_init(fb, camera->image_width, camera->image_height))
+    {
+        fprintf(stderr, "render_distributed: could not allocate framebuffer\n");
+        return false;
+    }
+
+    int tiles_x = (fb->width + tile_size - 1) / tile_size;
+    int tiles_y = (fb->height + tile_size - 1) / tile_size;
+    Coordinator co = {
+        .fb = fb,
+        .key = scene_key(scene),
+        .job = {
+            .camera = *camera,
+            .max_depth = settings->max_depth,
+            .roulette_depth = settings->roulette_depth,
+            .frame = settings->frame,
+            .sampler = settings->sampler,
+            .flags = (settings->packets ? JOB_PACKETS : 0) | (settings->wavefront ? JOB_WAVEFRONT : 0) |
+                     (adaptive.enabled ? JOB_ADAPTIVE : 0),
+            .adaptive_threshold = adaptive.threshold,
+            .adaptive_min_spp = adaptive.min_spp,
+            .adaptive_max_spp = adaptive.max_spp,
+        },
+        .tile_count = tiles_x * tiles_y,
+        .tiles = malloc(sizeof(TileMessage) * (size_t)(tiles_x * tiles_y)),
+        .tile_state = malloc(sizeof(int) * (size_t)(tiles_x * tiles_y)),
+        .pixels = malloc(sizeof(Color) * (size_t)tile_size * (size_t)tile_size),
+    };
+    pid_t *pids = malloc(sizeof(pid_t) * (size_t)(distributed->local_workers > 0 ? distributed->local_workers : 1));
+    int listen_fd = -1;
+    int spawned = 0;
+    bool ok = co.tiles && co.tile_state && co.pixels && pids;
+    if (!ok)
+        fprintf(stderr, "render_distributed: out of memory\n");
+
+    for (int t = 0; ok && t < co.tile_count; t++)
+    {
+        TileMessage *tile = &co.tiles[t];
+        tile->x0 = (t % tiles_x) * tile_size;
+        tile->y0 = (t / tiles_x) * tile_size;
+        tile->x1 = tile->x0 + tile_size < fb->width ? tile->x0 + tile_size : fb->width;
+        tile->y1 = tile->y0 + tile_size < fb->height ? tile->y0 + tile_size : fb->height;
+        co.tile_state[t] = TILE_PENDING;
+    }
+
+    ok = ok && (listen_fd = open_socket(distributed->address, true)) >= 0;
+    if (ok && distributed->local_workers > 0)
+    {
+        int threads = settings->thread_count > 0 ? settings->thread_count : render_default_thread_count();
+        RenderSettings host = {
+            .thread_count = threads / distributed->local_workers > 0 ? threads / distributed->local_workers : 1,
+            .texture_cache_bytes = settings->texture_cache_bytes,
+            .geometry_cache_bytes = settings->geometry_cache_bytes,
+        };
+        spawned = spawn_local_workers(distributed->address, scene, distributed->local_workers, &host, listen_fd, pids);
+    }
+    if (ok)
+        fprintf(stderr, "Rendering %d x %d image in %d tiles, coordinating on %s with %d local workers\n",
+                fb->width, fb->height, co.tile_count, distributed->address, spawned);
+
+    double start = now_seconds();
+    double last_worker = start;
+    struct pollfd *fds = NULL;
+    int fds_capacity = 0;
+    while (ok && co.done_count < co.tile_count)
+    {
+        if (co.connection_count + 1 > fds_capacity)
+        {
+            fds_capacity = co.connection_capacity + 1;
+            struct pollfd *grown = realloc(fds, sizeof(struct pollfd) * (size_t)fds_capacity);
+            if (!grown)
+            {
+                ok = false;
+                break;
+            }
+            fds = grown;
+        }
+        fds[0] = (struct pollfd){.fd = listen_fd, .events = POLLIN};
+        int polled = co.connection_count;
+        for (int c = 0; c < polled; c++)
+            fds[c + 1] = (struct pollfd){.fd = co.connections[c].fd, .events = POLLIN};
+        if (poll(fds, (nfds_t)polled + 1, 500) < 0 && errno != EINTR)
+        {
+            ok = false;
+            break;
+        }
+
+        // Walk backwards, dropping a connection moves the last one into its slot
+        double now = now_seconds();
+        for (int c = polled - 1; c >= 0; c--)
+        {
+            const char *reason = NULL;
+            Connection *conn = &co.connections[c];
+            if (fds[c + 1].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                if (!serve_connection(&co, c, &reason))
+                    drop_connection(&co, c, reason);
+            }
+            else if (distributed->tile_timeout > 0 && conn->tile >= 0 && now - conn->assigned_at > distributed->tile_timeout)
+            {
+                drop_connection(&co, c, "tile timed out");
+            }
+        }
+        if (fds[0].revents & POLLIN)
+            accept_connection(&co, listen_fd, io_timeout);
+
+        // Idle workers pick up tiles that came back to the queue
+        for (int c = co.connection_count - 1; c >= 0; c--)
+        {
+            if (co.connections[c].ready && co.connections[c].tile < 0 && !assign_tile(&co, c))
+                drop_connection(&co, c, "send failed");
+        }
+
+        if (co.connection_count > 0)
+            last_worker = now;
+        else if (now - last_worker > idle_timeout)
+        {
+            fprintf(stderr, "render_distributed: no workers for %.0f s, giving up with %d of %d tiles done\n",
+                    idle_timeout, co.done_count, co.tile_count);
+            ok = false;
+        }
+    }
+    double seconds = now_seconds() - start;
+
+    // An empty tile tells every worker the job is over
+    TileMessage stop = {0, 0, 0, 0};
+    for (int c = 0; c < co.connection_count; c++)
+    {
+        if (co.connections[c].ready)
+            send_all(co.connections[c].fd, &stop, sizeof(stop));
+        close(co.connections[c].fd);
+    }
+    for (int i = 0; i < spawned; i++)
+        waitpid(pids[i], NULL, 0);
+    if (listen_fd >= 0)
+    {
+        close(listen_fd);
+        if (strncmp(distributed->address, "unix:", 5) == 0)
+            unlink(distributed->address + 5);
+    }
+
+    if (ok)
+    {
+        if (seconds <= 0)
+            seconds = 1e-9;
+        fprintf(stderr, "Rendered in %.2f s: %.3f M primary rays/s, %.3f M rays/s, %d tiles re-issued\n", seconds,
+                co.samples / seconds * 1e-6, co.rays / seconds * 1e-6, co.reissued);
+    }
+    else
+    {
+        framebuffer_free(fb);
+    }
+    free(fds);
+    free(pids);
+    free(co.connections);
+    free(co.pixels);
+    free(co.tile_state);
+    free(co.tiles);
+    return ok;
+}
@@ -0,0 +1,52 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "render.h"
+
+#define DISTRIBUTED_DEFAULT_TILE_SIZE 64
+#define DISTRIBUTED_DEFAULT_IO_TIMEOUT 30.0    // Seconds a started message may stall
+#define DISTRIBUTED_DEFAULT_IDLE_TIMEOUT 60.0  // Seconds without any worker before giving up
+
+// Bump whenever a message layout changes
+#define DISTRIBUTED_VERSION 2
+
+// -----------------------------------------------------------------------------
+// Distributed rendering
+// -----------------------------------------------------------------------------
+// A coordinator listens on an address, either "unix:<path>" or
+// "[tcp:]<host>:<port>", and splits the image into tiles. Worker processes
+// load the same scene, connect, and render one tile at a time with
+// render_tiles on all their threads; the pixels go back to the coordinator
+// as raw Color values and are copied into its framebuffer. A worker that
+// disconnects, sends garbage or stalls gives its tile back to the queue, and
+// the next idle worker renders it again.
+//
+// The coordinator sends the camera and render settings, so a worker only
+// needs the scene. Workers must run the same build: messages are plain
+// structs and the handshake rejects a different version, Color size or
+// scene. Since every pixel seeds its own samples, the assembled image is bit
+// for bit the image a single process renders.
+typedef struct
+{
+    const char *address;
+    int local_workers;   // Worker processes to fork on this host, 0 to only wait for others
+    int tile_size;       // Edge length of a distributed tile, <= 0 means default
+    double tile_timeout; // Seconds before a tile is taken back from its worker, <= 0 never
+    double io_timeout;   // <= 0 means default
+    double idle_timeout; // <= 0 means default
+} DistributedSettings;
+
+// Coordinates a distributed render of camera into fb, which is allocated
+// here as in render_scene. settings->spp_map and settings->accumulation are
+// not supported. Returns false when the render could not be completed.
+bool render_distributed(Framebuffer *fb, Scene *scene, Camera *camera, const RenderSettings *settings,
+                        const DistributedSettings *distributed);
+
+// Connects to the coordinator at address and renders the tiles it hands
+// out until it has no more. The thread count and the texture and geometry
+// cache budgets come from host, they belong to the machine and not the job;
+// the rest of host is ignored. Returns false on connection or protocol
+// errors.
+bool distributed_worker(const char *address, Scene *scene, const RenderSettings *host);
+
+#endif // DISTRIBUTED_H
@@ -0,0 +1,440 @@
+#include "framebuffer.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+bool framebuffer_init(Framebuffer *fb, int width, int height)
+{
+    fb->width = width;
+    fb->height = height;
+    fb->pixels = calloc((size_t)width * (size_t)height, sizeof(Color));
+    return fb->pixels != NULL;
+}
+
+void framebuffer_free(Framebuffer *fb)
+{
+    free(fb->pixels);
+    fb->pixels = NULL;
+    fb->width = 0;
+    fb->height = 0;
+}
+
+void framebuffer_copy_rect(Framebuffer *dst, int dst_x, int dst_y, const Framebuffer *src, int src_x, int src_y,
+                           int width, int height)
+{
+    for (int y = 0; y < height; y++)
+        memcpy(framebuffer_at(dst, dst_x, dst_y + y), &src->pixels[(size_t)(src_y + y) * (size_t)src->width + (size_t)src_x],
+               sizeof(Color) * (size_t)width);
+}
+
+// -----------------------------------------------------------------------------
+// Gamma / clamp pass
+// -----------------------------------------------------------------------------
+
+// Channel c of the pixel array seen as one flat array of n * 3 channels
+static inline double channel(const Framebuffer *fb, size_t c)
+{
+    const real *pixel = &fb->pixels[c / 3].x;
+    return pixel[c % 3];
+}
+
+void framebuffer_quantize(const Framebuffer *fb, uint16_t maxval, uint16_t *out)
+{
+    size_t n = (size_t)fb->width * (size_t)fb->height * 3;
+    double scale = maxval + 0.999;
+    size_t i = 0;
+
+#if defined(__SSE2__) && !defined(RT_FLOAT)
+    // Color is three packed doubles, so the pixels form one flat channel array
+    const double *in = &fb->pixels[0].x;
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d vscale = _mm_set1_pd(scale);
+    for (; i + 4 <= n; i += 4)
+    {
+        // max/min return the second operand for NaN, so NaN maps to 0
+        __m128d a = _mm_min_pd(_mm_max_pd(_mm_loadu_pd(in + i), zero), one);
+        __m128d b = _mm_min_pd(_mm_max_pd(_mm_loadu_pd(in + i + 2), zero), one);
+        a = _mm_mul_pd(_mm_sqrt_pd(a), vscale);
+        b = _mm_mul_pd(_mm_sqrt_pd(b), vscale);
+        __m128i q = _mm_unpacklo_epi64(_mm_cvttpd_epi32(a), _mm_cvttpd_epi32(b));
+
+        int32_t lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, q);
+        out[i] = (uint16_t)lanes[0];
+        out[i + 1] = (uint16_t)lanes[1];
+        out[i + 2] = (uint16_t)lanes[2];
+        out[i + 3] = (uint16_t)lanes[3];
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        double v = channel(fb, i);
+        v = v > 0.0 ? v : 0.0;
+        v = v < 1.0 ? v : 1.0;
+        out[i] = (uint16_t)(sqrt(v) * scale);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Encoders
+// -----------------------------------------------------------------------------
+
+bool image_format_parse(const char *name, ImageFormat *format)
+{
+    if (strcmp(name, "p3") == 0)
+        *format = IMAGE_FORMAT_PPM_ASCII;
+    else if (strcmp(name, "ppm") == 0 || strcmp(name, "p6") == 0)
+        *format = IMAGE_FORMAT_PPM;
+    else if (strcmp(name, "ppm16") == 0)
+        *format = IMAGE_FORMAT_PPM16;
+    else if (strcmp(name, "pfm") == 0)
+        *format = IMAGE_FORMAT_PFM;
+    else
+        return false;
+    return true;
+}
+
+ImageFormat image_format_from_path(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    if (dot && strcmp(dot, ".pfm") == 0)
+        return IMAGE_FORMAT_PFM;
+    return IMAGE_FORMAT_PPM;
+}
+
+static int write_header(char *buf, size_t size, const Framebuffer *fb, ImageFormat format)
+{
+    switch (format)
+    {
+    case IMAGE_FORMAT_PPM_ASCII:
+        return snprintf(buf, size, "P3\n%d %d\n255\n", fb->width, fb->height);
+    case IMAGE_FORMAT_PPM:
+        return snprintf(buf, size, "P6\n%d %d\n255\n", fb->width, fb->height);
+    case IMAGE_FORMAT_PPM16:
+        return snprintf(buf, size, "P6\n%d %d\n65535\n", fb->width, fb->height);
+    case IMAGE_FORMAT_PFM:
+    default:
+    {
+        // A negative scale marks little-endian samples
+        uint16_t probe = 1;
+        bool little_endian = *(unsigned char *)&probe == 1;
+        return snprintf(buf, size, "PF\n%d %d\n%s\n", fb->width, fb->height, little_endian ? "-1.0" : "1.0");
+    }
+    }
+}
+
+static size_t bytes_per_channel(ImageFormat format)
+{
+    switch (format)
+    {
+    case IMAGE_FORMAT_PPM16:
+        return 2;
+    case IMAGE_FORMAT_PFM:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+// Size of a binary image, header included
+static size_t binary_size(const Framebuffer *fb, ImageFormat format)
+{
+    char header[64];
+    size_t channels = (size_t)fb->width * (size_t)fb->height * 3;
+    return (size_t)write_header(header, sizeof(header), fb, format) + channels * bytes_per_channel(format);
+}
+
+// Encodes a binary format into dst, which holds binary_size bytes
+static bool encode_binary(const Framebuffer *fb, ImageFormat format, unsigned char *dst)
+{
+    char header[64];
+    int header_size = write_header(header, sizeof(header), fb, format);
+    memcpy(dst, header, (size_t)header_size);
+    dst += header_size;
+
+    size_t channels = (size_t)fb->width * (size_t)fb->height * 3;
+    if (format == IMAGE_FORMAT_PFM)
+    {
+        // Linear values, no clamping. PFM stores rows bottom to top.
+        // The header leaves dst unaligned, hence the memcpy per sample.
+        size_t row = (size_t)fb->width * 3;
+        for (int y = 0; y < fb->height; y++)
+        {
+            size_t first = (size_t)(fb->height - 1 - y) * row;
+            for (size_t i = 0; i < row; i++)
+            {
+                float f = (float)channel(fb, first + i);
+                memcpy(dst + sizeof(float) * ((size_t)y * row + i), &f, sizeof(float));
+            }
+        }
+        return true;
+    }
+
+    uint16_t *values = malloc(sizeof(uint16_t) * channels);
+    if (!values)
+        return false;
+    framebuffer_quantize(fb, format == IMAGE_FORMAT_PPM16 ? 65535 : 255, values);
+    if (format == IMAGE_FORMAT_PPM16)
+    {
+        for (size_t i = 0; i < channels; i++)
+        {
+            dst[2 * i] = (unsigned char)(values[i] >> 8);
+            dst[2 * i + 1] = (unsigned char)(values[i] & 0xff);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < channels; i++)
+            dst[i] = (unsigned char)values[i];
+    }
+    free(values);
+    return true;
+}
+
+// P3 has variable-length records, so it is formatted into a worst-case
+// buffer ("255 255 255\n" per pixel) and written in one go
+static bool write_ascii(FILE *output, const Framebuffer *fb)
+{
+    size_t pixels = (size_t)fb->width * (size_t)fb->height;
+    uint16_t *values = malloc(sizeof(uint16_t) * pixels * 3);
+    char *text = malloc(64 + pixels * 12);
+    if (!values || !text)
+    {
+        free(values);
+        free(text);
+        return false;
+    }
+
+    framebuffer_quantize(fb, 255, values);
+    size_t len = (size_t)write_header(text, 64, fb, IMAGE_FORMAT_PPM_ASCII);
+    for (size_t i = 0; i < pixels * 3; i++)
+    {
+        unsigned v = values[i];
+        if (v >= 100)
+            text[len++] = (char)('0' + v / 100);
+        if (v >= 10)
+            text[len++] = (char)('0' + v / 10 % 10);
+        text[len++] = (char)('0' + v % 10);
+        text[len++] = (i % 3 == 2) ? '\n' : ' ';
+    }
+
+    bool ok = fwrite(text, 1, len, output) == len;
+    free(values);
+    free(text);
+    return ok;
+}
+
+bool framebuffer_write(FILE *output, const Framebuffer *fb, ImageFormat format)
+{
+    if (format == IMAGE_FORMAT_PPM_ASCII)
+        return write_ascii(output, fb);
+
+    size_t size = binary_size(fb, format);
+    unsigned char *buffer = malloc(size);
+    if (!buffer)
+        return false;
+
+    bool ok = encode_binary(fb, format, buffer) && fwrite(buffer, 1, size, output) == size;
+    free(buffer);
+    return ok && fflush(output) == 0;
+}
+
+bool framebuffer_write_file(const char *path, const Framebuffer *fb, ImageFormat format)
+{
+    if (format == IMAGE_FORMAT_PPM_ASCII)
+    {
+        FILE *output = fopen(path, "wb");
+        if (!output)
+            return false;
+        bool ok = write_ascii(output, fb);
+        return fclose(output) == 0 && ok;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+
+    size_t size = binary_size(fb, format);
+    bool ok = ftruncate(fd, (off_t)size) == 0;
+    void *map = ok ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (map != MAP_FAILED)
+    {
+        ok = encode_binary(fb, format, map);
+        munmap(map, size);
+    }
+    else
+    {
+        ok = false;
+    }
+    return close(fd) == 0 && ok;
+}
+
+// -----------------------------------------------------------------------------
+// Decoder
+// -----------------------------------------------------------------------------
+
+#define DECODE_MAX_DIMENSION 65536
+
+// Reads the next header field into buf, skipping whitespace and # comments.
+// The one whitespace character after the field is consumed, as the formats
+// require before the binary samples.
+static bool read_token(FILE *file, char *buf, size_t size)
+{
+    int c = fgetc(file);
+    while (c == '#' || isspace(c))
+    {
+        if (c == '#')
+            while (c != '\n' && c != EOF)
+                c = fgetc(file);
+        c = fgetc(file);
+    }
+    size_t len = 0;
+    while (c != EOF && !isspace(c))
+    {
+        if (len + 1 >= size)
+            return false;
+        buf[len++] = (char)c;
+        c = fgetc(file);
+    }
+    buf[len] = '\0';
+    return len > 0;
+}
+
+static bool read_header_int(FILE *file, long max, long *value)
+{
+    char token[32], *end;
+    if (!read_token(file, token, sizeof(token)))
+        return false;
+    *value = strtol(token, &end, 10);
+    return *end == '\0' && *value > 0 && *value <= max;
+}
+
+// Inverse of framebuffer_quantize for the middle of step q
+static real decode_ppm_value(unsigned long q, unsigned long maxval)
+{
+    double v = ((double)(q < maxval ? q : maxval) + 0.5) / ((double)maxval + 0.999);
+    return (real)(v * v);
+}
+
+static const char *decode_ppm(FILE *file, bool ascii, Framebuffer *fb)
+{
+    long maxval;
+    if (!read_header_int(file, 65535, &maxval))
+        return "bad maximum value";
+    size_t channels = (size_t)fb->width * (size_t)fb->height * 3;
+    if (ascii)
+    {
+        char token[32], *end;
+        for (size_t i = 0; i < channels; i++)
+        {
+            if (!read_token(file, token, sizeof(token)))
+                return "truncated image";
+            unsigned long q = strtoul(token, &end, 10);
+            if (*end != '\0')
+                return "bad sample";
+            (&fb->pixels[i / 3].x)[i % 3] = decode_ppm_value(q, (unsigned long)maxval);
+        }
+        return NULL;
+    }
+
+    size_t bytes = maxval > 255 ? 2 : 1;
+    unsigned char *data = malloc(channels * bytes);
+    if (!data)
+        return "out of memory";
+    const char *error = NULL;
+    if (fread(data, bytes, channels, file) != channels)
+        error = "truncated image";
+    for (size_t i = 0; !error && i < channels; i++)
+    {
+        unsigned long q = bytes == 2 ? (unsigned long)data[2 * i] << 8 | data[2 * i + 1] : data[i];
+        (&fb->pixels[i / 3].x)[i % 3] = decode_ppm_value(q, (unsigned long)maxval);
+    }
+    free(data);
+    return error;
+}
+
+static const char *decode_pfm(FILE *file, Framebuffer *fb)
+{
+    char token[32], *end;
+    if (!read_token(file, token, sizeof(token)))
+        return "bad scale";
+    double scale = strtod(token, &end);
+    if (*end != '\0' || scale == 0.0)
+        return "bad scale";
+    // A negative scale marks little-endian samples
+    uint16_t probe = 1;
+    bool swap = (scale < 0) != (*(unsigned char *)&probe == 1);
+
+    size_t row = (size_t)fb->width * 3;
+    float *data = malloc(sizeof(float) * row * (size_t)fb->height);
+    if (!data)
+        return "out of memory";
+    const char *error = NULL;
+    if (fread(data, sizeof(float), row * (size_t)fb->height, file) != row * (size_t)fb->height)
+        error = "truncated image";
+    // Rows are stored bottom to top
+    for (int y = 0; !error && y < fb->height; y++)
+    {
+        const float *src = &data[(size_t)(fb->height - 1 - y) * row];
+        for (size_t i = 0; i < row; i++)
+        {
+            float f = src[i];
+            if (swap)
+            {
+                uint32_t bits;
+                memcpy(&bits, &f, sizeof(bits));
+                bits = __builtin_bswap32(bits);
+                memcpy(&f, &bits, sizeof(f));
+            }
+            (&framebuffer_at(fb, (int)(i / 3), y)->x)[i % 3] = (real)f;
+        }
+    }
+    free(data);
+    return error;
+}
+
+bool framebuffer_read_file(const char *path, Framebuffer *fb)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "framebuffer_read_file: could not open %s\n", path);
+        return false;
+    }
+
+    char magic[4];
+    long width, height;
+    const char *error = NULL;
+    fb->pixels = NULL;
+    if (!read_token(file, magic, sizeof(magic)) ||
+        (strcmp(magic, "P3") != 0 && strcmp(magic, "P6") != 0 && strcmp(magic, "PF") != 0))
+        error = "not a P3, P6 or PF image";
+    else if (!read_header_int(file, DECODE_MAX_DIMENSION, &width) ||
+             !read_header_int(file, DECODE_MAX_DIMENSION, &height))
+        error = "bad image size";
+    else if (!framebuffer_init(fb, (int)width, (int)height))
+        error = "out of memory";
+    else if (magic[1] == 'F')
+        error = decode_pfm(file, fb);
+    else
+        error = decode_ppm(file, magic[1] == '3', fb);
+    fclose(file);
+
+    if (error)
+    {
+        fprintf(stderr, "framebuffer_read_file: %s: %s\n", path, error);
+        framebuffer_free(fb);
+        return false;
+    }
+    return true;
+}
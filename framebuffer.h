@@ -0,0 +1,67 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "math/vec3.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// -----------------------------------------------------------------------------
+// Framebuffer: linear color storage shared by all render threads
+// -----------------------------------------------------------------------------
+typedef struct
+{
+    int width;
+    int height;
+    Color *pixels; // Row-major, row 0 is the top row of the image
+} Framebuffer;
+
+typedef enum
+{
+    IMAGE_FORMAT_PPM_ASCII, // P3, 8 bits per channel as text
+    IMAGE_FORMAT_PPM,       // P6, 8 bits per channel
+    IMAGE_FORMAT_PPM16,     // P6 with maxval 65535, 16-bit big-endian channels
+    IMAGE_FORMAT_PFM        // Portable float map, linear 32-bit HDR values
+} ImageFormat;
+
+// Allocates a zeroed framebuffer, returns false on allocation failure
+bool framebuffer_init(Framebuffer *fb, int width, int height);
+
+void framebuffer_free(Framebuffer *fb);
+
+// Returns a pointer to the pixel at column x of row y (y = 0 is the top row)
+static inline Color *framebuffer_at(Framebuffer *fb, int x, int y)
+{
+    return &fb->pixels[(size_t)y * (size_t)fb->width + (size_t)x];
+}
+
+// Copies the width x height block of src at (src_x, src_y) to (dst_x, dst_y)
+// of dst. The block must lie inside both images.
+void framebuffer_copy_rect(Framebuffer *dst, int dst_x, int dst_y, const Framebuffer *src, int src_x, int src_y,
+                           int width, int height);
+
+// Converts every channel of the framebuffer in one pass: clamp to [0, 1],
+// gamma 2 correction, then scale and truncate to [0, maxval]. out holds
+// width * height * 3 values.
+void framebuffer_quantize(const Framebuffer *fb, uint16_t maxval, uint16_t *out);
+
+// Parses a format name ("p3", "ppm", "ppm16", "pfm"), returns false if unknown
+bool image_format_parse(const char *name, ImageFormat *format);
+
+// Picks a format from a file name extension (.pfm, otherwise 8-bit PPM)
+ImageFormat image_format_from_path(const char *path);
+
+// Encodes the whole image in memory and writes it with a single fwrite
+bool framebuffer_write(FILE *output, const Framebuffer *fb, ImageFormat format);
+
+// Writes the image to path. Binary formats are encoded straight into an
+// mmap of the output file.
+bool framebuffer_write_file(const char *path, const Framebuffer *fb, ImageFormat format);
+
+// Reads a P3, P6 (8 or 16 bits) or PFM image into a newly allocated fb.
+// PPM values are decoded to the middle of their quantization step before
+// gamma 2 is undone, so writing them again in the same format gives back the
+// same file. Prints the reason and returns false on failure.
+bool framebuffer_read_file(const char *path, Framebuffer *fb);
+
+#endif // FRAMEBUFFER_H
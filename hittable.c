@@ -1,9 +1,35 @@
 #include "hittable.h"
+#include "instance.h"
+#include "paged.h"
+#include "stats.h"
 #include <math.h>
 
 // Implementation moved from hittable.h
 
-bool hit_sphere(const Sphere *s, Material material, Ray r, double t_min, double t_max, HitRecord *rec)
+void sphere_hit_record(const Sphere *s, MaterialId material, Ray r, double t, HitRecord *rec)
+{
+    rec->t = t;
+    rec->p = ray_at(r, t);
+
+    // Calculate Normal: (Point - Center) / Radius
+    Vec3 outward_normal = vec3_div(vec3_sub(rec->p, s->center), s->radius);
+
+    // check for inword or outward normal
+    if (vec3_dot(r.direction, outward_normal) > 0)
+    {
+        rec->normal = vec3_scale(outward_normal, -1.0); // Inward
+        rec->front_face = false;
+    }
+    else
+    {
+        rec->normal = outward_normal;
+        rec->front_face = true;
+    }
+
+    rec->material = material;
+}
+
+bool hit_sphere(const Sphere *s, MaterialId material, Ray r, double t_min, double t_max, HitRecord *rec)
 {
     Vec3 oc = vec3_sub(r.origin, s->center);
     double a = vec3_length_squared(r.direction);
@@ -30,30 +56,11 @@ bool hit_sphere(const Sphere *s, Material material, Ray r, double t_min, double
     }
 
     // Success! We hit the sphere. Record the data.
-    rec->t = root;
-    rec->p = ray_at(r, root);
-
-    // Calculate Normal: (Point - Center) / Radius
-    Vec3 outward_normal = vec3_div(vec3_sub(rec->p, s->center), s->radius);
-
-    // check for inword or outward normal
-    if (vec3_dot(r.direction, outward_normal) > 0)
-    {
-        rec->normal = vec3_scale(outward_normal, -1.0); // Inward
-        rec->front_face = false;
-    }
-    else
-    {
-        rec->normal = outward_normal;
-        rec->front_face = true;
-    }
-
-    rec->material = material;
-
+    sphere_hit_record(s, material, r, root, rec);
     return true;
 }
 
-bool hit_plane(const Plane *p, Material material, Ray r, double t_min, double t_max, HitRecord *rec)
+bool hit_plane(const Plane *p, MaterialId material, Ray r, double t_min, double t_max, HitRecord *rec)
 {
     double denominator = vec3_dot(p->normal, r.direction);
 
@@ -72,6 +79,7 @@ bool hit_plane(const Plane *p, Material material, Ray r, double t_min, double t_
     rec->material = material;
 
     // Face forward check (make plane double-sided)
+    rec->front_face = denominator <= 0;
     if (denominator > 0)
         rec->normal = vec3_scale(p->normal, -1.0);
     else
@@ -80,7 +88,27 @@ bool hit_plane(const Plane *p, Material material, Ray r, double t_min, double t_
     return true;
 }
 
-bool hit_triangle(const Triangle *tr, Material material, Ray r, double t_min, double t_max, HitRecord *rec)
+void triangle_hit_record(const Triangle *tr, MaterialId material, Ray r, double t, HitRecord *rec)
+{
+    Vec3 v0v1 = vec3_sub(tr->v1, tr->v0);
+    Vec3 v0v2 = vec3_sub(tr->v2, tr->v0);
+
+    rec->t = t;
+    rec->p = ray_at(r, t);
+    rec->material = material;
+
+    // Calculate normal from cross product
+    Vec3 outward_normal = vec3_unit(vec3_cross(v0v1, v0v2));
+
+    // Face forward check, the winding decides which side is outside
+    rec->front_face = vec3_dot(r.direction, outward_normal) <= 0;
+    if (!rec->front_face)
+        rec->normal = vec3_scale(outward_normal, -1.0);
+    else
+        rec->normal = outward_normal;
+}
+
+bool hit_triangle(const Triangle *tr, MaterialId material, Ray r, double t_min, double t_max, HitRecord *rec)
 {
     Vec3 v0v1 = vec3_sub(tr->v1, tr->v0);
     Vec3 v0v2 = vec3_sub(tr->v2, tr->v0);
@@ -105,42 +133,186 @@ bool hit_triangle(const Triangle *tr, Material material, Ray r, double t_min, do
     if (t < t_min || t > t_max)
         return false;
 
-    rec->t = t;
-    rec->p = ray_at(r, t);
-    rec->material = material;
+    triangle_hit_record(tr, material, r, t, rec);
+    return true;
+}
 
-    // Calculate normal from cross product
-    Vec3 outward_normal = vec3_unit(vec3_cross(v0v1, v0v2));
+Triangle mesh_triangle(const Mesh *mesh, uint32_t index)
+{
+    const uint32_t *idx = &mesh->indices[3 * (size_t)index];
+    return (Triangle){mesh->vertices[idx[0]], mesh->vertices[idx[1]], mesh->vertices[idx[2]]};
+}
 
-    // Face forward check
-    if (vec3_dot(r.direction, outward_normal) > 0)
-        rec->normal = vec3_scale(outward_normal, -1.0);
-    else
-        rec->normal = outward_normal;
+bool hit_mesh_triangle(const Mesh *mesh, uint32_t index, MaterialId material, Ray r, double t_min, double t_max, HitRecord *rec)
+{
+    Triangle tr = mesh_triangle(mesh, index);
+    return hit_triangle(&tr, material, r, t_min, t_max, rec);
+}
+
+void hittable_hit_record(const Hittable *h, uint32_t prim, Ray r, double t, HitRecord *rec)
+{
+    rec->hittable = h;
+    rec->instance = NULL;
+    rec->prim = prim;
+    switch (h->type)
+    {
+    case HITTABLE_SPHERE:
+        sphere_hit_record(&(h->object.sphere), h->material, r, t, rec);
+        break;
+    case HITTABLE_TRIANGLE:
+        triangle_hit_record(&(h->object.triangle), h->material, r, t, rec);
+        break;
+    case HITTABLE_MESH:
+    {
+        Triangle tr = mesh_triangle(h->object.mesh, prim);
+        triangle_hit_record(&tr, h->material, r, t, rec);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Texture coordinates
+// -----------------------------------------------------------------------------
+
+void sphere_uv(const Sphere *s, Point3 p, SurfaceUv *uv)
+{
+    // Longitude from -x through +z, latitude from the south pole (-y).
+    // sin(theta) is kept off 0 at the poles, where u is undefined.
+    Vec3 n = vec3_div(vec3_sub(p, s->center), s->radius);
+    double y = fmin(fmax(n.y, -1.0), 1.0);
+    double sin_theta = fmax(sqrt(1 - y * y), 1e-8);
+    uv->u = (atan2(-n.z, n.x) + M_PI) / (2 * M_PI);
+    uv->v = acos(-y) / M_PI;
+    uv->dpdu = vec3_scale(vec3_create(n.z, 0, -n.x), 2 * M_PI * s->radius);
+    uv->dpdv = vec3_scale(vec3_create(-n.x * y / sin_theta, sin_theta, -n.z * y / sin_theta), M_PI * s->radius);
+}
 
+void plane_uv(const Plane *plane, Point3 p, SurfaceUv *uv)
+{
+    Vec3 offset = vec3_sub(p, plane->point);
+    vec3_basis(vec3_unit(plane->normal), &uv->dpdu, &uv->dpdv);
+    uv->u = vec3_dot(offset, uv->dpdu);
+    uv->v = vec3_dot(offset, uv->dpdv);
+}
+
+void triangle_uv(const Triangle *tr, Point3 p, SurfaceUv *uv)
+{
+    // Barycentric coordinates of p in the plane of the edges
+    Vec3 v0v1 = vec3_sub(tr->v1, tr->v0);
+    Vec3 v0v2 = vec3_sub(tr->v2, tr->v0);
+    Vec3 v0p = vec3_sub(p, tr->v0);
+    double d00 = vec3_dot(v0v1, v0v1), d01 = vec3_dot(v0v1, v0v2), d11 = vec3_dot(v0v2, v0v2);
+    double d20 = vec3_dot(v0p, v0v1), d21 = vec3_dot(v0p, v0v2);
+    double inv_denominator = 1.0 / (d00 * d11 - d01 * d01);
+    uv->u = (d11 * d20 - d01 * d21) * inv_denominator;
+    uv->v = (d00 * d21 - d01 * d20) * inv_denominator;
+    uv->dpdu = v0v1;
+    uv->dpdv = v0v2;
+}
+
+void hit_record_uv(const HitRecord *rec, SurfaceUv *uv)
+{
+    *uv = (SurfaceUv){0};
+    const Hittable *h = rec->hittable;
+    if (!h)
+        return;
+    // Instanced primitives are worked out in object space
+    const Instance *instance = rec->instance;
+    Point3 p = instance ? transform_point(&instance->to_object, rec->p) : rec->p;
+    switch (h->type)
+    {
+    case HITTABLE_SPHERE:
+        sphere_uv(&h->object.sphere, p, uv);
+        break;
+    case HITTABLE_PLANE:
+        plane_uv(&h->object.plane, p, uv);
+        break;
+    case HITTABLE_TRIANGLE:
+        triangle_uv(&h->object.triangle, p, uv);
+        break;
+    case HITTABLE_MESH:
+    {
+        Triangle tr = mesh_triangle(h->object.mesh, rec->prim);
+        triangle_uv(&tr, p, uv);
+        break;
+    }
+    default:
+        return;
+    }
+    if (instance)
+    {
+        uv->dpdu = transform_vector(&instance->to_world, uv->dpdu);
+        uv->dpdv = transform_vector(&instance->to_world, uv->dpdv);
+    }
+}
+
+// Records which primitive a hit_hittable hit belongs to
+static bool hit_on(const Hittable *h, uint32_t prim, HitRecord *rec)
+{
+    rec->hittable = h;
+    rec->instance = NULL;
+    rec->prim = prim;
     return true;
 }
 
 bool hit_hittable(const Hittable *h, Ray r, double t_min, double t_max, HitRecord *rec)
 {
+    STATS_PRIM_TESTS(h->type, h->type == HITTABLE_MESH ? h->object.mesh->triangle_count : 1);
     switch (h->type)
     {
     case HITTABLE_SPHERE:
-        return hit_sphere(&(h->object.sphere), h->material, r, t_min, t_max, rec);
+        return hit_sphere(&(h->object.sphere), h->material, r, t_min, t_max, rec) && hit_on(h, 0, rec);
     case HITTABLE_PLANE:
-        return hit_plane(&(h->object.plane), h->material, r, t_min, t_max, rec);
+        return hit_plane(&(h->object.plane), h->material, r, t_min, t_max, rec) && hit_on(h, 0, rec);
     case HITTABLE_TRIANGLE:
-        return hit_triangle(&(h->object.triangle), h->material, r, t_min, t_max, rec);
+        return hit_triangle(&(h->object.triangle), h->material, r, t_min, t_max, rec) && hit_on(h, 0, rec);
+    case HITTABLE_MESH:
+    {
+        // Brute force; scenes normally reach mesh triangles through the BVH
+        bool hit_anything = false;
+        for (uint32_t i = 0; i < h->object.mesh->triangle_count; i++)
+        {
+            if (hit_mesh_triangle(h->object.mesh, i, h->material, r, t_min, t_max, rec))
+            {
+                hit_anything = hit_on(h, i, rec);
+                t_max = rec->t;
+            }
+        }
+        return hit_anything;
+    }
+    case HITTABLE_INSTANCE:
+    {
+        // Likewise, the scene BVH normally finds instances
+        BvhHit hit;
+        if (!instance_intersect(h->object.instance, r, t_min, &t_max, &hit))
+            return false;
+        instance_hit_record(h->object.instance, h->material, hit, r, t_max, rec);
+        return true;
+    }
+    case HITTABLE_PAGED_MESH:
+    {
+        PagedHit hit;
+        if (!paged_mesh_intersect(h->object.paged_mesh, r, t_min, &t_max, &hit))
+            return false;
+        paged_mesh_hit_record(h->object.paged_mesh, h->material, hit, r, t_max, rec);
+        return hit_on(h, hit.prim, rec);
+    }
     default:
         return false;
     }
 }
 
-bool scatter_metal(const Material *material, Ray r_in, HitRecord *rec, Color *attenuation, Ray *scattered)
+bool scatter_metal(const Material *material, Ray r_in, HitRecord *rec, Color *attenuation, Ray *scattered, Sampler *sampler)
 {
     Vec3 reflected = vec3_reflect(vec3_unit(r_in.direction), rec->normal);
     // add fuzz
-    reflected = vec3_add(reflected, vec3_scale(random_in_unit_sphere(), material->properties.fuzz));
+    double u, v;
+    sampler_2d(sampler, SAMPLE_SCATTER, &u, &v);
+    Vec3 fuzz = vec3_in_unit_ball(u, v, sampler_1d(sampler, SAMPLE_SCATTER_RADIUS));
+    reflected = vec3_add(reflected, vec3_scale(fuzz, material->properties.fuzz));
 
     *scattered = ray_create(rec->p, vec3_scale(reflected, 1.0));
     *attenuation = material->color;
@@ -148,23 +320,21 @@ bool scatter_metal(const Material *material, Ray r_in, HitRecord *rec, Color *at
     return (vec3_dot(scattered->direction, rec->normal) > 0);
 }
 
-bool scatter_lambertian(const Material *material, Ray r_in, HitRecord *rec, Color *attenuation, Ray *scattered)
+bool scatter_lambertian(const Material *material, Ray r_in, HitRecord *rec, Color *attenuation, Ray *scattered, Sampler *sampler)
 {
-    Vec3 scatter_direction = vec3_add(rec->normal, random_in_unit_sphere());
+    // The direction of the normal plus a point uniform in the unit ball, drawn
+    // in closed form: its density 2 cos^3 / pi is a cosine power lobe
+    double u, v;
+    sampler_2d(sampler, SAMPLE_SCATTER, &u, &v);
+    Vec3 scatter_direction = vec3_cosine_power_hemisphere(rec->normal, u, v, LAMBERTIAN_COSINE_POWER);
 
-    // Catch degenerate scatter direction (if random vector opposes normal exactly)
-    if (vec3_length_squared(scatter_direction) < 1e-8)
-    {
-        scatter_direction = rec->normal;
-    }
-
-        *scattered = ray_create(rec->p, vec3_unit(scatter_direction));
+    *scattered = ray_create(rec->p, scatter_direction);
     *attenuation = material->color;
 
     return true;
 }
 
-bool scatter_dielectric(const Material *material, Ray r_in, HitRecord *rec, Color *a, Ray *scattered)
+bool scatter_dielectric(const Material *material, Ray r_in, HitRecord *rec, Color *a, Ray *scattered, Sampler *sampler)
 {
     Color attenuation = vec3_create(1.0, 1.0, 1.0); // No attenuation for dielectric
     double ref_idx = rec->front_face ? (1.0 / material->properties.ref_idx) : material->properties.ref_idx;
@@ -190,21 +360,40 @@ bool scatter_dielectric(const Material *material, Ray r_in, HitRecord *rec, Colo
     return true;
 }
 
-bool scatter_ray(const Material *material, Ray r_in, HitRecord *rec, Color *attenuation, Ray *scattered)
+bool scatter_ray(const Material *material, Ray r_in, HitRecord *rec, Color *attenuation, Ray *scattered, Sampler *sampler)
 {
+    STATS_ADD(scatters[material->type], 1);
     switch (material->type)
     {
     case MATERIAL_LAMBERTIAN:
-        return scatter_lambertian(material, r_in, rec, attenuation, scattered);
+        return scatter_lambertian(material, r_in, rec, attenuation, scattered, sampler);
         break;
     case MATERIAL_METAL:
-        return scatter_metal(material, r_in, rec, attenuation, scattered);
+        return scatter_metal(material, r_in, rec, attenuation, scattered, sampler);
         break;
     case MATERIAL_DIELECTRIC:
-        return scatter_dielectric(material, r_in, rec, attenuation, scattered);
+        return scatter_dielectric(material, r_in, rec, attenuation, scattered, sampler);
         break;
+    case MATERIAL_EMISSIVE:
+        return false; // The path ends at the light
     default:
         return false;
         break;
     }
 }
+
+Color material_eval(const Material *material, const HitRecord *rec, Vec3 wi, double *pdf)
+{
+    double cos_theta = vec3_dot(rec->normal, wi);
+    if (material->type != MATERIAL_LAMBERTIAN || cos_theta <= 0)
+    {
+        *pdf = 0;
+        return vec3_create(0, 0, 0);
+    }
+    // scatter_lambertian samples the direction of the normal offset by a
+    // point uniform in the unit ball, which has density 2 cos^3 / pi. The
+    // attenuation it returns is the plain albedo, so BSDF * cos equals
+    // albedo * pdf.
+    *pdf = 2 * cos_theta * cos_theta * cos_theta / M_PI;
+    return vec3_scale(material->color, *pdf);
+}
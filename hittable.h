@@ -3,7 +3,13 @@
 
 #include "math/vec3.h"
 #include "math/ray.h"
+#include "math/sampler.h"
 #include <stdbool.h> // for bool, true, false
+#include <stdint.h>
+
+// Lambertian surfaces scatter with density 2 cos^3 / pi, the cosine power
+// lobe of this exponent (see vec3_cosine_power_hemisphere)
+#define LAMBERTIAN_COSINE_POWER 3
 
 // -----------------------------------------------------------------------------
 // Hittable objects
@@ -12,14 +18,19 @@ typedef enum
 {
     HITTABLE_SPHERE,
     HITTABLE_PLANE,
-    HITTABLE_TRIANGLE
+    HITTABLE_TRIANGLE,
+    HITTABLE_MESH,
+    HITTABLE_INSTANCE, // Transformed copy of an object group, see instance.h
+    HITTABLE_PAGED_MESH, // Triangle mesh paged in from a file, see paged.h
+    HITTABLE_TYPE_COUNT
 } HittableType;
 
 typedef enum
 {
     MATERIAL_LAMBERTIAN,
     MATERIAL_METAL,
-    MATERIAL_DIELECTRIC
+    MATERIAL_DIELECTRIC,
+    MATERIAL_EMISSIVE // Emits color as radiance from both sides, scatters nothing
 } MaterialType;
 
 typedef struct
@@ -30,9 +41,10 @@ typedef struct
 
 typedef struct
 {
-    Color color;
+    Color color; // Multiplies the texture when there is one
 
     MaterialType type;
+    uint32_t texture; // Scene texture + 1, 0 for a plain color
     union
     {
         double fuzz;    // For metal materials
@@ -41,6 +53,9 @@ typedef struct
 
 } Material;
 
+// Index into the scene's material table (Scene.materials)
+typedef uint32_t MaterialId;
+
 typedef struct
 {
     Point3 v0;
@@ -54,39 +69,108 @@ typedef struct
     double radius;
 } Sphere;
 
+// Indexed triangle mesh: triangle i uses vertices indices[3i], [3i+1], [3i+2]
+// of the shared vertex array. One Hittable stands for the whole mesh, the
+// BVH references its triangles individually.
+typedef struct
+{
+    Point3 *vertices;
+    uint32_t *indices;
+    uint32_t vertex_count;
+    uint32_t triangle_count;
+} Mesh;
+
+typedef struct t_instance Instance;
+typedef struct t_paged_mesh PagedMesh;
+
 typedef struct t_hittable
 {
-    HittableType type; // Type of the hittable object
+    HittableType type;   // Type of the hittable object
+    MaterialId material; // Looked up in the scene's material table when shading
     union
     {
         Sphere sphere;
         Triangle triangle;
         Plane plane;
-    } object;          // The actual object data
-    Material material; // Material properties of the hittable object
+        const Mesh *mesh; // Not owned, must outlive the hittable
+        const Instance *instance; // Not owned either
+        const PagedMesh *paged_mesh; // Nor this
+    } object; // The actual object data
 } Hittable;
 
 // -----------------------------------------------------------------------------
 // Hit Record: Stores data about where a ray hit an object
 // -----------------------------------------------------------------------------
+// Only the material ID is carried, the material itself is fetched once per
+// shaded hit rather than copied for every candidate intersection.
+//
+// The hit primitive is kept as well, so the texture coordinates, which only
+// textured materials need, can be worked out afterwards (hit_record_uv).
 typedef struct
 {
-    double t;          // Distance along the ray
-    Point3 p;          // The exact point of intersection
-    Vec3 normal;       // The surface normal at that point
-    Material material; // Material of the hit object
-    bool front_face;   // Whether the hit was on the outside surface
+    double t;            // Distance along the ray
+    Point3 p;            // The exact point of intersection
+    Vec3 normal;         // The surface normal at that point
+    MaterialId material; // Material of the hit object
+    uint32_t prim;       // Triangle of a mesh
+    bool front_face;     // Whether the hit was on the outside surface
+    const Hittable *hittable; // The sphere, plane, triangle or mesh hit
+    const Instance *instance; // The instance it was reached through, or NULL
 } HitRecord;
 
+// Texture coordinates at a surface point and how the point moves with them.
+// Spheres use longitude and latitude, triangles their barycentric coordinates
+// with v1 at (1, 0) and v2 at (0, 1), planes distances along a tangent frame
+// of the normal.
+typedef struct
+{
+    double u;
+    double v;
+    Vec3 dpdu;
+    Vec3 dpdv;
+} SurfaceUv;
+
 // returns true if the ray hits the sphere between t_min and t_max, recording the information in rec
-bool hit_sphere(const Sphere *s, Material material, Ray r, double t_min, double t_max, HitRecord *rec);
+bool hit_sphere(const Sphere *s, MaterialId material, Ray r, double t_min, double t_max, HitRecord *rec);
+
+bool hit_plane(const Plane *p, MaterialId material, Ray r, double t_min, double t_max, HitRecord *rec);
 
-bool hit_plane(const Plane *p, Material material, Ray r, double t_min, double t_max, HitRecord *rec);
+bool hit_triangle(const Triangle *tr, MaterialId material, Ray r, double t_min, double t_max, HitRecord *rec);
 
-bool hit_triangle(const Triangle *tr, Material material, Ray r, double t_min, double t_max, HitRecord *rec);
+// Gathers triangle index of the mesh from the shared vertex array
+Triangle mesh_triangle(const Mesh *mesh, uint32_t index);
+
+// hit_triangle on one triangle of the mesh
+bool hit_mesh_triangle(const Mesh *mesh, uint32_t index, MaterialId material, Ray r, double t_min, double t_max, HitRecord *rec);
+
+// Fill rec for a hit at distance t that an intersection test already accepted
+void sphere_hit_record(const Sphere *s, MaterialId material, Ray r, double t, HitRecord *rec);
+
+void triangle_hit_record(const Triangle *tr, MaterialId material, Ray r, double t, HitRecord *rec);
+
+// Fills rec for a bounded hittable hit at distance t. prim selects the
+// triangle of a mesh and is ignored for other types.
+void hittable_hit_record(const Hittable *h, uint32_t prim, Ray r, double t, HitRecord *rec);
+
+// Texture coordinates of the point p on a primitive
+void sphere_uv(const Sphere *s, Point3 p, SurfaceUv *uv);
+
+void plane_uv(const Plane *plane, Point3 p, SurfaceUv *uv);
+
+void triangle_uv(const Triangle *tr, Point3 p, SurfaceUv *uv);
+
+// Texture coordinates of a hit that hit_hittable, hittable_hit_record or
+// instance_hit_record filled in, all zero for other records
+void hit_record_uv(const HitRecord *rec, SurfaceUv *uv);
 
 bool hit_hittable(const Hittable *h, Ray r, double t_min, double t_max, HitRecord *rec);
 
-bool scatter_ray(const Material *material, Ray r_in, HitRecord *rec, Color *attenuation, Ray *scattered);
+bool scatter_ray(const Material *material, Ray r_in, HitRecord *rec, Color *attenuation, Ray *scattered, Sampler *sampler);
+
+// BSDF times cosine for light arriving at rec from unit direction wi, and in
+// *pdf the density (per solid angle) scatter_ray samples wi with. Only
+// lambertian surfaces can be evaluated; the others sample (near) singular
+// directions and report 0 for both.
+Color material_eval(const Material *material, const HitRecord *rec, Vec3 wi, double *pdf);
 
 #endif // SCENE_H
\ No newline at end of file
@@ -0,0 +1,83 @@
+#include "instance.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+bool instance_group_build(InstanceGroup *group, const Material *materials, uint32_t material_count)
+{
+    bvh_free(&group->bvh);
+    group->bounds = aabb_empty();
+    if (group->count == 0)
+    {
+        fprintf(stderr, "instance_group_build: the group is empty\n");
+        return false;
+    }
+
+    uint32_t *indices = malloc(sizeof(uint32_t) * (group->count + 1));
+    if (!indices)
+        return false;
+    for (uint32_t i = 0; i < group->count; i++)
+    {
+        const Hittable *h = &group->hittables[i];
+        Aabb bounds;
+        const char *problem = NULL;
+        if (h->type == HITTABLE_INSTANCE)
+            problem = "is an instance, groups cannot nest";
+        else if (h->type == HITTABLE_PAGED_MESH)
+            problem = "is a paged mesh, groups hold resident geometry only";
+        else if (!hittable_bounds(h, &bounds))
+            problem = "is unbounded";
+        else if (h->material >= material_count)
+            problem = "uses an undefined material";
+        else if (materials[h->material].type == MATERIAL_EMISSIVE)
+            problem = "is emissive, lights cannot be instanced";
+        if (problem)
+        {
+            fprintf(stderr, "instance_group_build: hittable %u of the group %s\n", i, problem);
+            free(indices);
+            return false;
+        }
+        group->bounds = aabb_union(group->bounds, bounds);
+        indices[i] = i;
+    }
+
+    bool ok = bvh_build(&group->bvh, group->hittables, indices, group->count);
+    free(indices);
+    return ok;
+}
+
+void instance_group_free(InstanceGroup *group)
+{
+    bvh_free(&group->bvh);
+}
+
+bool instance_init(Instance *instance, const InstanceGroup *group, Transform to_world)
+{
+    instance->group = group;
+    instance->to_world = to_world;
+    return transform_inverse(&to_world, &instance->to_object);
+}
+
+Aabb instance_bounds(const Instance *instance)
+{
+    return transform_bounds(&instance->to_world, instance->group->bounds);
+}
+
+bool instance_intersect(const Instance *instance, Ray r, double t_min, double *t_max, BvhHit *hit)
+{
+    return bvh_intersect(&instance->group->bvh, 0, transform_ray(&instance->to_object, r), t_min, t_max, hit);
+}
+
+void instance_hit_record(const Instance *instance, MaterialId material, BvhHit hit, Ray r, double t, HitRecord *rec)
+{
+    Ray object_ray = transform_ray(&instance->to_object, r);
+    hittable_hit_record(&instance->group->hittables[hit.hittable], hit.prim, object_ray, t, rec);
+
+    // The object space normal faces against the object space ray, and the
+    // inverse transpose keeps the sign of that dot product
+    rec->p = ray_at(r, t);
+    rec->normal = vec3_unit(transform_normal(&instance->to_object, rec->normal));
+    rec->instance = instance;
+    if (material != INSTANCE_KEEP_MATERIALS)
+        rec->material = material;
+}
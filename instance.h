@@ -0,0 +1,65 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "bvh.h"
+#include "math/transform.h"
+
+// Instance material that keeps the materials of the group's hittables
+#define INSTANCE_KEEP_MATERIALS UINT32_MAX
+
+// -----------------------------------------------------------------------------
+// Object groups and instances
+// -----------------------------------------------------------------------------
+// A group is a set of spheres, triangles and meshes with its own BVH, built
+// once in the group's object space. An instance is a HITTABLE_INSTANCE
+// hittable that places a group in the world with an affine transform; any
+// number of instances share the group's geometry and BVH, so a thousand
+// copies of an asset cost a thousand transforms, not a thousand copies.
+//
+// The scene BVH holds the instances as leaf primitives (the top level). A
+// ray that reaches one is moved into object space and traced through the
+// group's BVH (the bottom level); the transform keeps the ray parameter t,
+// so hit distances compare directly with the rest of the scene. Hit records
+// are filled in object space and carried back: the point and the normal,
+// which uses the inverse transpose.
+//
+// Groups may not hold planes (unbounded), other instances (two levels only)
+// or emissive materials (lights are sampled in world space).
+typedef struct
+{
+    Hittable *hittables; // In the scene arena
+    uint32_t count;
+    uint32_t capacity;
+    Bvh bvh;     // Built by instance_group_build
+    Aabb bounds; // Object space
+} InstanceGroup;
+
+struct t_instance
+{
+    const InstanceGroup *group;
+    Transform to_world;  // Object to world space
+    Transform to_object; // Its inverse
+};
+
+// Builds the group's BVH once all its hittables are added. Prints the reason
+// and returns false for hittables a group cannot hold or on allocation
+// failure.
+bool instance_group_build(InstanceGroup *group, const Material *materials, uint32_t material_count);
+
+void instance_group_free(InstanceGroup *group);
+
+// Sets up an instance of group, returns false if to_world is singular
+bool instance_init(Instance *instance, const InstanceGroup *group, Transform to_world);
+
+// World space bounds of a built group's instance
+Aabb instance_bounds(const Instance *instance);
+
+// Closest hit of r in the instance's group, reported like bvh_intersect
+// with hit->hittable and hit->prim indexing the group's hittables
+bool instance_intersect(const Instance *instance, Ray r, double t_min, double *t_max, BvhHit *hit);
+
+// Fills rec for the hit instance_intersect reported. material replaces the
+// group's materials unless it is INSTANCE_KEEP_MATERIALS.
+void instance_hit_record(const Instance *instance, MaterialId material, BvhHit hit, Ray r, double t, HitRecord *rec);
+
+#endif // INSTANCE_H
@@ -1,51 +1,640 @@
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include "math/vec3.h"
 #include "math/ray.h"
 #include "hittable.h" // Include our new struct definitions
 #include <time.h>
 #include "scene.h"
+#include "render.h"
+#include "demo_scene.h"
+#include "scene_file.h"
+#include "progressive.h"
+#include "distributed.h"
+#include "denoise.h"
+#include "animation.h"
 
 #define WIDTH 1920
 #define HEIGHT 1080
+#define WATCH_POLL_SECONDS 0.05 // How often -L looks at the scene file
 
-Hittable world[] = {
-    {HITTABLE_SPHERE, .object.sphere = {{0, 0, -1}, 0.5}, {.color = {0.1, 0.2, 0.5}, .type = MATERIAL_LAMBERTIAN}}, // Center sphere
-    {HITTABLE_SPHERE, .object.sphere = {{1, 0, -1.5}, 0.5}, {
-                                                                .color = {0.3, 0.3, 0.7},
-                                                                .type = MATERIAL_DIELECTRIC,
-                                                                .properties.ref_idx = 0.9,
-                                                            }}, // Right sphere
-    {HITTABLE_SPHERE, .object.sphere = {{-1, 0, -1.5}, 0.5}, {
-                                                                 .color = {0.3, 0.7, 0.3},
-                                                                 .type = MATERIAL_METAL,
-                                                                 .properties.fuzz = 0.0,
-                                                             }}, // Left sphere
-    {HITTABLE_PLANE, .object.plane = {{0, -0.5, 0}, {0, 1, 0}}, {
-                                                                    .color = {0.8, 0.6, 0.2},
-                                                                    .type = MATERIAL_LAMBERTIAN,
-                                                                }}, // Ground Plane,
-};
-
-#define NUM_HITTABLES (sizeof(world) / sizeof(world[0]))
-
-int main()
-{
-    Scene scene = {0};
-    scene.hittable_count = NUM_HITTABLES;
-    for (size_t i = 0; i < NUM_HITTABLES; i++)
-    {
-        scene.world[i] = world[i];
-    }
-
-    Camera camera = camera_create(
-        vec3_create(0, 0.0, 0.5),
-        vec3_create(-2.0, -1.725, -0.5),
-        vec3_create(4.0, 0, 0),
-        vec3_create(0, 2.25, 0),
-        WIDTH / 3,
-        HEIGHT / 3, 100); // 100 samples per pixel
-
-    render_scene(stdout, &scene, &camera, 10);
-    return 0;
-}
\ No newline at end of file
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-t threads] [-S] [-w] [-s spp] [-q sampler] [-R bounces] [-a threshold[,min,max]] [-M file]\n"
+                    "       [-p spp] [-P file] [-c file] [-r] [-i seconds] [-X MB] [-G MB] [-x x0,y0,x1,y1] [-b file] [-l] [-L]\n"
+                    "       [-d] [-A prefix] [-F frames] [-D address [-W count] [-T seconds]] [-C address] [-o file] [-f format]\n"
+                    "       [-m mesh] [-n] [-J file] [scene]\n",
+            program);
+    fprintf(stderr, "  -t threads  number of render threads (default: one per core)\n");
+    fprintf(stderr, "  -S          trace primary rays one at a time instead of in packets\n");
+    fprintf(stderr, "  -w          render with the wavefront pipeline\n");
+    fprintf(stderr, "  -s spp      samples per pixel (default: from the scene, else 100)\n");
+    fprintf(stderr, "  -q sampler  sobol, stratified, bluenoise or random (default sobol)\n");
+    fprintf(stderr, "  -R bounces  start Russian roulette after this many bounces, 0 never (default %d)\n", RENDER_DEFAULT_ROULETTE_DEPTH);
+    fprintf(stderr, "  -a ...      adaptive sampling, stop a pixel once its display error is below\n");
+    fprintf(stderr, "              threshold (e.g. 0.01), min/max spp default to 32 and 4x samples\n");
+    fprintf(stderr, "  -M file     write the samples taken per pixel as a grey image, white = max\n");
+    fprintf(stderr, "  -p spp      render progressively in passes of spp samples (default %d)\n", PROGRESSIVE_DEFAULT_PASS_SPP);
+    fprintf(stderr, "  -P file     progressive, write a preview image after every pass\n");
+    fprintf(stderr, "  -c file     progressive, checkpoint the accumulated samples to file\n");
+    fprintf(stderr, "  -r          resume from the -c checkpoint, or extend it to more samples\n");
+    fprintf(stderr, "  -i seconds  time between checkpoints (default %g)\n", PROGRESSIVE_DEFAULT_CHECKPOINT_INTERVAL);
+    fprintf(stderr, "  -X MB       texture tile cache budget (default %d)\n", TEXTURE_DEFAULT_CACHE_MB);
+    fprintf(stderr, "  -G MB       paged geometry cluster cache budget (default %d)\n", PAGED_DEFAULT_CACHE_MB);
+    fprintf(stderr, "  -x x0,y0,x1,y1  render only the pixels [x0, x1) x [y0, y1), rows from the top,\n");
+    fprintf(stderr, "              and write them as an image of their own\n");
+    fprintf(stderr, "  -b file     with -x, write the image in file with the region replaced instead\n");
+    fprintf(stderr, "  -l          progressive, coarse to fine: start at 1/%d resolution and 1 spp\n", PROGRESSIVE_DEFAULT_COARSE_STEP);
+    fprintf(stderr, "  -L          -l, then render the scene file again whenever it is saved, until\n");
+    fprintf(stderr, "              interrupted (needs a scene and -P)\n");
+    fprintf(stderr, "  -d          denoise the image with its albedo, normal and depth buffers\n");
+    fprintf(stderr, "  -A prefix   write the buffers as prefix_albedo.pfm, _normal, _depth and _variance\n");
+    fprintf(stderr, "  -F frames   render an animated scene's frames first-last, first- for the rest\n");
+    fprintf(stderr, "              or one frame, to -o with \"#\" replaced by the frame number\n");
+    fprintf(stderr, "  -D address  coordinate a distributed render on unix:<path> or <host>:<port>\n");
+    fprintf(stderr, "  -W count    with -D, fork count worker processes on this host\n");
+    fprintf(stderr, "  -T seconds  with -D, re-issue tiles a worker holds longer than this\n");
+    fprintf(stderr, "  -C address  render tiles for the coordinator at address, then exit\n");
+    fprintf(stderr, "  -o file     write the image to file instead of stdout\n");
+    fprintf(stderr, "  -f format   p3, ppm, ppm16 or pfm (default: from -o extension, else ppm)\n");
+    fprintf(stderr, "  -m mesh     render an .obj, .ply or .stl mesh instead of the spheres\n");
+    fprintf(stderr, "  -n          do not read or write the scene cache\n");
+    fprintf(stderr, "  -J file     write the trace statistics as JSON (builds with make STATS=1)\n");
+    fprintf(stderr, "  scene       scene description file (see scene_file.h), replaces the demo scene\n");
+}
+
+// Writes the per-pixel sample counts as a grey image, scaled so max_spp is white
+static bool write_spp_map(const char *path, const uint32_t *spp_map, int width, int height, size_t max_spp)
+{
+    Framebuffer map;
+    if (!framebuffer_init(&map, width, height))
+        return false;
+    for (size_t i = 0; i < (size_t)width * (size_t)height; i++)
+    {
+        double v = (double)spp_map[i] / (double)max_spp;
+        // The writers apply gamma 2, square it so grey levels stay linear in spp
+        map.pixels[i] = vec3_create(v * v, v * v, v * v);
+    }
+    bool ok = framebuffer_write_file(path, &map, image_format_from_path(path));
+    framebuffer_free(&map);
+    return ok;
+}
+
+// Look-dev loop behind -L: renders coarse to fine, then waits for the scene
+// file to be saved again and starts over with the new version. A save during
+// a render cancels it within a tile. Returns when a render is
+// interrupted by a signal or fails for another reason than a changed file.
+static bool watch_scene(Scene *scene, Animation *animation, const char *scene_path, FileStamp stamp, Camera camera,
+                        RenderSettings settings, ProgressiveSettings progressive, long samples_per_pixel,
+                        const Framebuffer *base, bool use_cache, int thread_count)
+{
+    bool loaded = true;
+    for (;;)
+    {
+        if (loaded)
+        {
+            Framebuffer fb;
+            progressive.watch_path = scene_path;
+            progressive.watch_stamp = stamp;
+            bool rendered = render_progressive(&fb, scene, &camera, &settings, &progressive);
+            if (rendered)
+                framebuffer_free(&fb);
+            FileStamp now;
+            file_stamp(scene_path, &now);
+            if (file_stamp_equal(&now, &stamp))
+            {
+                if (!rendered)
+                    return false;
+                fprintf(stderr, "Waiting for %s to change\n", scene_path);
+            }
+        }
+
+        struct timespec poll = {0, (long)(WATCH_POLL_SECONDS * 1e9)};
+        FileStamp now;
+        file_stamp(scene_path, &now);
+        while (file_stamp_equal(&now, &stamp))
+        {
+            nanosleep(&poll, NULL);
+            file_stamp(scene_path, &now);
+        }
+        stamp = now;
+
+        struct timespec start, stop;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        SceneFileSettings file;
+        animation_free(animation);
+        scene_free(scene);
+        scene_init(scene);
+        animation_init(animation);
+        loaded = scene_file_load(scene, &file, animation, scene_path, use_cache, thread_count);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        if (!loaded)
+        {
+            fprintf(stderr, "Could not load %s, waiting for the next save\n", scene_path);
+            continue;
+        }
+        camera = file.camera;
+        if (samples_per_pixel > 0)
+            camera.samples_per_pixel = (size_t)samples_per_pixel;
+        settings.max_depth = file.max_depth;
+        RenderRegion region = settings.region;
+        if (!render_region_clip(&region, camera.image_width, camera.image_height) ||
+            (base && (base->width != camera.image_width || base->height != camera.image_height)))
+        {
+            fprintf(stderr, "The -x region or -b image no longer fits the %d x %d image, waiting for the next save\n",
+                    camera.image_width, camera.image_height);
+            loaded = false;
+            continue;
+        }
+        fprintf(stderr, "Reloaded %s in %.3f s\n", scene_path,
+                (double)(stop.tv_sec - start.tv_sec) + (double)(stop.tv_nsec - start.tv_nsec) * 1e-9);
+    }
+}
+
+// Writes the AOVs as <prefix>_albedo.pfm, _normal.pfm, _depth.pfm and
+// _variance.pfm, the last two grey
+static bool write_aovs(const char *prefix, const RenderAovs *aovs)
+{
+    char path[4096];
+    Framebuffer grey;
+    if (!framebuffer_init(&grey, aovs->albedo.width, aovs->albedo.height))
+        return false;
+    bool ok = snprintf(path, sizeof(path), "%s_albedo.pfm", prefix) < (int)sizeof(path) &&
+              framebuffer_write_file(path, &aovs->albedo, IMAGE_FORMAT_PFM);
+    ok = ok && snprintf(path, sizeof(path), "%s_normal.pfm", prefix) < (int)sizeof(path) &&
+         framebuffer_write_file(path, &aovs->normal, IMAGE_FORMAT_PFM);
+    size_t count = (size_t)grey.width * (size_t)grey.height;
+    for (size_t i = 0; i < count; i++)
+        grey.pixels[i] = vec3_create(aovs->depth[i], aovs->depth[i], aovs->depth[i]);
+    ok = ok && snprintf(path, sizeof(path), "%s_depth.pfm", prefix) < (int)sizeof(path) &&
+         framebuffer_write_file(path, &grey, IMAGE_FORMAT_PFM);
+    for (size_t i = 0; i < count; i++)
+        grey.pixels[i] = vec3_create(aovs->variance[i], aovs->variance[i], aovs->variance[i]);
+    ok = ok && snprintf(path, sizeof(path), "%s_variance.pfm", prefix) < (int)sizeof(path) &&
+         framebuffer_write_file(path, &grey, IMAGE_FORMAT_PFM);
+    framebuffer_free(&grey);
+    return ok;
+}
+
+// What the command line asks for besides the render, progressive and
+// distributed settings
+typedef struct
+{
+    const char *output_path;
+    const char *format_name;
+    const char *mesh_path;
+    const char *scene_path;
+    const char *spp_map_path;
+    const char *stats_path;
+    const char *aov_prefix;
+    const char *frames;
+    const char *base_path;
+    const char *worker_address;
+    long samples_per_pixel; // 0 keeps the scene's
+    bool denoise;
+    bool crop;
+    bool watch;
+    bool use_cache;
+} Options;
+
+// Parses the command line into opt and the settings, which must hold their
+// defaults. Returns false when an argument is unknown or malformed.
+static bool parse_options(int argc, char **argv, Options *opt, RenderSettings *settings,
+                          ProgressiveSettings *progressive, DistributedSettings *distributed)
+{
+    *opt = (Options){.use_cache = true};
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            settings->thread_count = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-S") == 0)
+        {
+            settings->packets = false;
+        }
+        else if (strcmp(argv[i], "-w") == 0)
+        {
+            settings->wavefront = true;
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            opt->samples_per_pixel = atol(argv[++i]);
+            if (opt->samples_per_pixel <= 0)
+                return false;
+        }
+        else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+        {
+            if (!sampler_parse(argv[++i], &settings->sampler))
+                return false;
+        }
+        else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc)
+        {
+            settings->roulette_depth = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+        {
+            settings->adaptive.enabled = true;
+            settings->adaptive.min_spp = 32;
+            settings->adaptive.max_spp = 0; // Resolved once the camera is known
+            if (sscanf(argv[++i], "%lf,%zu,%zu", &settings->adaptive.threshold, &settings->adaptive.min_spp,
+                       &settings->adaptive.max_spp) < 1 ||
+                settings->adaptive.threshold <= 0.0)
+                return false;
+        }
+        else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc)
+        {
+            opt->spp_map_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            progressive->pass_spp = (size_t)atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc)
+        {
+            progressive->preview_path = argv[++i];
+            progressive->preview_format = image_format_from_path(progressive->preview_path);
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            progressive->checkpoint_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-r") == 0)
+        {
+            progressive->resume = true;
+        }
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+        {
+            progressive->checkpoint_interval = atof(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "-X") == 0 || strcmp(argv[i], "-G") == 0) && i + 1 < argc)
+        {
+            bool textures = argv[i][1] == 'X';
+            long megabytes = atol(argv[++i]);
+            if (megabytes <= 0)
+                return false;
+            if (textures)
+                settings->texture_cache_bytes = (size_t)megabytes << 20;
+            else
+                settings->geometry_cache_bytes = (size_t)megabytes << 20;
+        }
+        else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+        {
+            RenderRegion *r = &settings->region;
+            if (sscanf(argv[++i], "%d,%d,%d,%d", &r->x0, &r->y0, &r->x1, &r->y1) != 4 || r->x0 < 0 || r->y0 < 0 ||
+                r->x1 <= r->x0 || r->y1 <= r->y0)
+                return false;
+            opt->crop = true;
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+        {
+            opt->base_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-l") == 0)
+        {
+            progressive->coarse_to_fine = true;
+        }
+        else if (strcmp(argv[i], "-L") == 0)
+        {
+            progressive->coarse_to_fine = true;
+            opt->watch = true;
+        }
+        else if (strcmp(argv[i], "-d") == 0)
+        {
+            opt->denoise = true;
+        }
+        else if (strcmp(argv[i], "-A") == 0 && i + 1 < argc)
+        {
+            opt->aov_prefix = argv[++i];
+        }
+        else if (strcmp(argv[i], "-F") == 0 && i + 1 < argc)
+        {
+            opt->frames = argv[++i];
+        }
+        else if (strcmp(argv[i], "-D") == 0 && i + 1 < argc)
+        {
+            distributed->address = argv[++i];
+        }
+        else if (strcmp(argv[i], "-W") == 0 && i + 1 < argc)
+        {
+            distributed->local_workers = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc)
+        {
+            distributed->tile_timeout = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc)
+        {
+            opt->worker_address = argv[++i];
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            opt->output_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            opt->format_name = argv[++i];
+        }
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+        {
+            opt->mesh_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-n") == 0)
+        {
+            opt->use_cache = false;
+        }
+        else if (strcmp(argv[i], "-J") == 0 && i + 1 < argc)
+        {
+            opt->stats_path = argv[++i];
+        }
+        else if (argv[i][0] != '-' && !opt->scene_path)
+        {
+            opt->scene_path = argv[i];
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool progressive_mode(const ProgressiveSettings *progressive)
+{
+    return progressive->pass_spp > 0 || progressive->preview_path || progressive->checkpoint_path ||
+           progressive->coarse_to_fine;
+}
+
+// Rejects flags that do not work together, with the reason on stderr. A new
+// flag adds its rules here.
+static bool check_options(const Options *opt, const RenderSettings *settings, const ProgressiveSettings *progressive,
+                          const DistributedSettings *distributed)
+{
+    bool progressive_render = progressive_mode(progressive);
+    bool want_aovs = opt->denoise || opt->aov_prefix;
+    const char *error = NULL;
+    if ((progressive->resume && !progressive->checkpoint_path) || (progressive_render && settings->adaptive.enabled))
+        error = "-r needs -c, and progressive rendering does not combine with -a";
+    else if (distributed->address && (progressive_render || opt->spp_map_path || opt->worker_address))
+        error = "-D does not combine with progressive rendering, -M or -C";
+    else if (want_aovs && (progressive_render || distributed->address))
+        error = "-d and -A do not combine with progressive or distributed rendering";
+    else if ((opt->base_path && !opt->crop) ||
+             (opt->crop && (distributed->address || want_aovs || opt->frames || opt->worker_address)))
+        error = "-b needs -x, and -x does not combine with distributed rendering, -d, -A, -F or -C";
+    else if (opt->watch &&
+             (!opt->scene_path || !progressive->preview_path || progressive->checkpoint_path || opt->spp_map_path))
+        error = "-L needs a scene file and -P, and does not combine with -c or -M";
+    else if (opt->frames && (progressive_render || distributed->address || want_aovs || opt->spp_map_path ||
+                             settings->adaptive.enabled))
+        error = "-F does not combine with progressive or distributed rendering, -a, -d, -A or -M";
+    if (error)
+        fprintf(stderr, "%s\n", error);
+    return error == NULL;
+}
+
+// Parses the -F range: first, first-last or first- up to last_frame
+static bool parse_frames(const char *frames, uint32_t last_frame, SequenceSettings *sequence)
+{
+    char *end;
+    unsigned long first = strtoul(frames, &end, 10), last = first;
+    bool valid = end != frames && frames[0] != '-';
+    if (valid && *end == '-')
+    {
+        char *rest = end + 1;
+        last = last_frame;
+        end = rest;
+        if (*rest)
+            last = strtoul(rest, &end, 10);
+        valid = *rest != '-' && (!*rest || end != rest);
+    }
+    valid = valid && *end == '\0' && first <= last && last < UINT32_MAX;
+    sequence->first_frame = (uint32_t)first;
+    sequence->last_frame = (uint32_t)last;
+    return valid;
+}
+
+static void print_cache_stats(const Scene *scene)
+{
+    if (scene->textures.count > 0)
+        texture_stats_print(stderr, &scene->textures);
+    if (scene->paged_geometry.count > 0)
+        paged_stats_print(stderr, &scene->paged_geometry);
+}
+
+int main(int argc, char **argv)
+{
+    RenderSettings settings = {
+        .max_depth = 10,
+        .roulette_depth = RENDER_DEFAULT_ROULETTE_DEPTH,
+        .thread_count = 0,
+        .tile_size = RENDER_DEFAULT_TILE_SIZE,
+        .packets = true,
+    };
+    ProgressiveSettings progressive = {
+        .checkpoint_interval = PROGRESSIVE_DEFAULT_CHECKPOINT_INTERVAL,
+    };
+    DistributedSettings distributed = {0};
+    Options opt;
+    if (!parse_options(argc, argv, &opt, &settings, &progressive, &distributed))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!check_options(&opt, &settings, &progressive, &distributed))
+        return 1;
+    bool want_aovs = opt.denoise || opt.aov_prefix;
+
+    // Everything below leaves through cleanup
+    bool ok = false;
+    Scene scene;
+    Animation animation;
+    Framebuffer base = {0};
+    RenderAovs aovs = {0};
+    scene_init(&scene);
+    animation_init(&animation);
+    int thread_count = settings.thread_count > 0 ? settings.thread_count : render_default_thread_count();
+    Camera camera = demo_camera(WIDTH / 3, HEIGHT / 3, 100); // 100 samples per pixel
+    ImageFormat format = opt.output_path ? image_format_from_path(opt.output_path) : IMAGE_FORMAT_PPM;
+
+    bool loaded;
+    SceneFileSettings file;
+    FileStamp scene_stamp;
+    if (opt.scene_path)
+    {
+        // Taken before loading, so a save during the load is noticed
+        file_stamp(opt.scene_path, &scene_stamp);
+        // The scene file provides the camera, sampling and output defaults,
+        // the command line overrides the output
+        loaded = scene_file_load(&scene, &file, &animation, opt.scene_path, opt.use_cache, thread_count);
+        if (loaded)
+        {
+            camera = file.camera;
+            settings.max_depth = file.max_depth;
+            if (!opt.output_path && file.output_path[0])
+            {
+                opt.output_path = file.output_path;
+                format = file.output_format;
+            }
+        }
+    }
+    else
+    {
+        loaded = opt.mesh_path ? demo_scene_mesh(&scene, opt.mesh_path, thread_count) : demo_scene_spheres(&scene);
+        loaded = loaded && scene_build(&scene);
+    }
+    if (!loaded)
+    {
+        fprintf(stderr, "Could not build the scene\n");
+        goto cleanup;
+    }
+    if (opt.mesh_path || opt.scene_path)
+        fprintf(stderr, "BVH: %u primitives, %.1f bytes per primitive\n", scene.bvh.prim_count,
+                scene.bvh.prim_count ? (double)bvh_memory(&scene.bvh) / scene.bvh.prim_count : 0.0);
+
+    if (opt.format_name && !image_format_parse(opt.format_name, &format))
+    {
+        usage(argv[0]);
+        goto cleanup;
+    }
+    if (opt.worker_address)
+    {
+        // The coordinator sends the camera and settings, only the scene is ours
+        ok = distributed_worker(opt.worker_address, &scene, &settings);
+        goto cleanup;
+    }
+    if (opt.samples_per_pixel > 0)
+        camera.samples_per_pixel = (size_t)opt.samples_per_pixel;
+    if (opt.crop && !render_region_clip(&settings.region, camera.image_width, camera.image_height))
+    {
+        fprintf(stderr, "The -x region lies outside the %d x %d image\n", camera.image_width, camera.image_height);
+        goto cleanup;
+    }
+    if (opt.crop)
+    {
+        RenderRegion r = settings.region;
+        fprintf(stderr, "Cropping to [%d, %d) x [%d, %d), %.1f%% of the image\n", r.x0, r.x1, r.y0, r.y1,
+                100.0 * (r.x1 - r.x0) * (r.y1 - r.y0) / ((double)camera.image_width * camera.image_height));
+    }
+    if (opt.base_path)
+    {
+        if (!framebuffer_read_file(opt.base_path, &base) || base.width != camera.image_width ||
+            base.height != camera.image_height)
+        {
+            fprintf(stderr, "Could not read %s as a %d x %d image to merge into\n", opt.base_path, camera.image_width,
+                    camera.image_height);
+            goto cleanup;
+        }
+        progressive.merge_base = &base;
+    }
+    if (opt.watch)
+    {
+        ok = watch_scene(&scene, &animation, opt.scene_path, scene_stamp, camera, settings, progressive,
+                         opt.samples_per_pixel, opt.base_path ? &base : NULL, opt.use_cache, thread_count);
+        goto cleanup;
+    }
+    if (opt.frames)
+    {
+        SequenceSettings sequence = {.output_pattern = opt.output_path, .format = format};
+        if (!parse_frames(opt.frames, animation.frame_count - 1U, &sequence) || !opt.output_path)
+        {
+            fprintf(stderr, "-F needs a frame range and an output path\n");
+            goto cleanup;
+        }
+        ok = render_sequence(&scene, &camera, &animation, &settings, &sequence);
+        if (stats_enabled())
+            stats_print(stderr, &scene.trace_stats);
+        print_cache_stats(&scene);
+        goto cleanup;
+    }
+    if (settings.adaptive.enabled && settings.adaptive.max_spp == 0)
+        settings.adaptive.max_spp = 4 * camera.samples_per_pixel;
+    if (opt.spp_map_path)
+    {
+        settings.spp_map = calloc((size_t)camera.image_width * (size_t)camera.image_height, sizeof(uint32_t));
+        if (!settings.spp_map)
+        {
+            fprintf(stderr, "Could not allocate the sample count map\n");
+            goto cleanup;
+        }
+    }
+    if (want_aovs)
+    {
+        if (!render_aovs_init(&aovs, camera.image_width, camera.image_height))
+        {
+            fprintf(stderr, "Could not allocate the AOV buffers\n");
+            goto cleanup;
+        }
+        settings.aovs = &aovs;
+    }
+
+    Framebuffer fb;
+    if (distributed.address)
+        ok = render_distributed(&fb, &scene, &camera, &settings, &distributed);
+    else if (progressive_mode(&progressive))
+        ok = render_progressive(&fb, &scene, &camera, &settings, &progressive);
+    else
+        ok = render_scene(&fb, &scene, &camera, &settings);
+    if (stats_enabled())
+        stats_print(stderr, &scene.trace_stats);
+    print_cache_stats(&scene);
+    if (opt.stats_path)
+    {
+        FILE *stats_file = fopen(opt.stats_path, "w");
+        if (stats_file)
+        {
+            stats_write_json(stats_file, &scene.trace_stats);
+            fclose(stats_file);
+        }
+        else
+            fprintf(stderr, "Could not write the statistics to %s\n", opt.stats_path);
+        if (!stats_enabled())
+            fprintf(stderr, "This build does not collect statistics, rebuild with make STATS=1\n");
+    }
+    if (ok && opt.aov_prefix && !write_aovs(opt.aov_prefix, &aovs))
+        fprintf(stderr, "Could not write the AOVs\n");
+    if (ok && opt.denoise)
+    {
+        struct timespec start, stop;
+        DenoiseSettings denoise_settings = {.thread_count = settings.thread_count};
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ok = denoise(&fb, &aovs, &denoise_settings);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        fprintf(stderr, "Denoised in %.3f s\n",
+                (double)(stop.tv_sec - start.tv_sec) + (double)(stop.tv_nsec - start.tv_nsec) * 1e-9);
+    }
+    if (ok && opt.crop)
+    {
+        // The region alone, or pasted into the -b image
+        Framebuffer region;
+        ok = render_region_image(&region, &fb, settings.region, opt.base_path ? &base : NULL);
+        framebuffer_free(&fb);
+        fb = region;
+        if (!ok)
+            fprintf(stderr, "Could not allocate the cropped image\n");
+    }
+    if (ok)
+    {
+        ok = opt.output_path ? framebuffer_write_file(opt.output_path, &fb, format)
+                             : framebuffer_write(stdout, &fb, format);
+        if (!ok)
+            fprintf(stderr, "Could not write the image\n");
+        framebuffer_free(&fb);
+    }
+    if (ok && opt.spp_map_path)
+    {
+        size_t max_spp = settings.adaptive.enabled ? settings.adaptive.max_spp : camera.samples_per_pixel;
+        ok = write_spp_map(opt.spp_map_path, settings.spp_map, camera.image_width, camera.image_height, max_spp);
+        if (!ok)
+            fprintf(stderr, "Could not write the sample count map\n");
+    }
+
+cleanup:
+    render_aovs_free(&aovs);
+    framebuffer_free(&base);
+    free(settings.spp_map);
+    animation_free(&animation);
+    scene_free(&scene);
+    return ok ? 0 : 1;
+}
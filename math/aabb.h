@@ -0,0 +1,60 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "vec3.h"
+#include <math.h>
+#include <stdbool.h>
+
+// -----------------------------------------------------------------------------
+// Axis-aligned bounding box
+// -----------------------------------------------------------------------------
+typedef struct
+{
+    Point3 min;
+    Point3 max;
+} Aabb;
+
+// Returns a box that contains nothing, the identity for aabb_union
+static inline Aabb aabb_empty(void)
+{
+    Aabb b = {vec3_create(INFINITY, INFINITY, INFINITY), vec3_create(-INFINITY, -INFINITY, -INFINITY)};
+    return b;
+}
+
+static inline Aabb aabb_union(Aabb a, Aabb b)
+{
+    Aabb r = {
+        vec3_create(fmin(a.min.x, b.min.x), fmin(a.min.y, b.min.y), fmin(a.min.z, b.min.z)),
+        vec3_create(fmax(a.max.x, b.max.x), fmax(a.max.y, b.max.y), fmax(a.max.z, b.max.z))};
+    return r;
+}
+
+static inline Aabb aabb_grow(Aabb a, Point3 p)
+{
+    Aabb r = {
+        vec3_create(fmin(a.min.x, p.x), fmin(a.min.y, p.y), fmin(a.min.z, p.z)),
+        vec3_create(fmax(a.max.x, p.x), fmax(a.max.y, p.y), fmax(a.max.z, p.z))};
+    return r;
+}
+
+static inline Point3 aabb_centroid(Aabb a)
+{
+    return vec3_scale(vec3_add(a.min, a.max), 0.5);
+}
+
+// Surface area, the cost metric of the SAH. Empty boxes have zero area.
+static inline double aabb_surface_area(Aabb a)
+{
+    Vec3 d = vec3_sub(a.max, a.min);
+    if (d.x < 0 || d.y < 0 || d.z < 0)
+        return 0.0;
+    return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// Component of v along axis (0 = x, 1 = y, 2 = z)
+static inline double vec3_axis(Vec3 v, int axis)
+{
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+#endif // AABB_H
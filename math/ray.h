@@ -9,10 +9,17 @@ typedef struct
     Vec3 direction;
 } Ray;
 
-Ray ray_create(Point3 origin, Vec3 direction);
+static inline Ray ray_create(Point3 origin, Vec3 direction)
+{
+    Ray r = {origin, direction};
+    return r;
+}
 
 // Returns the point at parameter t along the ray.
 // Formula: P(t) = origin + (direction * t)
-Point3 ray_at(Ray r, double t);
+static inline Point3 ray_at(Ray r, real t)
+{
+    return vec3_add(r.origin, vec3_scale(r.direction, t));
+}
 
 #endif // RAY_H
\ No newline at end of file
@@ -0,0 +1,48 @@
+#include "rng.h"
+
+void rng_init(Rng *rng, uint64_t initstate, uint64_t stream)
+{
+    rng->state = 0;
+    rng->inc = (stream << 1u) | 1u;
+    rng_next_u32(rng);
+    rng->state += initstate;
+    rng_next_u32(rng);
+}
+
+// SplitMix64 finalizer, turns a small frame number into a well mixed state
+static uint64_t mix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+void rng_seed(Rng *rng, uint32_t pixel_index, uint32_t sample, uint32_t frame)
+{
+    rng_init(rng, mix64(frame), pixel_index);
+    rng_advance(rng, (uint64_t)sample * RNG_SAMPLE_STRIDE);
+}
+
+// Brown, "Random Number Generation with Arbitrary Stride": composes the LCG
+// step with itself by repeated squaring.
+void rng_advance(Rng *rng, uint64_t delta)
+{
+    uint64_t cur_mult = RNG_MULTIPLIER;
+    uint64_t cur_plus = rng->inc;
+    uint64_t acc_mult = 1u;
+    uint64_t acc_plus = 0u;
+
+    while (delta > 0)
+    {
+        if (delta & 1)
+        {
+            acc_mult *= cur_mult;
+            acc_plus = acc_plus * cur_mult + cur_plus;
+        }
+        cur_plus = (cur_mult + 1) * cur_plus;
+        cur_mult *= cur_mult;
+        delta >>= 1;
+    }
+    rng->state = acc_mult * rng->state + acc_plus;
+}
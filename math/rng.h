@@ -0,0 +1,56 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// PCG32 random number generator (O'Neill, pcg-random.org)
+// -----------------------------------------------------------------------------
+// 16 bytes of state, no locks and no globals: every sample owns its own Rng
+// and passes it down explicitly, which keeps renders reproducible and makes
+// them independent of thread scheduling.
+typedef struct
+{
+    uint64_t state;
+    uint64_t inc; // Stream selector, always odd
+} Rng;
+
+#define RNG_MULTIPLIER 6364136223846793005ULL
+
+// Number of draws reserved for one sample inside a pixel's stream. Samples
+// start at multiples of this offset, so sample N can be reached directly
+// without replaying samples 0..N-1.
+#define RNG_SAMPLE_STRIDE (1ULL << 20)
+
+// Seeds rng with an explicit initial state and stream
+void rng_init(Rng *rng, uint64_t initstate, uint64_t stream);
+
+// Seeds rng for one camera sample: each pixel gets its own stream, each
+// frame its own starting point and each sample its own window of the stream.
+void rng_seed(Rng *rng, uint32_t pixel_index, uint32_t sample, uint32_t frame);
+
+// Jumps the generator delta draws ahead in O(log delta) steps
+void rng_advance(Rng *rng, uint64_t delta);
+
+static inline uint32_t rng_next_u32(Rng *rng)
+{
+    uint64_t old = rng->state;
+    rng->state = old * RNG_MULTIPLIER + rng->inc;
+    uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+    uint32_t rot = (uint32_t)(old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+// Returns a random real in [0,1)
+static inline double random_double(Rng *rng)
+{
+    return rng_next_u32(rng) * (1.0 / 4294967296.0);
+}
+
+// Returns a random real in [min,max)
+static inline double random_double_range(Rng *rng, double min, double max)
+{
+    return min + (max - min) * random_double(rng);
+}
+
+#endif // RNG_H
@@ -0,0 +1,432 @@
+#include "sampler.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#define BLUE_NOISE_SIZE 64 // Edge of the toroidal mask, a power of two
+#define BLUE_NOISE_SIGMA 1.5
+#define BLUE_NOISE_INITIAL_FRACTION 10 // One in this many pixels set in the initial pattern
+
+static const char *const sampler_names[SAMPLER_TYPE_COUNT] = {"sobol", "stratified", "bluenoise", "random"};
+
+// -----------------------------------------------------------------------------
+// Hashing
+// -----------------------------------------------------------------------------
+
+// Wellons' lowbias32 integer hash
+static uint32_t hash_u32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t hash_combine(uint32_t seed, uint32_t value)
+{
+    return hash_u32(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+static double u32_to_unit(uint32_t x)
+{
+    return x * (1.0 / 4294967296.0);
+}
+
+// -----------------------------------------------------------------------------
+// Owen-scrambled Sobol (Burley, "Practical Hash-based Owen Scrambling", 2020)
+// -----------------------------------------------------------------------------
+// Only the first two Sobol dimensions are used. Every dimension pair the
+// renderer asks for is that 2D sequence, with the sample index shuffled and
+// both coordinates Owen-scrambled under seeds of its own, which keeps the
+// pairs independent of each other while each stays a (0,2)-sequence.
+
+static uint32_t reverse_bits(uint32_t x)
+{
+    x = __builtin_bswap32(x);
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    return ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+}
+
+// Generator matrix of Sobol dimension 1 applied a byte at a time:
+// sobol_1_table[k][b] is the contribution of byte k of the index being b,
+// bit-reversed as the Owen scramble wants it
+static uint32_t sobol_1_table[4][256];
+static pthread_once_t sobol_once = PTHREAD_ONCE_INIT;
+
+static void build_sobol_tables(void)
+{
+    uint32_t direction[32];
+    direction[0] = 1u << 31;
+    for (int bit = 1; bit < 32; bit++)
+        direction[bit] = direction[bit - 1] ^ (direction[bit - 1] >> 1);
+    for (int k = 0; k < 4; k++)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            uint32_t v = 0;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                if (b & (1 << bit))
+                    v ^= direction[8 * k + bit];
+            }
+            sobol_1_table[k][b] = reverse_bits(v);
+        }
+    }
+}
+
+// Hash in which every output bit depends only on the same and lower input bits
+static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// Owen scramble: flips every bit depending on the bits above it. The index
+// shuffle is the same operation on the sample index, which moves the first
+// 2^k samples to another aligned block of 2^k, still a (0,k,2)-net.
+static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// The Sobol values below come out Owen-scrambled. Dimension 0 is the van der
+// Corput sequence, the bit-reversed index, so scrambling it needs only one
+// reversal; dimension 1 is looked up already reversed.
+static uint32_t scrambled_sobol_0(uint32_t index, uint32_t seed)
+{
+    return reverse_bits(laine_karras_permutation(index, seed));
+}
+
+static uint32_t scrambled_sobol_1(uint32_t index, uint32_t seed)
+{
+    uint32_t reversed = sobol_1_table[0][index & 0xff] ^ sobol_1_table[1][(index >> 8) & 0xff] ^
+                        sobol_1_table[2][(index >> 16) & 0xff] ^ sobol_1_table[3][index >> 24];
+    return reverse_bits(laine_karras_permutation(reversed, seed));
+}
+
+static void sobol_2d(uint32_t index, uint32_t seed, uint32_t *x, uint32_t *y)
+{
+    index = nested_uniform_scramble(index, seed);
+    *x = scrambled_sobol_0(index, hash_combine(seed, 1));
+    *y = scrambled_sobol_1(index, hash_combine(seed, 2));
+}
+
+static uint32_t sobol_1d(uint32_t index, uint32_t seed)
+{
+    return scrambled_sobol_0(nested_uniform_scramble(index, seed), hash_combine(seed, 1));
+}
+
+// -----------------------------------------------------------------------------
+// Correlated multi-jittered sampling (Kensler, Pixar tech memo 13-01)
+// -----------------------------------------------------------------------------
+// The samples of a pixel fall into an m x n grid of strata, and their x and y
+// projections into count strata each. Sample numbers past the planned count
+// start a new independently permuted round.
+
+// Pseudo-random permutation of i in [0, length), cycle-walking a bijection
+// of the next power of two
+static uint32_t permute(uint32_t i, uint32_t length, uint32_t p)
+{
+    uint32_t w = length - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do
+    {
+        i ^= p;
+        i *= 0xe170893du;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3fu;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69u;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= length);
+    return (i + p) % length;
+}
+
+// Jitter inside a stratum
+static double jitter(uint32_t i, uint32_t p)
+{
+    i ^= p;
+    i ^= i >> 17;
+    i ^= i >> 10;
+    i *= 0xb36534e5u;
+    i ^= i >> 12;
+    i ^= i >> 21;
+    i *= 0x93fc4795u;
+    i ^= 0xdf6e307fu;
+    i ^= i >> 17;
+    i *= 1 | p >> 18;
+    return u32_to_unit(i);
+}
+
+// Splits sample number index into its round and its place in the round, and
+// returns the seed of that round
+static uint32_t stratified_round(const Sampler *sampler, uint32_t dimension, uint32_t *index)
+{
+    uint32_t count = sampler->count;
+    uint32_t round = *index / count;
+    *index %= count;
+    return hash_combine(hash_combine(sampler->seed, dimension), round);
+}
+
+static void stratified_2d(const Sampler *sampler, uint32_t dimension, double *u, double *v)
+{
+    uint32_t index = sampler->index;
+    uint32_t p = stratified_round(sampler, dimension, &index);
+    uint32_t count = sampler->count;
+    uint32_t m = (uint32_t)sqrt((double)count);
+    uint32_t n = (count + m - 1) / m;
+
+    uint32_t s = permute(index, count, p * 0x51633e2du);
+    uint32_t sx = permute(s % m, m, p * 0xa511e9b3u);
+    uint32_t sy = permute(s / m, n, p * 0x63d83595u);
+    double jx = jitter(s, p * 0xa399d265u);
+    double jy = jitter(s, p * 0x711ad6a5u);
+    *u = (s % m + (sy + jx) / n) / m;
+    *v = (s / m + (sx + jy) / m) / n;
+}
+
+static double stratified_1d(const Sampler *sampler, uint32_t dimension)
+{
+    uint32_t index = sampler->index;
+    uint32_t p = stratified_round(sampler, dimension, &index);
+    uint32_t s = permute(index, sampler->count, p * 0x68bc21ebu);
+    return (s + jitter(s, p * 0x02e5be93u)) / sampler->count;
+}
+
+// -----------------------------------------------------------------------------
+// Blue-noise dithered Sobol (Georgiev and Fajardo, "Blue-noise Dithered
+// Sampling", 2016)
+// -----------------------------------------------------------------------------
+// All pixels share one Owen-scrambled Sobol sequence, shifted modulo 1 by the
+// value of a blue-noise mask at the pixel. Neighbouring pixels get offsets
+// far apart, so what error remains at low spp is spread as high-frequency
+// noise the eye (and the denoiser) averages away. Every dimension reads the
+// mask at a different toroidal offset.
+
+static uint16_t blue_noise_rank[BLUE_NOISE_SIZE * BLUE_NOISE_SIZE];
+static pthread_once_t blue_noise_once = PTHREAD_ONCE_INIT;
+
+// Pixel of the extreme energy among pixels with pattern value set: the
+// tightest cluster (highest energy) of ones or the largest void (lowest) of
+// zeros
+static int find_extreme(const float *energy, const bool *pattern, bool set, bool highest)
+{
+    int best = -1;
+    for (int i = 0; i < BLUE_NOISE_SIZE * BLUE_NOISE_SIZE; i++)
+    {
+        if (pattern[i] != set)
+            continue;
+        if (best < 0 || (highest ? energy[i] > energy[best] : energy[i] < energy[best]))
+            best = i;
+    }
+    return best;
+}
+
+static void update_energy(float *energy, const float *kernel, int pixel, float sign)
+{
+    int px = pixel % BLUE_NOISE_SIZE, py = pixel / BLUE_NOISE_SIZE;
+    for (int y = 0; y < BLUE_NOISE_SIZE; y++)
+    {
+        const float *row = &kernel[((y - py) & (BLUE_NOISE_SIZE - 1)) * BLUE_NOISE_SIZE];
+        for (int x = 0; x < BLUE_NOISE_SIZE; x++)
+            energy[y * BLUE_NOISE_SIZE + x] += sign * row[(x - px) & (BLUE_NOISE_SIZE - 1)];
+    }
+}
+
+// Ulichney's void-and-cluster method: ranks every pixel of the mask so that
+// the first k ranked pixels are evenly spread for every k
+static void build_blue_noise(void)
+{
+    enum { count = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE };
+    static float kernel[count], energy[count], initial_energy[count];
+    static bool pattern[count], initial[count];
+
+    // Gaussian energy of a pixel towards another at toroidal offset (x, y)
+    for (int y = 0; y < BLUE_NOISE_SIZE; y++)
+    {
+        for (int x = 0; x < BLUE_NOISE_SIZE; x++)
+        {
+            int dx = x < BLUE_NOISE_SIZE / 2 ? x : BLUE_NOISE_SIZE - x;
+            int dy = y < BLUE_NOISE_SIZE / 2 ? y : BLUE_NOISE_SIZE - y;
+            kernel[y * BLUE_NOISE_SIZE + x] =
+                (float)exp(-(dx * dx + dy * dy) / (2.0 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+        }
+    }
+
+    // Random initial pattern, then swap its tightest cluster into its largest
+    // void until that changes nothing
+    Rng rng;
+    rng_init(&rng, 0x626c7565u, 1);
+    int ones = count / BLUE_NOISE_INITIAL_FRACTION;
+    memset(pattern, 0, sizeof(pattern));
+    memset(energy, 0, sizeof(energy));
+    for (int placed = 0; placed < ones;)
+    {
+        int pixel = (int)(rng_next_u32(&rng) % count);
+        if (pattern[pixel])
+            continue;
+        pattern[pixel] = true;
+        update_energy(energy, kernel, pixel, 1);
+        placed++;
+    }
+    for (;;)
+    {
+        int cluster = find_extreme(energy, pattern, true, true);
+        pattern[cluster] = false;
+        update_energy(energy, kernel, cluster, -1);
+        int void_pixel = find_extreme(energy, pattern, false, false);
+        pattern[void_pixel] = true;
+        update_energy(energy, kernel, void_pixel, 1);
+        if (void_pixel == cluster)
+            break;
+    }
+    memcpy(initial, pattern, sizeof(pattern));
+    memcpy(initial_energy, energy, sizeof(energy));
+
+    // Ranks below the initial pattern: remove its tightest clusters one by one
+    for (int rank = ones - 1; rank >= 0; rank--)
+    {
+        int cluster = find_extreme(energy, pattern, true, true);
+        pattern[cluster] = false;
+        update_energy(energy, kernel, cluster, -1);
+        blue_noise_rank[cluster] = (uint16_t)rank;
+    }
+
+    // Ranks above it: fill the largest voids one by one. Past half full this
+    // is the same as Ulichney's third phase, since the tightest cluster of
+    // zeros is the pixel with the least energy from the ones.
+    memcpy(pattern, initial, sizeof(pattern));
+    memcpy(energy, initial_energy, sizeof(energy));
+    for (int rank = ones; rank < count; rank++)
+    {
+        int void_pixel = find_extreme(energy, pattern, false, false);
+        pattern[void_pixel] = true;
+        update_energy(energy, kernel, void_pixel, 1);
+        blue_noise_rank[void_pixel] = (uint16_t)rank;
+    }
+}
+
+// Mask value in [0,1) for coordinate c of dimension
+static double blue_noise_offset(const Sampler *sampler, uint32_t dimension, uint32_t c)
+{
+    uint32_t h = hash_combine(sampler->seed, dimension * 2 + c);
+    uint32_t x = (sampler->mask_x + h) & (BLUE_NOISE_SIZE - 1);
+    uint32_t y = (sampler->mask_y + (h >> 16)) & (BLUE_NOISE_SIZE - 1);
+    return (blue_noise_rank[y * BLUE_NOISE_SIZE + x] + 0.5) / (BLUE_NOISE_SIZE * BLUE_NOISE_SIZE);
+}
+
+static double shift(double u, double offset)
+{
+    u += offset;
+    return u >= 1.0 ? u - 1.0 : u;
+}
+
+// -----------------------------------------------------------------------------
+// Sampler interface
+// -----------------------------------------------------------------------------
+
+void sampler_prepare(SamplerType type)
+{
+    if (type == SAMPLER_SOBOL || type == SAMPLER_BLUE_NOISE)
+        pthread_once(&sobol_once, build_sobol_tables);
+    if (type == SAMPLER_BLUE_NOISE)
+        pthread_once(&blue_noise_once, build_blue_noise);
+}
+
+void sampler_start(Sampler *sampler, const SamplerSetup *setup, int pixel_x, int pixel_y, uint32_t pixel_index,
+                   uint32_t sample)
+{
+    sampler->type = setup->type;
+    sampler->index = sample;
+    sampler->count = setup->sample_count > 0 ? setup->sample_count : 1;
+    sampler->base = 0;
+    sampler->mask_x = (uint16_t)(pixel_x & (BLUE_NOISE_SIZE - 1));
+    sampler->mask_y = (uint16_t)(pixel_y & (BLUE_NOISE_SIZE - 1));
+    if (setup->type == SAMPLER_RANDOM)
+        rng_seed(&sampler->rng, pixel_index, sample, setup->frame);
+    // The blue-noise sequence is shared by all pixels, only the mask differs
+    uint32_t frame_seed = hash_u32(setup->frame ^ 0x5bd1e995u);
+    sampler->seed = setup->type == SAMPLER_BLUE_NOISE ? frame_seed : hash_combine(frame_seed, pixel_index);
+}
+
+double sampler_dimension_1d(Sampler *sampler, uint32_t dimension)
+{
+    switch (sampler->type)
+    {
+    case SAMPLER_STRATIFIED:
+        return stratified_1d(sampler, dimension);
+    case SAMPLER_BLUE_NOISE:
+        return shift(u32_to_unit(sobol_1d(sampler->index, hash_combine(sampler->seed, dimension))),
+                     blue_noise_offset(sampler, dimension, 0));
+    case SAMPLER_RANDOM:
+        return random_double(&sampler->rng);
+    default:
+        return u32_to_unit(sobol_1d(sampler->index, hash_combine(sampler->seed, dimension)));
+    }
+}
+
+void sampler_dimension_2d(Sampler *sampler, uint32_t dimension, double *u, double *v)
+{
+    uint32_t x, y;
+    switch (sampler->type)
+    {
+    case SAMPLER_STRATIFIED:
+        stratified_2d(sampler, dimension, u, v);
+        return;
+    case SAMPLER_BLUE_NOISE:
+        sobol_2d(sampler->index, hash_combine(sampler->seed, dimension), &x, &y);
+        *u = shift(u32_to_unit(x), blue_noise_offset(sampler, dimension, 0));
+        *v = shift(u32_to_unit(y), blue_noise_offset(sampler, dimension, 1));
+        return;
+    case SAMPLER_RANDOM:
+        *u = random_double(&sampler->rng);
+        *v = random_double(&sampler->rng);
+        return;
+    default:
+        sobol_2d(sampler->index, hash_combine(sampler->seed, dimension), &x, &y);
+        *u = u32_to_unit(x);
+        *v = u32_to_unit(y);
+        return;
+    }
+}
+
+bool sampler_parse(const char *name, SamplerType *type)
+{
+    for (int t = 0; t < SAMPLER_TYPE_COUNT; t++)
+    {
+        if (strcmp(name, sampler_names[t]) == 0)
+        {
+            *type = (SamplerType)t;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *sampler_name(SamplerType type)
+{
+    return type < SAMPLER_TYPE_COUNT ? sampler_names[type] : "unknown";
+}
@@ -0,0 +1,109 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rng.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// -----------------------------------------------------------------------------
+// Samplers
+// -----------------------------------------------------------------------------
+// A camera sample consumes a fixed set of dimensions: two for the position
+// inside the pixel, then SAMPLE_VERTEX_DIMENSIONS at every path vertex.
+// Every dimension is its own stream over the samples of a pixel, addressed
+// by number instead of by draw order, so a path that skips a draw (no light
+// sample at a metal hit) does not shift the numbers of later bounces.
+//
+// The low-discrepancy samplers make the points of one dimension pair cover
+// the unit square evenly across a pixel's samples, which is where their
+// lower error at the same spp comes from. Mappings from the square to
+// directions are closed-form (see vec3.h), so every sample uses exactly its
+// dimensions, with no rejection loop to waste or desynchronize draws.
+typedef enum
+{
+    SAMPLER_SOBOL,      // Owen-scrambled Sobol (0,2)-sequence, the default
+    SAMPLER_STRATIFIED, // Correlated multi-jittered strata, best at the planned spp
+    SAMPLER_BLUE_NOISE, // Sobol shifted per pixel by a blue-noise mask
+    SAMPLER_RANDOM,     // Independent uniform numbers from the PCG stream
+    SAMPLER_TYPE_COUNT
+} SamplerType;
+
+// Dimensions of the camera vertex
+#define SAMPLE_PIXEL 0 // 2D, position inside the pixel
+
+// Dimensions of a path vertex, offsets into the vertex's block
+#define SAMPLE_LIGHT_PICK 0     // 1D, light chosen for next-event estimation
+#define SAMPLE_LIGHT_POINT 1    // 2D, point on that light
+#define SAMPLE_SCATTER 3        // 2D, scatter direction
+#define SAMPLE_SCATTER_RADIUS 5 // 1D, radius of the metal fuzz offset
+#define SAMPLE_ROULETTE 6       // 1D, Russian roulette
+#define SAMPLE_VERTEX_DIMENSIONS 7
+
+// What the samplers of one render share
+typedef struct
+{
+    SamplerType type;
+    uint32_t sample_count; // Samples per pixel the stratified sampler divides the pixel into
+    uint32_t frame;        // Mixed into every scramble, so frames get independent noise
+} SamplerSetup;
+
+// Per camera sample state, small enough to keep one per path in flight
+typedef struct
+{
+    Rng rng;           // SAMPLER_RANDOM only
+    uint32_t type;     // SamplerType
+    uint32_t seed;     // Scramble seed of the pixel and frame
+    uint32_t index;    // Sample number inside the pixel
+    uint32_t count;    // SamplerSetup.sample_count
+    uint32_t base;     // First dimension of the current path vertex
+    uint16_t mask_x;   // Blue-noise mask position of the pixel
+    uint16_t mask_y;
+} Sampler;
+
+// Builds the tables type needs once per process, before its first
+// sampler_start. Thread-safe, render_tiles calls it for every render.
+void sampler_prepare(SamplerType type);
+
+// Starts sample number sample of the pixel at (pixel_x, pixel_y) in camera
+// coordinates, pixel_index = pixel_y * image_width + pixel_x. Every sample is
+// seeded from (pixel, sample, frame) alone, so renders stay independent of
+// thread count and scheduling, and sample N can be taken without 0..N-1.
+void sampler_start(Sampler *sampler, const SamplerSetup *setup, int pixel_x, int pixel_y, uint32_t pixel_index,
+                   uint32_t sample);
+
+// Moves to path vertex number vertex: 0 is the camera, 1 the first hit
+static inline void sampler_vertex(Sampler *sampler, int vertex)
+{
+    sampler->base = (uint32_t)vertex * SAMPLE_VERTEX_DIMENSIONS;
+}
+
+double sampler_dimension_1d(Sampler *sampler, uint32_t dimension);
+void sampler_dimension_2d(Sampler *sampler, uint32_t dimension, double *u, double *v);
+
+// Value in [0,1) of dimension offset (SAMPLE_*) of the current vertex. The
+// random sampler ignores the dimension and just draws the next number.
+static inline double sampler_1d(Sampler *sampler, uint32_t offset)
+{
+    if (sampler->type == SAMPLER_RANDOM)
+        return random_double(&sampler->rng);
+    return sampler_dimension_1d(sampler, sampler->base + offset);
+}
+
+// Point in [0,1)^2 of the dimension pair starting at offset
+static inline void sampler_2d(Sampler *sampler, uint32_t offset, double *u, double *v)
+{
+    if (sampler->type == SAMPLER_RANDOM)
+    {
+        *u = random_double(&sampler->rng);
+        *v = random_double(&sampler->rng);
+        return;
+    }
+    sampler_dimension_2d(sampler, sampler->base + offset, u, v);
+}
+
+// sobol, stratified, bluenoise or random. Returns false for other names.
+bool sampler_parse(const char *name, SamplerType *type);
+
+const char *sampler_name(SamplerType type);
+
+#endif // SAMPLER_H
@@ -0,0 +1,157 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "aabb.h"
+#include "ray.h"
+#include "vec3.h"
+#include <math.h>
+#include <stdbool.h>
+
+// -----------------------------------------------------------------------------
+// Affine transform
+// -----------------------------------------------------------------------------
+// A 3x4 matrix: the 3x3 linear part in columns 0-2, the translation in
+// column 3. Points pick up the translation, direction vectors do not.
+typedef struct
+{
+    double m[3][4];
+} Transform;
+
+static inline Transform transform_identity(void)
+{
+    Transform t = {{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}}};
+    return t;
+}
+
+static inline Transform transform_translate(Vec3 offset)
+{
+    Transform t = transform_identity();
+    t.m[0][3] = offset.x;
+    t.m[1][3] = offset.y;
+    t.m[2][3] = offset.z;
+    return t;
+}
+
+static inline Transform transform_scale(Vec3 factors)
+{
+    Transform t = transform_identity();
+    t.m[0][0] = factors.x;
+    t.m[1][1] = factors.y;
+    t.m[2][2] = factors.z;
+    return t;
+}
+
+// Rotation by degrees about axis 0 (x), 1 (y) or 2 (z), counter-clockwise
+// when looking down the axis towards the origin
+static inline Transform transform_rotate(int axis, double degrees)
+{
+    Transform t = transform_identity();
+    double c = cos(degrees * M_PI / 180.0), s = sin(degrees * M_PI / 180.0);
+    int a = (axis + 1) % 3, b = (axis + 2) % 3;
+    t.m[a][a] = c;
+    t.m[a][b] = -s;
+    t.m[b][a] = s;
+    t.m[b][b] = c;
+    return t;
+}
+
+// The transform that applies b first, then a
+static inline Transform transform_compose(const Transform *a, const Transform *b)
+{
+    Transform t;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            t.m[i][j] = a->m[i][0] * b->m[0][j] + a->m[i][1] * b->m[1][j] + a->m[i][2] * b->m[2][j];
+        }
+        t.m[i][3] += a->m[i][3];
+    }
+    return t;
+}
+
+// Scales by scale, rotates by rotation degrees about x, y and z in that
+// order, then moves by position
+static inline Transform transform_place(Vec3 position, Vec3 rotation, Vec3 scale)
+{
+    Transform t = transform_scale(scale);
+    Transform step = transform_rotate(0, rotation.x);
+    t = transform_compose(&step, &t);
+    step = transform_rotate(1, rotation.y);
+    t = transform_compose(&step, &t);
+    step = transform_rotate(2, rotation.z);
+    t = transform_compose(&step, &t);
+    step = transform_translate(position);
+    return transform_compose(&step, &t);
+}
+
+static inline Point3 transform_point(const Transform *t, Point3 p)
+{
+    return vec3_create(t->m[0][0] * p.x + t->m[0][1] * p.y + t->m[0][2] * p.z + t->m[0][3],
+                       t->m[1][0] * p.x + t->m[1][1] * p.y + t->m[1][2] * p.z + t->m[1][3],
+                       t->m[2][0] * p.x + t->m[2][1] * p.y + t->m[2][2] * p.z + t->m[2][3]);
+}
+
+static inline Vec3 transform_vector(const Transform *t, Vec3 v)
+{
+    return vec3_create(t->m[0][0] * v.x + t->m[0][1] * v.y + t->m[0][2] * v.z,
+                       t->m[1][0] * v.x + t->m[1][1] * v.y + t->m[1][2] * v.z,
+                       t->m[2][0] * v.x + t->m[2][1] * v.y + t->m[2][2] * v.z);
+}
+
+// Carries a normal through the transform whose inverse is given: normals
+// use the inverse transpose so they stay perpendicular to sheared and
+// non-uniformly scaled surfaces. The result is not normalized.
+static inline Vec3 transform_normal(const Transform *inverse, Vec3 n)
+{
+    return vec3_create(inverse->m[0][0] * n.x + inverse->m[1][0] * n.y + inverse->m[2][0] * n.z,
+                       inverse->m[0][1] * n.x + inverse->m[1][1] * n.y + inverse->m[2][1] * n.z,
+                       inverse->m[0][2] * n.x + inverse->m[1][2] * n.y + inverse->m[2][2] * n.z);
+}
+
+static inline Ray transform_ray(const Transform *t, Ray r)
+{
+    Ray out = {transform_point(t, r.origin), transform_vector(t, r.direction)};
+    return out;
+}
+
+// Stores the inverse of t in *out, returns false when t is singular
+static inline bool transform_inverse(const Transform *t, Transform *out)
+{
+    const double(*m)[4] = t->m;
+    double c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    double c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    double c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    double det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+    if (fabs(det) < 1e-12)
+        return false;
+    double inv = 1.0 / det;
+
+    // Adjugate of the linear part, then the translation moved back through it
+    double a[3][3] = {
+        {c00 * inv, (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv, (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv},
+        {c01 * inv, (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv, (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv},
+        {c02 * inv, (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv, (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv}};
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+            out->m[i][j] = a[i][j];
+        out->m[i][3] = -(a[i][0] * m[0][3] + a[i][1] * m[1][3] + a[i][2] * m[2][3]);
+    }
+    return true;
+}
+
+// Box around the eight transformed corners of b
+static inline Aabb transform_bounds(const Transform *t, Aabb b)
+{
+    Aabb out = aabb_empty();
+    for (int corner = 0; corner < 8; corner++)
+    {
+        Point3 p = vec3_create(corner & 1 ? b.max.x : b.min.x, corner & 2 ? b.max.y : b.min.y,
+                               corner & 4 ? b.max.z : b.min.z);
+        out = aabb_grow(out, transform_point(t, p));
+    }
+    return out;
+}
+
+#endif // TRANSFORM_H
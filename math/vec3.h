@@ -3,69 +3,239 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
+
+// -----------------------------------------------------------------------------
+// Scalar type
+// -----------------------------------------------------------------------------
+// Vectors use double precision unless the build defines RT_FLOAT
+// (make PRECISION=float). The float build pads Vec3 to four lanes and aligns
+// it to 16 bytes, so a vector is exactly one SSE register and add, sub, mul
+// and scale compile to single packed instructions. The double build keeps the
+// packed 24-byte layout: a padded 32-byte vector only fits a register with
+// AVX and would grow every vertex array by a third.
+#ifdef RT_FLOAT
+typedef float real;
+#else
+typedef double real;
+#endif
 
 // -----------------------------------------------------------------------------
 // Type Definitions
 // -----------------------------------------------------------------------------
 
+#ifdef RT_FLOAT
+typedef float Real4 __attribute__((vector_size(16)));
+
 typedef struct
 {
-    double x;
-    double y;
-    double z;
+    real x;
+    real y;
+    real z;
+    real w; // Padding lane, kept at 0
+} __attribute__((aligned(16))) Vec3;
+#else
+typedef struct
+{
+    real x;
+    real y;
+    real z;
 } Vec3;
+#endif
 
 // Aliases for code readability
 typedef Vec3 Point3; // 3D point
 typedef Vec3 Color;  // RGB Color
 
-void vec3_construct(Vec3 *v, double x, double y, double z);
+// -----------------------------------------------------------------------------
+// Operations, all inline so the hot paths never pay for a call
+// -----------------------------------------------------------------------------
+
+static inline void vec3_construct(Vec3 *v, real x, real y, real z)
+{
+    v->x = x;
+    v->y = y;
+    v->z = z;
+#ifdef RT_FLOAT
+    v->w = 0;
+#endif
+}
+
+#ifdef RT_FLOAT
+// Moves between the struct and its register form, both compile to nothing
+static inline Real4 vec3_lanes(Vec3 v)
+{
+    Real4 r;
+    memcpy(&r, &v, sizeof(r));
+    return r;
+}
+
+static inline Vec3 vec3_from_lanes(Real4 r)
+{
+    Vec3 v;
+    memcpy(&v, &r, sizeof(v));
+    return v;
+}
+#endif
 
 // Constructor
-Vec3 vec3_create(double x, double y, double z);
+static inline Vec3 vec3_create(real x, real y, real z)
+{
+    Vec3 v;
+    vec3_construct(&v, x, y, z);
+    return v;
+}
 
 // Vector + Vector
-Vec3 vec3_add(Vec3 u, Vec3 v);
+static inline Vec3 vec3_add(Vec3 u, Vec3 v)
+{
+#ifdef RT_FLOAT
+    return vec3_from_lanes(vec3_lanes(u) + vec3_lanes(v));
+#else
+    return vec3_create(u.x + v.x, u.y + v.y, u.z + v.z);
+#endif
+}
 
 // Vector - Vector
-Vec3 vec3_sub(Vec3 u, Vec3 v);
+static inline Vec3 vec3_sub(Vec3 u, Vec3 v)
+{
+#ifdef RT_FLOAT
+    return vec3_from_lanes(vec3_lanes(u) - vec3_lanes(v));
+#else
+    return vec3_create(u.x - v.x, u.y - v.y, u.z - v.z);
+#endif
+}
 
 // Vector * Scalar
-Vec3 vec3_scale(Vec3 v, double t);
+static inline Vec3 vec3_scale(Vec3 v, real t)
+{
+#ifdef RT_FLOAT
+    return vec3_from_lanes(vec3_lanes(v) * t);
+#else
+    return vec3_create(v.x * t, v.y * t, v.z * t);
+#endif
+}
 
 // Vector * Vector (Element-wise / Hadamard product)
-Vec3 vec3_mul(Vec3 u, Vec3 v);
+static inline Vec3 vec3_mul(Vec3 u, Vec3 v)
+{
+#ifdef RT_FLOAT
+    return vec3_from_lanes(vec3_lanes(u) * vec3_lanes(v));
+#else
+    return vec3_create(u.x * v.x, u.y * v.y, u.z * v.z);
+#endif
+}
 
 // Vector / Scalar
-Vec3 vec3_div(Vec3 v, double t);
+static inline Vec3 vec3_div(Vec3 v, real t)
+{
+    return vec3_scale(v, 1 / t);
+}
 
 // Dot Product: u . v
-double vec3_dot(Vec3 u, Vec3 v);
+static inline real vec3_dot(Vec3 u, Vec3 v)
+{
+    return u.x * v.x + u.y * v.y + u.z * v.z;
+}
 
 // Cross Product: u x v
-Vec3 vec3_cross(Vec3 u, Vec3 v);
+static inline Vec3 vec3_cross(Vec3 u, Vec3 v)
+{
+    return vec3_create(
+        u.y * v.z - u.z * v.y,
+        u.z * v.x - u.x * v.z,
+        u.x * v.y - u.y * v.x);
+}
 
 // Length Squared (Faster)
-double vec3_length_squared(Vec3 v);
+static inline real vec3_length_squared(Vec3 v)
+{
+    return v.x * v.x + v.y * v.y + v.z * v.z;
+}
 
 // Length (Uses sqrt)
-double vec3_length(Vec3 v);
+static inline real vec3_length(Vec3 v)
+{
+    return sqrt(vec3_length_squared(v));
+}
 
 // Unit Vector (Normalize)
-Vec3 vec3_unit(Vec3 v);
+static inline Vec3 vec3_unit(Vec3 v)
+{
+    return vec3_div(v, vec3_length(v));
+}
 
 // Reflect vector v around normal n
 // Formula: v - 2*dot(v,n)*n
-Vec3 vec3_reflect(Vec3 v, Vec3 n);
+static inline Vec3 vec3_reflect(Vec3 v, Vec3 n)
+{
+    return vec3_sub(v, vec3_scale(n, 2 * vec3_dot(v, n)));
+}
+
+static inline Vec3 vec3_refract(Vec3 uv, Vec3 n, real etai_over_etat)
+{
+    real cos_theta = fmin(vec3_dot(vec3_scale(uv, -1), n), 1);
+    Vec3 r_out_perp = vec3_scale(vec3_add(uv, vec3_scale(n, cos_theta)), etai_over_etat);
+    Vec3 r_out_parallel = vec3_scale(n, -sqrt(fabs(1 - vec3_length_squared(r_out_perp))));
+    return vec3_add(r_out_perp, r_out_parallel);
+}
 
-Vec3 vec3_refract(Vec3 uv, Vec3 n, double etai_over_etat);
+// -----------------------------------------------------------------------------
+// Closed-form sample mappings
+// -----------------------------------------------------------------------------
+// Turn numbers in [0,1) into directions and points with a known density. Each
+// takes a fixed number of inputs, unlike a rejection loop, so well spread
+// inputs from a sampler stay well spread after the mapping.
 
-Vec3 random_in_unit_sphere();
+// Uniform direction on the unit sphere; z is uniform in [-1, 1] (Archimedes)
+static inline Vec3 vec3_on_unit_sphere(real u, real v)
+{
+    real z = 1 - 2 * u;
+    real r = sqrt(fmax(0.0, 1 - z * z));
+    real phi = 2 * M_PI * v;
+    return vec3_create(r * cos(phi), r * sin(phi), z);
+}
+
+// Uniform point inside the unit ball: a direction and a radius whose cube is uniform
+static inline Vec3 vec3_in_unit_ball(real u, real v, real w)
+{
+    return vec3_scale(vec3_on_unit_sphere(u, v), cbrt(w));
+}
 
-// Prints vector to console: "[x, y, z]"
-void vec3_print(const Vec3 *v);
+// Unit tangent and bitangent completing the unit vector n to an orthonormal
+// frame. Duff et al., "Building an Orthonormal Basis, Revisited" (2017),
+// which has no branch on n.
+static inline void vec3_basis(Vec3 n, Vec3 *tangent, Vec3 *bitangent)
+{
+    real sign = copysign(1.0, n.z);
+    real a = -1 / (sign + n.z);
+    real b = n.x * n.y * a;
+    *tangent = vec3_create(1 + sign * n.x * n.x * a, sign * b, -sign * n.x);
+    *bitangent = vec3_create(b, sign + n.y * n.y * a, -n.y);
+}
+
+// Direction around the unit normal n with density (exponent + 1) / (2 pi) *
+// cos^exponent per solid angle, cos taken to n. Exponent 1 is the cosine-
+// weighted hemisphere.
+static inline Vec3 vec3_cosine_power_hemisphere(Vec3 n, real u, real v, int exponent)
+{
+    // cos^(exponent + 1) is uniform. 1 - u > 0, so the direction is never
+    // tangent; the common lobes avoid pow.
+    real base = 1 - u;
+    real cos_theta = exponent == 1 ? sqrt(base) : exponent == 3 ? sqrt(sqrt(base)) : pow(base, 1.0 / (exponent + 1));
+    real sin_theta = sqrt(fmax(0.0, 1 - cos_theta * cos_theta));
+    real phi = 2 * M_PI * v;
+
+    Vec3 tangent, bitangent;
+    vec3_basis(n, &tangent, &bitangent);
+    return vec3_add(vec3_add(vec3_scale(tangent, sin_theta * cos(phi)), vec3_scale(bitangent, sin_theta * sin(phi))),
+                    vec3_scale(n, cos_theta));
+}
 
-// Writes a Color to file in PPM format
-void vec3_write_color(FILE *output, Color pixel_color);
+// Prints vector to console: "[x, y, z]"
+static inline void vec3_print(const Vec3 *v)
+{
+    fprintf(stderr, "[%f, %f, %f]\n", v->x, v->y, v->z);
+}
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,1086 @@
+#include "mesh.h"
+#include "math/aabb.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MESH_MAX_THREADS 64
+
+// -----------------------------------------------------------------------------
+// Parallel helper
+// -----------------------------------------------------------------------------
+typedef struct
+{
+    void (*fn)(void *ctx, int worker);
+    void *ctx;
+    int worker;
+} WorkerStart;
+
+static void *worker_main(void *arg)
+{
+    WorkerStart *start = arg;
+    start->fn(start->ctx, start->worker);
+    return NULL;
+}
+
+// Runs fn(ctx, worker) for worker = 0 .. count - 1, worker 0 on the calling
+// thread. Workers whose thread cannot be started run inline afterwards.
+static void run_parallel(int count, void (*fn)(void *ctx, int worker), void *ctx)
+{
+    pthread_t threads[MESH_MAX_THREADS];
+    WorkerStart starts[MESH_MAX_THREADS];
+    bool started[MESH_MAX_THREADS] = {false};
+
+    for (int i = 1; i < count; i++)
+    {
+        starts[i] = (WorkerStart){fn, ctx, i};
+        started[i] = pthread_create(&threads[i], NULL, worker_main, &starts[i]) == 0;
+    }
+    fn(ctx, 0);
+    for (int i = 1; i < count; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            fn(ctx, i);
+    }
+}
+
+// Splits [0, total) into count nearly equal ranges, returns the start of range i
+static size_t range_start(size_t total, int count, int i)
+{
+    return total / (size_t)count * (size_t)i + (total % (size_t)count) * (size_t)i / (size_t)count;
+}
+
+// -----------------------------------------------------------------------------
+// OBJ
+// -----------------------------------------------------------------------------
+// The file is cut into one chunk per thread at line boundaries. Pass 1 counts
+// the vertices and triangles of every chunk, prefix sums turn the counts into
+// output offsets, and pass 2 parses each chunk into its slice of the arrays.
+// Negative (relative) face indices resolve correctly because every chunk
+// knows how many vertices precede it.
+
+typedef struct
+{
+    const char *begin, *end;
+    uint32_t vertex_count, triangle_count; // Pass 1 results
+    uint32_t first_vertex, first_triangle; // Prefix sums
+    bool ok;
+} ObjChunk;
+
+typedef struct
+{
+    ObjChunk chunks[MESH_MAX_THREADS];
+    Mesh *mesh;
+} ObjJob;
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char *skip_space(const char *p, const char *end)
+{
+    while (p < end && is_space(*p))
+        p++;
+    return p;
+}
+
+static const char *next_line(const char *p, const char *end)
+{
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    return nl ? nl + 1 : end;
+}
+
+// Parses a decimal number without relying on a NUL terminator, since the
+// mapped file has none. Mantissas below 2^53 with small exponents are exact
+// (one correctly rounded multiply or divide), which covers typical mesh data.
+static const char *parse_double(const char *p, const char *end, double *out)
+{
+    static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int exponent = 0, digits = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+    {
+        if (mantissa < 1000000000000000000ull)
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+        else
+            exponent++;
+    }
+    if (p < end && *p == '.')
+    {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+        {
+            if (mantissa < 1000000000000000000ull)
+            {
+                mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                exponent--;
+            }
+        }
+    }
+    if (digits == 0)
+        return NULL;
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char *q = p + 1;
+        bool exp_negative = false;
+        if (q < end && (*q == '-' || *q == '+'))
+            exp_negative = *q++ == '-';
+        int e = 0;
+        const char *exp_start = q;
+        for (; q < end && *q >= '0' && *q <= '9'; q++)
+            e = e < 10000 ? e * 10 + (*q - '0') : e;
+        if (q > exp_start)
+        {
+            exponent += exp_negative ? -e : e;
+            p = q;
+        }
+    }
+
+    double value = (double)mantissa;
+    if (mantissa < (1ull << 53) && exponent >= -22 && exponent <= 22)
+        value = exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
+    else
+        value *= pow(10.0, exponent);
+    *out = negative ? -value : value;
+    return p;
+}
+
+// Parses one face vertex reference ("7", "7/1", "7//3", "-2/1/1") and returns
+// its position index, resolved to 0-based. Returns NULL at the end of the face.
+static const char *parse_face_ref(const char *p, const char *end, int64_t vertices_before, int64_t *index)
+{
+    p = skip_space(p, end);
+    if (p >= end || *p == '\n' || *p == '#')
+        return NULL;
+
+    bool negative = false;
+    if (*p == '-' || *p == '+')
+        negative = *p++ == '-';
+    int64_t value = 0;
+    const char *start = p;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+        value = value < INT32_MAX ? value * 10 + (*p - '0') : value;
+    if (p == start)
+    {
+        *index = -1;
+        return end; // Malformed, reported by the caller through the index
+    }
+
+    // Texture and normal indices are not used
+    while (p < end && !is_space(*p) && *p != '\n')
+        p++;
+
+    *index = negative ? vertices_before - value : value - 1;
+    return p;
+}
+
+static void obj_count_chunk(void *ctx, int worker)
+{
+    ObjChunk *chunk = &((ObjJob *)ctx)->chunks[worker];
+    uint32_t vertices = 0, triangles = 0;
+
+    for (const char *p = chunk->begin; p < chunk->end; p = next_line(p, chunk->end))
+    {
+        p = skip_space(p, chunk->end);
+        if (chunk->end - p < 2 || !is_space(p[1]))
+            continue;
+        if (p[0] == 'v')
+        {
+            vertices++;
+        }
+        else if (p[0] == 'f')
+        {
+            uint32_t refs = 0;
+            const char *q = p + 1;
+            for (;;)
+            {
+                q = skip_space(q, chunk->end);
+                if (q >= chunk->end || *q == '\n' || *q == '#')
+                    break;
+                refs++;
+                while (q < chunk->end && !is_space(*q) && *q != '\n')
+                    q++;
+            }
+            if (refs >= 3)
+                triangles += refs - 2;
+        }
+    }
+    chunk->vertex_count = vertices;
+    chunk->triangle_count = triangles;
+}
+
+static void obj_parse_chunk(void *ctx, int worker)
+{
+    ObjJob *job = ctx;
+    ObjChunk *chunk = &job->chunks[worker];
+    Mesh *mesh = job->mesh;
+    Point3 *vertex = mesh->vertices + chunk->first_vertex;
+    uint32_t *index = mesh->indices + 3 * (size_t)chunk->first_triangle;
+    int64_t vertices_before = chunk->first_vertex;
+    chunk->ok = true;
+
+    for (const char *p = chunk->begin; p < chunk->end; p = next_line(p, chunk->end))
+    {
+        p = skip_space(p, chunk->end);
+        if (chunk->end - p < 2 || !is_space(p[1]))
+            continue;
+        if (p[0] == 'v')
+        {
+            double xyz[3];
+            const char *q = p + 1;
+            for (int a = 0; a < 3; a++)
+            {
+                q = parse_double(skip_space(q, chunk->end), chunk->end, &xyz[a]);
+                if (!q)
+                {
+                    chunk->ok = false;
+                    return;
+                }
+            }
+            *vertex++ = vec3_create(xyz[0], xyz[1], xyz[2]);
+            vertices_before++;
+        }
+        else if (p[0] == 'f')
+        {
+            // Fan triangulation around the first vertex
+            int64_t first = 0, previous = 0, current;
+            int refs = 0;
+            for (const char *q = p + 1; (q = parse_face_ref(q, chunk->end, vertices_before, &current)) != NULL; refs++)
+            {
+                if (current < 0 || current >= mesh->vertex_count)
+                {
+                    chunk->ok = false;
+                    return;
+                }
+                if (refs == 0)
+                {
+                    first = current;
+                }
+                else if (refs >= 2)
+                {
+                    index[0] = (uint32_t)first;
+                    index[1] = (uint32_t)previous;
+                    index[2] = (uint32_t)current;
+                    index += 3;
+                }
+                previous = current;
+            }
+        }
+    }
+}
+
+static bool load_obj(Mesh *mesh, const char *data, size_t size, Arena *arena, int thread_count, const char **error)
+{
+    ObjJob job;
+    job.mesh = mesh;
+    const char *end = data + size;
+
+    // Chunk boundaries move forward to the start of the next line
+    for (int i = 0; i < thread_count; i++)
+    {
+        const char *begin = data + range_start(size, thread_count, i);
+        if (i > 0 && begin > data && begin[-1] != '\n')
+            begin = next_line(begin, end);
+        job.chunks[i].begin = begin;
+        if (i > 0)
+            job.chunks[i - 1].end = begin;
+    }
+    job.chunks[thread_count - 1].end = end;
+
+    run_parallel(thread_count, obj_count_chunk, &job);
+
+    uint64_t vertices = 0, triangles = 0;
+    for (int i = 0; i < thread_count; i++)
+    {
+        job.chunks[i].first_vertex = (uint32_t)vertices;
+        job.chunks[i].first_triangle = (uint32_t)triangles;
+        vertices += job.chunks[i].vertex_count;
+        triangles += job.chunks[i].triangle_count;
+    }
+    if (vertices > UINT32_MAX || triangles > UINT32_MAX / 3)
+    {
+        *error = "too many vertices or triangles";
+        return false;
+    }
+
+    mesh->vertex_count = (uint32_t)vertices;
+    mesh->triangle_count = (uint32_t)triangles;
+    mesh->vertices = arena_alloc(arena, sizeof(Point3) * vertices, _Alignof(Point3));
+    mesh->indices = arena_alloc(arena, sizeof(uint32_t) * 3 * triangles, _Alignof(uint32_t));
+    if ((vertices && !mesh->vertices) || (triangles && !mesh->indices))
+    {
+        *error = "out of memory";
+        return false;
+    }
+
+    run_parallel(thread_count, obj_parse_chunk, &job);
+    for (int i = 0; i < thread_count; i++)
+    {
+        if (!job.chunks[i].ok)
+        {
+            *error = "malformed record or face index out of range";
+            return false;
+        }
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Binary PLY
+// -----------------------------------------------------------------------------
+
+#define PLY_MAX_ELEMENTS 8
+#define PLY_MAX_PROPERTIES 16
+
+typedef enum
+{
+    PLY_INT8,
+    PLY_UINT8,
+    PLY_INT16,
+    PLY_UINT16,
+    PLY_INT32,
+    PLY_UINT32,
+    PLY_FLOAT32,
+    PLY_FLOAT64,
+    PLY_INVALID
+} PlyType;
+
+typedef struct
+{
+    char name[32];
+    PlyType type;
+    PlyType count_type; // PLY_INVALID for scalar properties
+    size_t offset;      // Within the record, scalar properties only
+} PlyProperty;
+
+typedef struct
+{
+    char name[32];
+    uint64_t count;
+    PlyProperty properties[PLY_MAX_PROPERTIES];
+    int property_count;
+    size_t stride; // Record size, 0 when the element has list properties
+} PlyElement;
+
+typedef struct
+{
+    const unsigned char *data, *end;
+    bool swap; // File endianness differs from the host
+
+    // Vertex element
+    const unsigned char *vertices;
+    size_t vertex_stride;
+    size_t xyz_offset[3];
+    PlyType xyz_type[3];
+
+    // Face element
+    const unsigned char *faces;
+    uint64_t face_count;
+    int face_property_count;
+    const PlyProperty *face_properties;
+    int index_property;
+    size_t face_stride; // Fixed triangle record size, 0 for the general path
+
+    // Per-thread face ranges for the general path
+    uint64_t first_face[MESH_MAX_THREADS + 1];
+    const unsigned char *face_start[MESH_MAX_THREADS];
+    uint32_t first_triangle[MESH_MAX_THREADS];
+
+    Mesh *mesh;
+    int thread_count;
+    bool ok[MESH_MAX_THREADS];
+} PlyJob;
+
+static PlyType ply_type(const char *name)
+{
+    static const struct
+    {
+        const char *name;
+        PlyType type;
+    } names[] = {
+        {"char", PLY_INT8}, {"int8", PLY_INT8}, {"uchar", PLY_UINT8}, {"uint8", PLY_UINT8},
+        {"short", PLY_INT16}, {"int16", PLY_INT16}, {"ushort", PLY_UINT16}, {"uint16", PLY_UINT16},
+        {"int", PLY_INT32}, {"int32", PLY_INT32}, {"uint", PLY_UINT32}, {"uint32", PLY_UINT32},
+        {"float", PLY_FLOAT32}, {"float32", PLY_FLOAT32}, {"double", PLY_FLOAT64}, {"float64", PLY_FLOAT64},
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (strcmp(name, names[i].name) == 0)
+            return names[i].type;
+    }
+    return PLY_INVALID;
+}
+
+static size_t ply_size(PlyType type)
+{
+    static const size_t sizes[] = {1, 1, 2, 2, 4, 4, 4, 8, 0};
+    return sizes[type];
+}
+
+static double ply_read(const unsigned char *p, PlyType type, bool swap)
+{
+    unsigned char b[8];
+    size_t n = ply_size(type);
+    for (size_t i = 0; i < n; i++)
+        b[i] = swap ? p[n - 1 - i] : p[i];
+
+    switch (type)
+    {
+    case PLY_INT8:
+        return (int8_t)b[0];
+    case PLY_UINT8:
+        return b[0];
+    case PLY_INT16:
+    {
+        int16_t v;
+        memcpy(&v, b, 2);
+        return v;
+    }
+    case PLY_UINT16:
+    {
+        uint16_t v;
+        memcpy(&v, b, 2);
+        return v;
+    }
+    case PLY_INT32:
+    {
+        int32_t v;
+        memcpy(&v, b, 4);
+        return v;
+    }
+    case PLY_UINT32:
+    {
+        uint32_t v;
+        memcpy(&v, b, 4);
+        return v;
+    }
+    case PLY_FLOAT32:
+    {
+        float v;
+        memcpy(&v, b, 4);
+        return v;
+    }
+    case PLY_FLOAT64:
+    default:
+    {
+        double v;
+        memcpy(&v, b, 8);
+        return v;
+    }
+    }
+}
+
+// Size of one record, walking its list properties. Returns 0 if the record
+// runs past end.
+static size_t ply_record_size(const PlyProperty *properties, int count, const unsigned char *p,
+                              const unsigned char *end, bool swap)
+{
+    size_t size = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const PlyProperty *prop = &properties[i];
+        if (prop->count_type == PLY_INVALID)
+        {
+            size += ply_size(prop->type);
+            continue;
+        }
+        size_t count_size = ply_size(prop->count_type);
+        if (p + size + count_size > end)
+            return 0;
+        double n = ply_read(p + size, prop->count_type, swap);
+        if (n < 0)
+            return 0;
+        size += count_size + (size_t)n * ply_size(prop->type);
+    }
+    return p + size <= end ? size : 0;
+}
+
+// Parses the ASCII header. On success *body points at the first data byte.
+static bool ply_parse_header(const char *data, size_t size, bool *big_endian, PlyElement *elements,
+                             int *element_count, const unsigned char **body)
+{
+    const char *end = data + size;
+    if (size < 4 || memcmp(data, "ply", 3) != 0 || (data[3] != '\n' && data[3] != '\r'))
+        return false;
+
+    *element_count = 0;
+    bool have_format = false;
+    for (const char *p = next_line(data, end); p < end;)
+    {
+        const char *line_end = memchr(p, '\n', (size_t)(end - p));
+        if (!line_end)
+            return false;
+        char line[256];
+        size_t len = (size_t)(line_end - p);
+        if (len >= sizeof(line))
+            len = sizeof(line) - 1;
+        memcpy(line, p, len);
+        line[len] = '\0';
+        p = line_end + 1;
+
+        char word[5][32];
+        unsigned long long count;
+        int words = sscanf(line, "%31s %31s %31s %31s %31s", word[0], word[1], word[2], word[3], word[4]);
+        if (words <= 0 || strcmp(word[0], "comment") == 0 || strcmp(word[0], "obj_info") == 0)
+            continue;
+
+        if (strcmp(word[0], "end_header") == 0)
+        {
+            *body = (const unsigned char *)p;
+            return have_format;
+        }
+        if (strcmp(word[0], "format") == 0 && words >= 2)
+        {
+            if (strcmp(word[1], "binary_little_endian") == 0)
+                *big_endian = false;
+            else if (strcmp(word[1], "binary_big_endian") == 0)
+                *big_endian = true;
+            else
+                return false; // ASCII PLY is not supported
+            have_format = true;
+        }
+        else if (strcmp(word[0], "element") == 0 && words >= 3 && sscanf(word[2], "%llu", &count) == 1)
+        {
+            if (*element_count == PLY_MAX_ELEMENTS)
+                return false;
+            PlyElement *e = &elements[(*element_count)++];
+            memset(e, 0, sizeof(*e));
+            snprintf(e->name, sizeof(e->name), "%s", word[1]);
+            e->count = count;
+        }
+        else if (strcmp(word[0], "property") == 0 && words >= 3 && *element_count > 0)
+        {
+            PlyElement *e = &elements[*element_count - 1];
+            if (e->property_count == PLY_MAX_PROPERTIES)
+                return false;
+            PlyProperty *prop = &e->properties[e->property_count++];
+            if (strcmp(word[1], "list") == 0)
+            {
+                if (words < 5)
+                    return false;
+                prop->count_type = ply_type(word[2]);
+                prop->type = ply_type(word[3]);
+                snprintf(prop->name, sizeof(prop->name), "%s", word[4]);
+                if (prop->count_type == PLY_INVALID || prop->type == PLY_INVALID)
+                    return false;
+            }
+            else
+            {
+                prop->count_type = PLY_INVALID;
+                prop->type = ply_type(word[1]);
+                snprintf(prop->name, sizeof(prop->name), "%s", word[2]);
+                if (prop->type == PLY_INVALID)
+                    return false;
+            }
+        }
+    }
+    return false;
+}
+
+static void ply_decode_vertices(void *ctx, int worker)
+{
+    PlyJob *job = ctx;
+    Mesh *mesh = job->mesh;
+    size_t begin = range_start(mesh->vertex_count, job->thread_count, worker);
+    size_t end = range_start(mesh->vertex_count, job->thread_count, worker + 1);
+
+    for (size_t i = begin; i < end; i++)
+    {
+        const unsigned char *record = job->vertices + i * job->vertex_stride;
+        mesh->vertices[i] = vec3_create(ply_read(record + job->xyz_offset[0], job->xyz_type[0], job->swap),
+                                        ply_read(record + job->xyz_offset[1], job->xyz_type[1], job->swap),
+                                        ply_read(record + job->xyz_offset[2], job->xyz_type[2], job->swap));
+    }
+}
+
+static void ply_decode_faces(void *ctx, int worker)
+{
+    PlyJob *job = ctx;
+    Mesh *mesh = job->mesh;
+    const PlyProperty *list = &job->face_properties[job->index_property];
+    size_t count_size = ply_size(list->count_type);
+    size_t index_size = ply_size(list->type);
+
+    uint64_t begin = job->first_face[worker];
+    uint64_t end = job->first_face[worker + 1];
+    const unsigned char *p = job->face_stride ? job->faces + begin * job->face_stride : job->face_start[worker];
+    uint32_t *out = mesh->indices + 3 * (size_t)job->first_triangle[worker];
+    job->ok[worker] = true;
+
+    for (uint64_t f = begin; f < end; f++)
+    {
+        // Records of the general path were validated by the range setup,
+        // fixed-size ones only need their count checked
+        const unsigned char *field = p;
+        size_t record_size = job->face_stride;
+        if (!job->face_stride)
+        {
+            record_size = 0;
+            for (int k = 0; k < job->face_property_count; k++)
+            {
+                if (k == job->index_property)
+                    field = p + record_size;
+                record_size += ply_record_size(&job->face_properties[k], 1, p + record_size, job->end, job->swap);
+            }
+        }
+
+        double n = ply_read(field, list->count_type, job->swap);
+        if (job->face_stride && n != 3)
+        {
+            job->ok[worker] = false;
+            return;
+        }
+        const unsigned char *idx = field + count_size;
+        double first = ply_read(idx, list->type, job->swap);
+        for (uint32_t k = 2; k < n; k++)
+        {
+            double a = ply_read(idx + (k - 1) * index_size, list->type, job->swap);
+            double b = ply_read(idx + k * index_size, list->type, job->swap);
+            if (first < 0 || a < 0 || b < 0 || first >= mesh->vertex_count || a >= mesh->vertex_count || b >= mesh->vertex_count)
+            {
+                job->ok[worker] = false;
+                return;
+            }
+            out[0] = (uint32_t)first;
+            out[1] = (uint32_t)a;
+            out[2] = (uint32_t)b;
+            out += 3;
+        }
+        p += record_size;
+    }
+}
+
+static bool load_ply(Mesh *mesh, const char *data, size_t size, Arena *arena, int thread_count, const char **error)
+{
+    PlyElement elements[PLY_MAX_ELEMENTS];
+    int element_count;
+    bool big_endian = false;
+    const unsigned char *p;
+    if (!ply_parse_header(data, size, &big_endian, elements, &element_count, &p))
+    {
+        *error = "not a binary PLY file, or unsupported header";
+        return false;
+    }
+    const unsigned char *end = (const unsigned char *)data + size;
+    uint16_t probe = 1;
+    bool host_little_endian = *(unsigned char *)&probe == 1;
+
+    PlyJob *job = calloc(1, sizeof(PlyJob));
+    if (!job)
+    {
+        *error = "out of memory";
+        return false;
+    }
+    job->data = (const unsigned char *)data;
+    job->end = end;
+    job->swap = big_endian == host_little_endian;
+    job->mesh = mesh;
+    job->thread_count = thread_count;
+    job->index_property = -1;
+
+    bool ok = true;
+    const PlyElement *vertex_element = NULL, *face_element = NULL;
+    for (int e = 0; e < element_count && ok; e++)
+    {
+        PlyElement *element = &elements[e];
+        size_t stride = 0;
+        bool fixed = true;
+        for (int k = 0; k < element->property_count; k++)
+        {
+            PlyProperty *prop = &element->properties[k];
+            prop->offset = stride;
+            stride += ply_size(prop->type);
+            fixed = fixed && prop->count_type == PLY_INVALID;
+        }
+        element->stride = fixed ? stride : 0;
+
+        if (strcmp(element->name, "vertex") == 0 && fixed)
+        {
+            vertex_element = element;
+            job->vertices = p;
+            job->vertex_stride = stride;
+            for (int a = 0; a < 3; a++)
+            {
+                const char *axis_name = a == 0 ? "x" : (a == 1 ? "y" : "z");
+                job->xyz_type[a] = PLY_INVALID;
+                for (int k = 0; k < element->property_count; k++)
+                {
+                    if (strcmp(element->properties[k].name, axis_name) == 0)
+                    {
+                        job->xyz_offset[a] = element->properties[k].offset;
+                        job->xyz_type[a] = element->properties[k].type;
+                    }
+                }
+                ok = ok && job->xyz_type[a] != PLY_INVALID;
+            }
+        }
+        else if (strcmp(element->name, "face") == 0)
+        {
+            face_element = element;
+            job->faces = p;
+            job->face_count = element->count;
+            job->face_properties = element->properties;
+            job->face_property_count = element->property_count;
+            for (int k = 0; k < element->property_count; k++)
+            {
+                if (element->properties[k].count_type != PLY_INVALID &&
+                    (strcmp(element->properties[k].name, "vertex_indices") == 0 ||
+                     strcmp(element->properties[k].name, "vertex_index") == 0))
+                    job->index_property = k;
+            }
+            ok = job->index_property >= 0;
+        }
+
+        // Step over the element. Fixed-size records are skipped in one step.
+        if (!ok)
+            break;
+        if (fixed)
+        {
+            if (element->count > (uint64_t)(end - p) / (stride ? stride : 1))
+                ok = false;
+            else
+                p += element->count * stride;
+        }
+        else if (element != face_element)
+        {
+            for (uint64_t i = 0; i < element->count && ok; i++)
+            {
+                size_t record = ply_record_size(element->properties, element->property_count, p, end, job->swap);
+                ok = record > 0;
+                p += record;
+            }
+        }
+        else
+        {
+            // All-triangle face lists with no other properties have a fixed
+            // record size, which the file size confirms without a scan
+            const PlyProperty *list = &element->properties[job->index_property];
+            size_t triangle_record = ply_size(list->count_type) + 3 * ply_size(list->type);
+            bool last = e == element_count - 1;
+            if (element->property_count == 1 && last && (uint64_t)(end - p) == element->count * triangle_record)
+            {
+                job->face_stride = triangle_record;
+                for (int t = 0; t <= thread_count; t++)
+                    job->first_face[t] = range_start(element->count, thread_count, t);
+                for (int t = 0; t < thread_count; t++)
+                    job->first_triangle[t] = (uint32_t)job->first_face[t];
+                p = end;
+                continue;
+            }
+
+            // General case: one sequential pass over the record sizes finds
+            // where every thread starts and how many triangles precede it
+            uint64_t triangles = 0;
+            int t = 0;
+            for (uint64_t i = 0; i < element->count && ok; i++)
+            {
+                while (t < thread_count && i == range_start(element->count, thread_count, t))
+                {
+                    job->first_face[t] = i;
+                    job->face_start[t] = p;
+                    job->first_triangle[t] = (uint32_t)triangles;
+                    t++;
+                }
+                size_t record = ply_record_size(element->properties, element->property_count, p, end, job->swap);
+                ok = record > 0;
+                if (ok)
+                {
+                    size_t list_offset = 0;
+                    for (int k = 0; k < job->index_property; k++)
+                        list_offset += ply_record_size(&element->properties[k], 1, p + list_offset, end, job->swap);
+                    double n = ply_read(p + list_offset, list->count_type, job->swap);
+                    triangles += n >= 3 ? (uint64_t)n - 2 : 0;
+                    ok = triangles <= UINT32_MAX / 3;
+                }
+                p += record;
+            }
+            for (; t <= thread_count; t++)
+            {
+                job->first_face[t] = element->count;
+                if (t < thread_count)
+                {
+                    job->face_start[t] = p;
+                    job->first_triangle[t] = (uint32_t)triangles;
+                }
+            }
+            mesh->triangle_count = (uint32_t)triangles;
+        }
+    }
+
+    if (ok && (!vertex_element || !face_element || vertex_element->count > UINT32_MAX ||
+               (job->face_stride && face_element->count > UINT32_MAX / 3)))
+        ok = false;
+    if (!ok)
+    {
+        *error = "missing or malformed vertex/face element";
+        free(job);
+        return false;
+    }
+
+    mesh->vertex_count = (uint32_t)vertex_element->count;
+    if (job->face_stride)
+        mesh->triangle_count = (uint32_t)face_element->count;
+    mesh->vertices = arena_alloc(arena, sizeof(Point3) * mesh->vertex_count, _Alignof(Point3));
+    mesh->indices = arena_alloc(arena, sizeof(uint32_t) * 3 * (size_t)mesh->triangle_count, _Alignof(uint32_t));
+    if ((mesh->vertex_count && !mesh->vertices) || (mesh->triangle_count && !mesh->indices))
+    {
+        *error = "out of memory";
+        free(job);
+        return false;
+    }
+
+    run_parallel(thread_count, ply_decode_vertices, job);
+    run_parallel(thread_count, ply_decode_faces, job);
+    for (int t = 0; t < thread_count; t++)
+        ok = ok && job->ok[t];
+    if (!ok)
+        *error = "face index out of range, or a non-triangle face in a fixed-size face list";
+    free(job);
+    return ok;
+}
+
+// -----------------------------------------------------------------------------
+// Binary STL
+// -----------------------------------------------------------------------------
+// 80-byte header, uint32 triangle count, then 50 bytes per triangle: normal,
+// three vertices (little-endian float32 each) and a 16-bit attribute. The
+// triangles are decoded in parallel, then equal vertices are merged with a
+// hash table so the mesh gets a shared vertex array.
+
+#define STL_HEADER_SIZE 84
+#define STL_RECORD_SIZE 50
+
+typedef struct
+{
+    const unsigned char *records;
+    uint32_t triangle_count;
+    float *corners; // 9 floats per triangle
+    int thread_count;
+} StlJob;
+
+static float read_float_le(const unsigned char *p)
+{
+    uint32_t bits = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static void stl_decode(void *ctx, int worker)
+{
+    StlJob *job = ctx;
+    size_t begin = range_start(job->triangle_count, job->thread_count, worker);
+    size_t end = range_start(job->triangle_count, job->thread_count, worker + 1);
+    for (size_t i = begin; i < end; i++)
+    {
+        const unsigned char *record = job->records + i * STL_RECORD_SIZE + 12; // Skip the normal
+        for (int k = 0; k < 9; k++)
+            job->corners[9 * i + (size_t)k] = read_float_le(record + 4 * k);
+    }
+}
+
+static uint32_t hash_corner(const float *c)
+{
+    uint32_t bits[3];
+    memcpy(bits, c, sizeof(bits));
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 3; i++)
+        h = (h ^ bits[i]) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+static bool load_stl(Mesh *mesh, const char *data, size_t size, Arena *arena, int thread_count, const char **error)
+{
+    if (size < STL_HEADER_SIZE)
+    {
+        *error = "file too small for binary STL";
+        return false;
+    }
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint32_t count = (uint32_t)bytes[80] | (uint32_t)bytes[81] << 8 | (uint32_t)bytes[82] << 16 | (uint32_t)bytes[83] << 24;
+    if ((uint64_t)count * STL_RECORD_SIZE + STL_HEADER_SIZE != size || count > UINT32_MAX / 3)
+    {
+        *error = "size does not match the triangle count (ASCII STL is not supported)";
+        return false;
+    }
+
+    size_t corner_count = 3 * (size_t)count;
+    size_t table_size = 16;
+    while (table_size < 2 * corner_count)
+        table_size *= 2;
+
+    StlJob job = {bytes + STL_HEADER_SIZE, count, malloc(sizeof(float) * 3 * corner_count), thread_count};
+    uint32_t *table = malloc(sizeof(uint32_t) * table_size);
+    uint32_t *first_corner = malloc(sizeof(uint32_t) * (corner_count + 1)); // Welded vertex -> a corner using it
+    mesh->indices = arena_alloc(arena, sizeof(uint32_t) * corner_count, _Alignof(uint32_t));
+    if (!job.corners || !table || !first_corner || (corner_count && !mesh->indices))
+    {
+        *error = "out of memory";
+        free(job.corners);
+        free(table);
+        free(first_corner);
+        return false;
+    }
+
+    run_parallel(thread_count, stl_decode, &job);
+
+    // Bitwise equal corners become one vertex
+    memset(table, 0xff, sizeof(uint32_t) * table_size);
+    uint32_t vertex_count = 0;
+    for (size_t i = 0; i < corner_count; i++)
+    {
+        const float *c = &job.corners[3 * i];
+        size_t slot = hash_corner(c) & (table_size - 1);
+        for (;; slot = (slot + 1) & (table_size - 1))
+        {
+            uint32_t v = table[slot];
+            if (v == UINT32_MAX)
+            {
+                table[slot] = vertex_count;
+                first_corner[vertex_count] = (uint32_t)i;
+                mesh->indices[i] = vertex_count++;
+                break;
+            }
+            if (memcmp(&job.corners[3 * (size_t)first_corner[v]], c, 3 * sizeof(float)) == 0)
+            {
+                mesh->indices[i] = v;
+                break;
+            }
+        }
+    }
+    free(table);
+
+    mesh->vertex_count = vertex_count;
+    mesh->triangle_count = count;
+    mesh->vertices = arena_alloc(arena, sizeof(Point3) * vertex_count, _Alignof(Point3));
+    if (vertex_count && !mesh->vertices)
+    {
+        *error = "out of memory";
+        free(job.corners);
+        free(first_corner);
+        return false;
+    }
+    for (uint32_t v = 0; v < vertex_count; v++)
+    {
+        const float *c = &job.corners[3 * (size_t)first_corner[v]];
+        mesh->vertices[v] = vec3_create(c[0], c[1], c[2]);
+    }
+    free(job.corners);
+    free(first_corner);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Entry points
+// -----------------------------------------------------------------------------
+
+static bool has_extension(const char *path, const char *ext)
+{
+    const char *dot = strrchr(path, '.');
+    if (!dot)
+        return false;
+    for (dot++; *dot && *ext; dot++, ext++)
+    {
+        char c = *dot >= 'A' && *dot <= 'Z' ? (char)(*dot - 'A' + 'a') : *dot;
+        if (c != *ext)
+            return false;
+    }
+    return *dot == '\0' && *ext == '\0';
+}
+
+bool mesh_load(Mesh *mesh, const char *path, Arena *arena, int thread_count, MeshLoadStats *stats)
+{
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(mesh, 0, sizeof(*mesh));
+
+    bool (*load)(Mesh *, const char *, size_t, Arena *, int, const char **) = NULL;
+    if (has_extension(path, "obj"))
+        load = load_obj;
+    else if (has_extension(path, "ply"))
+        load = load_ply;
+    else if (has_extension(path, "stl"))
+        load = load_stl;
+    if (!load)
+    {
+        fprintf(stderr, "mesh_load: %s: unknown mesh format\n", path);
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        fprintf(stderr, "mesh_load: %s: cannot open or empty file\n", path);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "mesh_load: %s: mmap failed\n", path);
+        return false;
+    }
+    madvise(data, size, MADV_WILLNEED);
+
+    if (thread_count < 1)
+        thread_count = 1;
+    if (thread_count > MESH_MAX_THREADS)
+        thread_count = MESH_MAX_THREADS;
+
+    const char *error = NULL;
+    bool ok = load(mesh, data, size, arena, thread_count, &error);
+    munmap(data, size);
+    if (!ok)
+    {
+        fprintf(stderr, "mesh_load: %s: %s\n", path, error);
+        memset(mesh, 0, sizeof(*mesh));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    if (stats)
+    {
+        stats->file_bytes = size;
+        stats->seconds = (double)(stop.tv_sec - start.tv_sec) + (double)(stop.tv_nsec - start.tv_nsec) * 1e-9;
+    }
+    return ok;
+}
+
+size_t mesh_memory(const Mesh *mesh)
+{
+    return sizeof(Point3) * (size_t)mesh->vertex_count + sizeof(uint32_t) * 3 * (size_t)mesh->triangle_count;
+}
+
+void mesh_fit(Mesh *mesh, Point3 center, double size)
+{
+    if (mesh->vertex_count == 0)
+        return;
+    Aabb bounds = aabb_empty();
+    for (uint32_t i = 0; i < mesh->vertex_count; i++)
+        bounds = aabb_grow(bounds, mesh->vertices[i]);
+
+    Vec3 extent = vec3_sub(bounds.max, bounds.min);
+    double largest = fmax(extent.x, fmax(extent.y, extent.z));
+    double scale = largest > 0 ? size / largest : 1.0;
+    Point3 mid = aabb_centroid(bounds);
+    for (uint32_t i = 0; i < mesh->vertex_count; i++)
+        mesh->vertices[i] = vec3_add(center, vec3_scale(vec3_sub(mesh->vertices[i], mid), scale));
+}
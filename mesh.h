@@ -0,0 +1,39 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "hittable.h"
+#include "arena.h"
+#include <stddef.h>
+
+// -----------------------------------------------------------------------------
+// Mesh import
+// -----------------------------------------------------------------------------
+// Supported formats, picked from the file extension:
+//   .obj  Wavefront OBJ, only "v" and "f" records are read. Faces with more
+//         than three vertices are split into triangle fans.
+//   .ply  Binary PLY (little or big endian) with a "vertex" element holding
+//         x, y, z and a "face" element holding a vertex index list.
+//   .stl  Binary STL. Vertices are stored per triangle in the file, identical
+//         ones are merged into the shared vertex array.
+//
+// The file is mapped with mmap and parsed in place by thread_count threads:
+// a counting pass gives every thread the offset of its output, then each
+// thread decodes its part of the file straight into the final arrays.
+typedef struct
+{
+    size_t file_bytes;
+    double seconds; // Wall time of the whole load
+} MeshLoadStats;
+
+// Loads path into mesh. The vertex and index arrays are allocated from arena.
+// Prints the reason to stderr and returns false on failure.
+bool mesh_load(Mesh *mesh, const char *path, Arena *arena, int thread_count, MeshLoadStats *stats);
+
+// Bytes held by the vertex and index arrays
+size_t mesh_memory(const Mesh *mesh);
+
+// Uniformly scales and moves the mesh so its bounding box is centered on
+// center and its largest side is size long
+void mesh_fit(Mesh *mesh, Point3 center, double size);
+
+#endif // MESH_H
@@ -0,0 +1,206 @@
+#include "packet.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PACKET_HAVE_X86 1
+#endif
+
+void packet_init(RayPacket *packet, const Ray *rays, uint32_t valid, double t_max)
+{
+    packet->valid = valid;
+    packet->hit = 0;
+    for (int i = 0; i < PACKET_SIZE; i++)
+    {
+        // Unused slots get a harmless ray so the box test can run on all lanes
+        Ray r = (valid & (1u << i)) ? rays[i] : ray_create(vec3_create(0, 0, 0), vec3_create(1, 1, 1));
+        packet->rays[i] = r;
+        packet->origin_x[i] = r.origin.x;
+        packet->origin_y[i] = r.origin.y;
+        packet->origin_z[i] = r.origin.z;
+        packet->inv_dir_x[i] = 1.0 / r.direction.x;
+        packet->inv_dir_y[i] = 1.0 / r.direction.y;
+        packet->inv_dir_z[i] = 1.0 / r.direction.z;
+        packet->t_max[i] = t_max;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Packet box tests: return the subset of mask whose rays overlap the node
+// -----------------------------------------------------------------------------
+
+static uint32_t packet_hit_node_scalar(const BvhNode *node, const RayPacket *p, double t_min, uint32_t mask)
+{
+    uint32_t result = 0;
+    for (int i = 0; i < PACKET_SIZE; i++)
+    {
+        if (!(mask & (1u << i)))
+            continue;
+        double origin[3] = {p->origin_x[i], p->origin_y[i], p->origin_z[i]};
+        double inv_dir[3] = {p->inv_dir_x[i], p->inv_dir_y[i], p->inv_dir_z[i]};
+        if (bvh_node_hit(node, origin, inv_dir, t_min, p->t_max[i]))
+            result |= 1u << i;
+    }
+    return result;
+}
+
+#ifdef PACKET_HAVE_X86
+
+// Same slab test as bvh_node_hit on four rays at once. max/min return their
+// second operand for NaN inputs, which matches the scalar comparisons.
+__attribute__((target("avx2"))) static uint32_t packet_hit_node_avx2(const BvhNode *node, const RayPacket *p, double t_min, uint32_t mask)
+{
+    const double *origin[3] = {p->origin_x, p->origin_y, p->origin_z};
+    const double *inv_dir[3] = {p->inv_dir_x, p->inv_dir_y, p->inv_dir_z};
+    const __m256d zero = _mm256_setzero_pd();
+    uint32_t result = 0;
+
+    for (int i = 0; i < PACKET_SIZE; i += 4)
+    {
+        if (!((mask >> i) & 0xf))
+            continue;
+
+        __m256d lo = _mm256_set1_pd(t_min);
+        __m256d hi = _mm256_loadu_pd(p->t_max + i);
+        for (int a = 0; a < 3; a++)
+        {
+            __m256d o = _mm256_loadu_pd(origin[a] + i);
+            __m256d inv = _mm256_loadu_pd(inv_dir[a] + i);
+            __m256d t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(node->bounds_min[a]), o), inv);
+            __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(node->bounds_max[a]), o), inv);
+            __m256d negative = _mm256_cmp_pd(inv, zero, _CMP_LT_OQ);
+            __m256d t_near = _mm256_blendv_pd(t0, t1, negative);
+            __m256d t_far = _mm256_blendv_pd(t1, t0, negative);
+            lo = _mm256_max_pd(t_near, lo);
+            hi = _mm256_min_pd(t_far, hi);
+        }
+        uint32_t lanes = (uint32_t)_mm256_movemask_pd(_mm256_cmp_pd(hi, lo, _CMP_GE_OQ));
+        result |= lanes << i;
+    }
+    return result & mask;
+}
+
+#endif // PACKET_HAVE_X86
+
+typedef uint32_t (*PacketNodeTest)(const BvhNode *, const RayPacket *, double, uint32_t);
+
+static PacketNodeTest packet_hit_node = packet_hit_node_scalar;
+
+__attribute__((constructor)) static void packet_select_kernels(void)
+{
+#ifdef PACKET_HAVE_X86
+    const char *request = getenv("RT_SIMD");
+    __builtin_cpu_init();
+    if ((!request || strcmp(request, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+        packet_hit_node = packet_hit_node_avx2;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Traversal
+// -----------------------------------------------------------------------------
+
+// Traces the rays in mask one by one, starting at node root
+static void trace_single(const Bvh *bvh, RayPacket *p, uint32_t root, double t_min, uint32_t mask)
+{
+    for (int i = 0; i < PACKET_SIZE; i++)
+    {
+        if ((mask & (1u << i)) && bvh_intersect(bvh, root, p->rays[i], t_min, &p->t_max[i], &p->closest[i]))
+            p->hit |= 1u << i;
+    }
+}
+
+// Direction octant of ray i as three sign bits
+static int octant(const RayPacket *p, int i)
+{
+    return (p->inv_dir_x[i] < 0) | ((p->inv_dir_y[i] < 0) << 1) | ((p->inv_dir_z[i] < 0) << 2);
+}
+
+void bvh_intersect_packet(const Bvh *bvh, RayPacket *packet, double t_min, PacketStats *stats)
+{
+    uint32_t valid = packet->valid;
+    if (bvh->node_count == 0 || valid == 0)
+        return;
+
+    stats->packets++;
+
+    // Shared traversal order only makes sense when every ray agrees on it
+    int first = __builtin_ctz(valid);
+    int dir_octant = octant(packet, first);
+    for (int i = first + 1; i < PACKET_SIZE; i++)
+    {
+        if ((valid & (1u << i)) && octant(packet, i) != dir_octant)
+        {
+            trace_single(bvh, packet, 0, t_min, valid);
+            stats->single_rays += (uint64_t)__builtin_popcount(valid);
+            return;
+        }
+    }
+
+    const double *first_inv_dir[3] = {&packet->inv_dir_x[first], &packet->inv_dir_y[first], &packet->inv_dir_z[first]};
+
+    struct
+    {
+        uint32_t node;
+        uint32_t mask;
+    } stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    uint32_t node_index = 0;
+    uint32_t mask = valid;
+    uint32_t diverged = 0;
+
+    for (;;)
+    {
+        const BvhNode *node = &bvh->nodes[node_index];
+        uint32_t active = packet_hit_node(node, packet, t_min, mask);
+
+        if (active && __builtin_popcount(active) < PACKET_MIN_ACTIVE)
+        {
+            trace_single(bvh, packet, node_index, t_min, active);
+            diverged |= active;
+        }
+        else if (active && node->count > 0)
+        {
+            for (int i = 0; i < PACKET_SIZE; i++)
+            {
+                if ((active & (1u << i)) &&
+                    bvh_intersect_leaf(bvh, node, packet->rays[i], t_min, &packet->t_max[i], &packet->closest[i]))
+                    packet->hit |= 1u << i;
+            }
+        }
+        else if (active)
+        {
+            // All rays share the octant, so the first one picks the order
+            uint32_t near = node_index + 1, far = node->offset;
+            if (*first_inv_dir[node->axis] < 0)
+            {
+                near = node->offset;
+                far = node_index + 1;
+            }
+            stack[stack_size].node = far;
+            stack[stack_size].mask = active;
+            stack_size++;
+            node_index = near;
+            mask = active;
+            continue;
+        }
+
+        if (stack_size == 0)
+            break;
+        stack_size--;
+        node_index = stack[stack_size].node;
+        mask = stack[stack_size].mask;
+    }
+
+    stats->single_rays += (uint64_t)__builtin_popcount(diverged);
+    stats->packet_rays += (uint64_t)__builtin_popcount(valid & ~diverged);
+}
+
+void packet_stats_merge(PacketStats *into, const PacketStats *from)
+{
+    __atomic_fetch_add(&into->packets, from->packets, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&into->packet_rays, from->packet_rays, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&into->single_rays, from->single_rays, __ATOMIC_RELAXED);
+}
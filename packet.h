@@ -0,0 +1,51 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include "bvh.h"
+#include <stdint.h>
+
+#define PACKET_WIDTH 4
+#define PACKET_SIZE (PACKET_WIDTH * PACKET_WIDTH)
+
+// Once fewer rays than this still overlap a subtree, the packet stops sharing
+// traversal and finishes that subtree one ray at a time
+#define PACKET_MIN_ACTIVE 4
+
+// -----------------------------------------------------------------------------
+// Ray packet: a 4x4 block of coherent rays traced together
+// -----------------------------------------------------------------------------
+typedef struct
+{
+    // SoA copy of the rays, read by the vectorized box test
+    double origin_x[PACKET_SIZE], origin_y[PACKET_SIZE], origin_z[PACKET_SIZE];
+    double inv_dir_x[PACKET_SIZE], inv_dir_y[PACKET_SIZE], inv_dir_z[PACKET_SIZE];
+    double t_max[PACKET_SIZE]; // Closest hit so far per ray
+
+    Ray rays[PACKET_SIZE];
+    BvhHit closest[PACKET_SIZE]; // Closest primitive, valid where hit is set
+    uint32_t hit;                // Bit i set when ray i hit something
+    uint32_t valid;              // Bit i set when ray i is in use
+} RayPacket;
+
+// Counters of how primary rays were traced
+typedef struct
+{
+    uint64_t packets;     // Packets traced
+    uint64_t packet_rays; // Rays traced entirely in packet mode
+    uint64_t single_rays; // Rays that fell back to single-ray traversal
+} PacketStats;
+
+// Loads rays[i] for every bit i set in valid, all with the same t_max
+void packet_init(RayPacket *packet, const Ray *rays, uint32_t valid, double t_max);
+
+// Finds the closest BVH hit of every valid ray. Rays that share a direction
+// octant are traversed together: a node is visited when any active ray
+// overlaps it, and subtrees with fewer than PACKET_MIN_ACTIVE overlapping
+// rays are finished per ray. Packets spanning several octants are traced
+// one ray at a time.
+void bvh_intersect_packet(const Bvh *bvh, RayPacket *packet, double t_min, PacketStats *stats);
+
+// Atomically adds from into into, safe to call from several threads
+void packet_stats_merge(PacketStats *into, const PacketStats *from);
+
+#endif // PACKET_H
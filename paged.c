@@ -0,0 +1,917 @@
+#include "paged.h"
+
+#include "mesh.h"
+#include "stats.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PAGED_FILE_VERSION 1
+#define PAGED_SECTION_ALIGN 64 // Start of the triangle SoA in a cluster, and of the tables
+#define PAGED_MORTON_BITS 10   // Per axis, when ordering the triangles of a mesh into clusters
+
+// Cluster residency, PagedMesh.state
+#define PAGED_ABSENT 0
+#define PAGED_RESIDENT 1
+#define PAGED_REFERENCED 2 // Resident and visited since the clock hand last passed it
+
+static const char paged_magic[8] = {'R', 'T', 'P', 'A', 'G', 'E', 'D', 0};
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t layout[3]; // Sizes of the raw structs stored in the file
+    uint32_t cluster_count;
+    uint32_t top_node_count;
+    uint64_t triangle_count;
+    uint64_t clusters; // File offsets of the directory and the top-level tree
+    uint64_t top_nodes;
+    // The mesh file the paged mesh was converted from, all zero when written
+    // by other means
+    SidecarStamp source;
+    uint64_t file_size;
+} PagedFileHeader;
+
+static void paged_layout(uint32_t layout[3])
+{
+    layout[0] = sizeof(BvhNode);
+    layout[1] = sizeof(PagedCluster);
+    layout[2] = SOA_PADDING;
+}
+
+static uint64_t align_up(uint64_t offset, uint64_t align)
+{
+    return (offset + align - 1) & ~(align - 1);
+}
+
+// Offset of the triangle SoA from the start of a cluster
+static size_t cluster_soa_offset(uint32_t node_count)
+{
+    return (size_t)align_up(sizeof(BvhNode) * (uint64_t)node_count, PAGED_SECTION_ALIGN);
+}
+
+void paged_geometry_init(PagedGeometry *pg)
+{
+    *pg = (PagedGeometry){0};
+}
+
+void paged_geometry_free(PagedGeometry *pg)
+{
+    for (uint32_t i = 0; i < pg->count; i++)
+    {
+        PagedMesh *pm = pg->meshes[i];
+        munmap((void *)pm->mapping, pm->mapping_size);
+        free(pm->state);
+        free(pm);
+    }
+    free(pg->meshes);
+    if (pg->cache)
+    {
+        pthread_mutex_destroy(&pg->cache->lock);
+        free(pg->cache->slots);
+        free(pg->cache);
+    }
+    paged_geometry_init(pg);
+}
+
+// -----------------------------------------------------------------------------
+// Writing
+// -----------------------------------------------------------------------------
+
+void paged_writer_begin(PagedWriter *w, FILE *file)
+{
+    *w = (PagedWriter){.file = file, .position = PAGED_ALIGN}; // The header takes the first page
+}
+
+static bool write_at(FILE *file, uint64_t offset, const void *data, size_t size)
+{
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0 && fwrite(data, 1, size, file) == size;
+}
+
+bool paged_writer_add(PagedWriter *w, const Mesh *mesh)
+{
+    if (mesh->triangle_count == 0 || mesh->triangle_count > PAGED_MAX_CLUSTER_TRIANGLES)
+    {
+        fprintf(stderr, "paged_writer_add: a cluster holds 1 to %d triangles, not %u\n", PAGED_MAX_CLUSTER_TRIANGLES,
+                mesh->triangle_count);
+        return false;
+    }
+    if (w->count == UINT32_MAX)
+        return false;
+    if (w->count == w->capacity)
+    {
+        uint32_t capacity = w->capacity > 0 ? (w->capacity < UINT32_MAX / 2 ? 2 * w->capacity : UINT32_MAX) : 64;
+        PagedCluster *clusters = realloc(w->clusters, sizeof(PagedCluster) * capacity);
+        if (clusters)
+            w->clusters = clusters;
+        BvhNode *boxes = realloc(w->boxes, sizeof(BvhNode) * capacity);
+        if (boxes)
+            w->boxes = boxes;
+        if (!clusters || !boxes)
+            return false;
+        w->capacity = capacity;
+    }
+
+    Hittable h = {HITTABLE_MESH, 0, .object.mesh = mesh};
+    uint32_t index = 0;
+    Bvh bvh;
+    if (!bvh_build(&bvh, &h, &index, 1))
+        return false;
+    // The SoA's prim field holds the slot itself, so a hit leads straight
+    // back to its triangle
+    for (uint32_t k = 0; k < bvh.triangles.count; k++)
+        bvh.triangles.prim[k] = k;
+
+    size_t soa_offset = cluster_soa_offset(bvh.node_count);
+    size_t soa_bytes = triangle_soa_bytes(bvh.triangles.count);
+    PagedCluster *c = &w->clusters[w->count];
+    *c = (PagedCluster){
+        .offset = align_up(w->position, PAGED_ALIGN),
+        .bytes = (uint32_t)(soa_offset + soa_bytes),
+        .node_count = bvh.node_count,
+        .triangle_count = bvh.triangles.count,
+    };
+    bool ok = write_at(w->file, c->offset, bvh.nodes, sizeof(BvhNode) * bvh.node_count) &&
+              write_at(w->file, c->offset + soa_offset, bvh.triangles.v0_x, soa_bytes);
+
+    // The root's box is the cluster's box in the top-level tree
+    BvhNode *box = &w->boxes[w->count];
+    *box = bvh.nodes[0];
+    box->offset = w->count;
+    box->count = 1;
+    box->axis = BVH_LEAF_TRIANGLES;
+    bvh_free(&bvh);
+    if (!ok)
+        return false;
+    w->position = c->offset + c->bytes;
+    w->triangle_count += c->triangle_count;
+    w->count++;
+    return true;
+}
+
+// A cluster of the top-level build, key is its centroid on the split axis
+typedef struct
+{
+    float key;
+    uint32_t cluster;
+} TopItem;
+
+static int compare_top_items(const void *a, const void *b)
+{
+    const TopItem *x = a, *y = b;
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return x->cluster < y->cluster ? -1 : x->cluster > y->cluster;
+}
+
+typedef struct
+{
+    const BvhNode *boxes;
+    TopItem *items;
+    BvhNode *nodes;
+    uint32_t node_count;
+} TopBuild;
+
+// Builds the subtree over items [first, first + count) depth-first, split at
+// the median centroid along the axis of their largest centroid extent. The
+// top-level tree is small and only searched, a median split keeps it
+// balanced. Returns the index of the subtree's root.
+static uint32_t build_top(TopBuild *b, uint32_t first, uint32_t count)
+{
+    uint32_t index = b->node_count++;
+    if (count == 1)
+    {
+        b->nodes[index] = b->boxes[b->items[first].cluster];
+        return index;
+    }
+
+    float bounds_min[3] = {INFINITY, INFINITY, INFINITY}, bounds_max[3] = {-INFINITY, -INFINITY, -INFINITY};
+    float centroid_min[3] = {INFINITY, INFINITY, INFINITY}, centroid_max[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (uint32_t i = first; i < first + count; i++)
+    {
+        const BvhNode *box = &b->boxes[b->items[i].cluster];
+        for (int a = 0; a < 3; a++)
+        {
+            float centroid = 0.5f * (box->bounds_min[a] + box->bounds_max[a]);
+            bounds_min[a] = fminf(bounds_min[a], box->bounds_min[a]);
+            bounds_max[a] = fmaxf(bounds_max[a], box->bounds_max[a]);
+            centroid_min[a] = fminf(centroid_min[a], centroid);
+            centroid_max[a] = fmaxf(centroid_max[a], centroid);
+        }
+    }
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+    {
+        if (centroid_max[a] - centroid_min[a] > centroid_max[axis] - centroid_min[axis])
+            axis = a;
+    }
+    for (uint32_t i = first; i < first + count; i++)
+    {
+        const BvhNode *box = &b->boxes[b->items[i].cluster];
+        b->items[i].key = 0.5f * (box->bounds_min[axis] + box->bounds_max[axis]);
+    }
+    qsort(&b->items[first], count, sizeof(TopItem), compare_top_items);
+
+    uint32_t half = count / 2;
+    build_top(b, first, half); // The left child follows its parent
+    uint32_t right = build_top(b, first + half, count - half);
+    BvhNode *node = &b->nodes[index];
+    memcpy(node->bounds_min, bounds_min, sizeof(bounds_min));
+    memcpy(node->bounds_max, bounds_max, sizeof(bounds_max));
+    node->offset = right;
+    node->count = 0;
+    node->axis = (uint16_t)axis;
+    return index;
+}
+
+bool paged_writer_finish(PagedWriter *w, bool ok)
+{
+    if (ok && w->count == 0)
+    {
+        fprintf(stderr, "paged_writer_finish: the mesh has no clusters\n");
+        ok = false;
+    }
+    uint32_t top_node_count = 2 * w->count - 1;
+    TopBuild build = {.boxes = w->boxes};
+    if (ok)
+    {
+        build.items = malloc(sizeof(TopItem) * w->count);
+        build.nodes = malloc(sizeof(BvhNode) * top_node_count);
+        ok = build.items && build.nodes;
+    }
+    if (ok)
+    {
+        for (uint32_t i = 0; i < w->count; i++)
+            build.items[i] = (TopItem){0, i};
+        build_top(&build, 0, w->count);
+
+        PagedFileHeader header = {0};
+        memcpy(header.magic, paged_magic, sizeof(paged_magic));
+        header.version = PAGED_FILE_VERSION;
+        paged_layout(header.layout);
+        header.cluster_count = w->count;
+        header.top_node_count = top_node_count;
+        header.triangle_count = w->triangle_count;
+        header.clusters = align_up(w->position, PAGED_SECTION_ALIGN);
+        header.top_nodes = align_up(header.clusters + sizeof(PagedCluster) * (uint64_t)w->count, PAGED_SECTION_ALIGN);
+        header.source = w->source;
+        header.file_size = header.top_nodes + sizeof(BvhNode) * (uint64_t)top_node_count;
+        ok = write_at(w->file, header.clusters, w->clusters, sizeof(PagedCluster) * w->count) &&
+             write_at(w->file, header.top_nodes, build.nodes, sizeof(BvhNode) * top_node_count) &&
+             write_at(w->file, 0, &header, sizeof(header)) && fflush(w->file) == 0;
+    }
+    free(build.items);
+    free(build.nodes);
+    free(w->clusters);
+    free(w->boxes);
+    *w = (PagedWriter){0};
+    return ok;
+}
+
+// -----------------------------------------------------------------------------
+// Conversion
+// -----------------------------------------------------------------------------
+
+static int compare_keys(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Spreads the low 10 bits of v to every third bit
+static uint32_t morton_spread(uint32_t v)
+{
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Cuts mesh into clusters of PAGED_CLUSTER_TRIANGLES along a Morton curve
+// through the triangle centroids, which keeps every cluster compact
+static bool write_mesh_clusters(PagedWriter *w, const Mesh *mesh)
+{
+    uint32_t n = mesh->triangle_count;
+    uint64_t *keys = malloc(sizeof(uint64_t) * ((size_t)n + 1));
+    Point3 *vertices = malloc(sizeof(Point3) * 3 * PAGED_CLUSTER_TRIANGLES);
+    uint32_t *indices = malloc(sizeof(uint32_t) * 3 * PAGED_CLUSTER_TRIANGLES);
+    bool ok = keys && vertices && indices;
+
+    Aabb bounds = aabb_empty();
+    for (uint32_t i = 0; ok && i < n; i++)
+    {
+        Triangle tr = mesh_triangle(mesh, i);
+        bounds = aabb_grow(bounds, vec3_scale(vec3_add(vec3_add(tr.v0, tr.v1), tr.v2), 1.0 / 3.0));
+    }
+    Vec3 extent = vec3_sub(bounds.max, bounds.min);
+    double cells = (double)(1 << PAGED_MORTON_BITS);
+    double scale[3] = {cells / fmax(extent.x, 1e-30), cells / fmax(extent.y, 1e-30), cells / fmax(extent.z, 1e-30)};
+    for (uint32_t i = 0; ok && i < n; i++)
+    {
+        Triangle tr = mesh_triangle(mesh, i);
+        Vec3 offset = vec3_sub(vec3_scale(vec3_add(vec3_add(tr.v0, tr.v1), tr.v2), 1.0 / 3.0), bounds.min);
+        double c[3] = {offset.x * scale[0], offset.y * scale[1], offset.z * scale[2]};
+        uint32_t code = 0;
+        for (int a = 0; a < 3; a++)
+        {
+            uint32_t q = (uint32_t)fmin(fmax(c[a], 0.0), cells - 1);
+            code |= morton_spread(q) << a;
+        }
+        keys[i] = (uint64_t)code << 32 | i;
+    }
+    if (ok)
+        qsort(keys, n, sizeof(uint64_t), compare_keys);
+
+    for (uint32_t first = 0; ok && first < n; first += PAGED_CLUSTER_TRIANGLES)
+    {
+        uint32_t count = n - first < PAGED_CLUSTER_TRIANGLES ? n - first : PAGED_CLUSTER_TRIANGLES;
+        for (uint32_t j = 0; j < count; j++)
+        {
+            Triangle tr = mesh_triangle(mesh, (uint32_t)keys[first + j]);
+            vertices[3 * j] = tr.v0;
+            vertices[3 * j + 1] = tr.v1;
+            vertices[3 * j + 2] = tr.v2;
+            for (uint32_t k = 0; k < 3; k++)
+                indices[3 * j + k] = 3 * j + k;
+        }
+        Mesh cluster = {vertices, indices, 3 * count, count};
+        ok = paged_writer_add(w, &cluster);
+    }
+    free(keys);
+    free(vertices);
+    free(indices);
+    return ok;
+}
+
+// Maps the paged mesh behind fd and checks its tables. With source set, the
+// file must also have been converted from the mesh file source describes.
+static bool map_paged(int fd, const SidecarStamp *source, PagedMesh *pm)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PagedFileHeader))
+        return false;
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+
+    const uint8_t *base = map;
+    const PagedFileHeader *header = map;
+    uint32_t layout[3];
+    paged_layout(layout);
+    bool ok = memcmp(header->magic, paged_magic, sizeof(paged_magic)) == 0 && header->version == PAGED_FILE_VERSION &&
+              memcmp(header->layout, layout, sizeof(layout)) == 0 && header->file_size == size &&
+              header->cluster_count > 0 && header->top_node_count == 2 * (uint64_t)header->cluster_count - 1 &&
+              header->clusters <= size && (size - header->clusters) / sizeof(PagedCluster) >= header->cluster_count &&
+              header->top_nodes <= size && (size - header->top_nodes) / sizeof(BvhNode) >= header->top_node_count &&
+              header->clusters % PAGED_SECTION_ALIGN == 0 && header->top_nodes % PAGED_SECTION_ALIGN == 0;
+    if (ok && source)
+        ok = sidecar_stamp_equal(&header->source, source);
+
+    // Only the resident tables are checked, the clusters are trusted
+    const PagedCluster *clusters = (const PagedCluster *)(base + (ok ? header->clusters : 0));
+    for (uint32_t i = 0; ok && i < header->cluster_count; i++)
+    {
+        const PagedCluster *c = &clusters[i];
+        ok = c->offset % PAGED_ALIGN == 0 && c->offset <= size && c->bytes <= size - c->offset &&
+             c->node_count > 0 && c->triangle_count > 0 && c->triangle_count <= PAGED_MAX_CLUSTER_TRIANGLES &&
+             c->bytes >= cluster_soa_offset(c->node_count) + triangle_soa_bytes(c->triangle_count);
+    }
+    const BvhNode *top = (const BvhNode *)(base + (ok ? header->top_nodes : 0));
+    for (uint32_t i = 0; ok && i < header->top_node_count; i++)
+    {
+        if (top[i].count > 0)
+            ok = top[i].count == 1 && top[i].offset < header->cluster_count;
+        else
+            ok = top[i].offset > i && top[i].offset < header->top_node_count && top[i].axis < 3;
+    }
+    if (!ok)
+    {
+        munmap(map, size);
+        return false;
+    }
+    pm->mapping = base;
+    pm->mapping_size = size;
+    pm->clusters = clusters;
+    pm->top = top;
+    pm->cluster_count = header->cluster_count;
+    pm->top_node_count = header->top_node_count;
+    pm->triangle_count = header->triangle_count;
+    return true;
+}
+
+// Converting one mesh file, for sidecar_map and sidecar_convert
+typedef struct
+{
+    const Mesh *mesh; // Only needed to write
+    const SidecarStamp *source;
+    PagedMesh *pm;
+} PagedConversion;
+
+static bool conversion_write(FILE *file, void *context)
+{
+    PagedConversion *c = context;
+    PagedWriter w;
+    paged_writer_begin(&w, file);
+    w.source = *c->source;
+    return paged_writer_finish(&w, write_mesh_clusters(&w, c->mesh));
+}
+
+static bool conversion_map(int fd, void *context)
+{
+    PagedConversion *c = context;
+    return map_paged(fd, c->source, c->pm);
+}
+
+static bool has_suffix(const char *path, const char *suffix)
+{
+    size_t length = strlen(path), suffix_length = strlen(suffix);
+    return length >= suffix_length && strcmp(path + length - suffix_length, suffix) == 0;
+}
+
+// Opens path as a paged mesh, or the converted file of the mesh at path
+static bool open_paged(const char *path, int thread_count, PagedMesh *pm)
+{
+    if (has_suffix(path, PAGED_FILE_SUFFIX))
+    {
+        PagedConversion conversion = {NULL, NULL, pm};
+        bool ok = sidecar_map(path, conversion_map, &conversion);
+        if (!ok)
+            fprintf(stderr, "paged_geometry_add: %s is missing or not a paged mesh\n", path);
+        return ok;
+    }
+
+    SidecarStamp source;
+    if (!sidecar_stamp(path, &source))
+    {
+        fprintf(stderr, "paged_geometry_add: cannot open %s\n", path);
+        return false;
+    }
+    char *converted_path = sidecar_path(path, PAGED_FILE_SUFFIX);
+    if (!converted_path)
+        return false;
+    PagedConversion conversion = {NULL, &source, pm};
+    bool ok = sidecar_map(converted_path, conversion_map, &conversion);
+    if (!ok)
+    {
+        Arena arena;
+        arena_init(&arena, 0);
+        Mesh mesh;
+        MeshLoadStats load_stats;
+        ok = mesh_load(&mesh, path, &arena, thread_count, &load_stats);
+        if (ok)
+        {
+            conversion.mesh = &mesh;
+            ok = sidecar_convert("paged_geometry_add", path, converted_path, conversion_write, conversion_map,
+                                 &conversion);
+        }
+        arena_free(&arena);
+    }
+    free(converted_path);
+    return ok;
+}
+
+bool paged_geometry_add(PagedGeometry *pg, const char *path, int thread_count, const PagedMesh **mesh)
+{
+    if (pg->count == pg->capacity)
+    {
+        uint32_t capacity = pg->capacity > 0 ? 2 * pg->capacity : 4;
+        PagedMesh **meshes = realloc(pg->meshes, sizeof(PagedMesh *) * capacity);
+        if (!meshes)
+            return false;
+        pg->meshes = meshes;
+        pg->capacity = capacity;
+    }
+    if (!pg->cache)
+    {
+        pg->cache = calloc(1, sizeof(PagedCache));
+        if (!pg->cache)
+            return false;
+        pthread_mutex_init(&pg->cache->lock, NULL);
+        pg->cache->budget_bytes = (size_t)PAGED_DEFAULT_CACHE_MB << 20;
+        long page_size = sysconf(_SC_PAGESIZE);
+        pg->cache->page_aligned = page_size > 0 && PAGED_ALIGN % page_size == 0;
+    }
+
+    PagedMesh *pm = calloc(1, sizeof(PagedMesh));
+    if (!pm)
+        return false;
+    if (!open_paged(path, thread_count, pm))
+    {
+        free(pm);
+        return false;
+    }
+
+    // Every cluster of every mesh may end up resident at once
+    PagedCache *cache = pg->cache;
+    uint64_t slots = (uint64_t)cache->slot_capacity + pm->cluster_count;
+    PagedSlot *grown = slots <= UINT32_MAX ? realloc(cache->slots, sizeof(PagedSlot) * slots) : NULL;
+    if (grown)
+    {
+        cache->slots = grown;
+        cache->slot_capacity = (uint32_t)slots;
+    }
+    pm->state = calloc(pm->cluster_count, 1);
+    pm->cache = cache;
+    if (!grown || !pm->state)
+    {
+        munmap((void *)pm->mapping, pm->mapping_size);
+        free(pm->state);
+        free(pm);
+        return false;
+    }
+    // Clusters are read ahead whole when they are loaded, faults should not
+    // read around them
+    if (cache->page_aligned)
+        madvise((void *)pm->mapping, pm->mapping_size, MADV_RANDOM);
+    pg->meshes[pg->count++] = pm;
+    *mesh = pm;
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Cluster cache
+// -----------------------------------------------------------------------------
+
+// Runs the clock hand until the resident clusters fit the budget: a
+// referenced cluster loses its reference and gets another round, an
+// unreferenced one is evicted. Called with the cache locked.
+static void evict_to_budget(PagedCache *cache)
+{
+    // Two sweeps clear every reference, unless other threads keep setting them
+    uint64_t steps = 2 * (uint64_t)cache->slot_count + 1;
+    while (cache->resident_bytes > cache->budget_bytes && cache->slot_count > 1 && steps-- > 0)
+    {
+        if (cache->hand >= cache->slot_count)
+            cache->hand = 0;
+        PagedSlot *slot = &cache->slots[cache->hand];
+        uint8_t *state = &slot->mesh->state[slot->cluster];
+        uint8_t s = PAGED_REFERENCED;
+        if (__atomic_compare_exchange_n(state, &s, PAGED_RESIDENT, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            cache->hand++;
+            continue;
+        }
+        s = PAGED_RESIDENT;
+        if (!__atomic_compare_exchange_n(state, &s, PAGED_ABSENT, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            continue; // Visited meanwhile
+
+        const PagedCluster *c = &slot->mesh->clusters[slot->cluster];
+        if (cache->page_aligned)
+            madvise((void *)(slot->mesh->mapping + c->offset), c->bytes, MADV_DONTNEED);
+        cache->resident_bytes -= c->bytes;
+        cache->evictions++;
+        *slot = cache->slots[--cache->slot_count];
+    }
+}
+
+// Makes an absent cluster resident
+static void cluster_load(const PagedMesh *pm, uint32_t cluster)
+{
+    PagedCache *cache = pm->cache;
+    pthread_mutex_lock(&cache->lock);
+    if (__atomic_load_n(&pm->state[cluster], __ATOMIC_RELAXED) == PAGED_ABSENT)
+    {
+        const PagedCluster *c = &pm->clusters[cluster];
+        if (cache->page_aligned)
+            madvise((void *)(pm->mapping + c->offset), c->bytes, MADV_WILLNEED);
+        __atomic_store_n(&pm->state[cluster], PAGED_REFERENCED, __ATOMIC_RELAXED);
+        cache->slots[cache->slot_count++] = (PagedSlot){pm, cluster};
+        cache->resident_bytes += c->bytes;
+        cache->loads++;
+        cache->load_bytes += c->bytes;
+        evict_to_budget(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Records a visit to the cluster, by binned_rays rays of a batch or by a
+// single ray when 0, loading the cluster when it is absent
+static void cluster_visit(const PagedMesh *pm, uint32_t cluster, uint32_t binned_rays)
+{
+    PagedCache *cache = pm->cache;
+    __atomic_fetch_add(&cache->requests, 1, __ATOMIC_RELAXED);
+    if (binned_rays > 0)
+    {
+        __atomic_fetch_add(&cache->binned_requests, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cache->binned_rays, binned_rays, __ATOMIC_RELAXED);
+    }
+    uint8_t *state = &pm->state[cluster];
+    uint8_t s = __atomic_load_n(state, __ATOMIC_RELAXED);
+    while (s == PAGED_RESIDENT &&
+           !__atomic_compare_exchange_n(state, &s, PAGED_REFERENCED, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    if (s == PAGED_ABSENT)
+        cluster_load(pm, cluster);
+}
+
+void paged_geometry_prepare(PagedGeometry *pg, size_t budget_bytes)
+{
+    if (!pg->cache)
+        return;
+    pthread_mutex_lock(&pg->cache->lock);
+    pg->cache->budget_bytes = budget_bytes;
+    evict_to_budget(pg->cache);
+    pthread_mutex_unlock(&pg->cache->lock);
+}
+
+// -----------------------------------------------------------------------------
+// Tracing
+// -----------------------------------------------------------------------------
+
+static void ray_slabs(Ray r, double origin[3], double inv_dir[3])
+{
+    origin[0] = r.origin.x;
+    origin[1] = r.origin.y;
+    origin[2] = r.origin.z;
+    inv_dir[0] = 1.0 / r.direction.x;
+    inv_dir[1] = 1.0 / r.direction.y;
+    inv_dir[2] = 1.0 / r.direction.z;
+}
+
+// Where the ray enters and leaves the node's box, clipped to [t_min, t_max].
+// The slab test of bvh_node_hit.
+static bool node_interval(const BvhNode *node, const double origin[3], const double inv_dir[3], double t_min,
+                          double t_max, double *entry, double *exit)
+{
+    for (int a = 0; a < 3; a++)
+    {
+        double t0 = (node->bounds_min[a] - origin[a]) * inv_dir[a];
+        double t1 = (node->bounds_max[a] - origin[a]) * inv_dir[a];
+        if (inv_dir[a] < 0)
+        {
+            double tmp = t0;
+            t0 = t1;
+            t1 = tmp;
+        }
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if (t_max < t_min)
+            return false;
+    }
+    *entry = t_min;
+    *exit = t_max;
+    return true;
+}
+
+// Finds the cluster the ray visits after the one at (*entry, *cluster):
+// clusters are visited by the distance at which the ray enters their box,
+// ties by index, and only when that is before t_max. Start with *entry at
+// -INFINITY. Returns false when no cluster is left.
+static bool next_cluster(const PagedMesh *pm, const double origin[3], const double inv_dir[3], double t_min,
+                         double t_max, double *entry, uint32_t *cluster)
+{
+    double after = *entry;
+    uint32_t after_cluster = *cluster;
+    double best = INFINITY;
+    uint32_t best_cluster = UINT32_MAX;
+
+    uint32_t stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    uint32_t node_index = 0;
+    for (;;)
+    {
+        const BvhNode *node = &pm->top[node_index];
+        double node_entry, node_exit;
+        // A box inside this one is entered no earlier and left no later, so
+        // nothing below it can come after (after, after_cluster) if the ray
+        // leaves before after, or beat best if it enters after best
+        if (node_interval(node, origin, inv_dir, t_min, t_max, &node_entry, &node_exit) && node_exit >= after &&
+            node_entry <= best)
+        {
+            if (node->count > 0)
+            {
+                uint32_t c = node->offset;
+                bool later = node_entry > after || (node_entry == after && c > after_cluster);
+                if (later && (node_entry < best || (node_entry == best && c < best_cluster)))
+                {
+                    best = node_entry;
+                    best_cluster = c;
+                }
+            }
+            else
+            {
+                if (inv_dir[node->axis] < 0)
+                {
+                    stack[stack_size++] = node_index + 1;
+                    node_index = node->offset;
+                }
+                else
+                {
+                    stack[stack_size++] = node->offset;
+                    node_index = node_index + 1;
+                }
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            break;
+        node_index = stack[--stack_size];
+    }
+    if (best_cluster == UINT32_MAX)
+        return false;
+    *entry = best;
+    *cluster = best_cluster;
+    return true;
+}
+
+// The cluster's BVH, pointing into the mapping
+static void cluster_bvh(const PagedMesh *pm, uint32_t cluster, Bvh *bvh)
+{
+    const PagedCluster *c = &pm->clusters[cluster];
+    uint8_t *base = (uint8_t *)pm->mapping + c->offset;
+    *bvh = (Bvh){0};
+    bvh->nodes = (BvhNode *)base;
+    bvh->node_count = c->node_count;
+    bvh->prim_count = c->triangle_count;
+    triangle_soa_attach(&bvh->triangles, base + cluster_soa_offset(c->node_count), c->triangle_count,
+                        c->triangle_count);
+}
+
+bool paged_mesh_intersect(const PagedMesh *pm, Ray r, double t_min, double *t_max, PagedHit *hit)
+{
+    double origin[3], inv_dir[3];
+    ray_slabs(r, origin, inv_dir);
+    double entry = -INFINITY;
+    uint32_t cluster = 0;
+    bool hit_anything = false;
+    while (next_cluster(pm, origin, inv_dir, t_min, *t_max, &entry, &cluster))
+    {
+        cluster_visit(pm, cluster, 0);
+        Bvh bvh;
+        cluster_bvh(pm, cluster, &bvh);
+        BvhHit local;
+        if (bvh_intersect(&bvh, 0, r, t_min, t_max, &local))
+        {
+            *hit = (PagedHit){cluster, local.prim};
+            hit_anything = true;
+        }
+    }
+    return hit_anything;
+}
+
+void paged_mesh_hit_record(const PagedMesh *pm, MaterialId material, PagedHit hit, Ray r, double t, HitRecord *rec)
+{
+    Bvh bvh;
+    cluster_bvh(pm, hit.cluster, &bvh);
+    const TriangleSoA *soa = &bvh.triangles;
+    uint32_t k = hit.prim;
+    Point3 v0 = vec3_create(soa->v0_x[k], soa->v0_y[k], soa->v0_z[k]);
+    Triangle tr = {v0, vec3_add(v0, vec3_create(soa->e1_x[k], soa->e1_y[k], soa->e1_z[k])),
+                   vec3_add(v0, vec3_create(soa->e2_x[k], soa->e2_y[k], soa->e2_z[k]))};
+    triangle_hit_record(&tr, material, r, t, rec);
+    rec->hittable = NULL;
+    rec->instance = NULL;
+    rec->prim = hit.prim;
+}
+
+bool paged_batch_reserve(PagedBatch *batch, uint32_t count)
+{
+    if (count <= batch->capacity)
+        return true;
+    paged_batch_free(batch);
+    batch->rays = malloc(sizeof(Ray) * count);
+    batch->t_max = malloc(sizeof(double) * count);
+    batch->hits = malloc(sizeof(PagedHit) * count);
+    batch->found = malloc(sizeof(bool) * count);
+    batch->entry = malloc(sizeof(double) * count);
+    batch->cluster = malloc(sizeof(uint32_t) * count);
+    batch->active = malloc(sizeof(uint32_t) * count);
+    batch->keys = malloc(sizeof(uint64_t) * count);
+    if (!batch->rays || !batch->t_max || !batch->hits || !batch->found || !batch->entry || !batch->cluster ||
+        !batch->active || !batch->keys)
+    {
+        paged_batch_free(batch);
+        return false;
+    }
+    batch->capacity = count;
+    return true;
+}
+
+void paged_batch_free(PagedBatch *batch)
+{
+    free(batch->rays);
+    free(batch->t_max);
+    free(batch->hits);
+    free(batch->found);
+    free(batch->entry);
+    free(batch->cluster);
+    free(batch->active);
+    free(batch->keys);
+    *batch = (PagedBatch){0};
+}
+
+void paged_mesh_intersect_batch(const PagedMesh *pm, PagedBatch *batch, uint32_t count, double t_min)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        batch->found[i] = false;
+        batch->entry[i] = -INFINITY;
+        batch->cluster[i] = 0;
+        batch->active[i] = i;
+    }
+
+    // Every round moves each ray on to its next cluster, the same sequence
+    // paged_mesh_intersect walks, and traces the rays waiting at a cluster
+    // together
+    uint32_t active_count = count;
+    while (active_count > 0)
+    {
+        uint32_t binned = 0;
+        for (uint32_t a = 0; a < active_count; a++)
+        {
+            uint32_t i = batch->active[a];
+            double origin[3], inv_dir[3];
+            ray_slabs(batch->rays[i], origin, inv_dir);
+            if (next_cluster(pm, origin, inv_dir, t_min, batch->t_max[i], &batch->entry[i], &batch->cluster[i]))
+                batch->keys[binned++] = (uint64_t)batch->cluster[i] << 32 | i;
+        }
+        qsort(batch->keys, binned, sizeof(uint64_t), compare_keys);
+
+        for (uint32_t first = 0; first < binned;)
+        {
+            uint32_t cluster = (uint32_t)(batch->keys[first] >> 32);
+            uint32_t last = first + 1;
+            while (last < binned && (uint32_t)(batch->keys[last] >> 32) == cluster)
+                last++;
+            cluster_visit(pm, cluster, last - first);
+            Bvh bvh;
+            cluster_bvh(pm, cluster, &bvh);
+            for (uint32_t k = first; k < last; k++)
+            {
+                uint32_t i = (uint32_t)batch->keys[k];
+                BvhHit local;
+                if (bvh_intersect(&bvh, 0, batch->rays[i], t_min, &batch->t_max[i], &local))
+                {
+                    batch->hits[i] = (PagedHit){cluster, local.prim};
+                    batch->found[i] = true;
+                }
+            }
+            first = last;
+        }
+
+        for (uint32_t k = 0; k < binned; k++)
+            batch->active[k] = (uint32_t)batch->keys[k];
+        active_count = binned;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Statistics
+// -----------------------------------------------------------------------------
+
+void paged_geometry_stats(const PagedGeometry *pg, PagedStats *stats)
+{
+    *stats = (PagedStats){0};
+    for (uint32_t i = 0; i < pg->count; i++)
+    {
+        stats->cluster_count += pg->meshes[i]->cluster_count;
+        stats->triangle_count += pg->meshes[i]->triangle_count;
+        stats->file_bytes += pg->meshes[i]->mapping_size;
+    }
+    PagedCache *cache = pg->cache;
+    if (!cache)
+        return;
+    pthread_mutex_lock(&cache->lock);
+    stats->loads = cache->loads;
+    stats->load_bytes = cache->load_bytes;
+    stats->evictions = cache->evictions;
+    stats->resident_bytes = cache->resident_bytes;
+    stats->budget_bytes = cache->budget_bytes;
+    pthread_mutex_unlock(&cache->lock);
+    stats->requests = __atomic_load_n(&cache->requests, __ATOMIC_RELAXED);
+    stats->binned_requests = __atomic_load_n(&cache->binned_requests, __ATOMIC_RELAXED);
+    stats->binned_rays = __atomic_load_n(&cache->binned_rays, __ATOMIC_RELAXED);
+}
+
+void paged_stats_print(FILE *output, const PagedGeometry *pg)
+{
+    PagedStats stats;
+    paged_geometry_stats(pg, &stats);
+    ProcessStats process;
+    stats_process(&process);
+    double mb = 1.0 / (1024.0 * 1024.0);
+    fprintf(output, "Paged geometry: %u meshes, %llu triangles in %llu clusters, %.1f MB of files\n", pg->count,
+            (unsigned long long)stats.triangle_count, (unsigned long long)stats.cluster_count,
+            (double)stats.file_bytes * mb);
+    fprintf(output, "  Cluster visits: %llu\n", (unsigned long long)stats.requests);
+    if (stats.binned_requests > 0)
+        fprintf(output, "  Binned visits: %llu by %llu rays, %.1f rays per visit\n",
+                (unsigned long long)stats.binned_requests, (unsigned long long)stats.binned_rays,
+                (double)stats.binned_rays / (double)stats.binned_requests);
+    // Loads only make clusters resident in the cache, the storage reads
+    // below tell how much the page cache could not serve
+    fprintf(output, "  Logical loads: %llu, %.1f MB of clusters made resident, %llu evictions\n",
+            (unsigned long long)stats.loads, (double)stats.load_bytes * mb, (unsigned long long)stats.evictions);
+    fprintf(output, "  Resident clusters: %.1f of %.1f MB, process resident memory %.1f MB\n",
+            (double)stats.resident_bytes * mb, (double)stats.budget_bytes * mb, (double)process.resident_bytes * mb);
+    fprintf(output, "  Process page faults: %llu major, %llu minor, %.1f MB read from storage\n",
+            (unsigned long long)process.major_faults, (unsigned long long)process.minor_faults,
+            (double)process.read_bytes * mb);
+}
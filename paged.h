@@ -0,0 +1,211 @@
+#ifndef PAGED_H
+#define PAGED_H
+
+#include "hittable.h"
+#include "bvh.h"
+#include "sidecar.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PAGED_CLUSTER_TRIANGLES 4096      // Triangles per cluster when converting a mesh
+#define PAGED_MAX_CLUSTER_TRIANGLES 65536 // Keeps a cluster at a few MB
+#define PAGED_ALIGN 4096                  // Clusters start on page boundaries
+#define PAGED_DEFAULT_CACHE_MB 256        // Cluster budget when the render settings give none
+#define PAGED_FILE_SUFFIX ".rtpage"
+
+// -----------------------------------------------------------------------------
+// Out-of-core (paged) triangle meshes
+// -----------------------------------------------------------------------------
+// A paged mesh keeps its triangles in a file instead of the scene, so it can
+// be larger than memory. The file holds clusters of spatially close
+// triangles, each a complete local BVH (nodes, then the triangle SoA) that
+// starts on a page boundary, followed by a directory of the clusters and a
+// top-level tree over their boxes. The file is mapped read-only; the header,
+// directory and top-level tree are all a ray needs to find the clusters it
+// crosses and stay resident, the clusters are paged in on demand.
+//
+// Rays visit the clusters along them nearest entry first (ties by cluster
+// index) and stop once a hit is closer than the next cluster's box. Single
+// rays do that one cluster at a time. Batches of rays are binned by cluster
+// instead (paged_mesh_intersect_batch): each ray waits at the next cluster it
+// has to visit, and every bin is traced as a whole, so a cluster is paged in
+// once per batch instead of once per ray. Both give exactly the same hits.
+//
+// All paged meshes of a scene share one cache with a byte budget. A cluster
+// is resident from its first visit, which asks the kernel to read it in
+// (MADV_WILLNEED), until the cache evicts it with the CLOCK algorithm and
+// drops its pages (MADV_DONTNEED). Visits to resident clusters take no lock.
+// The data stays valid after an eviction: a thread still tracing through the
+// cluster just faults its pages back in, so the budget may be overrun
+// briefly but never gives a wrong hit.
+//
+// Paged meshes are converted once: a mesh file (see mesh.h) becomes
+// "<path>.rtpage", redone when the mesh's size or modification time changes.
+// Files ending in ".rtpage" are opened as they are, and PagedWriter writes
+// them a cluster at a time, so a generated mesh never has to fit in memory.
+// Materials of paged meshes cannot be emissive or textured.
+
+// One cluster in the directory
+typedef struct
+{
+    uint64_t offset;   // File offset of the nodes, PAGED_ALIGN aligned
+    uint32_t bytes;    // Nodes, padding and triangle SoA
+    uint32_t node_count;
+    uint32_t triangle_count;
+    uint32_t reserved;
+} PagedCluster;
+
+typedef struct t_paged_cache PagedCache;
+
+struct t_paged_mesh
+{
+    const uint8_t *mapping; // The whole file
+    size_t mapping_size;
+    const PagedCluster *clusters; // Directory, in the mapping
+    const BvhNode *top; // Top-level tree, each leaf holds one cluster (offset)
+    uint32_t cluster_count;
+    uint32_t top_node_count;
+    uint64_t triangle_count;
+    uint8_t *state;     // Residency of every cluster, see paged.c
+    PagedCache *cache;
+};
+
+// A resident cluster, in the cache's clock
+typedef struct
+{
+    const PagedMesh *mesh;
+    uint32_t cluster;
+} PagedSlot;
+
+struct t_paged_cache
+{
+    pthread_mutex_t lock; // Guards the clock and the byte counts
+    PagedSlot *slots;     // Resident clusters, room for every cluster there is
+    uint32_t slot_count;
+    uint32_t slot_capacity;
+    uint32_t hand;
+    size_t budget_bytes;
+    size_t resident_bytes;
+    bool page_aligned; // Clusters are whole pages, their pages can be dropped
+    uint64_t requests;  // Updated atomically
+    uint64_t binned_requests;
+    uint64_t binned_rays;
+    uint64_t loads;
+    uint64_t load_bytes;
+    uint64_t evictions;
+};
+
+// Lifecycle: paged_geometry_init, paged_geometry_add, paged_geometry_prepare
+// before rendering, tracing from any thread, paged_geometry_free.
+typedef struct
+{
+    PagedMesh **meshes;
+    uint32_t count;
+    uint32_t capacity;
+    PagedCache *cache; // Allocated with the first mesh
+} PagedGeometry;
+
+typedef struct
+{
+    uint64_t requests;        // Cluster visits: one per ray, or one per bin of a batch
+    uint64_t binned_requests; // The visits of batches
+    uint64_t binned_rays;     // And the rays they traced through the cluster
+    uint64_t loads;           // Logical: clusters made resident, their pages may still be cached
+    uint64_t load_bytes;      // Size of those clusters, not storage reads
+    uint64_t evictions;
+    size_t resident_bytes;
+    size_t budget_bytes;
+    uint64_t cluster_count;
+    uint64_t triangle_count;
+    uint64_t file_bytes;
+} PagedStats;
+
+// Closest hit in a paged mesh: the cluster and the triangle's slot in its SoA
+typedef struct
+{
+    uint32_t cluster;
+    uint32_t prim;
+} PagedHit;
+
+// Rays and per-ray state of paged_mesh_intersect_batch, one per thread
+typedef struct
+{
+    Ray *rays;
+    double *t_max;
+    PagedHit *hits;
+    bool *found;
+    double *entry;     // Entry distance of the last cluster visited
+    uint32_t *cluster; // And its index
+    uint32_t *active;  // Rays with clusters left to visit
+    uint64_t *keys;    // Cluster << 32 | ray, sorted into bins
+    uint32_t capacity;
+} PagedBatch;
+
+void paged_geometry_init(PagedGeometry *pg);
+
+void paged_geometry_free(PagedGeometry *pg);
+
+// Opens the paged mesh at path, converting a mesh file first unless its
+// converted file is up to date (thread_count threads import the mesh), and
+// returns it in *mesh. Prints the reason and returns false on failure.
+bool paged_geometry_add(PagedGeometry *pg, const char *path, int thread_count, const PagedMesh **mesh);
+
+// Sets the cache budget and evicts down to it, at least one cluster always
+// stays. Call before rendering and never while rays are traced.
+void paged_geometry_prepare(PagedGeometry *pg, size_t budget_bytes);
+
+// Closest hit of r in (t_min, *t_max]: lowers *t_max and fills *hit
+bool paged_mesh_intersect(const PagedMesh *pm, Ray r, double t_min, double *t_max, PagedHit *hit);
+
+// Fills rec for the hit paged_mesh_intersect reported, at distance t
+void paged_mesh_hit_record(const PagedMesh *pm, MaterialId material, PagedHit hit, Ray r, double t, HitRecord *rec);
+
+// Makes room for count rays, returns false on allocation failure
+bool paged_batch_reserve(PagedBatch *batch, uint32_t count);
+
+void paged_batch_free(PagedBatch *batch);
+
+// paged_mesh_intersect for batch->rays[0, count) with the limits in
+// batch->t_max, binned by cluster. Sets batch->found[i], and for the rays
+// that hit lowers batch->t_max[i] and fills batch->hits[i].
+void paged_mesh_intersect_batch(const PagedMesh *pm, PagedBatch *batch, uint32_t count, double t_min);
+
+void paged_geometry_stats(const PagedGeometry *pg, PagedStats *stats);
+
+// Prints the cache statistics, the process's page faults, storage reads and
+// resident memory. Rays per visit are shown for binned tracing only.
+void paged_stats_print(FILE *output, const PagedGeometry *pg);
+
+// -----------------------------------------------------------------------------
+// Writing paged meshes
+// -----------------------------------------------------------------------------
+// paged_writer_begin, one paged_writer_add per cluster, paged_writer_finish.
+// Only the cluster being added and the directory are held in memory.
+typedef struct
+{
+    FILE *file;
+    uint64_t position; // End of the last cluster
+    PagedCluster *clusters;
+    BvhNode *boxes; // Top-level leaf of every cluster
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t triangle_count;
+    SidecarStamp source; // Of the mesh file converted, all zero for generated meshes
+} PagedWriter;
+
+// Starts a paged mesh in file, which must be open for writing and seekable
+void paged_writer_begin(PagedWriter *w, FILE *file);
+
+// Appends the triangles of mesh as one cluster, at most
+// PAGED_MAX_CLUSTER_TRIANGLES. The vertices need not be shared.
+bool paged_writer_add(PagedWriter *w, const Mesh *mesh);
+
+// Builds the top-level tree, writes the directory and the header and frees
+// the writer. With ok false it only frees. Returns false if anything failed.
+bool paged_writer_finish(PagedWriter *w, bool ok);
+
+#endif // PAGED_H
@@ -0,0 +1,429 @@
+#include "progressive.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char checkpoint_magic[8] = {'R', 'T', 'C', 'H', 'K', 'P', 'T', '\0'};
+
+// The pixel sums follow the header directly
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t samples; // Per pixel, in every pixel
+    int32_t width;
+    int32_t height;
+    int32_t region_x0; // Pixels the sums cover, the clipped region
+    int32_t region_y0;
+    int32_t region_x1;
+    int32_t region_y1;
+    int32_t max_depth;
+    int32_t roulette_depth;
+    uint32_t frame;
+    uint32_t sampler;    // SamplerType
+    uint32_t planned;    // Samples per pixel the stratified sampler plans for, else 0
+    uint32_t color_size; // sizeof(Color), differs between float and double builds
+    uint64_t key;        // Hash of the camera and scene, see render_key
+} CheckpointHeader;
+
+static volatile sig_atomic_t interrupted;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    interrupted = 1;
+}
+
+static double elapsed_seconds(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Identifies what a checkpoint was rendered from. Catches a different camera
+// or a different number of objects, not every edit to the scene.
+static uint64_t render_key(const Scene *scene, const Camera *camera)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = fnv1a(hash, &camera->center, sizeof(camera->center));
+    hash = fnv1a(hash, &camera->pixel_delta_u, sizeof(camera->pixel_delta_u));
+    hash = fnv1a(hash, &camera->pixel_delta_v, sizeof(camera->pixel_delta_v));
+    hash = fnv1a(hash, &camera->pixel00_loc, sizeof(camera->pixel00_loc));
+    uint64_t count = scene->hittable_count;
+    return fnv1a(hash, &count, sizeof(count));
+}
+
+// -----------------------------------------------------------------------------
+// Checkpoint files
+// -----------------------------------------------------------------------------
+
+static bool checkpoint_write(const char *path, const CheckpointHeader *header, const Framebuffer *sums)
+{
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid()) >= (int)sizeof(tmp_path))
+        return false;
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file)
+        return false;
+    size_t count = (size_t)sums->width * (size_t)sums->height;
+    bool ok = fwrite(header, sizeof(*header), 1, file) == 1 &&
+              fwrite(sums->pixels, sizeof(Color), count, file) == count;
+    // The data must be on disk before the rename makes it the checkpoint
+    ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(tmp_path, path) == 0;
+    if (!ok)
+        unlink(tmp_path);
+    return ok;
+}
+
+// Loads the sums of a matching checkpoint. A missing file leaves *samples at
+// 0 and succeeds, anything else that does not fit the render fails.
+static bool checkpoint_read(const char *path, const CheckpointHeader *expected, Framebuffer *sums, uint32_t *samples)
+{
+    *samples = 0;
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        if (errno == ENOENT)
+            return true;
+        fprintf(stderr, "checkpoint_read: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    CheckpointHeader header;
+    const char *error = NULL;
+    size_t count = (size_t)sums->width * (size_t)sums->height;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, checkpoint_magic, sizeof(checkpoint_magic)) != 0)
+        error = "not a checkpoint file";
+    else if (header.version != CHECKPOINT_VERSION)
+        error = "unsupported checkpoint version";
+    else if (header.width != expected->width || header.height != expected->height ||
+             header.region_x0 != expected->region_x0 || header.region_y0 != expected->region_y0 ||
+             header.region_x1 != expected->region_x1 || header.region_y1 != expected->region_y1 ||
+             header.max_depth != expected->max_depth || header.roulette_depth != expected->roulette_depth ||
+             header.frame != expected->frame || header.sampler != expected->sampler ||
+             header.color_size != expected->color_size || header.key != expected->key)
+        error = "checkpoint belongs to a different render";
+    else if (header.planned != expected->planned)
+        error = "stratified checkpoints resume only to the samples per pixel they were started with";
+    else if (fread(sums->pixels, sizeof(Color), count, file) != count)
+        error = "truncated checkpoint";
+    fclose(file);
+
+    if (error)
+    {
+        fprintf(stderr, "checkpoint_read: %s: %s\n", path, error);
+        return false;
+    }
+    *samples = header.samples;
+    return true;
+}
+
+// Writes the preview under a temporary name, so viewers never see half an
+// image. A region render shows the region, alone or pasted into merge_base.
+static bool write_preview(const ProgressiveSettings *progressive, RenderRegion region, const Framebuffer *fb)
+{
+    const char *path = progressive->preview_path;
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid()) >= (int)sizeof(tmp_path))
+        return false;
+
+    Framebuffer cropped = {0};
+    const Framebuffer *image = fb;
+    bool whole = region.x0 == 0 && region.y0 == 0 && region.x1 == fb->width && region.y1 == fb->height;
+    if (!whole || progressive->merge_base)
+    {
+        if (!render_region_image(&cropped, fb, region, progressive->merge_base))
+            return false;
+        image = &cropped;
+    }
+    bool ok = framebuffer_write_file(tmp_path, image, progressive->preview_format) && rename(tmp_path, path) == 0;
+    if (!ok)
+        unlink(tmp_path);
+    framebuffer_free(&cropped);
+    return ok;
+}
+
+// -----------------------------------------------------------------------------
+// Watched files
+// -----------------------------------------------------------------------------
+
+void file_stamp(const char *path, FileStamp *stamp)
+{
+    struct stat st;
+    memset(stamp, 0, sizeof(*stamp));
+    if (stat(path, &st) == 0)
+    {
+        stamp->mtime = st.st_mtim;
+        stamp->size = st.st_size;
+        stamp->inode = st.st_ino;
+    }
+}
+
+bool file_stamp_equal(const FileStamp *a, const FileStamp *b)
+{
+    return a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec && a->size == b->size &&
+           a->inode == b->inode;
+}
+
+static bool watch_changed(const ProgressiveSettings *progressive)
+{
+    if (!progressive->watch_path)
+        return false;
+    FileStamp now;
+    file_stamp(progressive->watch_path, &now);
+    return !file_stamp_equal(&now, &progressive->watch_stamp);
+}
+
+// RenderSettings.cancel of watched renders, so a save is noticed within a tile
+static bool watch_cancel(void *context)
+{
+    return watch_changed(context);
+}
+
+// -----------------------------------------------------------------------------
+// Coarse-to-fine levels
+// -----------------------------------------------------------------------------
+
+// Shows a level: every pixel of the region takes the color of the lattice
+// pixel above and left of it
+static void fill_level(Framebuffer *display, const Framebuffer *fb, RenderRegion region, int step)
+{
+    for (int y = region.y0; y < region.y1; y++)
+    {
+        const Color *row = &fb->pixels[(size_t)(region.y0 + (y - region.y0) / step * step) * (size_t)fb->width];
+        for (int x = region.x0; x < region.x1; x++)
+            *framebuffer_at(display, x, y) = row[region.x0 + (x - region.x0) / step * step];
+    }
+}
+
+// Renders the levels coarser than full resolution into fb, down to the
+// lattice of step 2, and returns that step's skip for the first pass: 2, or
+// 0 when there were no levels. Returns -1 when stopped by a signal or a
+// change of the watched file, or when a level could not be rendered.
+static int render_levels(Framebuffer *fb, Scene *scene, const Camera *camera, const RenderSettings *pass_settings,
+                         const ProgressiveSettings *progressive, RenderRegion region, const struct timespec *start)
+{
+    int coarse = progressive->coarse_step > 0 ? progressive->coarse_step : PROGRESSIVE_DEFAULT_COARSE_STEP;
+    int first = 1;
+    while (first * 2 <= coarse)
+        first *= 2;
+    if (first == 1)
+        return 0;
+
+    Framebuffer display = {0};
+    if (progressive->preview_path && !framebuffer_init(&display, fb->width, fb->height))
+    {
+        fprintf(stderr, "render_progressive: could not allocate the level preview\n");
+        return -1;
+    }
+    Camera level_camera = *camera;
+    level_camera.samples_per_pixel = 1;
+    RenderSettings level_settings = *pass_settings;
+    level_settings.accumulation = NULL;
+    level_settings.first_sample = 0;
+
+    int step;
+    for (step = first; step > 1 && !interrupted; step /= 2)
+    {
+        level_settings.lattice_step = step;
+        level_settings.lattice_skip = step < first ? 2 * step : 0;
+        if (!render_tiles(fb, scene, &level_camera, &level_settings).ok)
+            break;
+        if (watch_changed(progressive))
+            break;
+        fprintf(stderr, "Level done: 1/%d resolution, %.3f s\n", step, elapsed_seconds(start));
+        if (progressive->preview_path)
+        {
+            fill_level(&display, fb, region, step);
+            if (!write_preview(progressive, region, &display))
+                fprintf(stderr, "render_progressive: could not write preview %s\n", progressive->preview_path);
+        }
+    }
+    framebuffer_free(&display);
+    return step == 1 ? 2 : -1;
+}
+
+// -----------------------------------------------------------------------------
+// Pass loop
+// -----------------------------------------------------------------------------
+
+bool render_progressive(Framebuffer *fb, Scene *scene, Camera *camera, const RenderSettings *settings,
+                        const ProgressiveSettings *progressive)
+{
+    RenderSettings pass_settings = *settings;
+    pass_settings.adaptive.enabled = false;
+    pass_settings.wavefront = false;
+    pass_settings.total_samples = (uint32_t)camera->samples_per_pixel;
+    pass_settings.lattice_step = 0;
+    pass_settings.lattice_skip = 0;
+    pass_settings.cancel = progressive->watch_path ? watch_cancel : NULL;
+    pass_settings.cancel_context = (void *)progressive;
+    if (pass_settings.thread_count <= 0)
+        pass_settings.thread_count = render_default_thread_count();
+    size_t pass_spp = progressive->pass_spp > 0 ? progressive->pass_spp : PROGRESSIVE_DEFAULT_PASS_SPP;
+    size_t target = camera->samples_per_pixel;
+
+    RenderRegion region = settings->region;
+    if (!render_region_clip(&region, camera->image_width, camera->image_height))
+    {
+        fprintf(stderr, "render_progressive: the region lies outside the image\n");
+        return false;
+    }
+
+    Framebuffer sums;
+    if (!framebuffer_init(fb, camera->image_width, camera->image_height))
+    {
+        fprintf(stderr, "render_progressive: could not allocate framebuffer\n");
+        return false;
+    }
+    if (!framebuffer_init(&sums, camera->image_width, camera->image_height))
+    {
+        fprintf(stderr, "render_progressive: could not allocate accumulation buffer\n");
+        framebuffer_free(fb);
+        return false;
+    }
+
+    CheckpointHeader header = {
+        .version = CHECKPOINT_VERSION,
+        .width = camera->image_width,
+        .height = camera->image_height,
+        .region_x0 = region.x0,
+        .region_y0 = region.y0,
+        .region_x1 = region.x1,
+        .region_y1 = region.y1,
+        .max_depth = settings->max_depth,
+        .roulette_depth = settings->roulette_depth,
+        .frame = settings->frame,
+        .sampler = settings->sampler,
+        .planned = settings->sampler == SAMPLER_STRATIFIED ? (uint32_t)target : 0,
+        .color_size = sizeof(Color),
+        .key = render_key(scene, camera),
+    };
+    memcpy(header.magic, checkpoint_magic, sizeof(checkpoint_magic));
+
+    uint32_t done = 0;
+    if (progressive->checkpoint_path && progressive->resume)
+    {
+        if (!checkpoint_read(progressive->checkpoint_path, &header, &sums, &done))
+        {
+            framebuffer_free(&sums);
+            framebuffer_free(fb);
+            return false;
+        }
+        if (done > 0)
+            fprintf(stderr, "Resuming from %u samples per pixel\n", done);
+    }
+    if (done >= target && done > 0)
+    {
+        // Nothing left to render, the mean is computed as the passes would
+        for (size_t i = 0; i < (size_t)fb->width * (size_t)fb->height; i++)
+            fb->pixels[i] = vec3_scale(sums.pixels[i], 1.0 / (double)done);
+        if (done > target)
+            fprintf(stderr, "Checkpoint already holds %u samples per pixel, more than %zu\n", done, target);
+    }
+    else
+    {
+        fprintf(stderr, "Rendering %d x %d image with %zu samples per pixel in passes of %zu on %d threads\n",
+                camera->image_width, camera->image_height, target, pass_spp, pass_settings.thread_count);
+    }
+
+    // A first signal finishes the current pass and checkpoints, a second one
+    // kills the process as usual
+    struct sigaction action = {0}, old_int, old_term;
+    action.sa_handler = on_signal;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    interrupted = 0;
+    sigaction(SIGINT, &action, &old_int);
+    sigaction(SIGTERM, &action, &old_term);
+
+    struct timespec start, last_checkpoint;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    last_checkpoint = start;
+    bool ok = true, changed = false;
+    size_t next_spp = pass_spp;
+    if (progressive->coarse_to_fine && done == 0 && target > 0)
+    {
+        int skip = render_levels(fb, scene, camera, &pass_settings, progressive, region, &start);
+        changed = watch_changed(progressive);
+        ok = skip >= 0 || changed || interrupted;
+        // The first pass completes sample 0, the pixels of the levels are
+        // its starting sums
+        pass_settings.lattice_skip = skip > 0 ? skip : 0;
+        memcpy(sums.pixels, fb->pixels, sizeof(Color) * (size_t)fb->width * (size_t)fb->height);
+        next_spp = 1;
+    }
+    while (ok && done < target && !interrupted && !changed)
+    {
+        Camera pass_camera = *camera;
+        pass_camera.samples_per_pixel = target - done < next_spp ? target - done : next_spp;
+        pass_settings.accumulation = &sums;
+        pass_settings.first_sample = done;
+        if (!render_tiles(fb, scene, &pass_camera, &pass_settings).ok)
+        {
+            ok = false;
+            break;
+        }
+        // A save cancels the pass half done, and the render with it
+        changed = watch_changed(progressive);
+        if (changed)
+            break;
+        done += (uint32_t)pass_camera.samples_per_pixel;
+        pass_settings.lattice_skip = 0;
+        next_spp = 2 * next_spp < pass_spp ? 2 * next_spp : pass_spp;
+        fprintf(stderr, "Pass done: %u of %zu samples per pixel, %.1f s\n", done, target, elapsed_seconds(&start));
+
+        if (progressive->preview_path && !write_preview(progressive, region, fb))
+            fprintf(stderr, "render_progressive: could not write preview %s\n", progressive->preview_path);
+
+        if (progressive->checkpoint_path &&
+            (done >= target || interrupted || elapsed_seconds(&last_checkpoint) >= progressive->checkpoint_interval))
+        {
+            header.samples = done;
+            ok = checkpoint_write(progressive->checkpoint_path, &header, &sums);
+            if (!ok)
+                fprintf(stderr, "render_progressive: could not write checkpoint %s\n", progressive->checkpoint_path);
+            clock_gettime(CLOCK_MONOTONIC, &last_checkpoint);
+        }
+    }
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    if (ok && done < target && changed)
+    {
+        fprintf(stderr, "%s changed, stopped at %u of %zu samples per pixel\n", progressive->watch_path, done, target);
+        ok = false;
+    }
+    else if (ok && done < target)
+    {
+        fprintf(stderr, "Interrupted at %u of %zu samples per pixel%s\n", done, target,
+                progressive->checkpoint_path ? ", resume from the checkpoint" : "");
+        ok = false;
+    }
+
+    framebuffer_free(&sums);
+    if (!ok)
+        framebuffer_free(fb);
+    return ok;
+}
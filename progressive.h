@@ -0,0 +1,85 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include "render.h"
+
+#include <sys/types.h>
+#include <time.h>
+
+#define PROGRESSIVE_DEFAULT_PASS_SPP 8
+#define PROGRESSIVE_DEFAULT_COARSE_STEP 16 // First coarse-to-fine level renders 1/16 of the width and height
+#define PROGRESSIVE_DEFAULT_CHECKPOINT_INTERVAL 30.0 // Seconds
+
+// Bump whenever the checkpoint layout changes
+#define CHECKPOINT_VERSION 6
+
+// -----------------------------------------------------------------------------
+// Progressive rendering
+// -----------------------------------------------------------------------------
+// The image is rendered in passes of pass_spp samples per pixel into an
+// accumulation buffer of per-pixel sums. After every pass the current mean is
+// written to preview_path. Every checkpoint_interval seconds, after the last
+// pass and when SIGINT or SIGTERM arrives, the sums are written to
+// checkpoint_path. Both files are written under a temporary name and renamed,
+// so a crash never leaves a torn file behind.
+//
+// Every sample seeds its Sampler from (pixel, sample, frame), so the number
+// of samples taken is the whole sampler state. A resumed render continues
+// with the next sample index: resuming gives the same image as an
+// uninterrupted render, and resuming with a higher camera->samples_per_pixel
+// extends the old one. The stratified sampler plans its strata for the
+// target, so its checkpoints resume only to the target they were planned for
+// and cannot be extended.
+//
+// Coarse-to-fine mode puts levels in front of the passes, for quick feedback
+// while editing a scene. Level one takes sample 0 of every coarse_step-th
+// pixel of every coarse_step-th row, each following level halves the step
+// and renders only the pixels the coarser levels have not, until every pixel
+// holds its sample 0. Previews of a level show every pixel in the color of
+// the lattice pixel above and left of it. The passes then continue with
+// sample 1 in passes of 1, 2, 4 .. up to pass_spp samples, so no sample is
+// taken twice and the final image is the one a fixed render gives.
+//
+// With settings->region the render and its previews cover the region alone,
+// or the region pasted into merge_base when that is set. Checkpoints record
+// the region and resume only a render of the same one.
+
+// Identifies one version of a file, to notice that it was saved again
+typedef struct
+{
+    struct timespec mtime;
+    off_t size;
+    ino_t inode;
+} FileStamp;
+
+// Stamps path, a missing file gets a zero stamp
+void file_stamp(const char *path, FileStamp *stamp);
+
+bool file_stamp_equal(const FileStamp *a, const FileStamp *b);
+
+typedef struct
+{
+    size_t pass_spp;
+    const char *preview_path;    // NULL for no previews
+    ImageFormat preview_format;
+    const char *checkpoint_path; // NULL for no checkpoints
+    double checkpoint_interval;  // Seconds, <= 0 checkpoints after every pass
+    bool resume;                 // Start from checkpoint_path when it exists
+    bool coarse_to_fine;         // Render the levels first, see above
+    int coarse_step;             // Rounded down to a power of two, <= 0 means default
+    const Framebuffer *merge_base; // Optional, same size as the image
+    // Optional. The render stops within a tile once watch_path no longer
+    // matches watch_stamp, settings->cancel is replaced for that.
+    const char *watch_path;
+    FileStamp watch_stamp;
+} ProgressiveSettings;
+
+// Renders camera->samples_per_pixel samples per pixel into fb, which is
+// allocated here as in render_scene. settings->adaptive, settings->wavefront
+// and the settings' lattice are ignored. Returns false on failure, when the
+// render was interrupted by a signal after writing its checkpoint, or when
+// the watched file changed (no checkpoint is written then).
+bool render_progressive(Framebuffer *fb, Scene *scene, Camera *camera, const RenderSettings *settings,
+                        const ProgressiveSettings *progressive);
+
+#endif // PROGRESSIVE_H
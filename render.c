@@ -0,0 +1,809 @@
+#include "render.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// -----------------------------------------------------------------------------
+// Tile work-stealing deque
+// -----------------------------------------------------------------------------
+// Each worker owns a deque of tile indices. The owner pops from the bottom,
+// idle workers steal from the top, so the owner keeps walking through a
+// spatially coherent run of tiles while thieves take the far end of it.
+typedef struct
+{
+    pthread_mutex_t lock;
+    int *tiles;
+    int top;    // Next index thieves steal from
+    int bottom; // One past the next index the owner pops
+} TileDeque;
+
+typedef struct
+{
+    int x0, y0; // Top-left pixel (framebuffer rows, 0 is the top)
+    int x1, y1; // One past the bottom-right pixel
+} Tile;
+
+typedef struct
+{
+    Framebuffer *fb;
+    Scene *scene;
+    Camera *camera;
+    int max_depth;
+    int roulette_depth;
+    SamplerSetup sampling;
+    bool packets;
+    bool wavefront;
+    int tile_size;
+    AdaptiveSettings adaptive;
+    size_t max_samples; // Per pixel, counting the samples already accumulated
+    uint32_t *spp_map;
+    Framebuffer *accumulation;
+    uint32_t first_sample;
+    RenderAovs *aovs;
+    int lattice_step;   // 1 renders every pixel
+    int lattice_skip;
+    int origin_x;       // Top-left pixel of the region, where the lattice starts
+    int origin_y;
+    bool (*cancel)(void *context);
+    void *cancel_context;
+    int cancelled;      // Set once cancel returned true, read atomically
+    uint64_t samples;   // Totals, summed atomically by the workers
+    uint64_t rays;
+
+    Tile *tiles;
+    TileDeque *deques;
+    struct t_worker *workers;
+    int worker_count;
+} RenderJob;
+
+typedef struct t_worker
+{
+    RenderJob *job;
+    int id;
+} Worker;
+
+static bool deque_pop(TileDeque *d, int *tile)
+{
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top)
+    {
+        *tile = d->tiles[--d->bottom];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static bool deque_steal(TileDeque *d, int *tile)
+{
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top)
+    {
+        *tile = d->tiles[d->top++];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+// Tiles are never pushed after the render starts, so once every deque is
+// empty there is no work left and the worker can exit.
+static bool next_tile(RenderJob *job, int id, int *tile)
+{
+    if (deque_pop(&job->deques[id], tile))
+        return true;
+
+    for (int k = 1; k < job->worker_count; k++)
+    {
+        int victim = (id + k) % job->worker_count;
+        if (deque_steal(&job->deques[victim], tile))
+            return true;
+    }
+    return false;
+}
+
+// -----------------------------------------------------------------------------
+// Per-pixel estimates
+// -----------------------------------------------------------------------------
+
+// Running sum plus luminance mean and variance of one pixel (Welford)
+typedef struct
+{
+    Color sum;
+    double mean;
+    double m2; // Sum of squared deviations from the mean
+    uint32_t count;
+} PixelEstimate;
+
+static void estimate_add(PixelEstimate *e, Color c)
+{
+    e->sum = vec3_add(e->sum, c);
+    e->count++;
+    double l = 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z;
+    double delta = l - e->mean;
+    e->mean += delta / e->count;
+    e->m2 += delta * (l - e->mean);
+}
+
+// Starts a pixel from the samples accumulated by earlier passes, if any
+static PixelEstimate estimate_begin(const RenderJob *job, int x, int y)
+{
+    PixelEstimate e = {0};
+    if (job->accumulation)
+    {
+        e.sum = *framebuffer_at(job->accumulation, x, y);
+        e.count = job->first_sample;
+    }
+    return e;
+}
+
+// True once the pixel needs no more samples
+static bool estimate_done(const PixelEstimate *e, const RenderJob *job)
+{
+    if (e->count >= job->max_samples)
+        return true;
+    if (!job->adaptive.enabled || e->count < job->adaptive.min_spp)
+        return false;
+
+    double half_width = 1.96 * sqrt(e->m2 / (e->count - 1) / e->count);
+    // Output is gamma 2, and d sqrt(L) = dL / (2 sqrt(L))
+    double display_error = half_width / (2.0 * sqrt(fmax(e->mean, ADAPTIVE_MIN_LUMINANCE)));
+    return display_error <= job->adaptive.threshold;
+}
+
+// Stores the final pixel and returns the samples taken in this pass
+static uint32_t estimate_store(const PixelEstimate *e, RenderJob *job, int x, int y)
+{
+    *framebuffer_at(job->fb, x, y) = vec3_scale(e->sum, 1.0 / (double)e->count);
+    if (job->accumulation)
+        *framebuffer_at(job->accumulation, x, y) = e->sum;
+    if (job->spp_map)
+        job->spp_map[(size_t)y * (size_t)job->fb->width + (size_t)x] = e->count;
+    return e->count - (job->accumulation ? job->first_sample : 0);
+}
+
+// First-hit sums of one pixel, only kept when the job has AOVs
+typedef struct
+{
+    Color albedo;
+    Vec3 normal;
+    double depth;
+} AovEstimate;
+
+static void aov_add_hit(AovEstimate *a, const Scene *scene, Ray r, const HitRecord *rec)
+{
+    // Triangles and planes do not orient their normals, turn them to the camera
+    Vec3 n = vec3_dot(rec->normal, r.direction) > 0 ? vec3_scale(rec->normal, -1) : rec->normal;
+    Material textured;
+    a->albedo = vec3_add(a->albedo, scene_material(scene, rec, &textured)->color);
+    a->normal = vec3_add(a->normal, n);
+    a->depth += rec->t;
+}
+
+static void aov_add_miss(AovEstimate *a, Ray r)
+{
+    a->albedo = vec3_add(a->albedo, sky_color(r));
+}
+
+static void aov_store(const AovEstimate *a, const PixelEstimate *e, RenderJob *job, int x, int y)
+{
+    RenderAovs *aovs = job->aovs;
+    size_t index = (size_t)y * (size_t)job->fb->width + (size_t)x;
+    double inv = 1.0 / (double)e->count;
+    *framebuffer_at(&aovs->albedo, x, y) = vec3_scale(a->albedo, inv);
+    *framebuffer_at(&aovs->normal, x, y) = vec3_scale(a->normal, inv);
+    aovs->depth[index] = a->depth * inv;
+    aovs->variance[index] = e->count > 1 ? e->m2 / (e->count - 1) / e->count : 0.0;
+}
+
+// Same as ray_color, but adds the first hit to the pixel's AOV sums
+static Color trace_with_aovs(RenderJob *job, Ray r, Sampler *sampler, AovEstimate *aov)
+{
+    HitRecord rec;
+    if (job->max_depth <= 0)
+    {
+        aov_add_miss(aov, r);
+        STATS_PATH_END(STATS_MAX_DEPTH, 0);
+        return vec3_create(0, 0, 0);
+    }
+    if (scene_hit(job->scene, r, RAY_T_MIN, RAY_T_MAX, &rec))
+    {
+        aov_add_hit(aov, job->scene, r, &rec);
+        return shade_hit(job->scene, r, &rec, job->max_depth, job->roulette_depth, sampler);
+    }
+    aov_add_miss(aov, r);
+    STATS_PATH_END(STATS_ESCAPED, 0);
+    return sky_color(r);
+}
+
+// -----------------------------------------------------------------------------
+// Tile renderers
+// -----------------------------------------------------------------------------
+
+// First lattice coordinate at or after from
+static inline int lattice_first(int from, int origin, int step)
+{
+    return from + (step - (from - origin) % step) % step;
+}
+
+// True for lattice pixels a coarser level already rendered
+static inline bool lattice_skipped(const RenderJob *job, int x, int y)
+{
+    return job->lattice_skip > 0 && (x - job->origin_x) % job->lattice_skip == 0 &&
+           (y - job->origin_y) % job->lattice_skip == 0;
+}
+
+static uint64_t render_tile(RenderJob *job, const Tile *tile)
+{
+    Camera *camera = job->camera;
+    uint64_t samples = 0;
+    int step = job->lattice_step;
+
+    for (int y = lattice_first(tile->y0, job->origin_y, step); y < tile->y1; y += step)
+    {
+        // Framebuffer rows run top to bottom, camera rows bottom to top
+        int j = camera->image_height - 1 - y;
+        for (int i = lattice_first(tile->x0, job->origin_x, step); i < tile->x1; i += step)
+        {
+            if (lattice_skipped(job, i, y))
+                continue;
+            uint32_t pixel_index = (uint32_t)(j * camera->image_width + i);
+
+            PixelEstimate estimate = estimate_begin(job, i, y);
+            AovEstimate aov = {0};
+            for (uint32_t s = estimate.count; !estimate_done(&estimate, job); s++)
+            {
+                Sampler sampler;
+                sampler_start(&sampler, &job->sampling, i, j, pixel_index, s);
+
+                Ray r = camera_get_ray(camera, i, j, &sampler);
+                Color c = job->aovs ? trace_with_aovs(job, r, &sampler, &aov)
+                                    : ray_color(job->scene, r, job->max_depth, job->roulette_depth, &sampler);
+                estimate_add(&estimate, c);
+            }
+            samples += estimate_store(&estimate, job, i, y);
+            if (job->aovs)
+                aov_store(&aov, &estimate, job, i, y);
+        }
+    }
+    return samples;
+}
+
+// Same result as render_tile, but every sample of a 4x4 pixel block is traced
+// as one packet up to the first hit. Each ray keeps its own Sampler, so the rest
+// of its path continues exactly as in single-ray mode. Pixels leave the
+// packet once they are done. On a coarse lattice a packet is a 4x4 block of
+// lattice pixels.
+static uint64_t render_tile_packets(RenderJob *job, const Tile *tile, PacketStats *stats)
+{
+    Camera *camera = job->camera;
+    uint64_t samples = 0;
+    int step = job->lattice_step;
+
+    for (int by = lattice_first(tile->y0, job->origin_y, step); by < tile->y1; by += PACKET_WIDTH * step)
+    {
+        for (int bx = lattice_first(tile->x0, job->origin_x, step); bx < tile->x1; bx += PACKET_WIDTH * step)
+        {
+            int px[PACKET_SIZE], py[PACKET_SIZE];
+            uint32_t pixels = 0;
+            PixelEstimate estimates[PACKET_SIZE];
+            AovEstimate aovs[PACKET_SIZE] = {0};
+            for (int k = 0; k < PACKET_SIZE; k++)
+            {
+                px[k] = bx + k % PACKET_WIDTH * step;
+                py[k] = by + k / PACKET_WIDTH * step;
+                if (px[k] < tile->x1 && py[k] < tile->y1 && !lattice_skipped(job, px[k], py[k]))
+                {
+                    estimates[k] = estimate_begin(job, px[k], py[k]);
+                    pixels |= 1u << k;
+                }
+            }
+            uint32_t valid = pixels;
+
+            for (uint32_t s = job->accumulation ? job->first_sample : 0; valid; s++)
+            {
+                Sampler samplers[PACKET_SIZE];
+                Ray rays[PACKET_SIZE];
+                HitRecord recs[PACKET_SIZE];
+                for (int k = 0; k < PACKET_SIZE; k++)
+                {
+                    if (!(valid & (1u << k)))
+                        continue;
+                    int j = camera->image_height - 1 - py[k];
+                    sampler_start(&samplers[k], &job->sampling, px[k], j, (uint32_t)(j * camera->image_width + px[k]), s);
+                    rays[k] = camera_get_ray(camera, px[k], j, &samplers[k]);
+                }
+
+                uint32_t hits = 0;
+                if (job->max_depth > 0)
+                {
+                    RayPacket packet;
+                    packet_init(&packet, rays, valid, RAY_T_MAX);
+                    hits = scene_hit_packet(job->scene, &packet, RAY_T_MIN, recs, stats);
+                }
+
+                for (int k = 0; k < PACKET_SIZE; k++)
+                {
+                    if (!(valid & (1u << k)))
+                        continue;
+                    Color c = vec3_create(0, 0, 0);
+                    bool hit = job->max_depth > 0 && (hits & (1u << k));
+                    if (job->aovs)
+                    {
+                        // Before shade_hit, which moves the record along the path
+                        if (hit)
+                            aov_add_hit(&aovs[k], job->scene, rays[k], &recs[k]);
+                        else
+                            aov_add_miss(&aovs[k], rays[k]);
+                    }
+                    if (job->max_depth <= 0)
+                        STATS_PATH_END(STATS_MAX_DEPTH, 0);
+                    else if (hit)
+                        c = shade_hit(job->scene, rays[k], &recs[k], job->max_depth, job->roulette_depth, &samplers[k]);
+                    else
+                    {
+                        c = sky_color(rays[k]);
+                        STATS_PATH_END(STATS_ESCAPED, 0);
+                    }
+                    estimate_add(&estimates[k], c);
+                    if (estimate_done(&estimates[k], job))
+                        valid &= ~(1u << k);
+                }
+            }
+
+            for (int k = 0; k < PACKET_SIZE; k++)
+            {
+                if (!(pixels & (1u << k)))
+                    continue;
+                samples += estimate_store(&estimates[k], job, px[k], py[k]);
+                if (job->aovs)
+                    aov_store(&aovs[k], &estimates[k], job, px[k], py[k]);
+            }
+        }
+    }
+    return samples;
+}
+
+static bool job_cancelled(RenderJob *job)
+{
+    if (!job->cancel)
+        return false;
+    if (__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED))
+        return true;
+    if (!job->cancel(job->cancel_context))
+        return false;
+    __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static void *render_worker(void *arg)
+{
+    Worker *worker = arg;
+    RenderJob *job = worker->job;
+    PacketStats stats = {0};
+    PathQueue queue;
+    uint64_t samples = 0;
+    int tile;
+    bool wavefront = job->wavefront;
+    bool packets = job->packets && !wavefront;
+
+    scene_take_ray_count(); // Worker 0 is the calling thread, drop its earlier rays
+    stats_thread_reset();
+    if (wavefront)
+    {
+        uint32_t tile_pixels = (uint32_t)(job->tile_size * job->tile_size);
+        if (!path_queue_init(&queue, tile_pixels > WAVEFRONT_MAX_PATHS ? tile_pixels : WAVEFRONT_MAX_PATHS))
+        {
+            // The other workers may all be in the same position, so this
+            // one still renders its tiles, one path at a time
+            fprintf(stderr, "render_tiles: worker %d could not allocate its path queue, tracing single paths\n",
+                    worker->id);
+            wavefront = false;
+        }
+    }
+
+    while (!job_cancelled(job) && next_tile(job, worker->id, &tile))
+    {
+        const Tile *t = &job->tiles[tile];
+        if (wavefront)
+        {
+            wavefront_render_block(&queue, job->scene, job->camera, job->max_depth, job->roulette_depth,
+                                   &job->sampling, job->fb, t->x0, t->y0, t->x1, t->y1);
+            samples += (uint64_t)(t->x1 - t->x0) * (uint64_t)(t->y1 - t->y0) * job->max_samples;
+        }
+        else if (packets)
+        {
+            samples += render_tile_packets(job, t, &stats);
+        }
+        else
+        {
+            samples += render_tile(job, t);
+        }
+    }
+    if (wavefront)
+        path_queue_free(&queue);
+    packet_stats_merge(&job->scene->packet_stats, &stats);
+    stats_thread_merge(&job->scene->trace_stats);
+    __atomic_fetch_add(&job->samples, samples, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->rays, scene_take_ray_count(), __ATOMIC_RELAXED);
+    return NULL;
+}
+
+bool render_aovs_init(RenderAovs *aovs, int width, int height)
+{
+    size_t count = (size_t)width * (size_t)height;
+    *aovs = (RenderAovs){0};
+    bool ok = framebuffer_init(&aovs->albedo, width, height) && framebuffer_init(&aovs->normal, width, height);
+    aovs->depth = calloc(count, sizeof(double));
+    aovs->variance = calloc(count, sizeof(double));
+    if (ok && aovs->depth && aovs->variance)
+        return true;
+    render_aovs_free(aovs);
+    return false;
+}
+
+void render_aovs_free(RenderAovs *aovs)
+{
+    framebuffer_free(&aovs->albedo);
+    framebuffer_free(&aovs->normal);
+    free(aovs->depth);
+    free(aovs->variance);
+    *aovs = (RenderAovs){0};
+}
+
+int render_default_thread_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// -----------------------------------------------------------------------------
+// Persistent worker pool
+// -----------------------------------------------------------------------------
+
+static void *pool_thread(void *arg)
+{
+    RenderPool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    int id = ++pool->next_id;
+    uint64_t seen = pool->generation;
+    pthread_cond_broadcast(&pool->idle); // render_pool_init waits for every id
+    for (;;)
+    {
+        while (!pool->closing && pool->generation == seen)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->closing)
+            break;
+        seen = pool->generation;
+        RenderJob *job = pool->job;
+        pthread_mutex_unlock(&pool->lock);
+
+        // Small jobs use fewer workers than the pool has
+        if (id < job->worker_count)
+            render_worker(&job->workers[id]);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+bool render_pool_init(RenderPool *pool, int thread_count)
+{
+    *pool = (RenderPool){0};
+    pool->thread_count = thread_count > 0 ? thread_count : render_default_thread_count();
+    pool->threads = malloc(sizeof(pthread_t) * pool->thread_count);
+    if (!pool->threads)
+        return false;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    for (int t = 1; t < pool->thread_count; t++)
+    {
+        if (pthread_create(&pool->threads[pool->started], NULL, pool_thread, pool) != 0)
+        {
+            fprintf(stderr, "render_pool_init: could not start worker %d\n", t);
+            break;
+        }
+        pool->started++;
+    }
+
+    // A thread that has not taken its id yet would miss the first job
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next_id < pool->started)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+void render_pool_free(RenderPool *pool)
+{
+    if (!pool->threads)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int t = 0; t < pool->started; t++)
+        pthread_join(pool->threads[t], NULL);
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    *pool = (RenderPool){0};
+}
+
+// Runs job on the pool's threads plus the calling thread as worker 0
+static void pool_run(RenderPool *pool, RenderJob *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->busy = pool->started;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    render_worker(&job->workers[0]);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pool->job = NULL;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+bool render_region_clip(RenderRegion *region, int width, int height)
+{
+    if (region->x1 <= region->x0 || region->y1 <= region->y0)
+    {
+        *region = (RenderRegion){0, 0, width, height};
+        return width > 0 && height > 0;
+    }
+    region->x0 = region->x0 > 0 ? region->x0 : 0;
+    region->y0 = region->y0 > 0 ? region->y0 : 0;
+    region->x1 = region->x1 < width ? region->x1 : width;
+    region->y1 = region->y1 < height ? region->y1 : height;
+    return region->x1 > region->x0 && region->y1 > region->y0;
+}
+
+bool render_region_image(Framebuffer *out, const Framebuffer *fb, RenderRegion region, const Framebuffer *base)
+{
+    if (!render_region_clip(&region, fb->width, fb->height))
+        return false;
+    int width = region.x1 - region.x0, height = region.y1 - region.y0;
+    if (!base)
+    {
+        if (!framebuffer_init(out, width, height))
+            return false;
+        framebuffer_copy_rect(out, 0, 0, fb, region.x0, region.y0, width, height);
+        return true;
+    }
+    if (!framebuffer_init(out, base->width, base->height))
+        return false;
+    framebuffer_copy_rect(out, 0, 0, base, 0, 0, base->width, base->height);
+    framebuffer_copy_rect(out, region.x0, region.y0, fb, region.x0, region.y0, width, height);
+    return true;
+}
+
+RenderCounts render_tiles(Framebuffer *fb, Scene *scene, Camera *camera, const RenderSettings *settings)
+{
+    int tile_size = settings->tile_size > 0 ? settings->tile_size : RENDER_DEFAULT_TILE_SIZE;
+    RenderPool *pool = settings->pool;
+    int worker_count = settings->thread_count > 0 ? settings->thread_count : render_default_thread_count();
+    if (pool)
+        worker_count = pool->started + 1;
+
+    RenderRegion region = settings->region;
+    if (!render_region_clip(&region, fb->width, fb->height))
+        return (RenderCounts){.ok = true};
+    int lattice_step = settings->lattice_step > 1 ? settings->lattice_step : 1;
+    // Keep about as many lattice pixels per tile as a full-resolution tile has
+    tile_size *= lattice_step;
+    int tiles_x = (region.x1 - region.x0 + tile_size - 1) / tile_size;
+    int tiles_y = (region.y1 - region.y0 + tile_size - 1) / tile_size;
+    int tile_count = tiles_x * tiles_y;
+    if (tile_count == 0)
+        return (RenderCounts){.ok = true};
+    if (worker_count > tile_count)
+        worker_count = tile_count;
+    // The variance only covers the samples of this call
+    RenderAovs *aovs = settings->accumulation ? NULL : settings->aovs;
+
+    RenderJob job = {
+        .fb = fb,
+        .scene = scene,
+        .camera = camera,
+        .max_depth = settings->max_depth,
+        .roulette_depth = settings->roulette_depth,
+        .packets = settings->packets,
+        .wavefront = settings->wavefront && !settings->adaptive.enabled && !settings->accumulation && !aovs &&
+                     !settings->spp_map && lattice_step == 1 && settings->lattice_skip <= 1,
+        .tile_size = tile_size,
+        .adaptive = settings->adaptive,
+        .max_samples = settings->adaptive.enabled ? settings->adaptive.max_spp
+                                                  : settings->first_sample + camera->samples_per_pixel,
+        .spp_map = settings->spp_map,
+        .accumulation = settings->accumulation,
+        .first_sample = settings->first_sample,
+        .aovs = aovs,
+        .lattice_step = lattice_step,
+        .lattice_skip = settings->lattice_skip > lattice_step ? settings->lattice_skip : 0,
+        .origin_x = region.x0,
+        .origin_y = region.y0,
+        .cancel = settings->cancel,
+        .cancel_context = settings->cancel_context,
+        .tiles = malloc(sizeof(Tile) * tile_count),
+        .deques = malloc(sizeof(TileDeque) * worker_count),
+        .worker_count = worker_count,
+    };
+    // Stratification is planned for every sample the pixel will get
+    job.sampling = (SamplerSetup){
+        .type = settings->sampler,
+        .sample_count = (uint32_t)(settings->total_samples > 0 ? settings->total_samples : job.max_samples),
+        .frame = settings->frame,
+    };
+    sampler_prepare(settings->sampler);
+    int *tile_order = malloc(sizeof(int) * tile_count);
+    Worker *workers = malloc(sizeof(Worker) * worker_count);
+    pthread_t *threads = pool ? NULL : malloc(sizeof(pthread_t) * worker_count);
+    job.workers = workers;
+    bool ok = false;
+
+    if (!job.tiles || !job.deques || !tile_order || !workers || (!pool && !threads))
+    {
+        fprintf(stderr, "render_tiles: out of memory\n");
+        goto cleanup;
+    }
+    scene_set_texture_view(scene, camera, job.sampling.sample_count);
+    size_t texture_cache = settings->texture_cache_bytes > 0 ? settings->texture_cache_bytes
+                                                               : (size_t)TEXTURE_DEFAULT_CACHE_MB << 20;
+    if (!texture_system_prepare(&scene->textures, texture_cache))
+        goto cleanup;
+    paged_geometry_prepare(&scene->paged_geometry, settings->geometry_cache_bytes > 0
+                                                       ? settings->geometry_cache_bytes
+                                                       : (size_t)PAGED_DEFAULT_CACHE_MB << 20);
+
+    for (int t = 0; t < tile_count; t++)
+    {
+        Tile *tile = &job.tiles[t];
+        tile->x0 = region.x0 + (t % tiles_x) * tile_size;
+        tile->y0 = region.y0 + (t / tiles_x) * tile_size;
+        tile->x1 = tile->x0 + tile_size < region.x1 ? tile->x0 + tile_size : region.x1;
+        tile->y1 = tile->y0 + tile_size < region.y1 ? tile->y0 + tile_size : region.y1;
+        tile_order[t] = t;
+    }
+
+    // Give every worker a contiguous band of tiles. Popping from the bottom
+    // walks the band in reverse, which is fine since the order of tiles has
+    // no effect on the output.
+    for (int w = 0; w < worker_count; w++)
+    {
+        TileDeque *d = &job.deques[w];
+        int begin = (int)((long)tile_count * w / worker_count);
+        int end = (int)((long)tile_count * (w + 1) / worker_count);
+        pthread_mutex_init(&d->lock, NULL);
+        d->tiles = &tile_order[begin];
+        d->top = 0;
+        d->bottom = end - begin;
+    }
+
+    for (int w = 0; w < worker_count; w++)
+    {
+        workers[w].job = &job;
+        workers[w].id = w;
+    }
+    if (pool)
+    {
+        pool_run(pool, &job);
+    }
+    else
+    {
+        int started = 0;
+        for (int w = 1; w < worker_count; w++)
+        {
+            // The calling thread acts as worker 0
+            if (pthread_create(&threads[w], NULL, render_worker, &workers[w]) != 0)
+            {
+                // Tiles of workers that failed to start get stolen by the others
+                fprintf(stderr, "render_tiles: could not start worker %d\n", w);
+                break;
+            }
+            started = w;
+        }
+
+        render_worker(&workers[0]);
+
+        for (int w = 1; w <= started; w++)
+        {
+            pthread_join(threads[w], NULL);
+        }
+    }
+    for (int w = 0; w < worker_count; w++)
+    {
+        pthread_mutex_destroy(&job.deques[w].lock);
+    }
+    ok = true;
+
+cleanup:
+    free(threads);
+    free(workers);
+    free(tile_order);
+    free(job.deques);
+    free(job.tiles);
+    return (RenderCounts){job.samples, job.rays, ok};
+}
+
+bool render_scene(Framebuffer *fb, Scene *scene, Camera *camera, const RenderSettings *settings)
+{
+    RenderSettings resolved = *settings;
+    if (resolved.thread_count <= 0)
+        resolved.thread_count = render_default_thread_count();
+    if (resolved.adaptive.enabled)
+    {
+        if (resolved.adaptive.min_spp < 2)
+            resolved.adaptive.min_spp = 2;
+        if (resolved.adaptive.max_spp < resolved.adaptive.min_spp)
+            resolved.adaptive.max_spp = resolved.adaptive.min_spp;
+        fprintf(stderr, "Rendering %d x %d image with %zu to %zu samples per pixel (threshold %g) on %d threads\n",
+                camera->image_width, camera->image_height, resolved.adaptive.min_spp, resolved.adaptive.max_spp,
+                resolved.adaptive.threshold, resolved.thread_count);
+        if (resolved.wavefront)
+            fprintf(stderr, "render_scene: adaptive sampling does not use the wavefront pipeline\n");
+    }
+    else
+    {
+        fprintf(stderr, "Rendering %d x %d image with %zu samples per pixel on %d threads\n", camera->image_width, camera->image_height, camera->samples_per_pixel, resolved.thread_count);
+    }
+    if (resolved.aovs && resolved.wavefront && !resolved.adaptive.enabled)
+        fprintf(stderr, "render_scene: AOV renders do not use the wavefront pipeline\n");
+    else if (resolved.spp_map && resolved.wavefront && !resolved.adaptive.enabled)
+        fprintf(stderr, "render_scene: sample count maps do not use the wavefront pipeline\n");
+
+    if (!framebuffer_init(fb, camera->image_width, camera->image_height))
+    {
+        fprintf(stderr, "render_scene: could not allocate framebuffer\n");
+        return false;
+    }
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    RenderCounts counts = render_tiles(fb, scene, camera, &resolved);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    if (!counts.ok)
+    {
+        framebuffer_free(fb);
+        return false;
+    }
+    double seconds = (double)(stop.tv_sec - start.tv_sec) + (double)(stop.tv_nsec - start.tv_nsec) * 1e-9;
+    if (seconds <= 0)
+        seconds = 1e-9;
+    fprintf(stderr, "Rendered in %.2f s: %.3f M primary rays/s, %.3f M rays/s (%.2f rays per sample)\n", seconds,
+            counts.samples / seconds * 1e-6, counts.rays / seconds * 1e-6,
+            counts.samples ? (double)counts.rays / counts.samples : 0.0);
+    uint64_t samples = counts.samples;
+
+    if (resolved.adaptive.enabled)
+    {
+        double pixels = (double)fb->width * (double)fb->height;
+        double fixed = pixels * (double)camera->samples_per_pixel;
+        fprintf(stderr, "Samples: %llu, %.1f per pixel on average, %.1f%% fewer than %zu per pixel\n",
+                (unsigned long long)samples, samples / pixels, fixed > 0 ? 100.0 * (1.0 - samples / fixed) : 0.0,
+                camera->samples_per_pixel);
+    }
+    if (resolved.packets && (!resolved.wavefront || resolved.adaptive.enabled || resolved.aovs || resolved.spp_map))
+    {
+        const PacketStats *ps = &scene->packet_stats;
+        uint64_t total = ps->packet_rays + ps->single_rays;
+        fprintf(stderr, "Primary rays: %llu in packet mode (%.1f%%), %llu in single-ray mode, %llu packets\n",
+                (unsigned long long)ps->packet_rays, total ? 100.0 * ps->packet_rays / total : 0.0,
+                (unsigned long long)ps->single_rays, (unsigned long long)ps->packets);
+    }
+    return true;
+}
@@ -0,0 +1,189 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "scene.h"
+#include "framebuffer.h"
+#include "wavefront.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#define RENDER_DEFAULT_TILE_SIZE 16
+#define RENDER_DEFAULT_ROULETTE_DEPTH 3 // Bounces before Russian roulette starts
+
+// Luminance floor used when converting a pixel's error to display space, so
+// near-black pixels do not demand unbounded precision
+#define ADAPTIVE_MIN_LUMINANCE 0.01
+
+// -----------------------------------------------------------------------------
+// Adaptive sampling
+// -----------------------------------------------------------------------------
+// Every pixel keeps a running mean and variance of its sample luminance
+// (Welford). After min_spp samples it stops as soon as the 95% confidence
+// interval of its mean, converted to gamma-corrected display units, is
+// narrower than +-threshold. Noisy pixels keep going up to max_spp, so the
+// samples flat regions do not need end up where the noise is.
+typedef struct
+{
+    bool enabled;
+    double threshold; // Display-space error, 0.01 is about 2.5 of 255 levels
+    size_t min_spp;   // At least 2
+    size_t max_spp;
+} AdaptiveSettings;
+
+// -----------------------------------------------------------------------------
+// Auxiliary outputs (AOVs)
+// -----------------------------------------------------------------------------
+// Per-pixel averages over the camera samples' first hits, the guides the
+// denoiser uses to tell edges from noise. Samples that miss the scene add
+// the sky color as albedo, a zero normal and depth 0.
+typedef struct
+{
+    Framebuffer albedo; // Material color of the first hit
+    Framebuffer normal; // Shading normal of the first hit, turned towards the camera
+    double *depth;      // Distance t to the first hit, width * height values
+    double *variance;   // Variance of the pixel's mean luminance, 0 below 2 samples
+} RenderAovs;
+
+// Allocates zeroed buffers, returns false on allocation failure
+bool render_aovs_init(RenderAovs *aovs, int width, int height);
+
+void render_aovs_free(RenderAovs *aovs);
+
+// Framebuffer pixels [x0, x1) x [y0, y1), rows counted from the top
+typedef struct
+{
+    int x0, y0, x1, y1;
+} RenderRegion;
+
+// Resolves a region against a width x height image: an empty region becomes
+// the whole image, anything else is clipped to it. Returns false when the
+// clipped region is empty.
+bool render_region_clip(RenderRegion *region, int width, int height);
+
+// Allocates out as the picture a crop render delivers: the region of fb
+// alone, or a copy of base (same size as fb) with the region pasted in.
+// Returns false on allocation failure.
+bool render_region_image(Framebuffer *out, const Framebuffer *fb, RenderRegion region, const Framebuffer *base);
+
+// -----------------------------------------------------------------------------
+// Persistent worker pool
+// -----------------------------------------------------------------------------
+// Threads that stay alive across render_tiles calls, for callers that render
+// many images in a row (animation sequences). Without a pool every call
+// starts and joins its own threads. The calling thread still works as
+// worker 0, so a pool of thread_count runs thread_count - 1 threads.
+typedef struct
+{
+    pthread_t *threads;
+    int thread_count;   // Workers including the calling thread
+    int started;        // Threads actually running, workers 1 .. started
+    int next_id;        // Worker ids handed out to the threads so far
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // A job was posted or the pool is closing
+    pthread_cond_t idle; // The last thread finished the current job
+    void *job;           // The RenderJob being rendered, private to render.c
+    uint64_t generation; // Bumped for every posted job
+    int busy;            // Threads still working on the current job
+    bool closing;
+} RenderPool;
+
+// Starts thread_count - 1 threads (<= 0 means one per online core in
+// total). Threads that fail to start leave their share to the others.
+// Returns false on allocation failure.
+bool render_pool_init(RenderPool *pool, int thread_count);
+
+// Stops and joins the threads
+void render_pool_free(RenderPool *pool);
+
+// -----------------------------------------------------------------------------
+// Render settings
+// -----------------------------------------------------------------------------
+typedef struct
+{
+    int max_depth;      // Maximum number of bounces per path
+    int roulette_depth; // Bounces before Russian roulette may end a path, <= 0 never
+    int thread_count;   // Number of worker threads, <= 0 means one per online core
+    int tile_size;      // Edge length of a square tile in pixels, <= 0 means default
+    uint32_t frame;     // Frame number, mixed into every sample's random seed
+    SamplerType sampler; // Where every sample's numbers come from, see math/sampler.h
+    bool packets;       // Trace primary rays in 4x4 packets
+    bool wavefront;     // Use the wavefront pipeline instead of one path at a time
+
+    // When enabled, camera->samples_per_pixel is ignored in favour of the
+    // adaptive limits. Adaptive renders do not use the wavefront pipeline.
+    AdaptiveSettings adaptive;
+    // Optional, receives the samples taken per framebuffer pixel. Renders with
+    // a sample count map do not use the wavefront pipeline.
+    uint32_t *spp_map;
+
+    // Progressive passes. When accumulation is set (same size as fb), the call
+    // takes samples first_sample .. first_sample + camera->samples_per_pixel - 1
+    // of every pixel, adds them to the running sums in accumulation and writes
+    // the mean of all samples so far to fb. The sums are added in sample order,
+    // so any sequence of passes gives the same image as one fixed render.
+    // Not combined with adaptive sampling or the wavefront pipeline.
+    Framebuffer *accumulation;
+    uint32_t first_sample;
+    // Samples per pixel of the whole render, which the stratified sampler
+    // divides every pixel into. 0 plans for the samples of this call.
+    uint32_t total_samples;
+
+    // When not empty, only the pixels of region are rendered and the rest of
+    // fb is left as it is. Every pixel seeds its own samples, so rendering an
+    // image region by region gives the same pixels as rendering it whole.
+    RenderRegion region;
+
+    // Coarse-to-fine levels. When lattice_step > 1 only every lattice_step-th
+    // pixel of every lattice_step-th row is rendered, counted from the
+    // region's top-left pixel. Pixels that are also on the lattice of
+    // lattice_skip (a multiple of lattice_step, 0 for none) are left alone,
+    // the previous, coarser level rendered them. Lattice renders do not use
+    // the wavefront pipeline.
+    int lattice_step;
+    int lattice_skip;
+
+    // Optional, same size as fb, receives the first-hit buffers of the
+    // rendered pixels. AOV renders do not use the wavefront pipeline.
+    RenderAovs *aovs;
+
+    // Optional. When set, the render runs on the pool's threads and
+    // thread_count is ignored.
+    RenderPool *pool;
+
+    // Tile cache budget of the scene's textures, 0 for TEXTURE_DEFAULT_CACHE_MB
+    size_t texture_cache_bytes;
+
+    // Cluster cache budget of the scene's paged meshes, 0 for PAGED_DEFAULT_CACHE_MB
+    size_t geometry_cache_bytes;
+
+    // Optional, called with cancel_context before every tile. Once it returns
+    // true the workers take no more tiles and the call returns early, with fb
+    // and accumulation partly updated.
+    bool (*cancel)(void *context);
+    void *cancel_context;
+} RenderSettings;
+
+// What a render_tiles call traced
+typedef struct
+{
+    uint64_t samples; // Camera samples, one primary ray each
+    uint64_t rays;    // Every ray traced: primary, bounces and scattered
+    bool ok;          // False when the render could not run, fb is then not updated
+} RenderCounts;
+
+// Returns the number of online cores (at least 1)
+int render_default_thread_count(void);
+
+// Renders the whole image into fb using a pool of worker threads.
+// The image is split into tiles which are handed out through per-thread
+// work-stealing deques. Every sample seeds its own Sampler from (pixel, sample,
+// frame), so the result does not depend on the thread count or on tile
+// scheduling. A cancelled render still counts as ok; a failed one prints the
+// reason and sets ok to false.
+RenderCounts render_tiles(Framebuffer *fb, Scene *scene, Camera *camera, const RenderSettings *settings);
+
+// Allocates fb at the camera resolution and renders the scene into it.
+// Returns false if the framebuffer could not be allocated or the render failed.
+bool render_scene(Framebuffer *fb, Scene *scene, Camera *camera, const RenderSettings *settings);
+
+#endif // RENDER_H
@@ -4,7 +4,494 @@
 #include "math/vec3.h"
 #include "hittable.h"
 
+#include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+void scene_init(Scene *scene)
+{
+    arena_init(&scene->arena, 0);
+    scene->world = NULL;
+    scene->hittable_count = 0;
+    scene->hittable_capacity = 0;
+    scene->materials = NULL;
+    scene->material_count = 0;
+    scene->material_capacity = 0;
+    scene->groups = NULL;
+    scene->group_count = 0;
+    scene->group_capacity = 0;
+    scene->bvh = (Bvh){0};
+    scene->bvh_area = 0;
+    scene->unbounded = NULL;
+    scene->unbounded_count = 0;
+    scene->paged = NULL;
+    scene->paged_count = 0;
+    scene->lights = NULL;
+    scene->light_cdf = NULL;
+    scene->light_count = 0;
+    scene->light_power = 0;
+    texture_system_init(&scene->textures);
+    scene->texture_view = (TextureView){0};
+    paged_geometry_init(&scene->paged_geometry);
+    scene->packet_stats = (PacketStats){0};
+    scene->trace_stats = (TraceStats){0};
+    scene->mapping = NULL;
+    scene->mapping_size = 0;
+    scene->bvh_mapped = false;
+}
+
+bool scene_reserve(Scene *scene, size_t capacity)
+{
+    if (capacity <= scene->hittable_capacity)
+        return true;
+
+    Hittable *world = arena_grow(&scene->arena, scene->world,
+                                 sizeof(Hittable) * scene->hittable_capacity,
+                                 sizeof(Hittable) * capacity, _Alignof(Hittable));
+    if (!world)
+        return false;
+    scene->world = world;
+    scene->hittable_capacity = capacity;
+    return true;
+}
+
+// Doubles the capacity until count more hittables fit
+static bool scene_make_room(Scene *scene, size_t count)
+{
+    size_t needed = scene->hittable_count + count;
+    if (needed <= scene->hittable_capacity)
+        return true;
+
+    size_t capacity = scene->hittable_capacity > 0 ? scene->hittable_capacity : 64;
+    while (capacity < needed)
+        capacity *= 2;
+    return scene_reserve(scene, capacity);
+}
+
+bool scene_add(Scene *scene, Hittable hittable)
+{
+    if (!scene_make_room(scene, 1))
+        return false;
+    scene->world[scene->hittable_count++] = hittable;
+    return true;
+}
+
+bool scene_add_material(Scene *scene, Material material, MaterialId *id)
+{
+    if (scene->material_count == scene->material_capacity)
+    {
+        uint32_t capacity = scene->material_capacity > 0 ? 2 * scene->material_capacity : 16;
+        Material *materials = arena_grow(&scene->arena, scene->materials,
+                                         sizeof(Material) * scene->material_capacity,
+                                         sizeof(Material) * capacity, _Alignof(Material));
+        if (!materials)
+            return false;
+        scene->materials = materials;
+        scene->material_capacity = capacity;
+    }
+    *id = scene->material_count;
+    scene->materials[scene->material_count++] = material;
+    return true;
+}
+
+bool scene_add_many(Scene *scene, const Hittable *hittables, size_t count)
+{
+    if (!scene_make_room(scene, count))
+        return false;
+    memcpy(&scene->world[scene->hittable_count], hittables, sizeof(Hittable) * count);
+    scene->hittable_count += count;
+    return true;
+}
+
+bool scene_add_texture(Scene *scene, const char *path, double scale, uint32_t *texture)
+{
+    uint32_t id;
+    if (!texture_system_add(&scene->textures, path, scale, &id))
+        return false;
+    *texture = id + 1;
+    return true;
+}
+
+bool scene_add_paged_mesh(Scene *scene, const char *path, MaterialId material, int thread_count)
+{
+    const PagedMesh *mesh;
+    if (!paged_geometry_add(&scene->paged_geometry, path, thread_count, &mesh))
+        return false;
+    Hittable h = {HITTABLE_PAGED_MESH, material, .object.paged_mesh = mesh};
+    return scene_add(scene, h);
+}
+
+bool scene_add_group(Scene *scene, uint32_t *group)
+{
+    if (scene->group_count == scene->group_capacity)
+    {
+        uint32_t capacity = scene->group_capacity > 0 ? 2 * scene->group_capacity : 8;
+        InstanceGroup **groups = arena_grow(&scene->arena, scene->groups,
+                                            sizeof(InstanceGroup *) * scene->group_capacity,
+                                            sizeof(InstanceGroup *) * capacity, _Alignof(InstanceGroup *));
+        if (!groups)
+            return false;
+        scene->groups = groups;
+        scene->group_capacity = capacity;
+    }
+    InstanceGroup *g = arena_alloc(&scene->arena, sizeof(InstanceGroup), _Alignof(InstanceGroup));
+    if (!g)
+        return false;
+    *g = (InstanceGroup){0};
+    *group = scene->group_count;
+    scene->groups[scene->group_count++] = g;
+    return true;
+}
+
+bool scene_group_add(Scene *scene, uint32_t group, Hittable hittable)
+{
+    InstanceGroup *g = scene->groups[group];
+    if (g->count == g->capacity)
+    {
+        uint32_t capacity = g->capacity > 0 ? 2 * g->capacity : 16;
+        Hittable *hittables = arena_grow(&scene->arena, g->hittables, sizeof(Hittable) * g->capacity,
+                                         sizeof(Hittable) * capacity, _Alignof(Hittable));
+        if (!hittables)
+            return false;
+        g->hittables = hittables;
+        g->capacity = capacity;
+    }
+    g->hittables[g->count++] = hittable;
+    return true;
+}
+
+bool scene_add_instance(Scene *scene, uint32_t group, Transform to_world, MaterialId material)
+{
+    Instance *instance = arena_alloc(&scene->arena, sizeof(Instance), _Alignof(Instance));
+    if (!instance || !instance_init(instance, scene->groups[group], to_world))
+        return false;
+    Hittable h = {HITTABLE_INSTANCE, material, .object.instance = instance};
+    return scene_add(scene, h);
+}
+
+bool scene_build(Scene *scene)
+{
+    if (scene->bvh_mapped)
+        scene->bvh = (Bvh){0};
+    else
+        bvh_free(&scene->bvh);
+    scene->bvh_mapped = false;
+
+    // Bounded indices are only needed while building, unbounded ones are kept
+    uint32_t *bounded = malloc(sizeof(uint32_t) * (scene->hittable_count + 1));
+    scene->unbounded = arena_alloc(&scene->arena, sizeof(uint32_t) * (scene->hittable_count + 1), _Alignof(uint32_t));
+    scene->paged = arena_alloc(&scene->arena, sizeof(uint32_t) * (scene->hittable_count + 1), _Alignof(uint32_t));
+    if (!bounded || !scene->unbounded || !scene->paged)
+    {
+        free(bounded);
+        return false;
+    }
+
+    // Instance bounds need the group BVHs
+    for (uint32_t g = 0; g < scene->group_count; g++)
+    {
+        if (!instance_group_build(scene->groups[g], scene->materials, scene->material_count))
+        {
+            fprintf(stderr, "scene_build: could not build group %u\n", g);
+            free(bounded);
+            return false;
+        }
+    }
+
+    uint32_t bounded_count = 0;
+    Aabb bounds;
+    scene->unbounded_count = 0;
+    scene->paged_count = 0;
+    for (size_t i = 0; i < scene->hittable_count; i++)
+    {
+        MaterialId material = scene->world[i].material;
+        bool keeps_materials = scene->world[i].type == HITTABLE_INSTANCE && material == INSTANCE_KEEP_MATERIALS;
+        if (!keeps_materials && material >= scene->material_count)
+        {
+            fprintf(stderr, "scene_build: hittable %zu uses undefined material %u\n", i, scene->world[i].material);
+            free(bounded);
+            return false;
+        }
+        if (scene->world[i].type == HITTABLE_INSTANCE && !keeps_materials &&
+            scene->materials[material].type == MATERIAL_EMISSIVE)
+        {
+            fprintf(stderr, "scene_build: instance %zu is emissive, lights cannot be instanced\n", i);
+            free(bounded);
+            return false;
+        }
+        if (scene->world[i].type == HITTABLE_PAGED_MESH)
+        {
+            if (scene->materials[material].texture != 0)
+            {
+                fprintf(stderr, "scene_build: paged mesh %zu is textured, paged meshes have no texture coordinates\n", i);
+                free(bounded);
+                return false;
+            }
+            scene->paged[scene->paged_count++] = (uint32_t)i;
+        }
+        else if (hittable_bounds(&scene->world[i], &bounds))
+        {
+            bounded[bounded_count++] = (uint32_t)i;
+        }
+        else
+        {
+            scene->unbounded[scene->unbounded_count++] = (uint32_t)i;
+        }
+    }
+
+    bool ok = bvh_build(&scene->bvh, scene->world, bounded, bounded_count);
+    free(bounded);
+    scene->bvh_area = bvh_surface_area(&scene->bvh);
+    return ok && scene_build_lights(scene);
+}
+
+bool scene_set_instance_transform(Scene *scene, size_t index, Transform to_world)
+{
+    Hittable *h = &scene->world[index];
+    if (h->type != HITTABLE_INSTANCE)
+        return false;
+    // Instances are allocated by scene_add_instance, the scene owns them
+    Instance *instance = (Instance *)h->object.instance;
+    Instance moved;
+    if (!instance_init(&moved, instance->group, to_world))
+        return false;
+    *instance = moved;
+    return true;
+}
+
+bool scene_refit(Scene *scene, bool *rebuilt)
+{
+    *rebuilt = false;
+    if (scene->bvh_mapped)
+        return true; // Cached scenes hold no instances
+    bvh_refit(&scene->bvh);
+    if (bvh_surface_area(&scene->bvh) <= SCENE_REFIT_MAX_GROWTH * scene->bvh_area)
+        return true;
+
+    // Same primitives as scene_build put in, which already checked them
+    uint32_t *bounded = malloc(sizeof(uint32_t) * (scene->hittable_count + 1));
+    if (!bounded)
+        return false;
+    uint32_t bounded_count = 0;
+    Aabb bounds;
+    for (size_t i = 0; i < scene->hittable_count; i++)
+    {
+        if (hittable_bounds(&scene->world[i], &bounds))
+            bounded[bounded_count++] = (uint32_t)i;
+    }
+    bvh_free(&scene->bvh);
+    bool ok = bvh_build(&scene->bvh, scene->world, bounded, bounded_count);
+    free(bounded);
+    scene->bvh_area = bvh_surface_area(&scene->bvh);
+    *rebuilt = true;
+    return ok;
+}
+
+// Rec. 709 luminance, the weight of an emitter's color in its power
+static double luminance(Color c)
+{
+    return 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z;
+}
+
+static double light_area(const Hittable *h, uint32_t prim)
+{
+    if (h->type == HITTABLE_SPHERE)
+        return 4 * M_PI * h->object.sphere.radius * h->object.sphere.radius;
+    Triangle tr = h->type == HITTABLE_MESH ? mesh_triangle(h->object.mesh, prim) : h->object.triangle;
+    return 0.5 * vec3_length(vec3_cross(vec3_sub(tr.v1, tr.v0), vec3_sub(tr.v2, tr.v0)));
+}
+
+bool scene_build_lights(Scene *scene)
+{
+    scene->light_count = 0;
+    scene->light_power = 0;
+
+    // Count first, the arena cannot shrink an allocation
+    size_t count = 0;
+    for (size_t i = 0; i < scene->hittable_count; i++)
+    {
+        const Hittable *h = &scene->world[i];
+        if (h->type == HITTABLE_INSTANCE)
+            continue; // Never emissive, scene_build checks
+        const Material *m = &scene->materials[h->material];
+        if (m->type != MATERIAL_EMISSIVE || luminance(m->color) <= 0)
+            continue;
+        if (h->type == HITTABLE_PLANE)
+        {
+            fprintf(stderr, "scene_build_lights: hittable %zu is an emissive plane, use triangles for area lights\n", i);
+            return false;
+        }
+        if (h->type == HITTABLE_PAGED_MESH)
+        {
+            fprintf(stderr, "scene_build_lights: hittable %zu is an emissive paged mesh, lights must be resident\n", i);
+            return false;
+        }
+        if (m->texture != 0)
+        {
+            fprintf(stderr, "scene_build_lights: hittable %zu is emissive with a texture, lights emit one color\n", i);
+            return false;
+        }
+        count += h->type == HITTABLE_MESH ? h->object.mesh->triangle_count : 1;
+    }
+    if (count == 0)
+        return true;
+    if (count > UINT32_MAX)
+        return false;
+
+    scene->lights = arena_alloc(&scene->arena, sizeof(Light) * count, _Alignof(Light));
+    scene->light_cdf = arena_alloc(&scene->arena, sizeof(double) * count, _Alignof(double));
+    if (!scene->lights || !scene->light_cdf)
+        return false;
+    for (size_t i = 0; i < scene->hittable_count; i++)
+    {
+        const Hittable *h = &scene->world[i];
+        if (h->type == HITTABLE_INSTANCE)
+            continue;
+        const Material *m = &scene->materials[h->material];
+        if (m->type != MATERIAL_EMISSIVE || luminance(m->color) <= 0)
+            continue;
+        uint32_t prims = h->type == HITTABLE_MESH ? h->object.mesh->triangle_count : 1;
+        for (uint32_t prim = 0; prim < prims; prim++)
+        {
+            scene->light_power += light_area(h, prim) * luminance(m->color);
+            scene->lights[scene->light_count] = (Light){(uint32_t)i, prim};
+            scene->light_cdf[scene->light_count++] = scene->light_power;
+        }
+    }
+    return true;
+}
+
+void scene_free(Scene *scene)
+{
+    if (!scene->bvh_mapped)
+        bvh_free(&scene->bvh);
+    for (uint32_t g = 0; g < scene->group_count; g++)
+        instance_group_free(scene->groups[g]);
+    if (scene->mapping)
+        munmap(scene->mapping, scene->mapping_size);
+    texture_system_free(&scene->textures);
+    paged_geometry_free(&scene->paged_geometry);
+    arena_free(&scene->arena);
+    scene_init(scene);
+}
+
+// Rays traced by the calling thread since the last scene_take_ray_count
+static _Thread_local uint64_t rays_traced;
+
+uint64_t scene_take_ray_count(void)
+{
+    uint64_t count = rays_traced;
+    rays_traced = 0;
+    return count;
+}
+
+// The BVH and the planes, everything but the paged meshes
+static bool scene_hit_resident(const Scene *scene, Ray r, double t_min, double t_max, HitRecord *rec)
+{
+    bool hit_anything = bvh_hit(&scene->bvh, scene->world, r, t_min, t_max, rec);
+    if (hit_anything)
+        t_max = rec->t;
+
+    for (size_t i = 0; i < scene->unbounded_count; i++)
+    {
+        if (hit_hittable(&scene->world[scene->unbounded[i]], r, t_min, t_max, rec))
+        {
+            hit_anything = true;
+            t_max = rec->t;
+        }
+    }
+    return hit_anything;
+}
+
+bool scene_hit(const Scene *scene, Ray r, double t_min, double t_max, HitRecord *rec)
+{
+    rays_traced++;
+    STATS_RAY_BEGIN();
+    bool hit_anything = scene_hit_resident(scene, r, t_min, t_max, rec);
+    if (hit_anything)
+        t_max = rec->t;
+
+    for (size_t i = 0; i < scene->paged_count; i++)
+    {
+        if (hit_hittable(&scene->world[scene->paged[i]], r, t_min, t_max, rec))
+        {
+            hit_anything = true;
+            t_max = rec->t;
+        }
+    }
+    STATS_RAY_END();
+    return hit_anything;
+}
+
+void scene_hit_batch(const Scene *scene, PagedBatch *batch, uint32_t count, double t_min, double t_max,
+                     HitRecord *recs, bool *hits)
+{
+    rays_traced += count;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        STATS_RAY_BEGIN();
+        hits[i] = scene_hit_resident(scene, batch->rays[i], t_min, t_max, &recs[i]);
+        batch->t_max[i] = hits[i] ? recs[i].t : t_max;
+        STATS_RAY_END();
+    }
+
+    // One paged mesh after the other, like scene_hit
+    for (size_t m = 0; m < scene->paged_count; m++)
+    {
+        const Hittable *h = &scene->world[scene->paged[m]];
+        paged_mesh_intersect_batch(h->object.paged_mesh, batch, count, t_min);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (!batch->found[i])
+                continue;
+            paged_mesh_hit_record(h->object.paged_mesh, h->material, batch->hits[i], batch->rays[i], batch->t_max[i],
+                                  &recs[i]);
+            recs[i].hittable = h;
+            hits[i] = true;
+        }
+    }
+}
+
+uint32_t scene_hit_packet(Scene *scene, RayPacket *packet, double t_min, HitRecord *recs, PacketStats *stats)
+{
+    rays_traced += (uint64_t)__builtin_popcount(packet->valid);
+    bvh_intersect_packet(&scene->bvh, packet, t_min, stats);
+
+    uint32_t hits = 0;
+    for (int i = 0; i < PACKET_SIZE; i++)
+    {
+        if (!(packet->valid & (1u << i)))
+            continue;
+
+        // Planes are cheap and unbounded, test them per ray like scene_hit,
+        // then the paged meshes
+        Ray r = packet->rays[i];
+        double t_max = packet->t_max[i];
+        bool per_ray_hit = false;
+        for (size_t k = 0; k < scene->unbounded_count + scene->paged_count; k++)
+        {
+            uint32_t index = k < scene->unbounded_count ? scene->unbounded[k] : scene->paged[k - scene->unbounded_count];
+            if (hit_hittable(&scene->world[index], r, t_min, t_max, &recs[i]))
+            {
+                per_ray_hit = true;
+                t_max = recs[i].t;
+            }
+        }
+
+        if (per_ray_hit)
+        {
+            hits |= 1u << i;
+        }
+        else if (packet->hit & (1u << i))
+        {
+            bvh_hit_record(scene->world, packet->closest[i], r, packet->t_max[i], &recs[i]);
+            hits |= 1u << i;
+        }
+    }
+    return hits;
+}
 
 Camera camera_create(Point3 center, Point3 lower_left_corner, Vec3 horizontal, Vec3 vertical, int image_width, int image_height, size_t samples_per_pixel)
 {
@@ -19,66 +506,271 @@ Camera camera_create(Point3 center, Point3 lower_left_corner, Vec3 horizontal, V
     return cam;
 }
 
-// return a vector with random components in [-0.5 , 0.5]
-static Vec3
-random_vec()
+Color sky_color(Ray r)
 {
-    return vec3_create((double)rand() / RAND_MAX - 0.5, (double)rand() / RAND_MAX - 0.5, (double)rand() / RAND_MAX - 0.5);
+    Vec3 unit_direction = vec3_unit(r.direction);
+    double t = 0.5 * (unit_direction.y + 1.0);
+    Color white = vec3_create(1.0, 1.0, 1.0);
+    Color blue = vec3_create(0.5, 0.7, 1.0);
+    return vec3_add(vec3_scale(white, 1.0 - t), vec3_scale(blue, t));
 }
 
-Color ray_color(Scene *scene, Ray r, int depth)
+// -----------------------------------------------------------------------------
+// Textures
+// -----------------------------------------------------------------------------
+
+void scene_set_texture_view(Scene *scene, const Camera *camera, uint32_t sample_count)
 {
-    HitRecord rec;
-    bool hit_anything = false;
-    double closest_so_far = 100000.0; // Infinity-ish
-    double t_min = 0.001;             // Minimum distance (shadow acne prevention)
+    scene->texture_view = (TextureView){
+        .center = camera->center,
+        .pixel00_loc = camera->pixel00_loc,
+        .pixel_delta_u = camera->pixel_delta_u,
+        .pixel_delta_v = camera->pixel_delta_v,
+        .spp_scale = fmax(0.125, 1.0 / sqrt(sample_count > 0 ? (double)sample_count : 1.0)),
+        .valid = true,
+    };
+}
 
-    if (depth <= 0)
-        return vec3_create(0, 0, 0);
+// Filter width in uv units at a hit, from the camera's ray differentials
+// (pbrt-v4's approximation, used at every bounce): the rays through the
+// next pixel right and the next pixel down meet the tangent plane at p, and
+// the two offsets from p are solved for uv by least squares on dpdu, dpdv.
+static double texture_footprint(const TextureView *view, const HitRecord *rec, const SurfaceUv *uv)
+{
+    if (!view->valid)
+        return 0;
+    // Direction to p scaled to end on the image plane, like the camera ray
+    Vec3 forward = vec3_cross(view->pixel_delta_u, view->pixel_delta_v);
+    Vec3 to_p = vec3_sub(rec->p, view->center);
+    double along = vec3_dot(to_p, forward);
+    double plane = vec3_dot(vec3_sub(view->pixel00_loc, view->center), forward);
+    double p_distance = vec3_dot(to_p, rec->normal);
+    if (fabs(along) < 1e-12 || fabs(p_distance) < 1e-12)
+        return 0;
+    Vec3 direction = vec3_scale(to_p, plane / along);
+
+    double a00 = vec3_dot(uv->dpdu, uv->dpdu), a01 = vec3_dot(uv->dpdu, uv->dpdv), a11 = vec3_dot(uv->dpdv, uv->dpdv);
+    double determinant = a00 * a11 - a01 * a01;
+    if (!(fabs(determinant) > 1e-24))
+        return 0;
 
-    for (int i = 0; i < scene->hittable_count; i++)
+    double width = 0;
+    Vec3 deltas[2] = {view->pixel_delta_u, view->pixel_delta_v};
+    for (int i = 0; i < 2; i++)
     {
-        HitRecord temp_rec;
-        if (hit_hittable(&scene->world[i], r, t_min, closest_so_far, &temp_rec))
-        {
-            hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
-        }
+        Vec3 d = vec3_add(direction, deltas[i]);
+        double denominator = vec3_dot(d, rec->normal);
+        if (fabs(denominator) < 1e-12)
+            return 0;
+        Vec3 offset = vec3_sub(vec3_scale(d, p_distance / denominator), to_p);
+        offset = vec3_scale(offset, view->spp_scale);
+        double b0 = vec3_dot(uv->dpdu, offset), b1 = vec3_dot(uv->dpdv, offset);
+        double du = (a11 * b0 - a01 * b1) / determinant;
+        double dv = (a00 * b1 - a01 * b0) / determinant;
+        width = fmax(width, fmax(fabs(du), fabs(dv)));
     }
+    // Twice the largest derivative, as pbrt sizes its trilinear filter
+    return isfinite(width) ? 2 * width : 0;
+}
 
-    if (hit_anything)
+const Material *scene_material(const Scene *scene, const HitRecord *rec, Material *scratch)
+{
+    const Material *material = &scene->materials[rec->material];
+    if (material->texture == 0)
+        return material;
+    SurfaceUv uv;
+    hit_record_uv(rec, &uv);
+    Color texel = texture_lookup(&scene->textures, material->texture - 1, uv.u, uv.v,
+                                 texture_footprint(&scene->texture_view, rec, &uv));
+    *scratch = *material;
+    scratch->color = vec3_mul(material->color, texel);
+    return scratch;
+}
+
+// -----------------------------------------------------------------------------
+// Light sampling
+// -----------------------------------------------------------------------------
+
+// Density per solid angle with which scene_sample_light picks the point at rec
+// when sampling from origin: light selection (power / total) times uniform
+// area sampling (1 / area), converted from area to solid angle
+static double light_pdf(const Scene *scene, Point3 origin, const HitRecord *rec)
+{
+    Vec3 to_light = vec3_sub(rec->p, origin);
+    double distance_squared = vec3_length_squared(to_light);
+    double cos_light = fabs(vec3_dot(rec->normal, to_light)) / sqrt(distance_squared);
+    if (cos_light <= 0)
+        return 0;
+    return luminance(scene->materials[rec->material].color) * distance_squared / (cos_light * scene->light_power);
+}
+
+// Uniform point and unit normal on a light's surface
+static void light_sample_point(const Hittable *h, uint32_t prim, Sampler *sampler, Point3 *p, Vec3 *normal)
+{
+    double u, v;
+    sampler_2d(sampler, SAMPLE_LIGHT_POINT, &u, &v);
+    if (h->type == HITTABLE_SPHERE)
+    {
+        *normal = vec3_on_unit_sphere(u, v);
+        *p = vec3_add(h->object.sphere.center, vec3_scale(*normal, h->object.sphere.radius));
+        return;
+    }
+    Triangle tr = h->type == HITTABLE_MESH ? mesh_triangle(h->object.mesh, prim) : h->object.triangle;
+    Vec3 e1 = vec3_sub(tr.v1, tr.v0);
+    Vec3 e2 = vec3_sub(tr.v2, tr.v0);
+    double su = sqrt(u);
+    *p = vec3_add(tr.v0, vec3_add(vec3_scale(e1, su * (1 - v)), vec3_scale(e2, su * v)));
+    *normal = vec3_unit(vec3_cross(e1, e2));
+}
+
+Color scene_sample_light(const Scene *scene, const HitRecord *rec, const Material *material, Sampler *sampler)
+{
+    Color black = vec3_create(0, 0, 0);
+
+    // First light whose running power sum exceeds the target
+    double target = sampler_1d(sampler, SAMPLE_LIGHT_PICK) * scene->light_power;
+    uint32_t lo = 0, hi = scene->light_count - 1;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (scene->light_cdf[mid] > target)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    const Light *light = &scene->lights[lo];
+    const Hittable *h = &scene->world[light->hittable];
+
+    Point3 p;
+    Vec3 normal;
+    light_sample_point(h, light->prim, sampler, &p, &normal);
+    Vec3 to_light = vec3_sub(p, rec->p);
+    double distance_squared = vec3_length_squared(to_light);
+    double distance = sqrt(distance_squared);
+    if (distance < RAY_T_MIN)
+        return black;
+    Vec3 wi = vec3_div(to_light, distance);
+    double cos_light = fabs(vec3_dot(normal, wi));
+    double bsdf_pdf;
+    Color f = material_eval(material, rec, wi, &bsdf_pdf);
+    if (cos_light < 1e-8 || bsdf_pdf <= 0)
+        return black;
+
+    HitRecord blocker;
+    if (scene_hit(scene, ray_create(rec->p, wi), RAY_T_MIN, distance - RAY_T_MIN, &blocker))
+        return black;
+
+    Color emitted = scene->materials[h->material].color;
+    double pdf = luminance(emitted) * distance_squared / (cos_light * scene->light_power);
+    double weight = pdf * pdf / (pdf * pdf + bsdf_pdf * bsdf_pdf); // Power heuristic
+    return vec3_scale(vec3_mul(emitted, f), weight / pdf);
+}
+
+double scene_emission_weight(const Scene *scene, Point3 origin, const HitRecord *rec, double bsdf_pdf)
+{
+    if (bsdf_pdf <= 0 || scene->light_count == 0)
+        return 1;
+    double pdf = light_pdf(scene, origin, rec);
+    return bsdf_pdf * bsdf_pdf / (bsdf_pdf * bsdf_pdf + pdf * pdf);
+}
+
+double roulette_survival(Color throughput)
+{
+    return fmin(fmax(throughput.x, fmax(throughput.y, throughput.z)), 1.0);
+}
+
+// -----------------------------------------------------------------------------
+// Paths
+// -----------------------------------------------------------------------------
+
+Color shade_hit(Scene *scene, Ray r, HitRecord *rec, int depth, int roulette_depth, Sampler *sampler)
+{
+    // Iterative path: the product of all attenuations so far is carried in
+    // throughput instead of being multiplied back up a recursion, light found
+    // along the way is added to radiance
+    Color radiance = vec3_create(0, 0, 0);
+    Color throughput = vec3_create(1.0, 1.0, 1.0);
+    double bsdf_pdf = 0; // The camera ray sees emitters in full
+    for (int bounces = 1;; bounces++)
     {
+        sampler_vertex(sampler, bounces);
+        Material textured;
+        const Material *material = scene_material(scene, rec, &textured);
+        if (material->type == MATERIAL_EMISSIVE)
+        {
+            double weight = scene_emission_weight(scene, r.origin, rec, bsdf_pdf);
+            STATS_PATH_END(STATS_EMITTED, bounces - 1);
+            return vec3_add(radiance, vec3_scale(vec3_mul(throughput, material->color), weight));
+        }
+        if (material->type == MATERIAL_LAMBERTIAN && scene->light_count > 0)
+            radiance = vec3_add(radiance, vec3_mul(throughput, scene_sample_light(scene, rec, material, sampler)));
+
         Ray scattered;
         Color attenuation;
-        if (!scatter_ray(&rec.material, r, &rec, &attenuation, &scattered))
+        if (!scatter_ray(material, r, rec, &attenuation, &scattered, sampler))
         {
-            return vec3_create(0, 0, 0); // Absorbed
+            STATS_PATH_END(STATS_ABSORBED, bounces - 1);
+            return radiance; // Absorbed
         }
-        // Call the function on the reflected ray
-        Color reflection_color = ray_color(scene, scattered, depth - 1);
+        throughput = vec3_mul(throughput, attenuation);
+        if (scene->light_count > 0)
+            material_eval(material, rec, vec3_unit(scattered.direction), &bsdf_pdf);
+        r = scattered;
 
-        return vec3_mul(attenuation, reflection_color);
+        if (--depth <= 0)
+        {
+            STATS_PATH_END(STATS_MAX_DEPTH, bounces);
+            return radiance;
+        }
+
+        if (roulette_depth > 0 && bounces >= roulette_depth)
+        {
+            double survival = roulette_survival(throughput);
+            if (survival < 1)
+            {
+                if (sampler_1d(sampler, SAMPLE_ROULETTE) >= survival)
+                {
+                    STATS_PATH_END(STATS_ROULETTE, bounces);
+                    return radiance;
+                }
+                throughput = vec3_scale(throughput, 1.0 / survival);
+            }
+        }
+
+        if (!scene_hit(scene, r, RAY_T_MIN, RAY_T_MAX, rec))
+        {
+            STATS_PATH_END(STATS_ESCAPED, bounces);
+            return vec3_add(radiance, vec3_mul(throughput, sky_color(r)));
+        }
     }
+}
 
-    // --- 3. Background (Sky) ---
-    Vec3 unit_direction = vec3_unit(r.direction);
-    double t = 0.5 * (unit_direction.y + 1.0);
-    Color white = vec3_create(1.0, 1.0, 1.0);
-    Color blue = vec3_create(0.5, 0.7, 1.0);
-    return vec3_add(vec3_scale(white, 1.0 - t), vec3_scale(blue, t));
+Color ray_color(Scene *scene, Ray r, int depth, int roulette_depth, Sampler *sampler)
+{
+    HitRecord rec;
+
+    if (depth <= 0)
+    {
+        STATS_PATH_END(STATS_MAX_DEPTH, 0);
+        return vec3_create(0, 0, 0);
+    }
+
+    if (scene_hit(scene, r, RAY_T_MIN, RAY_T_MAX, &rec))
+        return shade_hit(scene, r, &rec, depth, roulette_depth, sampler);
+
+    STATS_PATH_END(STATS_ESCAPED, 0);
+    return sky_color(r);
 }
 
-// Returns a vector with random x and y in [-0.5, 0.5], z is 0.
-static Vec3 sample_square()
+// Returns a vector with x and y in [-0.5, 0.5], z is 0.
+static Vec3 sample_square(Sampler *sampler)
 {
-    return vec3_create(
-        (double)rand() / RAND_MAX - 0.5,
-        (double)rand() / RAND_MAX - 0.5,
-        0.0);
+    double u, v;
+    sampler_2d(sampler, SAMPLE_PIXEL, &u, &v);
+    return vec3_create(u - 0.5, v - 0.5, 0.0);
 }
 
-Ray camera_get_ray(Camera *cam, int pixel_x, int pixel_y)
+Ray camera_get_ray(Camera *cam, int pixel_x, int pixel_y, Sampler *sampler)
 {
 
     Vec3 pixel_center = cam->pixel00_loc;
@@ -86,7 +778,7 @@ Ray camera_get_ray(Camera *cam, int pixel_x, int pixel_y)
     pixel_center = vec3_add(pixel_center, vec3_scale(cam->pixel_delta_u, pixel_x));
     pixel_center = vec3_add(pixel_center, vec3_scale(cam->pixel_delta_v, pixel_y));
 
-    Vec3 offset = sample_square();
+    Vec3 offset = sample_square(sampler);
     Vec3 pixel_sample = pixel_center;
     pixel_sample = vec3_add(pixel_sample, vec3_scale(cam->pixel_delta_u, offset.x));
     pixel_sample = vec3_add(pixel_sample, vec3_scale(cam->pixel_delta_v, offset.y));
@@ -96,25 +788,3 @@ Ray camera_get_ray(Camera *cam, int pixel_x, int pixel_y)
 
     return ray_create(ray_origin, ray_direction);
 }
-
-void render_scene(FILE *output, Scene *scene, Camera *camera, int max_depth)
-{
-    double scale = 1.0 / (double)camera->samples_per_pixel;
-    fprintf(stderr, "Rendering %d x %d image with %zu samples per pixel\n", camera->image_width, camera->image_height, camera->samples_per_pixel);
-    fprintf(output, "P3\n%d %d\n255\n", camera->image_width, camera->image_height);
-    for (int j = camera->image_height - 1; j >= 0; j--)
-    {
-        for (int i = 0; i < camera->image_width; i++)
-        {
-            Color pixel_color = vec3_create(0, 0, 0);
-            for (size_t s = 0; s < camera->samples_per_pixel; s++)
-            {
-                Ray r = camera_get_ray(camera, i, j);
-                Color sample_color = ray_color(scene, r, max_depth);
-                pixel_color = vec3_add(pixel_color, sample_color);
-            }
-            pixel_color = vec3_scale(pixel_color, scale);
-            vec3_write_color(output, pixel_color);
-        }
-    }
-}
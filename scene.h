@@ -2,9 +2,23 @@
 
 #include "math/vec3.h"
 #include "math/ray.h"
+#include "math/rng.h"
+#include "math/sampler.h"
 #include "hittable.h"
+#include "bvh.h"
+#include "instance.h"
+#include "arena.h"
+#include "packet.h"
+#include "stats.h"
+#include "texture.h"
+#include "paged.h"
 
-#define MAX_HITTABLES 100
+#define RAY_T_MIN 0.001    // Minimum distance (shadow acne prevention)
+#define RAY_T_MAX 100000.0 // Infinity-ish
+
+// scene_refit rebuilds the BVH instead once refitting has grown the summed
+// node surface area past this multiple of the area after the last build
+#define SCENE_REFIT_MAX_GROWTH 1.5
 
 // -----------------------------------------------------------------------------
 typedef struct
@@ -18,13 +32,191 @@ typedef struct
     size_t samples_per_pixel;
 } Camera;
 
+// The camera as texture filtering sees it, set by render_tiles. A hit's
+// filter footprint is the pixel it was seen through projected onto the
+// surface, shrunk by spp_scale as more samples average the pixel.
+typedef struct
+{
+    Point3 center;
+    Point3 pixel00_loc;
+    Vec3 pixel_delta_u;
+    Vec3 pixel_delta_v;
+    double spp_scale;
+    bool valid; // Without a camera textures are sampled at full resolution
+} TextureView;
+
+// One emissive sphere, triangle or mesh triangle
+typedef struct
+{
+    uint32_t hittable;
+    uint32_t prim; // Triangle of a mesh, 0 otherwise
+} Light;
+
+// Lifecycle: scene_init, scene_add / scene_add_many, scene_build, render,
+// scene_free. All scene storage comes from the arena, so adding primitives
+// never costs one malloc per object.
 typedef struct
 {
-    Hittable world[MAX_HITTABLES];
+    Arena arena;
+    Hittable *world; // Grows geometrically inside the arena
     size_t hittable_count;
+    size_t hittable_capacity;
+
+    // Indexed by MaterialId. Also lives in the arena, add materials before
+    // the hittables that reference them.
+    Material *materials;
+    uint32_t material_count;
+    uint32_t material_capacity;
+
+    // Object groups for instancing, each allocated in the arena so instances
+    // can point at it. scene_build builds their BVHs before the scene's.
+    InstanceGroup **groups;
+    uint32_t group_count;
+    uint32_t group_capacity;
+
+    // Built by scene_build: bounded primitives live in the BVH, planes are
+    // tested separately on every ray.
+    Bvh bvh;
+    double bvh_area; // bvh_surface_area right after the last build
+    uint32_t *unbounded;
+    size_t unbounded_count;
+    uint32_t *paged; // Paged meshes, traced after the BVH and the planes
+    size_t paged_count;
+
+    // Built by scene_build_lights. Lights are picked with probability
+    // proportional to their power, area times emitted luminance: light_cdf
+    // holds the running sums and light_power the total.
+    Light *lights;
+    double *light_cdf;
+    uint32_t light_count;
+    double light_power;
+
+    // Image textures, Material.texture - 1 indexes them. Every render sizes
+    // the tile cache and sets the view.
+    TextureSystem textures;
+    TextureView texture_view;
+
+    // Out-of-core meshes behind the HITTABLE_PAGED_MESH hittables, sharing
+    // one cluster cache. Every render sets its budget.
+    PagedGeometry paged_geometry;
+
+    PacketStats packet_stats; // Accumulated by packet-traced renders
+    TraceStats trace_stats;   // Accumulated by every render, stays zero without RT_STATS
+
+    // Set when the scene was loaded from a mapped cache file: world, the
+    // materials, the BVH arrays and the unbounded list then point into it
+    void *mapping;
+    size_t mapping_size;
+    bool bvh_mapped; // The BVH arrays are part of the mapping, not owned
 } Scene;
 
+// Prepares an empty scene
+void scene_init(Scene *scene);
+
+// Makes room for at least capacity hittables in total
+bool scene_reserve(Scene *scene, size_t capacity);
+
+// Appends one hittable, returns false on allocation failure
+bool scene_add(Scene *scene, Hittable hittable);
+
+// Appends a material to the table and returns its ID in *id
+bool scene_add_material(Scene *scene, Material material, MaterialId *id);
+
+// Appends count hittables with a single copy
+bool scene_add_many(Scene *scene, const Hittable *hittables, size_t count);
+
+// Loads the image texture at path, see texture.h, and returns the value for
+// Material.texture in *texture. Prints the reason and returns false on failure.
+bool scene_add_texture(Scene *scene, const char *path, double scale, uint32_t *texture);
+
+// Opens the paged mesh at path (see paged.h), converting a mesh file with
+// thread_count threads if needed, and appends it as a hittable. Prints the
+// reason and returns false on failure.
+bool scene_add_paged_mesh(Scene *scene, const char *path, MaterialId material, int thread_count);
+
+// Creates an empty object group and returns its index in *group
+bool scene_add_group(Scene *scene, uint32_t *group);
+
+// Appends one hittable to a group, see instance.h for what groups can hold
+bool scene_group_add(Scene *scene, uint32_t group, Hittable hittable);
+
+// Appends an instance of group placed by to_world. material replaces the
+// group's materials unless it is INSTANCE_KEEP_MATERIALS. Returns false on
+// allocation failure or for a singular transform.
+bool scene_add_instance(Scene *scene, uint32_t group, Transform to_world, MaterialId material);
+
+// Builds the acceleration structure, call after adding hittables and before rendering
+bool scene_build(Scene *scene);
+
+// Moves the instance world[index] of a built scene. The BVH is stale until
+// scene_refit. Returns false for other hittables or a singular transform.
+bool scene_set_instance_transform(Scene *scene, size_t index, Transform to_world);
+
+// Brings the BVH up to date after instances moved: refits it, or rebuilds
+// it when the refit tree has become too loose (SCENE_REFIT_MAX_GROWTH).
+// *rebuilt tells which. Returns false if a rebuild ran out of memory.
+bool scene_refit(Scene *scene, bool *rebuilt);
+
+// Collects the emissive primitives for light sampling. scene_build calls it,
+// scenes mapped from a cache call it after loading. Emissive planes are
+// rejected, an infinite area cannot be sampled.
+bool scene_build_lights(Scene *scene);
+
+// Releases all scene storage, the scene is empty afterwards
+void scene_free(Scene *scene);
+
+// Points texture filtering at the camera of a render taking sample_count
+// samples per pixel. render_tiles calls it.
+void scene_set_texture_view(Scene *scene, const Camera *camera, uint32_t sample_count);
+
+// The material at rec, with the texture looked up when it has one: then the
+// material is copied to scratch with its color multiplied by the filtered
+// texel, otherwise the table entry itself is returned.
+const Material *scene_material(const Scene *scene, const HitRecord *rec, Material *scratch);
+
+// Finds the closest hit over every hittable in the scene
+bool scene_hit(const Scene *scene, Ray r, double t_min, double t_max, HitRecord *rec);
+
+// scene_hit for batch->rays[0, count), filling recs[i] and hits[i]. Paged
+// meshes are traced for the whole batch at once, binned by cluster; the
+// results are exactly those of scene_hit.
+void scene_hit_batch(const Scene *scene, PagedBatch *batch, uint32_t count, double t_min, double t_max,
+                     HitRecord *recs, bool *hits);
+
+// Returns the number of rays the calling thread traced through scene_hit and
+// scene_hit_packet since the previous call, and resets it
+uint64_t scene_take_ray_count(void);
+
+// Packet version of scene_hit: fills recs[i] and sets bit i of the result
+// for every valid ray i that hit something
+uint32_t scene_hit_packet(Scene *scene, RayPacket *packet, double t_min, HitRecord *recs, PacketStats *stats);
+
 Camera camera_create(Point3 center, Point3 lower_left_corner, Vec3 horizontal, Vec3 vertical, int image_width, int image_height, size_t samples_per_pixel);
-Color ray_color(Scene *scene, Ray r, int depth);
-Ray camera_get_ray(Camera *cam, int pixel_x, int pixel_y);
-void render_scene(FILE *output, Scene *scene, Camera *camera, int max_depth);
\ No newline at end of file
+Color ray_color(Scene *scene, Ray r, int depth, int roulette_depth, Sampler *sampler);
+
+// Color returned by rays that leave the scene
+Color sky_color(Ray r);
+
+// Shades an existing hit and follows the path for depth - 1 more bounces.
+// rec is reused as scratch space for the following hits.
+//
+// Lambertian hits sample one light directly (next-event estimation) and the
+// BSDF-sampled path picks up emitters it hits as well; both estimates are
+// weighted with the power heuristic (multiple importance sampling). Once a
+// path has roulette_depth bounces behind it, it survives every further bounce
+// with probability max(throughput) and is reweighted by its inverse (Russian
+// roulette). roulette_depth <= 0 keeps every path until max_depth.
+Color shade_hit(Scene *scene, Ray r, HitRecord *rec, int depth, int roulette_depth, Sampler *sampler);
+
+// Next-event estimate at a lambertian hit: radiance from one light sampled in
+// proportion to its power, already MIS-weighted. Traces one shadow ray.
+Color scene_sample_light(const Scene *scene, const HitRecord *rec, const Material *material, Sampler *sampler);
+
+// MIS weight of emitted light found by a BSDF-sampled ray from origin that
+// hit an emitter at rec, with bsdf_pdf the density the direction was sampled
+// with. bsdf_pdf 0 marks a specular or camera ray, which gets full weight.
+double scene_emission_weight(const Scene *scene, Point3 origin, const HitRecord *rec, double bsdf_pdf);
+
+// Survival probability of Russian roulette for a path with this throughput
+double roulette_survival(Color throughput);
+Ray camera_get_ray(Camera *cam, int pixel_x, int pixel_y, Sampler *sampler);
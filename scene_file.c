@@ -0,0 +1,977 @@
+#include "scene_file.h"
+#include "mesh.h"
+#include "sidecar.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SCENE_FILE_MAX_TOKENS 16
+#define SCENE_CACHE_ALIGN 64
+
+static const char cache_magic[8] = {'R', 'T', 'S', 'C', 'A', 'C', 'H', 'E'};
+
+// Files the scene was built from, stored in the cache to detect changes
+typedef struct
+{
+    char path[SCENE_FILE_PATH_MAX];
+    SidecarStamp stamp;
+} CacheDependency;
+
+typedef struct
+{
+    uint64_t vertices; // File offsets
+    uint64_t indices;
+    uint32_t vertex_count;
+    uint32_t triangle_count;
+} CacheMesh;
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t layout[7]; // Sizes of the raw structs stored in the file
+    SceneFileSettings settings;
+
+    uint32_t dependency_count;
+    uint32_t mesh_count;
+    uint32_t material_count;
+    uint64_t hittable_count;
+    uint64_t unbounded_count;
+    uint32_t node_count;
+    uint32_t prim_count;
+    uint32_t sphere_count;
+    uint32_t triangle_count;
+
+    // Section offsets, each aligned to SCENE_CACHE_ALIGN
+    uint64_t dependencies;
+    uint64_t meshes;
+    uint64_t materials;
+    uint64_t hittables;
+    uint64_t unbounded;
+    uint64_t nodes;
+    uint64_t spheres;
+    uint64_t triangles;
+    uint64_t file_size;
+} CacheHeader;
+
+static void cache_layout(uint32_t layout[7])
+{
+    layout[0] = sizeof(Hittable);
+    layout[1] = sizeof(BvhNode);
+    layout[2] = sizeof(SceneFileSettings);
+    layout[3] = sizeof(Point3);
+    layout[4] = sizeof(CacheDependency);
+    layout[5] = SOA_PADDING;
+    layout[6] = sizeof(Material);
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) * 1e3 + (double)(now.tv_nsec - start->tv_nsec) * 1e-6;
+}
+
+static bool stat_dependency(const char *path, CacheDependency *dep)
+{
+    if (strlen(path) >= sizeof(dep->path))
+        return false;
+    memset(dep, 0, sizeof(*dep));
+    strcpy(dep->path, path);
+    return sidecar_stamp(path, &dep->stamp);
+}
+
+// -----------------------------------------------------------------------------
+// Text parser
+// -----------------------------------------------------------------------------
+
+typedef struct
+{
+    char name[64];
+    MaterialId id; // In the scene's material table
+} NamedMaterial;
+
+typedef struct
+{
+    char name[64];
+    uint32_t id; // In the scene's group table
+} NamedGroup;
+
+typedef struct
+{
+    char name[64];
+    uint32_t texture; // Value for Material.texture
+} NamedTexture;
+
+typedef struct
+{
+    const char *path;
+    int line;
+    Scene *scene;
+    SceneFileSettings *settings;
+    int thread_count;
+    Vec3 camera[4]; // camera statement, applied once the resolution is known
+    bool have_camera;
+
+    NamedMaterial *materials;
+    size_t material_count, material_capacity;
+    NamedGroup *groups;
+    size_t group_count, group_capacity;
+    NamedTexture *textures;
+    size_t texture_count, texture_capacity;
+    bool in_group; // Between "group" and "end", shapes go into current_group
+    uint32_t current_group;
+    Animation *animation;
+    bool camera_keyed;   // The frame 0 camera key is in the animation
+    bool have_instance;  // The previous statement placed an instance,
+    bool instance_keyed; // its frame 0 key is in the animation,
+    size_t instance_index;          // its world index
+    InstanceKey instance_placement; // and its frame 0 state
+    CacheDependency *dependencies;
+    uint32_t dependency_count, dependency_capacity;
+} Parser;
+
+static bool parse_error(Parser *p, const char *message)
+{
+    fprintf(stderr, "scene_file: %s:%d: %s\n", p->path, p->line, message);
+    return false;
+}
+
+static bool add_dependency(Parser *p, const char *path)
+{
+    if (p->dependency_count == p->dependency_capacity)
+    {
+        uint32_t capacity = p->dependency_capacity ? 2 * p->dependency_capacity : 4;
+        CacheDependency *grown = realloc(p->dependencies, sizeof(CacheDependency) * capacity);
+        if (!grown)
+            return parse_error(p, "out of memory");
+        p->dependencies = grown;
+        p->dependency_capacity = capacity;
+    }
+    if (!stat_dependency(path, &p->dependencies[p->dependency_count]))
+        return parse_error(p, "cannot stat file");
+    p->dependency_count++;
+    return true;
+}
+
+static bool parse_number(Parser *p, const char *token, double *out)
+{
+    char *end;
+    *out = strtod(token, &end);
+    if (end == token || *end != '\0')
+        return parse_error(p, "expected a number");
+    return true;
+}
+
+// Parses count numbers from tokens into out
+static bool parse_numbers(Parser *p, char **tokens, int count, double *out)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (!parse_number(p, tokens[i], &out[i]))
+            return false;
+    }
+    return true;
+}
+
+static bool parse_vec3(Parser *p, char **tokens, Vec3 *out)
+{
+    double v[3];
+    if (!parse_numbers(p, tokens, 3, v))
+        return false;
+    *out = vec3_create(v[0], v[1], v[2]);
+    return true;
+}
+
+static bool parse_int(Parser *p, const char *token, long min, long *out)
+{
+    char *end;
+    *out = strtol(token, &end, 10);
+    if (end == token || *end != '\0' || *out < min)
+        return parse_error(p, "expected a positive integer");
+    return true;
+}
+
+static bool find_material(Parser *p, const char *name, MaterialId *out)
+{
+    for (size_t i = 0; i < p->material_count; i++)
+    {
+        if (strcmp(p->materials[i].name, name) == 0)
+        {
+            *out = p->materials[i].id;
+            return true;
+        }
+    }
+    return parse_error(p, "unknown material");
+}
+
+// Adds h to the world, or to the group being defined
+static bool add_hittable(Parser *p, Hittable h)
+{
+    bool ok = p->in_group ? scene_group_add(p->scene, p->current_group, h) : scene_add(p->scene, h);
+    return ok || parse_error(p, "out of memory");
+}
+
+static bool parse_group(Parser *p, char **tokens, int count)
+{
+    NamedGroup g = {0};
+    if (count != 2 || strlen(tokens[1]) >= sizeof(g.name))
+        return parse_error(p, "usage: group <name>");
+    if (p->in_group)
+        return parse_error(p, "groups cannot nest, close the current one with end");
+    for (size_t i = 0; i < p->group_count; i++)
+    {
+        if (strcmp(p->groups[i].name, tokens[1]) == 0)
+            return parse_error(p, "group already defined");
+    }
+    strcpy(g.name, tokens[1]);
+
+    if (p->group_count == p->group_capacity)
+    {
+        size_t capacity = p->group_capacity ? 2 * p->group_capacity : 8;
+        NamedGroup *grown = realloc(p->groups, sizeof(NamedGroup) * capacity);
+        if (!grown)
+            return parse_error(p, "out of memory");
+        p->groups = grown;
+        p->group_capacity = capacity;
+    }
+    if (!scene_add_group(p->scene, &g.id))
+        return parse_error(p, "out of memory");
+    p->groups[p->group_count++] = g;
+    p->in_group = true;
+    p->current_group = g.id;
+    return true;
+}
+
+// instance <group> <position> [<rotation> [<scale>]] [<material>]
+static bool parse_instance(Parser *p, char **tokens, int count)
+{
+    bool has_material = count == 6 || count == 9 || count == 12;
+    int numbers = count - 2 - (has_material ? 1 : 0);
+    if (numbers != 3 && numbers != 6 && numbers != 9)
+        return parse_error(p, "usage: instance <group> <position> [<rotation> [<scale>]] [<material>]");
+    if (p->in_group)
+        return parse_error(p, "instances cannot be part of a group");
+
+    size_t g = 0;
+    while (g < p->group_count && strcmp(p->groups[g].name, tokens[1]) != 0)
+        g++;
+    if (g == p->group_count)
+        return parse_error(p, "unknown group");
+
+    Vec3 position, rotation = vec3_create(0, 0, 0), scale = vec3_create(1, 1, 1);
+    MaterialId material = INSTANCE_KEEP_MATERIALS;
+    if (!parse_vec3(p, &tokens[2], &position) || (numbers >= 6 && !parse_vec3(p, &tokens[5], &rotation)) ||
+        (numbers == 9 && !parse_vec3(p, &tokens[8], &scale)) ||
+        (has_material && !find_material(p, tokens[count - 1], &material)))
+        return false;
+
+    Transform to_world = transform_place(position, rotation, scale);
+    if (!scene_add_instance(p->scene, p->groups[g].id, to_world, material))
+        return parse_error(p, "singular instance transform or out of memory");
+    p->have_instance = true;
+    p->instance_keyed = false;
+    p->instance_index = p->scene->hittable_count - 1;
+    p->instance_placement = (InstanceKey){0, position, rotation, scale};
+    return true;
+}
+
+// key camera <frame> <center> <lower left> <horizontal> <vertical>
+// key <frame> <position> [<rotation> [<scale>]]
+static bool parse_key(Parser *p, char **tokens, int count)
+{
+    bool camera = count > 1 && strcmp(tokens[1], "camera") == 0;
+    int first = camera ? 2 : 1;
+    long frame;
+    if (camera ? count != 15 : (count != 5 && count != 8 && count != 11))
+        return parse_error(p, "usage: key camera <frame> <center> <lower left> <horizontal> <vertical> or "
+                              "key <frame> <position> [<rotation> [<scale>]]");
+    if (!parse_int(p, tokens[first], 1, &frame) || frame > UINT32_MAX - 1)
+        return parse_error(p, "key frames start at 1, frame 0 is the statement being keyed");
+
+    if (camera)
+    {
+        if (!p->have_camera)
+            return parse_error(p, "key camera before the camera statement");
+        CameraKey key = {.frame = (uint32_t)frame};
+        if (!parse_vec3(p, &tokens[3], &key.center) || !parse_vec3(p, &tokens[6], &key.lower_left) ||
+            !parse_vec3(p, &tokens[9], &key.horizontal) || !parse_vec3(p, &tokens[12], &key.vertical))
+            return false;
+        CameraKey placement = {0, p->camera[0], p->camera[1], p->camera[2], p->camera[3]};
+        if (!p->camera_keyed && !animation_add_camera_key(p->animation, placement))
+            return parse_error(p, "out of memory");
+        p->camera_keyed = true;
+        if (!animation_add_camera_key(p->animation, key))
+            return parse_error(p, "key frames must ascend, or out of memory");
+        return true;
+    }
+
+    if (!p->have_instance)
+        return parse_error(p, "key without an instance before it");
+    InstanceKey key = {(uint32_t)frame, vec3_create(0, 0, 0), vec3_create(0, 0, 0), vec3_create(1, 1, 1)};
+    if (!parse_vec3(p, &tokens[2], &key.position) || (count >= 8 && !parse_vec3(p, &tokens[5], &key.rotation)) ||
+        (count == 11 && !parse_vec3(p, &tokens[8], &key.scale)))
+        return false;
+    if (!p->instance_keyed && !animation_add_instance_key(p->animation, p->instance_index, p->instance_placement))
+        return parse_error(p, "out of memory");
+    p->instance_keyed = true;
+    if (!animation_add_instance_key(p->animation, p->instance_index, key))
+        return parse_error(p, "key frames must ascend, or out of memory");
+    return true;
+}
+
+// Relative paths start at the scene file's directory
+static bool resolve_path(Parser *p, const char *token, char path[SCENE_FILE_PATH_MAX])
+{
+    const char *slash = strrchr(p->path, '/');
+    int dir_length = token[0] == '/' || !slash ? 0 : (int)(slash - p->path + 1);
+    if (snprintf(path, SCENE_FILE_PATH_MAX, "%.*s%s", dir_length, p->path, token) >= SCENE_FILE_PATH_MAX)
+        return parse_error(p, "path too long");
+    return true;
+}
+
+// texture <name> <path> [<scale>]
+static bool parse_texture(Parser *p, char **tokens, int count)
+{
+    NamedTexture t = {0};
+    double scale = 1;
+    char path[SCENE_FILE_PATH_MAX];
+    if ((count != 3 && count != 4) || strlen(tokens[1]) >= sizeof(t.name))
+        return parse_error(p, "usage: texture <name> <path> [<scale>]");
+    for (size_t i = 0; i < p->texture_count; i++)
+    {
+        if (strcmp(p->textures[i].name, tokens[1]) == 0)
+            return parse_error(p, "texture already defined");
+    }
+    if ((count == 4 && !parse_number(p, tokens[3], &scale)) || !resolve_path(p, tokens[2], path))
+        return false;
+    strcpy(t.name, tokens[1]);
+
+    if (p->texture_count == p->texture_capacity)
+    {
+        size_t capacity = p->texture_capacity ? 2 * p->texture_capacity : 8;
+        NamedTexture *grown = realloc(p->textures, sizeof(NamedTexture) * capacity);
+        if (!grown)
+            return parse_error(p, "out of memory");
+        p->textures = grown;
+        p->texture_capacity = capacity;
+    }
+    if (!scene_add_texture(p->scene, path, scale, &t.texture))
+        return parse_error(p, "could not load texture");
+    p->textures[p->texture_count++] = t;
+    return true;
+}
+
+static bool parse_material(Parser *p, char **tokens, int count)
+{
+    NamedMaterial m = {0};
+    Material material = {0};
+    if (count < 4 || strlen(tokens[1]) >= sizeof(m.name))
+        return parse_error(p, "usage: material <name> <type> <r g b | texture> [parameter]");
+    strcpy(m.name, tokens[1]);
+
+    // The color is three numbers or the name of a texture
+    int color_tokens = 3;
+    for (size_t i = 0; i < p->texture_count; i++)
+    {
+        if (strcmp(p->textures[i].name, tokens[3]) == 0)
+        {
+            material.texture = p->textures[i].texture;
+            material.color = vec3_create(1, 1, 1);
+            color_tokens = 1;
+        }
+    }
+    if (color_tokens == 3 && count < 6)
+        return parse_error(p, "unknown texture");
+    if (color_tokens == 3 && !parse_vec3(p, &tokens[3], &material.color))
+        return false;
+    int parameter = 3 + color_tokens; // Token of the type's parameter
+
+    if (strcmp(tokens[2], "lambertian") == 0 && count == parameter)
+    {
+        material.type = MATERIAL_LAMBERTIAN;
+    }
+    else if (strcmp(tokens[2], "metal") == 0 && count == parameter + 1)
+    {
+        material.type = MATERIAL_METAL;
+        if (!parse_number(p, tokens[parameter], &material.properties.fuzz))
+            return false;
+    }
+    else if (strcmp(tokens[2], "dielectric") == 0 && count == parameter + 1)
+    {
+        material.type = MATERIAL_DIELECTRIC;
+        if (!parse_number(p, tokens[parameter], &material.properties.ref_idx))
+            return false;
+    }
+    else if (strcmp(tokens[2], "emissive") == 0 && count == parameter)
+    {
+        if (material.texture != 0)
+            return parse_error(p, "emissive materials cannot be textured");
+        material.type = MATERIAL_EMISSIVE;
+    }
+    else
+    {
+        return parse_error(p, "unknown material type or wrong number of parameters");
+    }
+
+    if (p->material_count == p->material_capacity)
+    {
+        size_t capacity = p->material_capacity ? 2 * p->material_capacity : 16;
+        NamedMaterial *grown = realloc(p->materials, sizeof(NamedMaterial) * capacity);
+        if (!grown)
+            return parse_error(p, "out of memory");
+        p->materials = grown;
+        p->material_capacity = capacity;
+    }
+    if (!scene_add_material(p->scene, material, &m.id))
+        return parse_error(p, "out of memory");
+    p->materials[p->material_count++] = m;
+    return true;
+}
+
+static bool parse_mesh(Parser *p, char **tokens, int count)
+{
+    if (count != 3 && count != 7)
+        return parse_error(p, "usage: mesh <path> <material> [<center> <size>]");
+
+    char path[SCENE_FILE_PATH_MAX];
+    MaterialId material;
+    Vec3 center = vec3_create(0, 0, 0);
+    double size = 0;
+    if (!resolve_path(p, tokens[1], path) || !find_material(p, tokens[2], &material) ||
+        (count == 7 && (!parse_vec3(p, &tokens[3], &center) || !parse_number(p, tokens[6], &size))))
+        return false;
+
+    Scene *scene = p->scene;
+    Mesh *mesh = arena_alloc(&scene->arena, sizeof(Mesh), _Alignof(Mesh));
+    MeshLoadStats stats;
+    if (!mesh || !mesh_load(mesh, path, &scene->arena, p->thread_count, &stats))
+        return parse_error(p, "could not load mesh");
+    if (count == 7)
+        mesh_fit(mesh, center, size);
+    fprintf(stderr, "Loaded %s: %u triangles in %.1f ms\n", path, mesh->triangle_count, stats.seconds * 1e3);
+
+    Hittable h = {HITTABLE_MESH, .object.mesh = mesh, .material = material};
+    return add_hittable(p, h) && add_dependency(p, path);
+}
+
+static bool parse_paged(Parser *p, char **tokens, int count)
+{
+    if (count != 3)
+        return parse_error(p, "usage: paged <path> <material>");
+    if (p->in_group)
+        return parse_error(p, "paged meshes cannot be part of a group");
+    char path[SCENE_FILE_PATH_MAX];
+    MaterialId material;
+    if (!resolve_path(p, tokens[1], path) || !find_material(p, tokens[2], &material))
+        return false;
+    if (!scene_add_paged_mesh(p->scene, path, material, p->thread_count))
+        return parse_error(p, "could not open paged mesh");
+    return true;
+}
+
+static bool parse_line(Parser *p, char **tokens, int count)
+{
+    SceneFileSettings *settings = p->settings;
+    const char *keyword = tokens[0];
+    Hittable h = {0};
+    long value, height;
+
+    // Keys follow the statement they animate
+    if (strcmp(keyword, "key") == 0)
+        return parse_key(p, tokens, count);
+    if (strcmp(keyword, "instance") != 0)
+        p->have_instance = false;
+
+    if (strcmp(keyword, "image") == 0)
+    {
+        if (count != 3)
+            return parse_error(p, "usage: image <width> <height>");
+        if (!parse_int(p, tokens[1], 1, &value) || !parse_int(p, tokens[2], 1, &height))
+            return false;
+        settings->camera.image_width = (int)value;
+        settings->camera.image_height = (int)height;
+        return true;
+    }
+    if (strcmp(keyword, "samples") == 0)
+    {
+        if (count != 2)
+            return parse_error(p, "usage: samples <per pixel>");
+        if (!parse_int(p, tokens[1], 1, &value))
+            return false;
+        settings->camera.samples_per_pixel = (size_t)value;
+        return true;
+    }
+    if (strcmp(keyword, "depth") == 0)
+    {
+        if (count != 2)
+            return parse_error(p, "usage: depth <max bounces>");
+        if (!parse_int(p, tokens[1], 1, &value))
+            return false;
+        settings->max_depth = (int)value;
+        return true;
+    }
+    if (strcmp(keyword, "output") == 0)
+    {
+        if ((count != 2 && count != 3) || strlen(tokens[1]) >= sizeof(settings->output_path))
+            return parse_error(p, "usage: output <path> [format]");
+        strcpy(settings->output_path, tokens[1]);
+        settings->output_format = image_format_from_path(tokens[1]);
+        if (count == 3 && !image_format_parse(tokens[2], &settings->output_format))
+            return parse_error(p, "unknown image format");
+        return true;
+    }
+    if (strcmp(keyword, "frames") == 0)
+    {
+        if (count != 2)
+            return parse_error(p, "usage: frames <count>");
+        if (!parse_int(p, tokens[1], 1, &value) || value > UINT32_MAX)
+            return false;
+        p->animation->frame_count = (uint32_t)value;
+        return true;
+    }
+    if (strcmp(keyword, "camera") == 0)
+    {
+        if (count != 13)
+            return parse_error(p, "usage: camera <center> <lower left> <horizontal> <vertical>");
+        if (p->camera_keyed)
+            return parse_error(p, "camera after its keys");
+        for (int i = 0; i < 4; i++)
+        {
+            if (!parse_vec3(p, &tokens[1 + 3 * i], &p->camera[i]))
+                return false;
+        }
+        p->have_camera = true;
+        return true;
+    }
+    if (strcmp(keyword, "material") == 0)
+        return parse_material(p, tokens, count);
+    if (strcmp(keyword, "texture") == 0)
+        return parse_texture(p, tokens, count);
+    if (strcmp(keyword, "mesh") == 0)
+        return parse_mesh(p, tokens, count);
+    if (strcmp(keyword, "paged") == 0)
+        return parse_paged(p, tokens, count);
+    if (strcmp(keyword, "group") == 0)
+        return parse_group(p, tokens, count);
+    if (strcmp(keyword, "instance") == 0)
+        return parse_instance(p, tokens, count);
+    if (strcmp(keyword, "end") == 0)
+    {
+        if (count != 1 || !p->in_group)
+            return parse_error(p, "end without group");
+        p->in_group = false;
+        return true;
+    }
+
+    if (strcmp(keyword, "sphere") == 0)
+    {
+        if (count != 6)
+            return parse_error(p, "usage: sphere <center> <radius> <material>");
+        h.type = HITTABLE_SPHERE;
+        if (!parse_vec3(p, &tokens[1], &h.object.sphere.center) ||
+            !parse_number(p, tokens[4], &h.object.sphere.radius) || !find_material(p, tokens[5], &h.material))
+            return false;
+    }
+    else if (strcmp(keyword, "plane") == 0)
+    {
+        if (count != 8)
+            return parse_error(p, "usage: plane <point> <normal> <material>");
+        if (p->in_group)
+            return parse_error(p, "planes cannot be part of a group");
+        h.type = HITTABLE_PLANE;
+        if (!parse_vec3(p, &tokens[1], &h.object.plane.point) || !parse_vec3(p, &tokens[4], &h.object.plane.normal) ||
+            !find_material(p, tokens[7], &h.material))
+            return false;
+    }
+    else if (strcmp(keyword, "triangle") == 0)
+    {
+        if (count != 11)
+            return parse_error(p, "usage: triangle <v0> <v1> <v2> <material>");
+        h.type = HITTABLE_TRIANGLE;
+        if (!parse_vec3(p, &tokens[1], &h.object.triangle.v0) || !parse_vec3(p, &tokens[4], &h.object.triangle.v1) ||
+            !parse_vec3(p, &tokens[7], &h.object.triangle.v2) || !find_material(p, tokens[10], &h.material))
+            return false;
+    }
+    else
+    {
+        return parse_error(p, "unknown statement");
+    }
+    return add_hittable(p, h);
+}
+
+static bool parse_file(Parser *p)
+{
+    FILE *file = fopen(p->path, "r");
+    if (!file)
+    {
+        fprintf(stderr, "scene_file: cannot open %s\n", p->path);
+        return false;
+    }
+
+    SceneFileSettings *settings = p->settings;
+    memset(settings, 0, sizeof(*settings));
+    settings->camera.image_width = 640;
+    settings->camera.image_height = 360;
+    settings->camera.samples_per_pixel = 100;
+    settings->max_depth = 10;
+    settings->output_format = IMAGE_FORMAT_PPM;
+
+    char line[1024];
+    bool ok = add_dependency(p, p->path);
+    while (ok && fgets(line, sizeof(line), file))
+    {
+        p->line++;
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+
+        char *tokens[SCENE_FILE_MAX_TOKENS];
+        int count = 0;
+        char *save;
+        for (char *t = strtok_r(line, " \t\r\n", &save); t; t = strtok_r(NULL, " \t\r\n", &save))
+        {
+            if (count == SCENE_FILE_MAX_TOKENS)
+            {
+                ok = parse_error(p, "too many arguments");
+                break;
+            }
+            tokens[count++] = t;
+        }
+        if (ok && count > 0)
+            ok = parse_line(p, tokens, count);
+    }
+    fclose(file);
+    if (ok && p->in_group)
+        ok = parse_error(p, "group without end");
+    if (ok && !p->have_camera)
+        ok = parse_error(p, "no camera statement");
+
+    // Without a frames statement the animation ends at its last key
+    Animation *animation = p->animation;
+    if (ok && animation->frame_count == 0)
+    {
+        uint32_t last = 0;
+        if (animation->camera_key_count > 0)
+            last = animation->camera_keys[animation->camera_key_count - 1].frame;
+        for (uint32_t t = 0; t < animation->track_count; t++)
+        {
+            const InstanceTrack *track = &animation->tracks[t];
+            if (track->keys[track->key_count - 1].frame > last)
+                last = track->keys[track->key_count - 1].frame;
+        }
+        animation->frame_count = last + 1;
+    }
+
+    if (ok)
+    {
+        Camera *c = &settings->camera;
+        *c = camera_create(p->camera[0], p->camera[1], p->camera[2], p->camera[3],
+                           c->image_width, c->image_height, c->samples_per_pixel);
+    }
+    return ok;
+}
+
+// -----------------------------------------------------------------------------
+// Binary cache
+// -----------------------------------------------------------------------------
+
+static uint64_t align_offset(uint64_t offset)
+{
+    return (offset + SCENE_CACHE_ALIGN - 1) & ~(uint64_t)(SCENE_CACHE_ALIGN - 1);
+}
+
+// Pads the file with zeros up to offset, then writes size bytes
+static bool write_section(FILE *file, uint64_t *position, uint64_t offset, const void *data, size_t size)
+{
+    static const char zeros[SCENE_CACHE_ALIGN] = {0};
+    if (fwrite(zeros, 1, (size_t)(offset - *position), file) != offset - *position)
+        return false;
+    *position = offset + size;
+    return size == 0 || fwrite(data, 1, size, file) == size;
+}
+
+static uint32_t mesh_index(const Mesh **meshes, uint32_t count, const Mesh *mesh)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (meshes[i] == mesh)
+            return i;
+    }
+    return count;
+}
+
+static bool cache_write(const char *cache_path, const Scene *scene, const SceneFileSettings *settings,
+                        const CacheDependency *dependencies, uint32_t dependency_count)
+{
+    const Bvh *bvh = &scene->bvh;
+    CacheHeader header = {0};
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = SCENE_CACHE_VERSION;
+    cache_layout(header.layout);
+    header.settings = *settings;
+    header.dependency_count = dependency_count;
+    header.material_count = scene->material_count;
+    header.hittable_count = scene->hittable_count;
+    header.unbounded_count = scene->unbounded_count;
+    header.node_count = bvh->node_count;
+    header.prim_count = bvh->prim_count;
+    header.sphere_count = bvh->spheres.count;
+    header.triangle_count = bvh->triangles.count;
+
+    // Meshes are referenced by pointer, the file stores their index instead
+    const Mesh **meshes = malloc(sizeof(Mesh *) * (scene->hittable_count + 1));
+    Hittable *world = malloc(sizeof(Hittable) * (scene->hittable_count + 1));
+    CacheMesh *cache_meshes = malloc(sizeof(CacheMesh) * (scene->hittable_count + 1));
+    bool ok = meshes && world && cache_meshes;
+    for (size_t i = 0; ok && i < scene->hittable_count; i++)
+    {
+        world[i] = scene->world[i];
+        if (world[i].type != HITTABLE_MESH)
+            continue;
+        uint32_t index = mesh_index(meshes, header.mesh_count, world[i].object.mesh);
+        if (index == header.mesh_count)
+            meshes[header.mesh_count++] = world[i].object.mesh;
+        world[i].object.mesh = (const Mesh *)(uintptr_t)index;
+    }
+
+    // Section layout
+    uint64_t offset = align_offset(sizeof(CacheHeader));
+    header.dependencies = offset;
+    offset = align_offset(offset + sizeof(CacheDependency) * dependency_count);
+    header.meshes = offset;
+    offset = align_offset(offset + sizeof(CacheMesh) * header.mesh_count);
+    for (uint32_t m = 0; ok && m < header.mesh_count; m++)
+    {
+        cache_meshes[m].vertex_count = meshes[m]->vertex_count;
+        cache_meshes[m].triangle_count = meshes[m]->triangle_count;
+        cache_meshes[m].vertices = offset;
+        offset = align_offset(offset + sizeof(Point3) * meshes[m]->vertex_count);
+        cache_meshes[m].indices = offset;
+        offset = align_offset(offset + sizeof(uint32_t) * 3 * (size_t)meshes[m]->triangle_count);
+    }
+    header.materials = offset;
+    offset = align_offset(offset + sizeof(Material) * scene->material_count);
+    header.hittables = offset;
+    offset = align_offset(offset + sizeof(Hittable) * scene->hittable_count);
+    header.unbounded = offset;
+    offset = align_offset(offset + sizeof(uint32_t) * scene->unbounded_count);
+    header.nodes = offset;
+    offset = align_offset(offset + sizeof(BvhNode) * bvh->node_count);
+    size_t sphere_bytes = bvh->node_count ? sphere_soa_bytes(bvh->spheres.count) : 0;
+    size_t triangle_bytes = bvh->node_count ? triangle_soa_bytes(bvh->triangles.count) : 0;
+    header.spheres = offset;
+    offset = align_offset(offset + sphere_bytes);
+    header.triangles = offset;
+    header.file_size = offset + triangle_bytes;
+
+    // Written under a temporary name and renamed, so readers never see a
+    // partial cache
+    char tmp_path[SCENE_FILE_PATH_MAX + 32];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", cache_path, (long)getpid());
+    FILE *file = ok ? fopen(tmp_path, "wb") : NULL;
+    if (file)
+    {
+        uint64_t position = 0;
+        ok = write_section(file, &position, 0, &header, sizeof(header)) &&
+             write_section(file, &position, header.dependencies, dependencies, sizeof(CacheDependency) * dependency_count) &&
+             write_section(file, &position, header.meshes, cache_meshes, sizeof(CacheMesh) * header.mesh_count);
+        for (uint32_t m = 0; ok && m < header.mesh_count; m++)
+        {
+            ok = write_section(file, &position, cache_meshes[m].vertices, meshes[m]->vertices,
+                               sizeof(Point3) * meshes[m]->vertex_count) &&
+                 write_section(file, &position, cache_meshes[m].indices, meshes[m]->indices,
+                               sizeof(uint32_t) * 3 * (size_t)meshes[m]->triangle_count);
+        }
+        ok = ok && write_section(file, &position, header.materials, scene->materials, sizeof(Material) * scene->material_count) &&
+             write_section(file, &position, header.hittables, world, sizeof(Hittable) * scene->hittable_count) &&
+             write_section(file, &position, header.unbounded, scene->unbounded, sizeof(uint32_t) * scene->unbounded_count) &&
+             write_section(file, &position, header.nodes, bvh->nodes, sizeof(BvhNode) * bvh->node_count) &&
+             write_section(file, &position, header.spheres, bvh->spheres.center_x, sphere_bytes) &&
+             write_section(file, &position, header.triangles, bvh->triangles.v0_x, triangle_bytes);
+        ok = fclose(file) == 0 && ok;
+        ok = ok && rename(tmp_path, cache_path) == 0;
+        if (!ok)
+            unlink(tmp_path);
+    }
+    else
+    {
+        ok = false;
+    }
+
+    free(meshes);
+    free(world);
+    free(cache_meshes);
+    return ok;
+}
+
+static bool section_fits(uint64_t offset, uint64_t count, size_t element, uint64_t file_size)
+{
+    return offset <= file_size && count <= (file_size - offset) / (element ? element : 1);
+}
+
+// Maps the cache and points the scene into it. Returns false, leaving the
+// scene untouched, when the cache is missing, stale or malformed.
+static bool cache_load(Scene *scene, SceneFileSettings *settings, const char *cache_path, bool *stale)
+{
+    *stale = false;
+    int fd = open(cache_path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    size_t size = 0;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CacheHeader))
+    {
+        size = (size_t)st.st_size;
+        // Private writable mapping: patching mesh pointers only copies the
+        // pages that hold them
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    *stale = true;
+    if (map == MAP_FAILED)
+        return false;
+
+    unsigned char *base = map;
+    const CacheHeader *header = map;
+    uint32_t layout[7];
+    cache_layout(layout);
+    bool ok = memcmp(header->magic, cache_magic, sizeof(cache_magic)) == 0 &&
+              header->version == SCENE_CACHE_VERSION && memcmp(header->layout, layout, sizeof(layout)) == 0 &&
+              header->file_size == size &&
+              section_fits(header->dependencies, header->dependency_count, sizeof(CacheDependency), size) &&
+              section_fits(header->meshes, header->mesh_count, sizeof(CacheMesh), size) &&
+              section_fits(header->materials, header->material_count, sizeof(Material), size) &&
+              section_fits(header->hittables, header->hittable_count, sizeof(Hittable), size) &&
+              section_fits(header->unbounded, header->unbounded_count, sizeof(uint32_t), size) &&
+              section_fits(header->nodes, header->node_count, sizeof(BvhNode), size) &&
+              (header->node_count == 0 ||
+               (section_fits(header->spheres, 1, sphere_soa_bytes(header->sphere_count), size) &&
+                section_fits(header->triangles, 1, triangle_soa_bytes(header->triangle_count), size)));
+
+    const CacheDependency *dependencies = (const CacheDependency *)(base + header->dependencies);
+    for (uint32_t i = 0; ok && i < header->dependency_count; i++)
+    {
+        SidecarStamp now;
+        ok = sidecar_stamp(dependencies[i].path, &now) && sidecar_stamp_equal(&now, &dependencies[i].stamp);
+    }
+
+    const CacheMesh *cache_meshes = (const CacheMesh *)(base + header->meshes);
+    Mesh *meshes = ok ? arena_alloc(&scene->arena, sizeof(Mesh) * (header->mesh_count + 1), _Alignof(Mesh)) : NULL;
+    ok = ok && meshes;
+    for (uint32_t m = 0; ok && m < header->mesh_count; m++)
+    {
+        const CacheMesh *cm = &cache_meshes[m];
+        ok = section_fits(cm->vertices, cm->vertex_count, sizeof(Point3), size) &&
+             section_fits(cm->indices, 3 * (uint64_t)cm->triangle_count, sizeof(uint32_t), size);
+        meshes[m] = (Mesh){(Point3 *)(base + cm->vertices), (uint32_t *)(base + cm->indices), cm->vertex_count, cm->triangle_count};
+    }
+
+    Hittable *world = (Hittable *)(base + header->hittables);
+    for (uint64_t i = 0; ok && i < header->hittable_count; i++)
+    {
+        ok = world[i].material < header->material_count;
+        if (!ok || world[i].type != HITTABLE_MESH)
+            continue;
+        uintptr_t index = (uintptr_t)world[i].object.mesh;
+        ok = index < header->mesh_count;
+        world[i].object.mesh = ok ? &meshes[index] : NULL;
+    }
+
+    if (!ok)
+    {
+        munmap(map, size);
+        return false;
+    }
+
+    *settings = header->settings;
+    scene->materials = (Material *)(base + header->materials);
+    scene->material_count = header->material_count;
+    scene->material_capacity = header->material_count;
+    scene->world = world;
+    scene->hittable_count = header->hittable_count;
+    scene->hittable_capacity = header->hittable_count;
+    scene->unbounded = (uint32_t *)(base + header->unbounded);
+    scene->unbounded_count = header->unbounded_count;
+
+    Bvh *bvh = &scene->bvh;
+    *bvh = (Bvh){0};
+    if (header->node_count > 0)
+    {
+        bvh->nodes = (BvhNode *)(base + header->nodes);
+        bvh->node_count = header->node_count;
+        bvh->prim_count = header->prim_count;
+        sphere_soa_attach(&bvh->spheres, base + header->spheres, header->sphere_count, header->sphere_count);
+        triangle_soa_attach(&bvh->triangles, base + header->triangles, header->triangle_count, header->triangle_count);
+    }
+    scene->mapping = map;
+    scene->mapping_size = size;
+    scene->bvh_mapped = true;
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Entry point
+// -----------------------------------------------------------------------------
+
+bool scene_file_load(Scene *scene, SceneFileSettings *settings, Animation *animation, const char *path, bool use_cache,
+                     int thread_count)
+{
+    animation_init(animation);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char cache_path[SCENE_FILE_PATH_MAX + 16];
+    snprintf(cache_path, sizeof(cache_path), "%s.rtcache", path);
+    bool stale = false;
+    if (use_cache && cache_load(scene, settings, cache_path, &stale))
+    {
+        if (!scene_build_lights(scene))
+        {
+            fprintf(stderr, "scene_file: %s: could not collect the lights\n", cache_path);
+            return false;
+        }
+        fprintf(stderr, "Scene: mapped %s in %.2f ms\n", cache_path, elapsed_ms(&start));
+        return true;
+    }
+    if (stale)
+        fprintf(stderr, "Scene: %s is out of date, rebuilding\n", cache_path);
+
+    Parser p = {.path = path, .scene = scene, .settings = settings, .thread_count = thread_count, .animation = animation};
+    animation->frame_count = 0; // Until a frames statement or the last key sets it
+    bool ok = parse_file(&p);
+    if (ok && !scene_build(scene))
+    {
+        fprintf(stderr, "scene_file: %s: could not build the scene\n", path);
+        ok = false;
+    }
+    if (ok)
+    {
+        fprintf(stderr, "Scene: parsed and built %s in %.1f ms\n", path, elapsed_ms(&start));
+        // Groups, instances, textures, paged meshes and keys are not part of the
+        // cache format
+        if (use_cache && scene->group_count > 0)
+            fprintf(stderr, "Scene: instanced scenes are not cached\n");
+        else if (use_cache && scene->textures.count > 0)
+            fprintf(stderr, "Scene: textured scenes are not cached\n");
+        else if (use_cache && scene->paged_geometry.count > 0)
+            fprintf(stderr, "Scene: scenes with paged meshes are not cached\n");
+        else if (use_cache && (animation_is_animated(animation) || animation->frame_count > 1))
+            fprintf(stderr, "Scene: animated scenes are not cached\n");
+        else if (use_cache && !cache_write(cache_path, scene, settings, p.dependencies, p.dependency_count))
+            fprintf(stderr, "Scene: could not write %s\n", cache_path);
+    }
+    free(p.groups);
+    free(p.textures);
+    free(p.materials);
+    free(p.dependencies);
+    return ok;
+}
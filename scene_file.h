@@ -0,0 +1,84 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "scene.h"
+#include "animation.h"
+#include "framebuffer.h"
+
+#define SCENE_FILE_PATH_MAX 256
+
+// Bump whenever the cache layout or the meaning of any cached field changes
+#define SCENE_CACHE_VERSION 3
+
+// -----------------------------------------------------------------------------
+// Scene description files
+// -----------------------------------------------------------------------------
+// One statement per line, "#" starts a comment. Vectors are three numbers.
+//
+//   image <width> <height>                      default 640 360
+//   samples <per pixel>                         default 100
+//   depth <max bounces>                         default 10
+//   output <path> [p3|ppm|ppm16|pfm]            optional
+//   camera <center> <lower left corner> <horizontal> <vertical>   required
+//   texture <name> <path> [<scale>]             PPM or PFM image, see texture.h
+//   material <name> lambertian <color>
+//   material <name> metal <color> <fuzz>
+//   material <name> dielectric <color> <refraction index>
+//   material <name> emissive <radiance>         for spheres, triangles and meshes
+//   sphere <center> <radius> <material>
+//   plane <point> <normal> <material>
+//   triangle <v0> <v1> <v2> <material>
+//   mesh <path> <material> [<center> <size>]    see mesh.h; optional fit box
+//   paged <path> <material>                     out-of-core mesh, see paged.h
+//   group <name>                                starts an object group, see instance.h
+//   end                                         closes it
+//   instance <group> <position> [<rotation> [<scale>]] [<material>]
+//   frames <count>                              animation length, see animation.h
+//   key camera <frame> <center> <lower left> <horizontal> <vertical>
+//   key <frame> <position> [<rotation> [<scale>]]
+//
+// Materials must be defined before they are used, textures before the
+// materials. A lambertian, metal or dielectric color may be a texture name
+// instead of three numbers; <scale> repeats the image that many times across
+// the surface's texture coordinates (see hittable.h). Mesh and texture paths
+// are relative to the scene file. Scenes with textures are not cached.
+//
+// A paged mesh is a mesh file (.obj, .ply, .stl) or a ".rtpage" file. It is
+// traced straight from a mapped file of triangle clusters instead of being
+// loaded, so it may be larger than memory; its material may be neither
+// emissive nor textured, and it cannot be part of a group. Scenes with paged
+// meshes are not cached.
+//
+// Spheres, triangles and meshes between "group" and "end" belong to the
+// group instead of the world. An instance scales the group by <scale>,
+// rotates it by <rotation> degrees about x, y and z in that order, and moves
+// it by <position>; with a material it replaces the group's materials.
+// Scenes with groups are not cached.
+//
+// "key camera" keys the camera, "key" alone the instance of the statement
+// before it. The camera and instance statements give the state at frame 0,
+// keys must follow them with ascending frames from 1. Without "frames" the
+// animation ends at the last key. Animated scenes are not cached.
+//
+// The first load parses the file, loads the meshes, builds the BVH and writes
+// everything to "<path>.rtcache". Later loads map that cache and use it in
+// place: no parsing, no mesh import, no BVH build. The cache is rebuilt when
+// the scene file or one of its meshes changes (size or modification time),
+// or when SCENE_CACHE_VERSION or the in-memory layout differs.
+typedef struct
+{
+    Camera camera; // Includes resolution and samples per pixel
+    int max_depth;
+    char output_path[SCENE_FILE_PATH_MAX]; // Empty when the file sets none
+    ImageFormat output_format;
+} SceneFileSettings;
+
+// Loads the scene at path into a freshly initialized scene, ready to render,
+// and its keyframes into a freshly initialized animation. use_cache = false
+// neither reads nor writes the cache. thread_count is used for mesh import.
+// Prints the reason to stderr and returns false on failure. Free the
+// animation with animation_free either way.
+bool scene_file_load(Scene *scene, SceneFileSettings *settings, Animation *animation, const char *path, bool use_cache,
+                     int thread_count);
+
+#endif // SCENE_FILE_H
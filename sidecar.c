@@ -0,0 +1,81 @@
+#include "sidecar.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool sidecar_stamp(const char *path, SidecarStamp *stamp)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return false;
+    stamp->size = (int64_t)st.st_size;
+    stamp->mtime_sec = (int64_t)st.st_mtim.tv_sec;
+    stamp->mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+    return true;
+}
+
+bool sidecar_stamp_equal(const SidecarStamp *a, const SidecarStamp *b)
+{
+    return a->size == b->size && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+char *sidecar_path(const char *path, const char *suffix)
+{
+    size_t size = strlen(path) + strlen(suffix) + 1;
+    char *result = malloc(size);
+    if (result)
+        snprintf(result, size, "%s%s", path, suffix);
+    return result;
+}
+
+bool sidecar_map(const char *path, SidecarMap map, void *context)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool ok = map(fd, context);
+    close(fd);
+    return ok;
+}
+
+bool sidecar_convert(const char *caller, const char *source_path, const char *path, SidecarWrite write, SidecarMap map,
+                     void *context)
+{
+    size_t tmp_size = strlen(path) + 32;
+    char *tmp_path = malloc(tmp_size);
+    FILE *file = NULL;
+    if (tmp_path)
+    {
+        snprintf(tmp_path, tmp_size, "%s.%ld.tmp", path, (long)getpid());
+        file = fopen(tmp_path, "wb");
+    }
+    bool named = file != NULL;
+    if (!named)
+    {
+        fprintf(stderr, "%s: cannot write %s, converting %s to a temporary file\n", caller, path, source_path);
+        file = tmpfile();
+    }
+
+    bool ok = file && write(file, context) && fflush(file) == 0;
+    if (ok && named)
+    {
+        ok = fclose(file) == 0 && rename(tmp_path, path) == 0;
+        file = NULL;
+        ok = ok && sidecar_map(path, map, context);
+    }
+    else if (ok)
+    {
+        ok = map(fileno(file), context);
+    }
+    if (file)
+        fclose(file);
+    if (named && !ok)
+        unlink(tmp_path);
+    free(tmp_path);
+    if (!ok)
+        fprintf(stderr, "%s: could not convert %s\n", caller, source_path);
+    return ok;
+}
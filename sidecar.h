@@ -0,0 +1,51 @@
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// -----------------------------------------------------------------------------
+// Derived files
+// -----------------------------------------------------------------------------
+// Converted textures, paged meshes and scene caches live next to the file
+// they were made from and record its stamp, so a changed source makes them
+// stale. New ones are written under a temporary name and renamed into
+// place, so readers never see a partial file.
+
+// Identifies a version of a source file. Plain integers, so file headers can
+// hold it as it is.
+typedef struct
+{
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} SidecarStamp;
+
+// Stamps the file at path, returns false when it cannot be stat'ed
+bool sidecar_stamp(const char *path, SidecarStamp *stamp);
+
+bool sidecar_stamp_equal(const SidecarStamp *a, const SidecarStamp *b);
+
+// Returns path with suffix appended, allocated with malloc, NULL on failure
+char *sidecar_path(const char *path, const char *suffix);
+
+// Fills file with the derived data, returns false on failure
+typedef bool (*SidecarWrite)(FILE *file, void *context);
+
+// Maps the derived file open at fd and checks it, returns false when it is
+// malformed or stale. fd is closed after the call, the mapping stays.
+typedef bool (*SidecarMap)(int fd, void *context);
+
+// Hands the file at path to map. Returns false when it is missing or map
+// rejects it.
+bool sidecar_map(const char *path, SidecarMap map, void *context);
+
+// Writes the derived file of source_path to path and maps the result. When
+// path cannot be created the data goes to an anonymous temporary file
+// instead, which lives as long as the mapping. caller prefixes the messages;
+// prints the reason and returns false on failure.
+bool sidecar_convert(const char *caller, const char *source_path, const char *path, SidecarWrite write, SidecarMap map,
+                     void *context);
+
+#endif // SIDECAR_H
@@ -0,0 +1,508 @@
+#include "soa.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SOA_HAVE_X86 1
+#endif
+
+// -----------------------------------------------------------------------------
+// Storage
+// -----------------------------------------------------------------------------
+// All arrays of one SoA live in a single zeroed allocation, the first array
+// pointer doubles as the base pointer to free.
+
+size_t sphere_soa_bytes(uint32_t capacity)
+{
+    return ((size_t)capacity + SOA_PADDING) * (4 * sizeof(double) + sizeof(uint32_t));
+}
+
+size_t triangle_soa_bytes(uint32_t capacity)
+{
+    return ((size_t)capacity + SOA_PADDING) * (9 * sizeof(double) + 2 * sizeof(uint32_t));
+}
+
+void sphere_soa_attach(SphereSoA *soa, void *base, uint32_t capacity, uint32_t count)
+{
+    size_t n = (size_t)capacity + SOA_PADDING;
+    double *block = base;
+    soa->center_x = block;
+    soa->center_y = block + n;
+    soa->center_z = block + 2 * n;
+    soa->radius = block + 3 * n;
+    soa->hittable = (uint32_t *)(block + 4 * n);
+    soa->count = count;
+}
+
+void triangle_soa_attach(TriangleSoA *soa, void *base, uint32_t capacity, uint32_t count)
+{
+    size_t n = (size_t)capacity + SOA_PADDING;
+    double *block = base;
+    soa->v0_x = block;
+    soa->v0_y = block + n;
+    soa->v0_z = block + 2 * n;
+    soa->e1_x = block + 3 * n;
+    soa->e1_y = block + 4 * n;
+    soa->e1_z = block + 5 * n;
+    soa->e2_x = block + 6 * n;
+    soa->e2_y = block + 7 * n;
+    soa->e2_z = block + 8 * n;
+    soa->hittable = (uint32_t *)(block + 9 * n);
+    soa->prim = soa->hittable + n;
+    soa->count = count;
+}
+
+bool sphere_soa_init(SphereSoA *soa, uint32_t capacity)
+{
+    void *block = calloc(1, sphere_soa_bytes(capacity));
+    memset(soa, 0, sizeof(*soa));
+    if (!block)
+        return false;
+    sphere_soa_attach(soa, block, capacity, 0);
+    return true;
+}
+
+bool triangle_soa_init(TriangleSoA *soa, uint32_t capacity)
+{
+    void *block = calloc(1, triangle_soa_bytes(capacity));
+    memset(soa, 0, sizeof(*soa));
+    if (!block)
+        return false;
+    triangle_soa_attach(soa, block, capacity, 0);
+    return true;
+}
+
+void sphere_soa_free(SphereSoA *soa)
+{
+    free(soa->center_x);
+    memset(soa, 0, sizeof(*soa));
+}
+
+void triangle_soa_free(TriangleSoA *soa)
+{
+    free(soa->v0_x);
+    memset(soa, 0, sizeof(*soa));
+}
+
+void sphere_soa_push(SphereSoA *soa, Point3 center, double radius, uint32_t hittable)
+{
+    uint32_t i = soa->count++;
+    soa->center_x[i] = center.x;
+    soa->center_y[i] = center.y;
+    soa->center_z[i] = center.z;
+    soa->radius[i] = radius;
+    soa->hittable[i] = hittable;
+}
+
+void triangle_soa_push(TriangleSoA *soa, Point3 v0, Point3 v1, Point3 v2, uint32_t hittable, uint32_t prim)
+{
+    uint32_t i = soa->count++;
+    Vec3 e1 = vec3_sub(v1, v0);
+    Vec3 e2 = vec3_sub(v2, v0);
+    soa->v0_x[i] = v0.x;
+    soa->v0_y[i] = v0.y;
+    soa->v0_z[i] = v0.z;
+    soa->e1_x[i] = e1.x;
+    soa->e1_y[i] = e1.y;
+    soa->e1_z[i] = e1.z;
+    soa->e2_x[i] = e2.x;
+    soa->e2_y[i] = e2.y;
+    soa->e2_z[i] = e2.z;
+    soa->hittable[i] = hittable;
+    soa->prim[i] = prim;
+}
+
+// -----------------------------------------------------------------------------
+// Scalar kernels
+// -----------------------------------------------------------------------------
+// Same arithmetic as hit_sphere / hit_triangle, in the same order, so every
+// kernel set produces bit-identical distances.
+
+static int sphere_hit_scalar(const SphereSoA *soa, uint32_t first, uint32_t count, Ray r, double t_min, double *t_max)
+{
+    double a = vec3_length_squared(r.direction);
+    int best = -1;
+
+    for (uint32_t i = first; i < first + count; i++)
+    {
+        double ocx = r.origin.x - soa->center_x[i];
+        double ocy = r.origin.y - soa->center_y[i];
+        double ocz = r.origin.z - soa->center_z[i];
+        double half_b = ocx * r.direction.x + ocy * r.direction.y + ocz * r.direction.z;
+        double c = (ocx * ocx + ocy * ocy + ocz * ocz) - soa->radius[i] * soa->radius[i];
+        double discriminant = half_b * half_b - a * c;
+        if (discriminant < 0)
+            continue;
+
+        double sqrtd = sqrt(discriminant);
+        double root = (-half_b - sqrtd) / a;
+        if (root < t_min || root > *t_max)
+        {
+            root = (-half_b + sqrtd) / a;
+            if (root < t_min || root > *t_max)
+                continue;
+        }
+        *t_max = root;
+        best = (int)i;
+    }
+    return best;
+}
+
+static int triangle_hit_scalar(const TriangleSoA *soa, uint32_t first, uint32_t count, Ray r, double t_min, double *t_max)
+{
+    Vec3 d = r.direction;
+    int best = -1;
+
+    for (uint32_t i = first; i < first + count; i++)
+    {
+        double px = d.y * soa->e2_z[i] - d.z * soa->e2_y[i];
+        double py = d.z * soa->e2_x[i] - d.x * soa->e2_z[i];
+        double pz = d.x * soa->e2_y[i] - d.y * soa->e2_x[i];
+        double det = soa->e1_x[i] * px + soa->e1_y[i] * py + soa->e1_z[i] * pz;
+        if (fabs(det) < 1e-8)
+            continue;
+
+        double inv_det = 1.0 / det;
+        double tx = r.origin.x - soa->v0_x[i];
+        double ty = r.origin.y - soa->v0_y[i];
+        double tz = r.origin.z - soa->v0_z[i];
+        double u = (tx * px + ty * py + tz * pz) * inv_det;
+        if (u < 0.0 || u > 1.0)
+            continue;
+
+        double qx = ty * soa->e1_z[i] - tz * soa->e1_y[i];
+        double qy = tz * soa->e1_x[i] - tx * soa->e1_z[i];
+        double qz = tx * soa->e1_y[i] - ty * soa->e1_x[i];
+        double v = (d.x * qx + d.y * qy + d.z * qz) * inv_det;
+        if (v < 0.0 || u + v > 1.0)
+            continue;
+
+        double t = (soa->e2_x[i] * qx + soa->e2_y[i] * qy + soa->e2_z[i] * qz) * inv_det;
+        if (t < t_min || t > *t_max)
+            continue;
+
+        *t_max = t;
+        best = (int)i;
+    }
+    return best;
+}
+
+#ifdef SOA_HAVE_X86
+
+// Picks the closest of the per-lane winners. Like the scalar loops, which
+// replace on equal t, a lane keeps its later primitive on a tie, so ties
+// between lanes go to the highest index.
+static int reduce_lanes(const double *lane_t, const double *lane_index, int lanes, double *t_max)
+{
+    int best = -1;
+    for (int l = 0; l < lanes; l++)
+    {
+        if (lane_index[l] >= 0 && (best < 0 || lane_t[l] < *t_max || (lane_t[l] == *t_max && lane_index[l] > best)))
+        {
+            *t_max = lane_t[l];
+            best = (int)lane_index[l];
+        }
+    }
+    return best;
+}
+
+// -----------------------------------------------------------------------------
+// AVX2 kernels, 4 primitives per step
+// -----------------------------------------------------------------------------
+
+__attribute__((target("avx2"))) static int sphere_hit_avx2(const SphereSoA *soa, uint32_t first, uint32_t count, Ray r, double t_min, double *t_max)
+{
+    const __m256d ox = _mm256_set1_pd(r.origin.x);
+    const __m256d oy = _mm256_set1_pd(r.origin.y);
+    const __m256d oz = _mm256_set1_pd(r.origin.z);
+    const __m256d dx = _mm256_set1_pd(r.direction.x);
+    const __m256d dy = _mm256_set1_pd(r.direction.y);
+    const __m256d dz = _mm256_set1_pd(r.direction.z);
+    const __m256d a = _mm256_set1_pd(vec3_length_squared(r.direction));
+    const __m256d tmin = _mm256_set1_pd(t_min);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d lane = _mm256_set_pd(3, 2, 1, 0);
+
+    __m256d best_t = _mm256_set1_pd(*t_max);
+    __m256d best_index = _mm256_set1_pd(-1);
+
+    for (uint32_t i = 0; i < count; i += 4)
+    {
+        uint32_t k = first + i;
+        __m256d ocx = _mm256_sub_pd(ox, _mm256_loadu_pd(soa->center_x + k));
+        __m256d ocy = _mm256_sub_pd(oy, _mm256_loadu_pd(soa->center_y + k));
+        __m256d ocz = _mm256_sub_pd(oz, _mm256_loadu_pd(soa->center_z + k));
+        __m256d radius = _mm256_loadu_pd(soa->radius + k);
+
+        __m256d half_b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)), _mm256_mul_pd(ocz, dz));
+        __m256d oc2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz));
+        __m256d c = _mm256_sub_pd(oc2, _mm256_mul_pd(radius, radius));
+        __m256d disc = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(a, c));
+
+        __m256d valid = _mm256_and_pd(_mm256_cmp_pd(disc, zero, _CMP_GE_OQ),
+                                      _mm256_cmp_pd(lane, _mm256_set1_pd((double)(count - i)), _CMP_LT_OQ));
+        if (_mm256_movemask_pd(valid) == 0)
+            continue;
+
+        __m256d sqrtd = _mm256_sqrt_pd(disc);
+        __m256d neg_half_b = _mm256_sub_pd(zero, half_b);
+        __m256d root1 = _mm256_div_pd(_mm256_sub_pd(neg_half_b, sqrtd), a);
+        __m256d root2 = _mm256_div_pd(_mm256_add_pd(neg_half_b, sqrtd), a);
+        __m256d ok1 = _mm256_and_pd(_mm256_cmp_pd(root1, tmin, _CMP_GE_OQ), _mm256_cmp_pd(root1, best_t, _CMP_LE_OQ));
+        __m256d ok2 = _mm256_and_pd(_mm256_cmp_pd(root2, tmin, _CMP_GE_OQ), _mm256_cmp_pd(root2, best_t, _CMP_LE_OQ));
+        __m256d t = _mm256_blendv_pd(root2, root1, ok1);
+        __m256d hit = _mm256_and_pd(valid, _mm256_or_pd(ok1, ok2));
+
+        best_t = _mm256_blendv_pd(best_t, t, hit);
+        best_index = _mm256_blendv_pd(best_index, _mm256_add_pd(lane, _mm256_set1_pd((double)k)), hit);
+    }
+
+    double lane_t[4], lane_index[4];
+    _mm256_storeu_pd(lane_t, best_t);
+    _mm256_storeu_pd(lane_index, best_index);
+    return reduce_lanes(lane_t, lane_index, 4, t_max);
+}
+
+__attribute__((target("avx2"))) static int triangle_hit_avx2(const TriangleSoA *soa, uint32_t first, uint32_t count, Ray r, double t_min, double *t_max)
+{
+    const __m256d ox = _mm256_set1_pd(r.origin.x);
+    const __m256d oy = _mm256_set1_pd(r.origin.y);
+    const __m256d oz = _mm256_set1_pd(r.origin.z);
+    const __m256d dx = _mm256_set1_pd(r.direction.x);
+    const __m256d dy = _mm256_set1_pd(r.direction.y);
+    const __m256d dz = _mm256_set1_pd(r.direction.z);
+    const __m256d tmin = _mm256_set1_pd(t_min);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d epsilon = _mm256_set1_pd(1e-8);
+    const __m256d sign_mask = _mm256_set1_pd(-0.0);
+    const __m256d lane = _mm256_set_pd(3, 2, 1, 0);
+
+    __m256d best_t = _mm256_set1_pd(*t_max);
+    __m256d best_index = _mm256_set1_pd(-1);
+
+    for (uint32_t i = 0; i < count; i += 4)
+    {
+        uint32_t k = first + i;
+        __m256d e1x = _mm256_loadu_pd(soa->e1_x + k);
+        __m256d e1y = _mm256_loadu_pd(soa->e1_y + k);
+        __m256d e1z = _mm256_loadu_pd(soa->e1_z + k);
+        __m256d e2x = _mm256_loadu_pd(soa->e2_x + k);
+        __m256d e2y = _mm256_loadu_pd(soa->e2_y + k);
+        __m256d e2z = _mm256_loadu_pd(soa->e2_z + k);
+
+        __m256d px = _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+        __m256d py = _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+        __m256d pz = _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+        __m256d det = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e1x, px), _mm256_mul_pd(e1y, py)), _mm256_mul_pd(e1z, pz));
+
+        __m256d ok = _mm256_and_pd(_mm256_cmp_pd(_mm256_andnot_pd(sign_mask, det), epsilon, _CMP_GE_OQ),
+                                   _mm256_cmp_pd(lane, _mm256_set1_pd((double)(count - i)), _CMP_LT_OQ));
+        if (_mm256_movemask_pd(ok) == 0)
+            continue;
+
+        __m256d inv_det = _mm256_div_pd(one, det);
+        __m256d tx = _mm256_sub_pd(ox, _mm256_loadu_pd(soa->v0_x + k));
+        __m256d ty = _mm256_sub_pd(oy, _mm256_loadu_pd(soa->v0_y + k));
+        __m256d tz = _mm256_sub_pd(oz, _mm256_loadu_pd(soa->v0_z + k));
+        __m256d u = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(tx, px), _mm256_mul_pd(ty, py)), _mm256_mul_pd(tz, pz)), inv_det);
+        ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(u, zero, _CMP_GE_OQ), _mm256_cmp_pd(u, one, _CMP_LE_OQ)));
+
+        __m256d qx = _mm256_sub_pd(_mm256_mul_pd(ty, e1z), _mm256_mul_pd(tz, e1y));
+        __m256d qy = _mm256_sub_pd(_mm256_mul_pd(tz, e1x), _mm256_mul_pd(tx, e1z));
+        __m256d qz = _mm256_sub_pd(_mm256_mul_pd(tx, e1y), _mm256_mul_pd(ty, e1x));
+        __m256d v = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)), _mm256_mul_pd(dz, qz)), inv_det);
+        ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(v, zero, _CMP_GE_OQ), _mm256_cmp_pd(_mm256_add_pd(u, v), one, _CMP_LE_OQ)));
+
+        __m256d t = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e2x, qx), _mm256_mul_pd(e2y, qy)), _mm256_mul_pd(e2z, qz)), inv_det);
+        ok = _mm256_and_pd(ok, _mm256_and_pd(_mm256_cmp_pd(t, tmin, _CMP_GE_OQ), _mm256_cmp_pd(t, best_t, _CMP_LE_OQ)));
+
+        best_t = _mm256_blendv_pd(best_t, t, ok);
+        best_index = _mm256_blendv_pd(best_index, _mm256_add_pd(lane, _mm256_set1_pd((double)k)), ok);
+    }
+
+    double lane_t[4], lane_index[4];
+    _mm256_storeu_pd(lane_t, best_t);
+    _mm256_storeu_pd(lane_index, best_index);
+    return reduce_lanes(lane_t, lane_index, 4, t_max);
+}
+
+// -----------------------------------------------------------------------------
+// SSE2 kernels, 2 primitives per step
+// -----------------------------------------------------------------------------
+
+// SSE2 has no blendv, select with masks instead
+static inline __m128d select_pd(__m128d mask, __m128d if_true, __m128d if_false)
+{
+    return _mm_or_pd(_mm_and_pd(mask, if_true), _mm_andnot_pd(mask, if_false));
+}
+
+__attribute__((target("sse2"))) static int sphere_hit_sse2(const SphereSoA *soa, uint32_t first, uint32_t count, Ray r, double t_min, double *t_max)
+{
+    const __m128d ox = _mm_set1_pd(r.origin.x);
+    const __m128d oy = _mm_set1_pd(r.origin.y);
+    const __m128d oz = _mm_set1_pd(r.origin.z);
+    const __m128d dx = _mm_set1_pd(r.direction.x);
+    const __m128d dy = _mm_set1_pd(r.direction.y);
+    const __m128d dz = _mm_set1_pd(r.direction.z);
+    const __m128d a = _mm_set1_pd(vec3_length_squared(r.direction));
+    const __m128d tmin = _mm_set1_pd(t_min);
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d lane = _mm_set_pd(1, 0);
+
+    __m128d best_t = _mm_set1_pd(*t_max);
+    __m128d best_index = _mm_set1_pd(-1);
+
+    for (uint32_t i = 0; i < count; i += 2)
+    {
+        uint32_t k = first + i;
+        __m128d ocx = _mm_sub_pd(ox, _mm_loadu_pd(soa->center_x + k));
+        __m128d ocy = _mm_sub_pd(oy, _mm_loadu_pd(soa->center_y + k));
+        __m128d ocz = _mm_sub_pd(oz, _mm_loadu_pd(soa->center_z + k));
+        __m128d radius = _mm_loadu_pd(soa->radius + k);
+
+        __m128d half_b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, dx), _mm_mul_pd(ocy, dy)), _mm_mul_pd(ocz, dz));
+        __m128d oc2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz));
+        __m128d c = _mm_sub_pd(oc2, _mm_mul_pd(radius, radius));
+        __m128d disc = _mm_sub_pd(_mm_mul_pd(half_b, half_b), _mm_mul_pd(a, c));
+
+        __m128d valid = _mm_and_pd(_mm_cmpge_pd(disc, zero), _mm_cmplt_pd(lane, _mm_set1_pd((double)(count - i))));
+        if (_mm_movemask_pd(valid) == 0)
+            continue;
+
+        __m128d sqrtd = _mm_sqrt_pd(disc);
+        __m128d neg_half_b = _mm_sub_pd(zero, half_b);
+        __m128d root1 = _mm_div_pd(_mm_sub_pd(neg_half_b, sqrtd), a);
+        __m128d root2 = _mm_div_pd(_mm_add_pd(neg_half_b, sqrtd), a);
+        __m128d ok1 = _mm_and_pd(_mm_cmpge_pd(root1, tmin), _mm_cmple_pd(root1, best_t));
+        __m128d ok2 = _mm_and_pd(_mm_cmpge_pd(root2, tmin), _mm_cmple_pd(root2, best_t));
+        __m128d t = select_pd(ok1, root1, root2);
+        __m128d hit = _mm_and_pd(valid, _mm_or_pd(ok1, ok2));
+
+        best_t = select_pd(hit, t, best_t);
+        best_index = select_pd(hit, _mm_add_pd(lane, _mm_set1_pd((double)k)), best_index);
+    }
+
+    double lane_t[2], lane_index[2];
+    _mm_storeu_pd(lane_t, best_t);
+    _mm_storeu_pd(lane_index, best_index);
+    return reduce_lanes(lane_t, lane_index, 2, t_max);
+}
+
+__attribute__((target("sse2"))) static int triangle_hit_sse2(const TriangleSoA *soa, uint32_t first, uint32_t count, Ray r, double t_min, double *t_max)
+{
+    const __m128d ox = _mm_set1_pd(r.origin.x);
+    const __m128d oy = _mm_set1_pd(r.origin.y);
+    const __m128d oz = _mm_set1_pd(r.origin.z);
+    const __m128d dx = _mm_set1_pd(r.direction.x);
+    const __m128d dy = _mm_set1_pd(r.direction.y);
+    const __m128d dz = _mm_set1_pd(r.direction.z);
+    const __m128d tmin = _mm_set1_pd(t_min);
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d epsilon = _mm_set1_pd(1e-8);
+    const __m128d sign_mask = _mm_set1_pd(-0.0);
+    const __m128d lane = _mm_set_pd(1, 0);
+
+    __m128d best_t = _mm_set1_pd(*t_max);
+    __m128d best_index = _mm_set1_pd(-1);
+
+    for (uint32_t i = 0; i < count; i += 2)
+    {
+        uint32_t k = first + i;
+        __m128d e1x = _mm_loadu_pd(soa->e1_x + k);
+        __m128d e1y = _mm_loadu_pd(soa->e1_y + k);
+        __m128d e1z = _mm_loadu_pd(soa->e1_z + k);
+        __m128d e2x = _mm_loadu_pd(soa->e2_x + k);
+        __m128d e2y = _mm_loadu_pd(soa->e2_y + k);
+        __m128d e2z = _mm_loadu_pd(soa->e2_z + k);
+
+        __m128d px = _mm_sub_pd(_mm_mul_pd(dy, e2z), _mm_mul_pd(dz, e2y));
+        __m128d py = _mm_sub_pd(_mm_mul_pd(dz, e2x), _mm_mul_pd(dx, e2z));
+        __m128d pz = _mm_sub_pd(_mm_mul_pd(dx, e2y), _mm_mul_pd(dy, e2x));
+        __m128d det = _mm_add_pd(_mm_add_pd(_mm_mul_pd(e1x, px), _mm_mul_pd(e1y, py)), _mm_mul_pd(e1z, pz));
+
+        __m128d ok = _mm_and_pd(_mm_cmpge_pd(_mm_andnot_pd(sign_mask, det), epsilon),
+                                _mm_cmplt_pd(lane, _mm_set1_pd((double)(count - i))));
+        if (_mm_movemask_pd(ok) == 0)
+            continue;
+
+        __m128d inv_det = _mm_div_pd(one, det);
+        __m128d tx = _mm_sub_pd(ox, _mm_loadu_pd(soa->v0_x + k));
+        __m128d ty = _mm_sub_pd(oy, _mm_loadu_pd(soa->v0_y + k));
+        __m128d tz = _mm_sub_pd(oz, _mm_loadu_pd(soa->v0_z + k));
+        __m128d u = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(tx, px), _mm_mul_pd(ty, py)), _mm_mul_pd(tz, pz)), inv_det);
+        ok = _mm_and_pd(ok, _mm_and_pd(_mm_cmpge_pd(u, zero), _mm_cmple_pd(u, one)));
+
+        __m128d qx = _mm_sub_pd(_mm_mul_pd(ty, e1z), _mm_mul_pd(tz, e1y));
+        __m128d qy = _mm_sub_pd(_mm_mul_pd(tz, e1x), _mm_mul_pd(tx, e1z));
+        __m128d qz = _mm_sub_pd(_mm_mul_pd(tx, e1y), _mm_mul_pd(ty, e1x));
+        __m128d v = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, qx), _mm_mul_pd(dy, qy)), _mm_mul_pd(dz, qz)), inv_det);
+        ok = _mm_and_pd(ok, _mm_and_pd(_mm_cmpge_pd(v, zero), _mm_cmple_pd(_mm_add_pd(u, v), one)));
+
+        __m128d t = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(e2x, qx), _mm_mul_pd(e2y, qy)), _mm_mul_pd(e2z, qz)), inv_det);
+        ok = _mm_and_pd(ok, _mm_and_pd(_mm_cmpge_pd(t, tmin), _mm_cmple_pd(t, best_t)));
+
+        best_t = select_pd(ok, t, best_t);
+        best_index = select_pd(ok, _mm_add_pd(lane, _mm_set1_pd((double)k)), best_index);
+    }
+
+    double lane_t[2], lane_index[2];
+    _mm_storeu_pd(lane_t, best_t);
+    _mm_storeu_pd(lane_index, best_index);
+    return reduce_lanes(lane_t, lane_index, 2, t_max);
+}
+
+#endif // SOA_HAVE_X86
+
+// -----------------------------------------------------------------------------
+// Dispatch
+// -----------------------------------------------------------------------------
+typedef int (*SphereKernel)(const SphereSoA *, uint32_t, uint32_t, Ray, double, double *);
+typedef int (*TriangleKernel)(const TriangleSoA *, uint32_t, uint32_t, Ray, double, double *);
+
+static SphereKernel sphere_kernel = sphere_hit_scalar;
+static TriangleKernel triangle_kernel = triangle_hit_scalar;
+static const char *kernel_name = "scalar";
+
+// Runs before main, so the pointers never change while threads render
+__attribute__((constructor)) static void soa_select_kernels(void)
+{
+#ifdef SOA_HAVE_X86
+    const char *request = getenv("RT_SIMD");
+    bool allow_avx2 = !request || strcmp(request, "avx2") == 0;
+    bool allow_sse2 = !request || strcmp(request, "sse2") == 0 || allow_avx2;
+
+    __builtin_cpu_init();
+    if (allow_avx2 && __builtin_cpu_supports("avx2"))
+    {
+        sphere_kernel = sphere_hit_avx2;
+        triangle_kernel = triangle_hit_avx2;
+        kernel_name = "avx2";
+    }
+    else if (allow_sse2 && __builtin_cpu_supports("sse2"))
+    {
+        sphere_kernel = sphere_hit_sse2;
+        triangle_kernel = triangle_hit_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+}
+
+int sphere_soa_hit(const SphereSoA *soa, uint32_t first, uint32_t count, Ray r, double t_min, double *t_max)
+{
+    return sphere_kernel(soa, first, count, r, t_min, t_max);
+}
+
+int triangle_soa_hit(const TriangleSoA *soa, uint32_t first, uint32_t count, Ray r, double t_min, double *t_max)
+{
+    return triangle_kernel(soa, first, count, r, t_min, t_max);
+}
+
+const char *soa_kernel_name(void)
+{
+    return kernel_name;
+}
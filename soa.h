@@ -0,0 +1,75 @@
+#ifndef SOA_H
+#define SOA_H
+
+#include "math/ray.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Every SoA array is allocated with this many spare zeroed entries at the end,
+// so the SIMD kernels can always load full vectors and mask the extra lanes.
+#define SOA_PADDING 4
+
+// -----------------------------------------------------------------------------
+// Structure-of-arrays primitive storage
+// -----------------------------------------------------------------------------
+// Only the geometry the intersection tests read is stored here. Materials stay
+// in the Hittable referenced by hittable[i] and are looked up once, for the
+// closest hit only.
+typedef struct
+{
+    double *center_x, *center_y, *center_z;
+    double *radius;
+    uint32_t *hittable; // Index into the scene's hittable array
+    uint32_t count;
+} SphereSoA;
+
+typedef struct
+{
+    double *v0_x, *v0_y, *v0_z;
+    double *e1_x, *e1_y, *e1_z; // v1 - v0
+    double *e2_x, *e2_y, *e2_z; // v2 - v0
+    uint32_t *hittable;
+    uint32_t *prim; // Triangle index within a mesh hittable, 0 otherwise
+    uint32_t count;
+} TriangleSoA;
+
+// Allocates room for count primitives (plus padding), count starts at 0
+bool sphere_soa_init(SphereSoA *soa, uint32_t capacity);
+bool triangle_soa_init(TriangleSoA *soa, uint32_t capacity);
+
+// Size of the single block behind an SoA of the given capacity
+size_t sphere_soa_bytes(uint32_t capacity);
+size_t triangle_soa_bytes(uint32_t capacity);
+
+// Points the arrays into an existing block laid out like the one *_soa_init
+// allocates (a mapped scene cache, for instance). The block is not owned, so
+// *_soa_free must not be called on it.
+void sphere_soa_attach(SphereSoA *soa, void *block, uint32_t capacity, uint32_t count);
+void triangle_soa_attach(TriangleSoA *soa, void *block, uint32_t capacity, uint32_t count);
+
+void sphere_soa_free(SphereSoA *soa);
+void triangle_soa_free(TriangleSoA *soa);
+
+void sphere_soa_push(SphereSoA *soa, Point3 center, double radius, uint32_t hittable);
+void triangle_soa_push(TriangleSoA *soa, Point3 v0, Point3 v1, Point3 v2, uint32_t hittable, uint32_t prim);
+
+// -----------------------------------------------------------------------------
+// Batch intersection kernels
+// -----------------------------------------------------------------------------
+// Test one ray against primitives [first, first + count) and return the index
+// of the closest one hit with t in [t_min, *t_max], or -1. On a hit *t_max is
+// lowered to its distance. The tests match hit_sphere / hit_triangle exactly,
+// and of primitives hit at the same t the one with the highest index wins,
+// as when the scalar loop replaces its best hit on equal t.
+//
+// The implementation (AVX2: 4 primitives per step, SSE2: 2, or scalar) is
+// picked once at startup from the CPU features. Setting RT_SIMD to "scalar",
+// "sse2" or "avx2" overrides the choice.
+int sphere_soa_hit(const SphereSoA *soa, uint32_t first, uint32_t count, Ray r, double t_min, double *t_max);
+int triangle_soa_hit(const TriangleSoA *soa, uint32_t first, uint32_t count, Ray r, double t_min, double *t_max);
+
+// Name of the selected kernel set ("avx2", "sse2" or "scalar")
+const char *soa_kernel_name(void);
+
+#endif // SOA_H
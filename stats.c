@@ -0,0 +1,200 @@
+#include "stats.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifdef RT_STATS
+_Thread_local TraceStats stats_thread;
+#endif
+
+static const char *prim_names[STATS_PRIM_TYPES] = {"sphere", "plane", "triangle", "mesh", "instance", "paged_mesh"};
+static const char *material_names[4] = {"lambertian", "metal", "dielectric", "emissive"};
+static const char *end_names[STATS_END_COUNT] = {"escaped", "absorbed", "max_depth", "emitted", "roulette"};
+
+int stats_enabled(void)
+{
+#ifdef RT_STATS
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void stats_thread_reset(void)
+{
+#ifdef RT_STATS
+    memset(&stats_thread, 0, sizeof(stats_thread));
+#endif
+}
+
+static void merge_array(uint64_t *into, const uint64_t *from, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        __atomic_fetch_add(&into[i], from[i], __ATOMIC_RELAXED);
+}
+
+void stats_thread_merge(TraceStats *into)
+{
+#ifdef RT_STATS
+    // Every field but the ray_tests scratch counter is a uint64_t total
+    merge_array((uint64_t *)into, (const uint64_t *)&stats_thread,
+                offsetof(TraceStats, ray_tests) / sizeof(uint64_t));
+#else
+    (void)into;
+    (void)merge_array;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Reports
+// -----------------------------------------------------------------------------
+
+static uint64_t sum(const uint64_t *values, size_t count)
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++)
+        total += values[i];
+    return total;
+}
+
+static double ratio(uint64_t a, uint64_t b)
+{
+    return b ? (double)a / (double)b : 0.0;
+}
+
+// Mean of a histogram whose bucket i stands for the value i
+static double linear_mean(const uint64_t *buckets, size_t count)
+{
+    uint64_t weighted = 0;
+    for (size_t i = 0; i < count; i++)
+        weighted += buckets[i] * i;
+    return ratio(weighted, sum(buckets, count));
+}
+
+// Lower edge of log2 bucket b
+static uint64_t log_bucket_floor(int b)
+{
+    return b == 0 ? 0 : 1ull << (b - 1);
+}
+
+// Prints the non-empty buckets as "label: count (percent)" lines
+static void print_histogram(FILE *output, const char *title, const uint64_t *buckets, int count, bool log_scale)
+{
+    uint64_t total = sum(buckets, (size_t)count);
+    fprintf(output, "  %s:\n", title);
+    for (int b = 0; b < count; b++)
+    {
+        if (buckets[b] == 0)
+            continue;
+        char label[32];
+        bool last = b == count - 1;
+        if (log_scale)
+        {
+            uint64_t low = log_bucket_floor(b);
+            if (last)
+                snprintf(label, sizeof(label), ">= %llu", (unsigned long long)low);
+            else if (b <= 1)
+                snprintf(label, sizeof(label), "%llu", (unsigned long long)low);
+            else
+                snprintf(label, sizeof(label), "%llu-%llu", (unsigned long long)low,
+                         (unsigned long long)(2 * low - 1));
+        }
+        else
+        {
+            snprintf(label, sizeof(label), last ? ">= %d" : "%d", b);
+        }
+        fprintf(output, "    %10s  %12llu  %5.1f%%\n", label, (unsigned long long)buckets[b],
+                100.0 * ratio(buckets[b], total));
+    }
+}
+
+void stats_print(FILE *output, const TraceStats *stats)
+{
+    uint64_t tests = sum(stats->prim_tests, STATS_PRIM_TYPES);
+    uint64_t paths = sum(stats->path_ends, STATS_END_COUNT);
+    fprintf(output, "Trace statistics:\n");
+    fprintf(output, "  Rays through scene_hit: %llu, %.2f primitive tests each\n", (unsigned long long)stats->rays,
+            ratio(stats->ray_tests_total, stats->rays));
+    fprintf(output, "  BVH nodes visited by single-ray traversal: %llu\n", (unsigned long long)stats->node_visits);
+    fprintf(output, "  Primitive tests: %llu,", (unsigned long long)tests);
+    for (int i = 0; i < STATS_PRIM_TYPES; i++)
+        fprintf(output, " %s %llu", prim_names[i], (unsigned long long)stats->prim_tests[i]);
+    fprintf(output, "\n  Scatters:");
+    for (int i = 0; i < 4; i++)
+        fprintf(output, " %s %llu", material_names[i], (unsigned long long)stats->scatters[i]);
+    fprintf(output, "\n  Paths: %llu, %.2f bounces on average,", (unsigned long long)paths,
+            linear_mean(stats->path_depth, STATS_DEPTH_BUCKETS));
+    for (int i = 0; i < STATS_END_COUNT; i++)
+        fprintf(output, " %s %.1f%%", end_names[i], 100.0 * ratio(stats->path_ends[i], paths));
+    fprintf(output, "\n");
+    print_histogram(output, "Primitive tests per scene_hit ray", stats->tests_per_ray, STATS_LOG_BUCKETS, true);
+    print_histogram(output, "Bounces per path", stats->path_depth, STATS_DEPTH_BUCKETS, false);
+}
+
+static void write_array(FILE *output, const char *name, const uint64_t *values, int count, bool last)
+{
+    fprintf(output, "    \"%s\": [", name);
+    for (int i = 0; i < count; i++)
+        fprintf(output, "%s%llu", i ? ", " : "", (unsigned long long)values[i]);
+    fprintf(output, "]%s\n", last ? "" : ",");
+}
+
+static void write_named(FILE *output, const char *name, const char *const *names, const uint64_t *values, int count)
+{
+    fprintf(output, "    \"%s\": {", name);
+    for (int i = 0; i < count; i++)
+        fprintf(output, "%s\"%s\": %llu", i ? ", " : "", names[i], (unsigned long long)values[i]);
+    fprintf(output, "},\n");
+}
+
+void stats_write_json(FILE *output, const TraceStats *stats)
+{
+    fprintf(output, "{\n");
+    fprintf(output, "    \"rays\": %llu,\n", (unsigned long long)stats->rays);
+    fprintf(output, "    \"ray_tests\": %llu,\n", (unsigned long long)stats->ray_tests_total);
+    fprintf(output, "    \"node_visits\": %llu,\n", (unsigned long long)stats->node_visits);
+    write_named(output, "prim_tests", prim_names, stats->prim_tests, STATS_PRIM_TYPES);
+    write_named(output, "scatters", material_names, stats->scatters, 4);
+    write_named(output, "path_ends", end_names, stats->path_ends, STATS_END_COUNT);
+    // Bucket b of tests_per_ray holds values in [2^(b-1), 2^b), bucket 0 holds 0
+    write_array(output, "tests_per_ray_log2", stats->tests_per_ray, STATS_LOG_BUCKETS, false);
+    write_array(output, "path_depth", stats->path_depth, STATS_DEPTH_BUCKETS, true);
+    fprintf(output, "}\n");
+}
+
+void stats_process(ProcessStats *stats)
+{
+    *stats = (ProcessStats){0};
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        stats->major_faults = (uint64_t)usage.ru_majflt;
+        stats->minor_faults = (uint64_t)usage.ru_minflt;
+    }
+
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file)
+    {
+        unsigned long total = 0, resident = 0;
+        long page_size = sysconf(_SC_PAGESIZE);
+        if (fscanf(file, "%lu %lu", &total, &resident) == 2 && page_size > 0)
+            stats->resident_bytes = (size_t)resident * (size_t)page_size;
+        fclose(file);
+    }
+
+    file = fopen("/proc/self/io", "r");
+    if (file)
+    {
+        char line[128];
+        unsigned long long bytes;
+        while (fgets(line, sizeof(line), file))
+        {
+            if (sscanf(line, "read_bytes: %llu", &bytes) == 1)
+                stats->read_bytes = bytes;
+        }
+        fclose(file);
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// -----------------------------------------------------------------------------
+// Hot-path statistics
+// -----------------------------------------------------------------------------
+// Built with -DRT_STATS (make STATS=1), the tracing code counts events into a
+// thread-local TraceStats: plain increments, no atomics and no sharing. Every
+// render worker merges its counters into the render's total when it finishes.
+// Without RT_STATS the STATS_* macros expand to nothing and their arguments
+// are never evaluated, so the hot paths compile exactly as if they were absent.
+
+#define STATS_LOG_BUCKETS 16 // Bucket b counts values in [2^(b-1), 2^b), the last one is open
+#define STATS_DEPTH_BUCKETS 33 // Bounces 0..31, the last bucket counts 32 and more
+#define STATS_PRIM_TYPES 6     // HittableType values
+
+typedef enum
+{
+    STATS_ESCAPED,   // Left the scene and picked up the sky
+    STATS_ABSORBED,  // scatter_ray returned false
+    STATS_MAX_DEPTH, // Cut off at max_depth
+    STATS_EMITTED,   // Hit an emissive surface
+    STATS_ROULETTE,  // Terminated by Russian roulette
+    STATS_END_COUNT
+} StatsPathEnd;
+
+typedef struct
+{
+    uint64_t rays;           // scene_hit calls
+    uint64_t ray_tests_total; // Primitive tests made inside scene_hit calls
+    uint64_t node_visits;    // BVH node boxes tested by single-ray traversal, packet fallbacks included
+    uint64_t prim_tests[STATS_PRIM_TYPES]; // Intersection tests of every kind of traversal, indexed by HittableType
+    uint64_t scatters[4];    // scatter_ray calls, indexed by MaterialType
+    uint64_t path_ends[STATS_END_COUNT];
+
+    uint64_t tests_per_ray[STATS_LOG_BUCKETS]; // Primitive tests of one scene_hit call
+    uint64_t path_depth[STATS_DEPTH_BUCKETS];  // Bounces of a finished path
+
+    uint64_t ray_tests; // Tests of the scene_hit call in progress
+} TraceStats;
+
+#ifdef RT_STATS
+extern _Thread_local TraceStats stats_thread;
+
+static inline int stats_log_bucket(uint64_t value)
+{
+    int bucket = value ? 64 - __builtin_clzll(value) : 0;
+    return bucket < STATS_LOG_BUCKETS ? bucket : STATS_LOG_BUCKETS - 1;
+}
+
+static inline int stats_linear_bucket(uint64_t value, int buckets)
+{
+    return value < (uint64_t)buckets - 1 ? (int)value : buckets - 1;
+}
+
+#define STATS_ADD(field, n) (stats_thread.field += (n))
+#define STATS_PRIM_TESTS(type, n) (stats_thread.prim_tests[(type)] += (n), stats_thread.ray_tests += (n))
+#define STATS_RAY_BEGIN() (stats_thread.rays++, stats_thread.ray_tests = 0)
+#define STATS_RAY_END()                                                                    \
+    (stats_thread.ray_tests_total += stats_thread.ray_tests,                               \
+     stats_thread.tests_per_ray[stats_log_bucket(stats_thread.ray_tests)]++)
+#define STATS_PATH_END(end, bounces)                                                       \
+    (stats_thread.path_ends[(end)]++,                                                      \
+     stats_thread.path_depth[stats_linear_bucket((uint64_t)(bounces), STATS_DEPTH_BUCKETS)]++)
+#else
+// sizeof keeps the arguments referenced without evaluating them
+#define STATS_ADD(field, n) ((void)sizeof(n))
+#define STATS_PRIM_TESTS(type, n) ((void)sizeof(type), (void)sizeof(n))
+#define STATS_RAY_BEGIN() ((void)0)
+#define STATS_RAY_END() ((void)0)
+#define STATS_PATH_END(end, bounces) ((void)sizeof(end), (void)sizeof(bounces))
+#endif
+
+// True when the build counts anything
+int stats_enabled(void);
+
+// Clears the calling thread's counters
+void stats_thread_reset(void);
+
+// Atomically adds the calling thread's counters to into
+void stats_thread_merge(TraceStats *into);
+
+// Human-readable report
+void stats_print(FILE *output, const TraceStats *stats);
+
+// The same report as a JSON object
+void stats_write_json(FILE *output, const TraceStats *stats);
+
+// -----------------------------------------------------------------------------
+// Process counters
+// -----------------------------------------------------------------------------
+// Read from the kernel when asked for, in every build. Counters the system
+// does not provide are 0.
+typedef struct
+{
+    size_t resident_bytes; // Resident set size
+    uint64_t major_faults; // Page faults that had to wait for storage
+    uint64_t minor_faults;
+    uint64_t read_bytes;   // Bytes read from storage on the process's behalf
+} ProcessStats;
+
+void stats_process(ProcessStats *stats);
+
+#endif // STATS_H
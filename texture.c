@@ -0,0 +1,584 @@
+#include "texture.h"
+
+#include "framebuffer.h"
+#include "sidecar.h"
+#include "stats.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TEXTURE_FILE_VERSION 1
+#define TEXTURE_HEADER_BYTES TEXTURE_TILE_BYTES // Keeps the tiles aligned to pages of up to 16 KB
+#define TEXTURE_NO_TILE UINT64_MAX
+#define TEXTURE_NO_SLOT UINT32_MAX
+
+static const char texture_magic[8] = {'R', 'T', 'T', 'E', 'X', 0, 0, 0};
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t tile_size;
+    uint32_t width; // Level 0
+    uint32_t height;
+    uint32_t level_count;
+    uint32_t reserved;
+    SidecarStamp source; // The image the file was converted from
+    uint64_t file_size;
+} TextureFileHeader;
+
+void texture_system_init(TextureSystem *ts)
+{
+    *ts = (TextureSystem){0};
+}
+
+static void shards_free(TextureSystem *ts)
+{
+    if (!ts->shards)
+        return;
+    for (int i = 0; i < TEXTURE_CACHE_SHARDS; i++)
+    {
+        TextureShard *shard = &ts->shards[i];
+        pthread_mutex_destroy(&shard->lock);
+        free(shard->slots);
+        free(shard->texels);
+        free(shard->buckets);
+    }
+    free(ts->shards);
+    ts->shards = NULL;
+    ts->cache_bytes = 0;
+}
+
+void texture_system_free(TextureSystem *ts)
+{
+    shards_free(ts);
+    for (uint32_t i = 0; i < ts->count; i++)
+        munmap((void *)ts->textures[i].mapping, ts->textures[i].mapping_size);
+    free(ts->textures);
+    texture_system_init(ts);
+}
+
+// -----------------------------------------------------------------------------
+// Conversion
+// -----------------------------------------------------------------------------
+
+// Fills the level table of a width x height image and returns the size of
+// its converted file. Every level halves the previous one, rounding down,
+// until both sides are 1.
+static uint64_t texture_layout(uint32_t width, uint32_t height, TextureLevel *levels, uint32_t *level_count)
+{
+    uint64_t offset = TEXTURE_HEADER_BYTES;
+    uint32_t count = 0;
+    for (;;)
+    {
+        TextureLevel *level = &levels[count++];
+        level->width = width;
+        level->height = height;
+        level->tiles_x = (width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+        level->tiles_y = (height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+        level->offset = offset;
+        offset += (uint64_t)level->tiles_x * level->tiles_y * TEXTURE_TILE_BYTES;
+        if ((width == 1 && height == 1) || count == TEXTURE_MAX_LEVELS)
+            break;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    *level_count = count;
+    return offset;
+}
+
+// Gamma 2 like the PPM output, rounded to the nearest step
+static uint8_t encode_channel(real c)
+{
+    return (uint8_t)(sqrt(fmin(fmax(c, 0.0), 1.0)) * 255.0 + 0.5);
+}
+
+static double decode_channel(uint8_t c)
+{
+    return (double)c * (double)c * (1.0 / (255.0 * 255.0));
+}
+
+// The next level down: texel x averages the source columns from x * width /
+// new_width up to (x + 1) * width / new_width, which folds the last column of
+// an odd width into the last block. Rows likewise.
+static Color *downsample(const Color *src, uint32_t width, uint32_t height, uint32_t new_width, uint32_t new_height)
+{
+    Color *dst = malloc(sizeof(Color) * new_width * new_height);
+    if (!dst)
+        return NULL;
+    for (uint32_t y = 0; y < new_height; y++)
+    {
+        uint32_t y0 = (uint32_t)((uint64_t)y * height / new_height);
+        uint32_t y1 = (uint32_t)((uint64_t)(y + 1) * height / new_height);
+        for (uint32_t x = 0; x < new_width; x++)
+        {
+            uint32_t x0 = (uint32_t)((uint64_t)x * width / new_width);
+            uint32_t x1 = (uint32_t)((uint64_t)(x + 1) * width / new_width);
+            Color sum = vec3_create(0, 0, 0);
+            for (uint32_t sy = y0; sy < y1; sy++)
+                for (uint32_t sx = x0; sx < x1; sx++)
+                    sum = vec3_add(sum, src[(size_t)sy * width + sx]);
+            dst[(size_t)y * new_width + x] = vec3_scale(sum, 1.0 / (double)((x1 - x0) * (y1 - y0)));
+        }
+    }
+    return dst;
+}
+
+// Writes the tiles of one level, texels past the level's edge are zero
+static bool write_level(FILE *file, const Color *pixels, const TextureLevel *level, uint8_t *tile)
+{
+    for (uint32_t ty = 0; ty < level->tiles_y; ty++)
+    {
+        for (uint32_t tx = 0; tx < level->tiles_x; tx++)
+        {
+            memset(tile, 0, TEXTURE_TILE_BYTES);
+            for (uint32_t y = 0; y < TEXTURE_TILE_SIZE && ty * TEXTURE_TILE_SIZE + y < level->height; y++)
+            {
+                const Color *row = &pixels[(size_t)(ty * TEXTURE_TILE_SIZE + y) * level->width];
+                for (uint32_t x = 0; x < TEXTURE_TILE_SIZE && tx * TEXTURE_TILE_SIZE + x < level->width; x++)
+                {
+                    Color c = row[tx * TEXTURE_TILE_SIZE + x];
+                    uint8_t *texel = &tile[4 * (y * TEXTURE_TILE_SIZE + x)];
+                    texel[0] = encode_channel(c.x);
+                    texel[1] = encode_channel(c.y);
+                    texel[2] = encode_channel(c.z);
+                    texel[3] = 255;
+                }
+            }
+            if (fwrite(tile, TEXTURE_TILE_BYTES, 1, file) != 1)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Writes the header and the whole pyramid of image to file. Only one level
+// and the next are held in memory at a time.
+static bool write_texture(FILE *file, const Framebuffer *image, const SidecarStamp *source)
+{
+    TextureFileHeader header = {0};
+    TextureLevel levels[TEXTURE_MAX_LEVELS];
+    memcpy(header.magic, texture_magic, sizeof(texture_magic));
+    header.version = TEXTURE_FILE_VERSION;
+    header.tile_size = TEXTURE_TILE_SIZE;
+    header.width = (uint32_t)image->width;
+    header.height = (uint32_t)image->height;
+    header.file_size = texture_layout(header.width, header.height, levels, &header.level_count);
+    header.source = *source;
+
+    uint8_t *tile = calloc(1, TEXTURE_TILE_BYTES);
+    if (!tile)
+        return false;
+    memcpy(tile, &header, sizeof(header));
+    bool ok = fwrite(tile, TEXTURE_HEADER_BYTES, 1, file) == 1;
+
+    const Color *pixels = image->pixels;
+    Color *owned = NULL;
+    for (uint32_t l = 0; ok && l < header.level_count; l++)
+    {
+        ok = write_level(file, pixels, &levels[l], tile);
+        if (ok && l + 1 < header.level_count)
+        {
+            Color *next = downsample(pixels, levels[l].width, levels[l].height, levels[l + 1].width,
+                                     levels[l + 1].height);
+            free(owned);
+            pixels = owned = next;
+            ok = next != NULL;
+        }
+    }
+    free(owned);
+    free(tile);
+    return ok && fflush(file) == 0;
+}
+
+// Maps the converted file behind fd if it was made from the image source
+// describes, filling texture's level table
+static bool map_texture(int fd, const SidecarStamp *source, Texture *texture)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < TEXTURE_HEADER_BYTES)
+        return false;
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+
+    const TextureFileHeader *header = map;
+    bool ok = memcmp(header->magic, texture_magic, sizeof(texture_magic)) == 0 &&
+              header->version == TEXTURE_FILE_VERSION && header->tile_size == TEXTURE_TILE_SIZE &&
+              sidecar_stamp_equal(&header->source, source) && header->file_size == size &&
+              header->width > 0 && header->height > 0;
+    if (ok)
+    {
+        uint32_t level_count;
+        ok = texture_layout(header->width, header->height, texture->levels, &level_count) == size &&
+             level_count == header->level_count;
+        texture->level_count = level_count;
+    }
+    if (!ok)
+    {
+        munmap(map, size);
+        return false;
+    }
+    texture->mapping = map;
+    texture->mapping_size = size;
+    return true;
+}
+
+// Converting one image, for sidecar_map and sidecar_convert
+typedef struct
+{
+    const Framebuffer *image; // Only needed to write
+    const SidecarStamp *source;
+    Texture *texture;
+} TextureConversion;
+
+static bool conversion_write(FILE *file, void *context)
+{
+    TextureConversion *c = context;
+    return write_texture(file, c->image, c->source);
+}
+
+static bool conversion_map(int fd, void *context)
+{
+    TextureConversion *c = context;
+    return map_texture(fd, c->source, c->texture);
+}
+
+bool texture_system_add(TextureSystem *ts, const char *path, double scale, uint32_t *id)
+{
+    if (ts->count == TEXTURE_MAX_COUNT)
+    {
+        fprintf(stderr, "texture_system_add: more than %d textures\n", TEXTURE_MAX_COUNT);
+        return false;
+    }
+    if (ts->count == ts->capacity)
+    {
+        uint32_t capacity = ts->capacity > 0 ? 2 * ts->capacity : 8;
+        Texture *textures = realloc(ts->textures, sizeof(Texture) * capacity);
+        if (!textures)
+            return false;
+        ts->textures = textures;
+        ts->capacity = capacity;
+    }
+
+    SidecarStamp source;
+    if (!sidecar_stamp(path, &source))
+    {
+        fprintf(stderr, "texture_system_add: cannot open %s\n", path);
+        return false;
+    }
+    char *converted_path = sidecar_path(path, TEXTURE_FILE_SUFFIX);
+    if (!converted_path)
+        return false;
+
+    Texture texture = {.scale = scale};
+    TextureConversion conversion = {NULL, &source, &texture};
+    bool ok = sidecar_map(converted_path, conversion_map, &conversion);
+    if (!ok)
+    {
+        Framebuffer image;
+        ok = framebuffer_read_file(path, &image);
+        if (ok)
+        {
+            conversion.image = &image;
+            ok = sidecar_convert("texture_system_add", path, converted_path, conversion_write, conversion_map,
+                                 &conversion);
+            framebuffer_free(&image);
+        }
+    }
+    free(converted_path);
+    if (!ok)
+        return false;
+
+    // A new texture cannot be in the cache yet, the cache stays valid
+    *id = ts->count;
+    ts->textures[ts->count++] = texture;
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Tile cache
+// -----------------------------------------------------------------------------
+
+// Texture id in bits 48..63, level in 42..46, tile row in 21..41, column in 0..20
+static uint64_t tile_key(uint32_t texture, uint32_t level, uint32_t tile_x, uint32_t tile_y)
+{
+    return (uint64_t)texture << 48 | (uint64_t)level << 42 | (uint64_t)tile_y << 21 | tile_x;
+}
+
+// splitmix64 finalizer. The low bits pick the shard, the rest the bucket.
+static uint64_t tile_hash(uint64_t key)
+{
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+}
+
+static uint32_t tile_bucket(const TextureShard *shard, uint64_t hash)
+{
+    return (uint32_t)(hash / TEXTURE_CACHE_SHARDS) & shard->bucket_mask;
+}
+
+bool texture_system_prepare(TextureSystem *ts, size_t cache_bytes)
+{
+    if (ts->count == 0 || (ts->shards && ts->cache_bytes == cache_bytes))
+        return true;
+    shards_free(ts);
+
+    size_t slots = cache_bytes / TEXTURE_TILE_BYTES / TEXTURE_CACHE_SHARDS;
+    if (slots < 1)
+        slots = 1;
+    if (slots > UINT32_MAX / 2)
+        slots = UINT32_MAX / 2;
+    uint32_t buckets = 1;
+    while (buckets < slots)
+        buckets *= 2;
+    long page_size = sysconf(_SC_PAGESIZE);
+    ts->drop_pages = page_size > 0 && TEXTURE_TILE_BYTES % page_size == 0;
+
+    ts->shards = calloc(TEXTURE_CACHE_SHARDS, sizeof(TextureShard));
+    if (!ts->shards)
+        return false;
+    bool ok = true;
+    for (int i = 0; i < TEXTURE_CACHE_SHARDS; i++)
+    {
+        TextureShard *shard = &ts->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        // Untouched slots are never paged in, resident memory grows with use
+        shard->slots = malloc(sizeof(TextureSlot) * slots);
+        shard->texels = malloc(TEXTURE_TILE_BYTES * slots);
+        shard->buckets = malloc(sizeof(uint32_t) * buckets);
+        shard->bucket_mask = buckets - 1;
+        shard->slot_count = (uint32_t)slots;
+        shard->head = shard->tail = TEXTURE_NO_SLOT;
+        ok = ok && shard->slots && shard->texels && shard->buckets;
+        for (uint32_t b = 0; shard->buckets && b < buckets; b++)
+            shard->buckets[b] = TEXTURE_NO_SLOT;
+    }
+    if (!ok)
+    {
+        shards_free(ts);
+        fprintf(stderr, "texture_system_prepare: cannot allocate a %zu byte tile cache\n", cache_bytes);
+        return false;
+    }
+    ts->cache_bytes = cache_bytes;
+    return true;
+}
+
+static void lru_unlink(TextureShard *shard, uint32_t s)
+{
+    TextureSlot *slot = &shard->slots[s];
+    if (slot->prev != TEXTURE_NO_SLOT)
+        shard->slots[slot->prev].next = slot->next;
+    else
+        shard->head = slot->next;
+    if (slot->next != TEXTURE_NO_SLOT)
+        shard->slots[slot->next].prev = slot->prev;
+    else
+        shard->tail = slot->prev;
+}
+
+static void lru_push_front(TextureShard *shard, uint32_t s)
+{
+    TextureSlot *slot = &shard->slots[s];
+    slot->prev = TEXTURE_NO_SLOT;
+    slot->next = shard->head;
+    if (shard->head != TEXTURE_NO_SLOT)
+        shard->slots[shard->head].prev = s;
+    else
+        shard->tail = s;
+    shard->head = s;
+}
+
+// Takes slot s out of its hash chain
+static void chain_remove(TextureShard *shard, uint32_t s)
+{
+    uint32_t *link = &shard->buckets[tile_bucket(shard, tile_hash(shard->slots[s].key))];
+    while (*link != s)
+        link = &shard->slots[*link].chain;
+    *link = shard->slots[s].chain;
+}
+
+// Texels of the tile, copied from the mapping into the least recently used
+// slot on a miss. Called with the shard locked.
+static const uint8_t *shard_tile(const TextureSystem *ts, TextureShard *shard, uint64_t key, uint64_t hash,
+                                 uint32_t texture, uint32_t level, uint32_t tile_x, uint32_t tile_y)
+{
+    uint32_t bucket = tile_bucket(shard, hash);
+    for (uint32_t s = shard->buckets[bucket]; s != TEXTURE_NO_SLOT; s = shard->slots[s].chain)
+    {
+        if (shard->slots[s].key == key)
+        {
+            shard->hits++;
+            if (shard->head != s)
+            {
+                lru_unlink(shard, s);
+                lru_push_front(shard, s);
+            }
+            return &shard->texels[(size_t)s * TEXTURE_TILE_BYTES];
+        }
+    }
+
+    shard->misses++;
+    uint32_t s;
+    if (shard->used < shard->slot_count)
+    {
+        s = shard->used++;
+    }
+    else
+    {
+        s = shard->tail;
+        lru_unlink(shard, s);
+        chain_remove(shard, s);
+        shard->evictions++;
+    }
+
+    const Texture *t = &ts->textures[texture];
+    const TextureLevel *l = &t->levels[level];
+    const uint8_t *source = t->mapping + l->offset + ((uint64_t)tile_y * l->tiles_x + tile_x) * TEXTURE_TILE_BYTES;
+    uint8_t *texels = &shard->texels[(size_t)s * TEXTURE_TILE_BYTES];
+    memcpy(texels, source, TEXTURE_TILE_BYTES);
+    // The cache holds the only copy that is kept around; the next miss on
+    // this tile reads it from the file again
+    if (ts->drop_pages)
+        madvise((void *)source, TEXTURE_TILE_BYTES, MADV_DONTNEED);
+
+    shard->slots[s].key = key;
+    shard->slots[s].chain = shard->buckets[bucket];
+    shard->buckets[bucket] = s;
+    lru_push_front(shard, s);
+    return texels;
+}
+
+// Reads the count texels (xs[i], ys[i]) of one level into out as RGBA8,
+// locking each distinct tile's shard once
+static void fetch_texels(const TextureSystem *ts, uint32_t texture, uint32_t level, const uint32_t *xs,
+                         const uint32_t *ys, int count, uint32_t *out)
+{
+    bool done[4] = {false, false, false, false};
+    for (int i = 0; i < count; i++)
+    {
+        if (done[i])
+            continue;
+        uint32_t tile_x = xs[i] / TEXTURE_TILE_SIZE, tile_y = ys[i] / TEXTURE_TILE_SIZE;
+        uint64_t key = tile_key(texture, level, tile_x, tile_y);
+        uint64_t hash = tile_hash(key);
+        TextureShard *shard = &ts->shards[hash % TEXTURE_CACHE_SHARDS];
+        pthread_mutex_lock(&shard->lock);
+        const uint8_t *texels = shard_tile(ts, shard, key, hash, texture, level, tile_x, tile_y);
+        for (int j = i; j < count; j++)
+        {
+            if (done[j] || xs[j] / TEXTURE_TILE_SIZE != tile_x || ys[j] / TEXTURE_TILE_SIZE != tile_y)
+                continue;
+            uint32_t offset = 4 * ((ys[j] % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + xs[j] % TEXTURE_TILE_SIZE);
+            memcpy(&out[j], &texels[offset], 4);
+            done[j] = true;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Lookups
+// -----------------------------------------------------------------------------
+
+// Texel coordinate c wrapped into [0, size)
+static uint32_t wrap(double c, uint32_t size)
+{
+    double m = fmod(c, (double)size);
+    if (m < 0)
+        m += size;
+    uint32_t i = (uint32_t)m;
+    return i < size ? i : 0;
+}
+
+static Color decode_texel(uint32_t texel)
+{
+    uint8_t c[4];
+    memcpy(c, &texel, 4);
+    return vec3_create(decode_channel(c[0]), decode_channel(c[1]), decode_channel(c[2]));
+}
+
+// Bilinear lookup in one level, texel centers at half-integer coordinates
+static Color bilinear(const TextureSystem *ts, uint32_t texture, uint32_t level, double u, double v)
+{
+    const TextureLevel *l = &ts->textures[texture].levels[level];
+    double x = u * l->width - 0.5, y = (1.0 - v) * l->height - 0.5;
+    double fx = floor(x), fy = floor(y);
+    uint32_t x0 = wrap(fx, l->width), y0 = wrap(fy, l->height);
+    uint32_t x1 = x0 + 1 < l->width ? x0 + 1 : 0, y1 = y0 + 1 < l->height ? y0 + 1 : 0;
+    uint32_t xs[4] = {x0, x1, x0, x1}, ys[4] = {y0, y0, y1, y1};
+    uint32_t texels[4];
+    fetch_texels(ts, texture, level, xs, ys, 4, texels);
+
+    double wx = x - fx, wy = y - fy;
+    Color top = vec3_add(vec3_scale(decode_texel(texels[0]), 1 - wx), vec3_scale(decode_texel(texels[1]), wx));
+    Color bottom = vec3_add(vec3_scale(decode_texel(texels[2]), 1 - wx), vec3_scale(decode_texel(texels[3]), wx));
+    return vec3_add(vec3_scale(top, 1 - wy), vec3_scale(bottom, wy));
+}
+
+Color texture_lookup(const TextureSystem *ts, uint32_t texture, double u, double v, double width)
+{
+    const Texture *t = &ts->textures[texture];
+    u *= t->scale;
+    v *= t->scale;
+    width *= t->scale;
+
+    // Level whose texels are about as wide as the footprint
+    uint32_t size = t->levels[0].width > t->levels[0].height ? t->levels[0].width : t->levels[0].height;
+    double level = width > 0 ? log2(width * size) : 0;
+    uint32_t last = t->level_count - 1;
+    if (!(level > 0))
+        return bilinear(ts, texture, 0, u, v);
+    if (level >= last)
+        return bilinear(ts, texture, last, u, v);
+    uint32_t l = (uint32_t)level;
+    double f = level - l;
+    return vec3_add(vec3_scale(bilinear(ts, texture, l, u, v), 1 - f),
+                    vec3_scale(bilinear(ts, texture, l + 1, u, v), f));
+}
+
+// -----------------------------------------------------------------------------
+// Statistics
+// -----------------------------------------------------------------------------
+
+void texture_system_stats(const TextureSystem *ts, TextureStats *stats)
+{
+    *stats = (TextureStats){0};
+    if (!ts->shards)
+        return;
+    for (int i = 0; i < TEXTURE_CACHE_SHARDS; i++)
+    {
+        TextureShard *shard = &ts->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->resident_bytes += (size_t)shard->used * TEXTURE_TILE_BYTES;
+        stats->capacity_bytes += (size_t)shard->slot_count * TEXTURE_TILE_BYTES;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    stats->requests = stats->hits + stats->misses;
+}
+
+void texture_stats_print(FILE *output, const TextureSystem *ts)
+{
+    TextureStats stats;
+    texture_system_stats(ts, &stats);
+    ProcessStats process;
+    stats_process(&process);
+    double mb = 1.0 / (1024.0 * 1024.0);
+    fprintf(output, "Texture cache:\n");
+    fprintf(output, "  Tile reads: %llu, %.2f%% hits\n", (unsigned long long)stats.requests,
+            stats.requests ? 100.0 * (double)stats.hits / (double)stats.requests : 0.0);
+    fprintf(output, "  Misses: %llu, %.1f MB copied from %u mapped textures, %llu evictions\n",
+            (unsigned long long)stats.misses, (double)stats.misses * TEXTURE_TILE_BYTES * mb, ts->count,
+            (unsigned long long)stats.evictions);
+    fprintf(output, "  Resident tiles: %.1f of %.1f MB, process resident memory %.1f MB\n",
+            (double)stats.resident_bytes * mb, (double)stats.capacity_bytes * mb, (double)process.resident_bytes * mb);
+}
@@ -0,0 +1,134 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "math/vec3.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TEXTURE_TILE_SIZE 64                                        // Texels per tile edge
+#define TEXTURE_TILE_BYTES (TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 4) // RGBA8, 16 KB
+#define TEXTURE_MAX_LEVELS 17       // Level 0 up to 65536 texels wide
+#define TEXTURE_MAX_COUNT 65535     // Texture ids take 16 bits of a tile key
+#define TEXTURE_CACHE_SHARDS 16
+#define TEXTURE_DEFAULT_CACHE_MB 64 // Tile cache budget when the render settings give none
+#define TEXTURE_FILE_SUFFIX ".rttex"
+
+// -----------------------------------------------------------------------------
+// Image textures
+// -----------------------------------------------------------------------------
+// A texture is converted once into a tiled mip pyramid: the source image
+// (PPM or PFM, see framebuffer_read_file) is box-filtered down level by level
+// in linear space, and every level is cut into 64 x 64 tiles of gamma-2
+// encoded RGBA8 texels, 16 KB each, one after the other in a file next to the
+// image (path + ".rttex"). The conversion is redone when the image's size or
+// modification time changes; when the directory is not writable it goes to a
+// temporary file instead. Texels are clamped to [0, 1], so HDR images lose
+// everything above white.
+//
+// The converted file is mapped read-only and never read directly by the
+// shading code. Lookups go through a tile cache of fixed size: a miss copies
+// the tile out of the mapping and drops the mapped pages again, so the
+// resident texture memory stays at the cache budget no matter how large the
+// textures are. The cache is split into TEXTURE_CACHE_SHARDS shards by tile
+// key, each with its own lock, hash table and least-recently-used list, so
+// render threads rarely wait for each other.
+
+typedef struct
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    uint64_t offset; // Byte offset of the level's first tile in the file, tiles row by row
+} TextureLevel;
+
+typedef struct
+{
+    const uint8_t *mapping; // The converted file
+    size_t mapping_size;
+    uint32_t level_count;
+    TextureLevel levels[TEXTURE_MAX_LEVELS];
+    double scale; // Repeats of the image per unit of surface uv
+} Texture;
+
+// One cache slot, texels in TextureShard.texels at the same index
+typedef struct
+{
+    uint64_t key;   // TEXTURE_NO_TILE when free
+    uint32_t prev;  // Least-recently-used list, head is the most recent
+    uint32_t next;
+    uint32_t chain; // Next slot in the same hash bucket
+} TextureSlot;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    TextureSlot *slots;
+    uint8_t *texels; // slot_count tiles
+    uint32_t *buckets;
+    uint32_t bucket_mask;
+    uint32_t slot_count;
+    uint32_t used;
+    uint32_t head;
+    uint32_t tail;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} TextureShard;
+
+// Lifecycle: texture_system_init, texture_system_add, texture_system_prepare
+// before rendering, lookups from any thread, texture_system_free.
+typedef struct
+{
+    Texture *textures;
+    uint32_t count;
+    uint32_t capacity;
+    // Allocated by texture_system_prepare, so lookups through a const
+    // TextureSystem can still update the cache
+    TextureShard *shards;
+    size_t cache_bytes; // Budget the shards were sized for
+    bool drop_pages;    // Tiles are whole pages, a miss can give the mapped copy back
+} TextureSystem;
+
+typedef struct
+{
+    uint64_t requests;  // Tile reads of the lookups, one per distinct tile of a filter footprint
+    uint64_t hits;
+    uint64_t misses;    // Tiles copied from the mapped files
+    uint64_t evictions;
+    size_t resident_bytes; // Tiles held by the cache
+    size_t capacity_bytes;
+} TextureStats;
+
+void texture_system_init(TextureSystem *ts);
+
+void texture_system_free(TextureSystem *ts);
+
+// Converts the image at path unless an up to date converted file exists,
+// maps it and returns its index in *id. scale repeats the image scale times
+// across the surface's uv range. Prints the reason and returns false on
+// failure.
+bool texture_system_add(TextureSystem *ts, const char *path, double scale, uint32_t *id);
+
+// Sizes the tile cache for cache_bytes, at least one tile per shard. Keeps
+// the cache when the budget did not change, otherwise starts it empty. Call
+// before rendering and never while lookups run. Returns false on allocation
+// failure.
+bool texture_system_prepare(TextureSystem *ts, size_t cache_bytes);
+
+// Trilinearly filtered linear color of texture at (u, v), v = 0 is the bottom
+// row of the image. width is the extent of the filter footprint in surface
+// uv units, 0 samples the finest level. Wraps around in both directions.
+// Thread-safe once texture_system_prepare returned true.
+Color texture_lookup(const TextureSystem *ts, uint32_t texture, double u, double v, double width);
+
+void texture_system_stats(const TextureSystem *ts, TextureStats *stats);
+
+// Prints the cache statistics and the process's resident memory
+void texture_stats_print(FILE *output, const TextureSystem *ts);
+
+#endif // TEXTURE_H
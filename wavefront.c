@@ -0,0 +1,307 @@
+#include "wavefront.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+bool path_queue_init(PathQueue *queue, uint32_t capacity)
+{
+    memset(queue, 0, sizeof(*queue));
+    queue->capacity = capacity;
+
+    double **columns[] = {
+        &queue->origin_x, &queue->origin_y, &queue->origin_z,
+        &queue->dir_x, &queue->dir_y, &queue->dir_z,
+        &queue->throughput_x, &queue->throughput_y, &queue->throughput_z,
+        &queue->radiance_x, &queue->radiance_y, &queue->radiance_z, &queue->bsdf_pdf};
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(columns) / sizeof(columns[0]); i++)
+    {
+        *columns[i] = malloc(sizeof(double) * capacity);
+        ok = ok && *columns[i];
+    }
+    queue->sampler = malloc(sizeof(Sampler) * capacity);
+    queue->slot = malloc(sizeof(uint32_t) * capacity);
+    queue->hits = malloc(sizeof(HitRecord) * capacity);
+    queue->hit = malloc(sizeof(bool) * capacity);
+    queue->results = malloc(sizeof(Color) * capacity);
+    queue->sums = malloc(sizeof(Color) * capacity);
+    ok = ok && queue->sampler && queue->slot && queue->hits && queue->hit && queue->results && queue->sums;
+
+    if (!ok)
+        path_queue_free(queue);
+    return ok;
+}
+
+void path_queue_free(PathQueue *queue)
+{
+    free(queue->origin_x);
+    free(queue->origin_y);
+    free(queue->origin_z);
+    free(queue->dir_x);
+    free(queue->dir_y);
+    free(queue->dir_z);
+    free(queue->throughput_x);
+    free(queue->throughput_y);
+    free(queue->throughput_z);
+    free(queue->radiance_x);
+    free(queue->radiance_y);
+    free(queue->radiance_z);
+    free(queue->bsdf_pdf);
+    free(queue->sampler);
+    free(queue->slot);
+    free(queue->hits);
+    free(queue->hit);
+    free(queue->results);
+    free(queue->sums);
+    paged_batch_free(&queue->paged);
+    memset(queue, 0, sizeof(*queue));
+}
+
+static Ray path_ray(const PathQueue *q, uint32_t i)
+{
+    return ray_create(vec3_create(q->origin_x[i], q->origin_y[i], q->origin_z[i]),
+                      vec3_create(q->dir_x[i], q->dir_y[i], q->dir_z[i]));
+}
+
+static void path_set_ray(PathQueue *q, uint32_t i, Ray r)
+{
+    q->origin_x[i] = r.origin.x;
+    q->origin_y[i] = r.origin.y;
+    q->origin_z[i] = r.origin.z;
+    q->dir_x[i] = r.direction.x;
+    q->dir_y[i] = r.direction.y;
+    q->dir_z[i] = r.direction.z;
+}
+
+// -----------------------------------------------------------------------------
+// Stages
+// -----------------------------------------------------------------------------
+
+// One camera path per (pixel, sample) of the chunk, slot = pixel * chunk + sample
+static void stage_generate(PathQueue *q, Camera *camera, const SamplerSetup *sampling,
+                           int x0, int y0, int width, int pixel_count, size_t first_sample, size_t chunk)
+{
+    q->count = 0;
+    for (int p = 0; p < pixel_count; p++)
+    {
+        int i = x0 + p % width;
+        int j = camera->image_height - 1 - (y0 + p / width);
+        uint32_t pixel_index = (uint32_t)(j * camera->image_width + i);
+
+        for (size_t s = 0; s < chunk; s++)
+        {
+            uint32_t n = q->count++;
+            sampler_start(&q->sampler[n], sampling, i, j, pixel_index, (uint32_t)(first_sample + s));
+            path_set_ray(q, n, camera_get_ray(camera, i, j, &q->sampler[n]));
+            q->throughput_x[n] = 1.0;
+            q->throughput_y[n] = 1.0;
+            q->throughput_z[n] = 1.0;
+            q->radiance_x[n] = 0.0;
+            q->radiance_y[n] = 0.0;
+            q->radiance_z[n] = 0.0;
+            q->bsdf_pdf[n] = 0.0; // The camera ray sees emitters in full
+            q->slot[n] = (uint32_t)(p * chunk + s);
+        }
+    }
+}
+
+static void stage_intersect(PathQueue *q, Scene *scene)
+{
+    // Paged meshes are traced for all paths at once, binned by cluster. The
+    // hits are the same either way, so running out of memory for the batch
+    // only costs paging.
+    if (scene->paged_count > 0 && paged_batch_reserve(&q->paged, q->count))
+    {
+        for (uint32_t n = 0; n < q->count; n++)
+            q->paged.rays[n] = path_ray(q, n);
+        scene_hit_batch(scene, &q->paged, q->count, RAY_T_MIN, RAY_T_MAX, q->hits, q->hit);
+        return;
+    }
+    for (uint32_t n = 0; n < q->count; n++)
+    {
+        q->hit[n] = scene_hit(scene, path_ray(q, n), RAY_T_MIN, RAY_T_MAX, &q->hits[n]);
+    }
+}
+
+static Color path_radiance(const PathQueue *q, uint32_t i)
+{
+    return vec3_create(q->radiance_x[i], q->radiance_y[i], q->radiance_z[i]);
+}
+
+// Ends path n with its gathered light plus extra
+static void path_finish(PathQueue *q, uint32_t n, Color extra)
+{
+    q->results[q->slot[n]] = vec3_add(path_radiance(q, n), extra);
+    q->slot[n] = UINT32_MAX;
+}
+
+// Finishes paths that escaped, reached a light, were absorbed or lost the
+// roulette (slot set to UINT32_MAX), and scatters the rest. bounces is the
+// number of scatters behind every path. Mirrors one iteration of shade_hit.
+static void stage_shade(PathQueue *q, const Scene *scene, int bounces, int max_depth, int roulette_depth)
+{
+    Color black = vec3_create(0, 0, 0);
+    for (uint32_t n = 0; n < q->count; n++)
+    {
+        Ray r = path_ray(q, n);
+        Color throughput = vec3_create(q->throughput_x[n], q->throughput_y[n], q->throughput_z[n]);
+
+        if (!q->hit[n])
+        {
+            path_finish(q, n, vec3_mul(throughput, sky_color(r)));
+            STATS_PATH_END(STATS_ESCAPED, bounces);
+            continue;
+        }
+
+        sampler_vertex(&q->sampler[n], bounces + 1);
+        HitRecord *rec = &q->hits[n];
+        Material textured;
+        const Material *material = scene_material(scene, rec, &textured);
+        if (material->type == MATERIAL_EMISSIVE)
+        {
+            double weight = scene_emission_weight(scene, r.origin, rec, q->bsdf_pdf[n]);
+            path_finish(q, n, vec3_scale(vec3_mul(throughput, material->color), weight));
+            STATS_PATH_END(STATS_EMITTED, bounces);
+            continue;
+        }
+        if (material->type == MATERIAL_LAMBERTIAN && scene->light_count > 0)
+        {
+            Color radiance = vec3_add(path_radiance(q, n),
+                                      vec3_mul(throughput, scene_sample_light(scene, rec, material, &q->sampler[n])));
+            q->radiance_x[n] = radiance.x;
+            q->radiance_y[n] = radiance.y;
+            q->radiance_z[n] = radiance.z;
+        }
+
+        Ray scattered;
+        Color attenuation;
+        if (!scatter_ray(material, r, rec, &attenuation, &scattered, &q->sampler[n]))
+        {
+            path_finish(q, n, black); // Absorbed
+            STATS_PATH_END(STATS_ABSORBED, bounces);
+            continue;
+        }
+        throughput = vec3_mul(throughput, attenuation);
+        if (scene->light_count > 0)
+            material_eval(material, rec, vec3_unit(scattered.direction), &q->bsdf_pdf[n]);
+
+        // Paths out of bounces are finished by the caller, without a roulette draw
+        int done = bounces + 1;
+        if (roulette_depth > 0 && done >= roulette_depth && done < max_depth)
+        {
+            double survival = roulette_survival(throughput);
+            if (survival < 1)
+            {
+                if (sampler_1d(&q->sampler[n], SAMPLE_ROULETTE) >= survival)
+                {
+                    path_finish(q, n, black);
+                    STATS_PATH_END(STATS_ROULETTE, done);
+                    continue;
+                }
+                throughput = vec3_scale(throughput, 1.0 / survival);
+            }
+        }
+
+        q->throughput_x[n] = throughput.x;
+        q->throughput_y[n] = throughput.y;
+        q->throughput_z[n] = throughput.z;
+        path_set_ray(q, n, scattered);
+    }
+}
+
+// Moves live paths to the front, keeping their order
+static void stage_compact(PathQueue *q)
+{
+    uint32_t live = 0;
+    for (uint32_t n = 0; n < q->count; n++)
+    {
+        if (q->slot[n] == UINT32_MAX)
+            continue;
+        if (live != n)
+        {
+            q->origin_x[live] = q->origin_x[n];
+            q->origin_y[live] = q->origin_y[n];
+            q->origin_z[live] = q->origin_z[n];
+            q->dir_x[live] = q->dir_x[n];
+            q->dir_y[live] = q->dir_y[n];
+            q->dir_z[live] = q->dir_z[n];
+            q->throughput_x[live] = q->throughput_x[n];
+            q->throughput_y[live] = q->throughput_y[n];
+            q->throughput_z[live] = q->throughput_z[n];
+            q->radiance_x[live] = q->radiance_x[n];
+            q->radiance_y[live] = q->radiance_y[n];
+            q->radiance_z[live] = q->radiance_z[n];
+            q->bsdf_pdf[live] = q->bsdf_pdf[n];
+            q->sampler[live] = q->sampler[n];
+            q->slot[live] = q->slot[n];
+        }
+        live++;
+    }
+    q->count = live;
+}
+
+void wavefront_render_block(PathQueue *queue, Scene *scene, Camera *camera, int max_depth, int roulette_depth,
+                            const SamplerSetup *sampling, Framebuffer *fb, int x0, int y0, int x1, int y1)
+{
+    int width = x1 - x0;
+    int pixel_count = width * (y1 - y0);
+    size_t spp = camera->samples_per_pixel;
+    size_t chunk = queue->capacity / (uint32_t)pixel_count;
+    if (chunk == 0)
+        chunk = 1;
+    if (chunk > spp)
+        chunk = spp;
+
+    for (int p = 0; p < pixel_count; p++)
+        queue->sums[p] = vec3_create(0, 0, 0);
+
+    for (size_t first = 0; first < spp; first += chunk)
+    {
+        size_t n = first + chunk <= spp ? chunk : spp - first;
+        stage_generate(queue, camera, sampling, x0, y0, width, pixel_count, first, n);
+
+        if (max_depth <= 0)
+        {
+            for (uint32_t k = 0; k < queue->count; k++)
+            {
+                queue->results[queue->slot[k]] = vec3_create(0, 0, 0);
+                STATS_PATH_END(STATS_MAX_DEPTH, 0);
+            }
+            queue->count = 0;
+        }
+
+        for (int depth = max_depth; queue->count > 0; depth--)
+        {
+            stage_intersect(queue, scene);
+            stage_shade(queue, scene, max_depth - depth, max_depth, roulette_depth);
+            if (depth - 1 <= 0)
+            {
+                // Out of bounces: whatever is still alive keeps the light it gathered
+                for (uint32_t k = 0; k < queue->count; k++)
+                {
+                    if (queue->slot[k] != UINT32_MAX)
+                    {
+                        path_finish(queue, k, vec3_create(0, 0, 0));
+                        STATS_PATH_END(STATS_MAX_DEPTH, max_depth);
+                    }
+                }
+                break;
+            }
+            stage_compact(queue);
+        }
+
+        // Sum in sample order, exactly like the per-path loop
+        for (int p = 0; p < pixel_count; p++)
+        {
+            for (size_t s = 0; s < n; s++)
+                queue->sums[p] = vec3_add(queue->sums[p], queue->results[p * n + s]);
+        }
+    }
+
+    double scale = 1.0 / (double)spp;
+    for (int p = 0; p < pixel_count; p++)
+    {
+        *framebuffer_at(fb, x0 + p % width, y0 + p / width) = vec3_scale(queue->sums[p], scale);
+    }
+}
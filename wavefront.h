@@ -0,0 +1,47 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "scene.h"
+#include "framebuffer.h"
+
+// Upper bound on the paths in flight per worker; the samples of a tile are
+// processed in chunks that fit
+#define WAVEFRONT_MAX_PATHS 16384
+
+// -----------------------------------------------------------------------------
+// Wavefront path queue
+// -----------------------------------------------------------------------------
+// Live paths are kept as structure-of-arrays and advanced stage by stage
+// (generate, intersect, shade/scatter, compact), so every stage runs over a
+// dense batch of paths instead of one path at a time.
+typedef struct
+{
+    double *origin_x, *origin_y, *origin_z;
+    double *dir_x, *dir_y, *dir_z;
+    double *throughput_x, *throughput_y, *throughput_z;
+    double *radiance_x, *radiance_y, *radiance_z; // Light gathered so far
+    double *bsdf_pdf; // Density of the last scatter direction, 0 when specular
+    Sampler *sampler;
+    uint32_t *slot;  // Where the path's final color goes in results
+    HitRecord *hits; // Intersect stage output
+    bool *hit;
+    uint32_t count;
+    PagedBatch paged; // Intersect stage rays, allocated once the scene has paged meshes
+
+    Color *results; // Final color of every path of the current chunk
+    Color *sums;    // Per-pixel running sums over all chunks
+    uint32_t capacity;
+} PathQueue;
+
+// capacity must be at least the number of pixels of the largest block
+bool path_queue_init(PathQueue *queue, uint32_t capacity);
+void path_queue_free(PathQueue *queue);
+
+// Renders framebuffer pixels [x0, x1) x [y0, y1) with the wavefront
+// pipeline. Produces exactly the same pixels as the per-path loop in
+// ray_color, since every path owns its Sampler, draws the same dimensions
+// and sums are taken in sample order.
+void wavefront_render_block(PathQueue *queue, Scene *scene, Camera *camera, int max_depth, int roulette_depth,
+                            const SamplerSetup *sampling, Framebuffer *fb, int x0, int y0, int x1, int y1);
+
+#endif // WAVEFRONT_H